@@ -1,4 +1,185 @@
 #pragma once
 #include <ntdef.h>
 
-DECLSPEC_IMPORT INT KLoggerLog(PCSTR log_msg);
\ No newline at end of file
+typedef struct KLogger* PKLOGGER;
+
+// levels, from the least severe. Callers may define KLOGGER_COMPILE_LEVEL before including
+// this header: macros of lower levels compile to nothing
+#define KLOGGER_LEVEL_TRACE 0
+#define KLOGGER_LEVEL_DEBUG 1
+#define KLOGGER_LEVEL_INFO 2
+#define KLOGGER_LEVEL_WARNING 3
+#define KLOGGER_LEVEL_ERROR 4
+
+// runtime mask, KLoggerMask: bits 0-4 enable levels, bits 8-31 categories 0-23,
+// a message is logged if both its level and its category are enabled.
+// Categories are taken modulo KLOGGER_CATEGORY_COUNT, so one out of range shares
+// the bit of another category instead of enabling a level or shifting past bit 31
+#define KLOGGER_CATEGORY_COUNT 24
+#define KLOGGER_MASK_LEVEL(Level) (1ul << (Level))
+#define KLOGGER_MASK_CATEGORY(Category) (1ul << (8 + (ULONG)(Category) % KLOGGER_CATEGORY_COUNT))
+#define KLOGGER_MASK_DIAGNOSTICS (1ul << 7) // library's own DbgPrint tracing
+#define KLOGGER_MASK_DEFAULT (0xffffff00ul | KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_INFO) | \
+	KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_WARNING) | KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_ERROR))
+
+// what writers do when their ring is full, OVERFLOW_POLICY in the registry
+#define KLOGGER_OVERFLOW_DROP 0 // the message is dropped, a LOSS record in the log tells how many were
+#define KLOGGER_OVERFLOW_OVERWRITE 1 // the oldest messages not being flushed yet are dropped instead
+#define KLOGGER_OVERFLOW_BLOCK 2 // callers at PASSIVE_LEVEL wait up to BLOCK_TIMEOUT_MS, others drop
+
+// settings of a KLoggerCreate logger, zero fields take the defaults of the registry keys
+typedef struct KLoggerConfig {
+	PCWSTR FileName; // full NT path, with no extension if SegmentSizeMb is set
+	SIZE_T BufSize; // of the shared ring
+	SIZE_T PerCpuBufSize; // non-zero - a ring of this size per processor
+	SIZE_T MaxBufSize; // non-zero - rings are resized between their size and this one as the load goes
+	ULONG WriteSlots;
+	ULONG SegmentSizeMb; // zero - a single file
+	ULONG MaxSegments; // zero - all are kept
+	ULONG Compress;
+	ULONG IndexKb; // non-zero - a sidecar index entry every that many KB of the log, for tools/klseek
+	ULONG DedupMs; // non-zero - repeats of a message on a processor within that many ms are counted, not logged
+	ULONG Overflow; // KLOGGER_OVERFLOW_*
+	ULONG BlockTimeoutMs;
+	ULONG FixedFlush; // non-zero - flush threshold and timeout don't adapt
+	ULONG NumaLocal; // non-zero - rings are allocated on the node of the processors writing them
+	PCWSTR LiveName; // non-NULL - rings are shared read-only as sections "<LiveName>.<ring>" for tools/kltail
+} KLOGGER_CONFIG, *PKLOGGER_CONFIG;
+
+// a catalog message: the format is registered once, KLoggerLogId then logs its ID
+// and arguments only. Id is 0 until the format is registered
+typedef struct KLoggerMessage {
+	PCSTR Format;
+	ULONG Id;
+} KLOGGER_MESSAGE, *PKLOGGER_MESSAGE;
+
+// one message of a KLoggerLogV batch, not necessarily null-terminated
+typedef struct KLoggerEntry {
+	PCSTR Msg;
+	SIZE_T Length;
+} KLOGGER_ENTRY, *PKLOGGER_ENTRY;
+
+typedef struct KLoggerStats {
+	ULONGLONG MessagesLogged;
+	ULONGLONG BytesLogged; // of messages as stored in the ring
+	ULONGLONG MessagesDropped; // the ring was full
+	ULONGLONG BytesDropped;
+	ULONGLONG MessagesOverwritten; // OVERFLOW_POLICY 1, oldest ones dropped for new ones
+	ULONGLONG BytesOverwritten;
+	ULONGLONG MessagesSuppressed; // DEDUP_MS repeats, reported by "last message repeated" records
+	ULONG MaxLoadFactor; // highest ring fill seen by a writer, in percents
+	ULONGLONG DpcFlushes; // woken by a writer over the flush threshold
+	ULONGLONG TimeoutFlushes;
+	ULONGLONG FlushedChunks;
+	ULONGLONG FlushedBytes; // written to the log file
+	ULONGLONG FlushTimeUs;
+	ULONGLONG MaxFlushTimeUs; // longest single flush
+	ULONGLONG FlushBytesPerSec; // FlushedBytes over FlushTimeUs
+	ULONG FlushThreshold; // ring fill in percents writers wake the flushing thread at
+	ULONG FlushTimeoutMs; // longest wait of the flushing thread
+	ULONGLONG IngestBytesPerSec; // recent ring bytes per second, drops included
+	ULONGLONG DrainBytesPerSec; // recent ring bytes per second a flush drains
+	ULONGLONG RingBufSize; // of each ring now
+	ULONG RingResizes;
+} KLOGGER_STATS, *PKLOGGER_STATS;
+
+DECLSPEC_IMPORT INT KLoggerLog(PCSTR log_msg);
+DECLSPEC_IMPORT INT KLoggerLogN(PCSTR log_msg, SIZE_T length);
+DECLSPEC_IMPORT INT KLoggerLogf(PCSTR format, ...);
+DECLSPEC_IMPORT INT KLoggerLogV(const KLOGGER_ENTRY* Entries, ULONG Count);
+DECLSPEC_IMPORT INT KLoggerGetStats(PKLOGGER_STATS pStats);
+DECLSPEC_IMPORT VOID KLoggerSetMask(ULONG Mask);
+DECLSPEC_IMPORT INT KLoggerCreate(PKLOGGER* ppLogger, const KLOGGER_CONFIG* pConfig);
+DECLSPEC_IMPORT INT KLoggerDestroy(PKLOGGER Logger);
+DECLSPEC_IMPORT INT KLoggerLogTo(PKLOGGER Logger, PCSTR log_msg);
+DECLSPEC_IMPORT INT KLoggerLogNTo(PKLOGGER Logger, PCSTR log_msg, SIZE_T length);
+DECLSPEC_IMPORT INT KLoggerLogfTo(PKLOGGER Logger, PCSTR format, ...);
+DECLSPEC_IMPORT INT KLoggerLogVTo(PKLOGGER Logger, const KLOGGER_ENTRY* Entries, ULONG Count);
+DECLSPEC_IMPORT INT KLoggerGetStatsOf(PKLOGGER Logger, PKLOGGER_STATS pStats);
+DECLSPEC_IMPORT INT KLoggerResize(SIZE_T BufSize);
+DECLSPEC_IMPORT INT KLoggerResizeOf(PKLOGGER Logger, SIZE_T BufSize);
+DECLSPEC_IMPORT INT KLoggerRegister(PCSTR Format, PULONG pId);
+DECLSPEC_IMPORT INT KLoggerRegisterCatalog(PKLOGGER_MESSAGE First, PKLOGGER_MESSAGE Last);
+DECLSPEC_IMPORT INT KLoggerLogId(ULONG Id, ...);
+DECLSPEC_IMPORT INT KLoggerLogIdTo(PKLOGGER Logger, ULONG Id, ...);
+extern DECLSPEC_IMPORT ULONG volatile KLoggerMask;
+
+#ifndef KLOGGER_COMPILE_LEVEL
+#if DBG
+#define KLOGGER_COMPILE_LEVEL KLOGGER_LEVEL_TRACE
+#else
+#define KLOGGER_COMPILE_LEVEL KLOGGER_LEVEL_INFO
+#endif
+#endif
+
+#define KLOGGER_ENABLED(Level, Category) \
+	((KLoggerMask & (KLOGGER_MASK_LEVEL(Level) | KLOGGER_MASK_CATEGORY(Category))) == \
+		(KLOGGER_MASK_LEVEL(Level) | KLOGGER_MASK_CATEGORY(Category)))
+
+// the mask is checked before the message is touched, arguments of disabled messages are not evaluated
+#define KLOGGER_LOG(Level, Category, Msg) \
+	do { if (KLOGGER_ENABLED(Level, Category)) KLoggerLog(Msg); } while (0)
+#define KLOGGER_LOGF(Level, Category, ...) \
+	do { if (KLOGGER_ENABLED(Level, Category)) KLoggerLogf(__VA_ARGS__); } while (0)
+#define KLOGGER_NOTHING() do { } while (0)
+
+#if KLOGGER_COMPILE_LEVEL <= KLOGGER_LEVEL_TRACE
+#define KLOG_TRACE(Category, Msg) KLOGGER_LOG(KLOGGER_LEVEL_TRACE, Category, Msg)
+#define KLOGF_TRACE(Category, ...) KLOGGER_LOGF(KLOGGER_LEVEL_TRACE, Category, __VA_ARGS__)
+#else
+#define KLOG_TRACE(Category, Msg) KLOGGER_NOTHING()
+#define KLOGF_TRACE(Category, ...) KLOGGER_NOTHING()
+#endif
+
+#if KLOGGER_COMPILE_LEVEL <= KLOGGER_LEVEL_DEBUG
+#define KLOG_DEBUG(Category, Msg) KLOGGER_LOG(KLOGGER_LEVEL_DEBUG, Category, Msg)
+#define KLOGF_DEBUG(Category, ...) KLOGGER_LOGF(KLOGGER_LEVEL_DEBUG, Category, __VA_ARGS__)
+#else
+#define KLOG_DEBUG(Category, Msg) KLOGGER_NOTHING()
+#define KLOGF_DEBUG(Category, ...) KLOGGER_NOTHING()
+#endif
+
+#if KLOGGER_COMPILE_LEVEL <= KLOGGER_LEVEL_INFO
+#define KLOG_INFO(Category, Msg) KLOGGER_LOG(KLOGGER_LEVEL_INFO, Category, Msg)
+#define KLOGF_INFO(Category, ...) KLOGGER_LOGF(KLOGGER_LEVEL_INFO, Category, __VA_ARGS__)
+#else
+#define KLOG_INFO(Category, Msg) KLOGGER_NOTHING()
+#define KLOGF_INFO(Category, ...) KLOGGER_NOTHING()
+#endif
+
+#if KLOGGER_COMPILE_LEVEL <= KLOGGER_LEVEL_WARNING
+#define KLOG_WARNING(Category, Msg) KLOGGER_LOG(KLOGGER_LEVEL_WARNING, Category, Msg)
+#define KLOGF_WARNING(Category, ...) KLOGGER_LOGF(KLOGGER_LEVEL_WARNING, Category, __VA_ARGS__)
+#else
+#define KLOG_WARNING(Category, Msg) KLOGGER_NOTHING()
+#define KLOGF_WARNING(Category, ...) KLOGGER_NOTHING()
+#endif
+
+#define KLOG_ERROR(Category, Msg) KLOGGER_LOG(KLOGGER_LEVEL_ERROR, Category, Msg)
+#define KLOGF_ERROR(Category, ...) KLOGGER_LOGF(KLOGGER_LEVEL_ERROR, Category, __VA_ARGS__)
+
+// static catalog: KLOGGER_DEFINE_MESSAGE(Name, Format) at file scope puts a KLOGGER_MESSAGE
+// built from the literal into the KLOGCAT section of the calling driver, and
+// KLOGGER_REGISTER_CATALOG() in its DriverEntry registers all of them with one call:
+//
+//   KLOGGER_DEFINE_MESSAGE(ReadFailed, "read of %u bytes at %I64x failed: %x\n");
+//   KLOGGER_CATALOG_BOUNDS();
+//   ... KLOGGER_REGISTER_CATALOG(); ... KLoggerLogId(ReadFailed.Id, Size, Offset, Status);
+//
+// KLOGGER_CATALOG_BOUNDS() goes once into the file with DriverEntry
+#ifdef _MSC_VER
+#pragma section("KLOGCAT$a", read, write)
+#pragma section("KLOGCAT$m", read, write)
+#pragma section("KLOGCAT$z", read, write)
+#define KLOGGER_DEFINE_MESSAGE(Name, Format) \
+	__declspec(allocate("KLOGCAT$m")) KLOGGER_MESSAGE Name = { Format, 0 }
+#define KLOGGER_CATALOG_BOUNDS() \
+	__declspec(allocate("KLOGCAT$a")) static KLOGGER_MESSAGE KLoggerCatalogStart = { NULL, 0 }; \
+	__declspec(allocate("KLOGCAT$z")) static KLOGGER_MESSAGE KLoggerCatalogStop = { NULL, 0 }
+#define KLOGGER_REGISTER_CATALOG() KLoggerRegisterCatalog(&KLoggerCatalogStart + 1, &KLoggerCatalogStop)
+#else
+#define KLOGGER_DEFINE_MESSAGE(Name, Format) \
+	__attribute__((section("klogcat"), used)) KLOGGER_MESSAGE Name = { Format, 0 }
+#define KLOGGER_CATALOG_BOUNDS() extern KLOGGER_MESSAGE __start_klogcat[], __stop_klogcat[]
+#define KLOGGER_REGISTER_CATALOG() KLoggerRegisterCatalog(__start_klogcat, __stop_klogcat)
+#endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "Catalog.h"
+
+#include <winerror.h>
+
+#include "StrScan.h"
+
+// writers look formats up at any IRQL without a lock: an entry is filled before Count
+// covers it and does not change after
+typedef struct Catalog {
+	PCHAR Formats[CATALOG_MAX_IDS]; // by Id - 1
+	SIZE_T Lengths[CATALOG_MAX_IDS];
+	BOOLEAN HasArgs[CATALOG_MAX_IDS]; // a constant message is logged without looking at its format
+	LONG volatile Count;
+	SIZE_T TextSize; // of all formats
+	KEVENT Lock; // synchronization event used as a mutex, taken by registrations
+} CATALOG;
+
+INT
+CatalogInit(
+	PCATALOG* ppCatalog
+) {
+	PCATALOG pCatalog = (PCATALOG)ExAllocatePool(NonPagedPool, sizeof(CATALOG));
+	if (!pCatalog) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	RtlZeroMemory(pCatalog, sizeof(CATALOG));
+	KeInitializeEvent(&(pCatalog->Lock), SynchronizationEvent, TRUE);
+
+	*ppCatalog = pCatalog;
+	return ERROR_SUCCESS;
+}
+
+VOID
+CatalogDeinit(
+	PCATALOG pCatalog
+) {
+	for (LONG i = 0; i < pCatalog->Count; ++i) {
+		ExFreePool(pCatalog->Formats[i]);
+	}
+
+	ExFreePool(pCatalog);
+}
+
+// PASSIVE_LEVEL, formats are compared as a whole, so a registration takes
+// time linear in the size of the catalog
+INT
+CatalogRegister(
+	PCATALOG pCatalog,
+	PCSTR Format,
+	PULONG pId
+) {
+	if (!Format || !pId) {
+		return ERROR_BAD_ARGUMENTS;
+	}
+
+	SIZE_T Length = StrScanLength(Format);
+	if (Length >= CATALOG_FORMAT_MAX) {
+		return ERROR_BAD_ARGUMENTS;
+	}
+
+	KeWaitForSingleObject(&(pCatalog->Lock), Executive, KernelMode, FALSE, NULL);
+
+	INT Err = ERROR_SUCCESS;
+	LONG Count = pCatalog->Count;
+	for (LONG i = 0; i < Count; ++i) {
+		if (pCatalog->Lengths[i] == Length && RtlCompareMemory(pCatalog->Formats[i], Format, Length) == Length) {
+			*pId = (ULONG)i + 1;
+			goto out;
+		}
+	}
+
+	if (Count == CATALOG_MAX_IDS) {
+		Err = ERROR_NO_MORE_ITEMS;
+		goto out;
+	}
+
+	PCHAR Copy = (PCHAR)ExAllocatePool(NonPagedPool, Length + 1);
+	if (!Copy) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	RtlCopyMemory(Copy, Format, Length + 1);
+	pCatalog->Formats[Count] = Copy;
+	pCatalog->Lengths[Count] = Length;
+	pCatalog->HasArgs[Count] = FALSE;
+	for (SIZE_T i = 0; i < Length; ++i) {
+		if (Format[i] == '%') {
+			pCatalog->HasArgs[Count] = TRUE;
+			break;
+		}
+	}
+	pCatalog->TextSize += Length;
+	InterlockedExchange(&(pCatalog->Count), Count + 1);
+	*pId = (ULONG)Count + 1;
+
+out:
+	KeSetEvent(&(pCatalog->Lock), 0, FALSE);
+	return Err;
+}
+
+PCSTR
+CatalogFormat(
+	PCATALOG pCatalog,
+	ULONG Id,
+	PBOOLEAN pHasArgs
+) {
+	if (Id - 1 >= (ULONG)pCatalog->Count) {
+		return NULL;
+	}
+
+	if (pHasArgs) {
+		*pHasArgs = pCatalog->HasArgs[Id - 1];
+	}
+	return pCatalog->Formats[Id - 1];
+}
+
+ULONG
+CatalogCount(
+	PCATALOG pCatalog
+) {
+	return (ULONG)pCatalog->Count;
+}
+
+// may be behind a registration going on
+SIZE_T
+CatalogTextSize(
+	PCATALOG pCatalog
+) {
+	return pCatalog->TextSize;
+}
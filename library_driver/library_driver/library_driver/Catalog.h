@@ -0,0 +1,22 @@
+#pragma once
+
+#include <ntddk.h>
+
+// message catalog: format strings registered once, messages then carry their ID and
+// arguments only. IDs are given out from 1 in registration order and are shared by all
+// loggers, a format registered again gets its ID back. Formats are copied, so the
+// registering driver may go away, and are never removed until the library unloads
+#define CATALOG_MAX_IDS 4096
+#define CATALOG_FORMAT_MAX 1024 // longest format, with '\0'
+
+typedef struct Catalog* PCATALOG;
+
+INT CatalogInit(PCATALOG* ppCatalog);
+VOID CatalogDeinit(PCATALOG pCatalog);
+
+INT CatalogRegister(PCATALOG pCatalog, PCSTR Format, PULONG pId);
+
+// NULL if Id is not registered. *pHasArgs, if given, tells if the format has conversions
+PCSTR CatalogFormat(PCATALOG pCatalog, ULONG Id, PBOOLEAN pHasArgs);
+ULONG CatalogCount(PCATALOG pCatalog);
+SIZE_T CatalogTextSize(PCATALOG pCatalog);
@@ -0,0 +1,224 @@
+#include "Compress.h"
+
+#include <string.h>
+
+#define LZ_LAST_LITERALS 5 // the block ends with at least that many literals
+#define LZ_MATCH_LIMIT 12 // no match starts closer to the end
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6 // the longer nothing matches, the faster input is skipped
+
+typedef unsigned char BYTE;
+
+static __inline unsigned
+LZRead32(
+	const BYTE* p
+) {
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static __inline unsigned
+LZHash(
+	unsigned v
+) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static __inline BYTE*
+LZPutLength(
+	BYTE* Out,
+	size_t Length
+) {
+	while (Length >= 255) {
+		*Out++ = 255;
+		Length -= 255;
+	}
+	*Out++ = (BYTE)Length;
+
+	return Out;
+}
+
+static BYTE*
+LZPutSequence(
+	BYTE* Out,
+	const BYTE* Literals,
+	size_t LiteralLength,
+	size_t Offset,
+	size_t MatchLength
+) {
+	BYTE* Token = Out++;
+	*Token = (BYTE)((LiteralLength >= 15 ? 15 : LiteralLength) << 4);
+	if (LiteralLength >= 15) {
+		Out = LZPutLength(Out, LiteralLength - 15);
+	}
+
+	memcpy(Out, Literals, LiteralLength);
+	Out += LiteralLength;
+
+	if (!Offset) {
+		return Out; // last sequence
+	}
+
+	*Out++ = (BYTE)Offset;
+	*Out++ = (BYTE)(Offset >> 8);
+
+	MatchLength -= LZ_MIN_MATCH;
+	*Token |= (BYTE)(MatchLength >= 15 ? 15 : MatchLength);
+	if (MatchLength >= 15) {
+		Out = LZPutLength(Out, MatchLength - 15);
+	}
+
+	return Out;
+}
+
+// greedy single-probe matcher, the log chunk is compressed by the flushing thread
+// while it drains the rings, speed comes first
+size_t
+LZCompress(
+	const void* In,
+	size_t InSize,
+	void* Out,
+	void* HashTable
+) {
+	const BYTE* Base = (const BYTE*)In;
+	const BYTE* p = Base;
+	const BYTE* Anchor = Base; // first literal not yet emitted
+	const BYTE* End = Base + InSize;
+	const BYTE* MatchLimit = End - LZ_MATCH_LIMIT;
+	BYTE* o = (BYTE*)Out;
+	unsigned* Table = (unsigned*)HashTable;
+
+	if (InSize > LZ_MATCH_LIMIT) {
+		memset(Table, 0, LZ_HASH_TABLE_SIZE);
+		p++;
+
+		while (p < MatchLimit) {
+			const BYTE* Match;
+			unsigned Misses = 1u << LZ_SKIP_TRIGGER;
+
+			// find a match
+			while (1) {
+				unsigned h = LZHash(LZRead32(p));
+				Match = Base + Table[h];
+				Table[h] = (unsigned)(p - Base);
+
+				if (p - Match <= LZ_MAX_OFFSET && Match < p && LZRead32(Match) == LZRead32(p)) {
+					break;
+				}
+
+				p += Misses++ >> LZ_SKIP_TRIGGER;
+				if (p >= MatchLimit) {
+					goto last_literals;
+				}
+			}
+
+			// extend it back over the literals and forward up to the last literals
+			while (p > Anchor && Match > Base && p[-1] == Match[-1]) {
+				p--;
+				Match--;
+			}
+
+			const BYTE* q = p + LZ_MIN_MATCH;
+			const BYTE* m = Match + LZ_MIN_MATCH;
+			while (q < End - LZ_LAST_LITERALS && *q == *m) {
+				q++;
+				m++;
+			}
+
+			o = LZPutSequence(o, Anchor, (size_t)(p - Anchor), (size_t)(p - Match), (size_t)(q - p));
+			Table[LZHash(LZRead32(q - 2))] = (unsigned)(q - 2 - Base);
+			p = q;
+			Anchor = p;
+		}
+	}
+
+last_literals:
+	o = LZPutSequence(o, Anchor, (size_t)(End - Anchor), 0, 0);
+	return (size_t)(o - (BYTE*)Out);
+}
+
+static __inline const BYTE*
+LZGetLength(
+	const BYTE* p,
+	const BYTE* End,
+	size_t* pLength
+) {
+	BYTE b;
+	do {
+		if (p >= End) {
+			return NULL;
+		}
+		b = *p++;
+		*pLength += b;
+	} while (b == 255);
+
+	return p;
+}
+
+size_t
+LZDecompress(
+	const void* In,
+	size_t InSize,
+	void* Out,
+	size_t OutSize
+) {
+	const BYTE* p = (const BYTE*)In;
+	const BYTE* End = p + InSize;
+	BYTE* o = (BYTE*)Out;
+	BYTE* OutEnd = o + OutSize;
+
+	while (p < End) {
+		BYTE Token = *p++;
+
+		size_t LiteralLength = Token >> 4;
+		if (LiteralLength == 15 && !(p = LZGetLength(p, End, &LiteralLength))) {
+			return (size_t)-1;
+		}
+
+		if (LiteralLength > (size_t)(End - p) || LiteralLength > (size_t)(OutEnd - o)) {
+			return (size_t)-1;
+		}
+
+		memcpy(o, p, LiteralLength);
+		o += LiteralLength;
+		p += LiteralLength;
+
+		if (p == End) {
+			break; // last sequence
+		}
+
+		if (End - p < 2) {
+			return (size_t)-1;
+		}
+
+		size_t Offset = p[0] | ((size_t)p[1] << 8);
+		p += 2;
+
+		size_t MatchLength = Token & 15;
+		if (MatchLength == 15 && !(p = LZGetLength(p, End, &MatchLength))) {
+			return (size_t)-1;
+		}
+		MatchLength += LZ_MIN_MATCH;
+
+		if (!Offset || Offset > (size_t)(o - (BYTE*)Out) || MatchLength > (size_t)(OutEnd - o)) {
+			return (size_t)-1;
+		}
+
+		// the match may overlap its own output: copy it in steps that don't,
+		// every step doubles the distance to the source
+		const BYTE* m = o - Offset;
+		while (MatchLength) {
+			size_t Step = (size_t)(o - m);
+			if (Step > MatchLength) {
+				Step = MatchLength;
+			}
+
+			memcpy(o, m, Step);
+			o += Step;
+			MatchLength -= Step;
+		}
+	}
+
+	return (size_t)(o - (BYTE*)Out);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// LZ4-like block compression of log chunks, shared by the driver and the host tools (tools/).
+// A block is a run of sequences: token, literals, offset, match length, where the token
+// holds the literal length in its high 4 bits and the match length - LZ_MIN_MATCH in the low ones,
+// 15 means more length bytes follow (each 255 continues). The last sequence has literals only.
+// Offsets are 2 bytes, little-endian, so matches reach 64 KB back
+
+#include <stddef.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 14
+#define LZ_HASH_TABLE_SIZE ((1u << LZ_HASH_LOG) * sizeof(unsigned))
+
+// worst case of compressed size, for incompressible input
+#define LZ_COMPRESS_BOUND(Size) ((Size) + (Size) / 255 + 16)
+
+// HashTable is LZ_HASH_TABLE_SIZE bytes of scratch memory, Out has LZ_COMPRESS_BOUND(InSize) bytes.
+// Returns the compressed size
+size_t LZCompress(const void* In, size_t InSize, void* Out, void* HashTable);
+
+// returns the decompressed size, (size_t)-1 if the block is corrupted or does not fit OutSize
+size_t LZDecompress(const void* In, size_t InSize, void* Out, size_t OutSize);
@@ -0,0 +1,189 @@
+#include "Dedup.h"
+
+#include <winerror.h>
+
+#define DEDUP_SLOTS 16 // per processor, picked by the top bits of the fingerprint
+#define DEDUP_SLOT_SHIFT 60
+#define DEDUP_SLOT_SIZE 128
+
+// written by its processor only, at or above DISPATCH_LEVEL. A writer that interrupted another
+// one on the same processor finds Version odd and leaves the slot alone. The flushing thread
+// takes Repeats of a closed window and checks Version to see that Text still belongs to them
+typedef union DedupSlot {
+	struct {
+		ULONGLONG Key; // fingerprint, 0 - free
+		LONGLONG Since; // timestamp of the occurrence that was logged
+		LONG volatile Repeats; // counted, not logged, since
+		LONG volatile Version; // odd while the message is being replaced
+		ULONG Length; // of the message
+		CHAR Text[DEDUP_TEXT_SIZE]; // null-terminated, without the line end
+	};
+	UCHAR Pad[DEDUP_SLOT_SIZE];
+} DEDUPSLOT, *PDEDUPSLOT;
+
+typedef struct Dedup {
+	PDEDUPSLOT Slots; // DEDUP_SLOTS per processor, aligned within pMem
+	PVOID pMem;
+	ULONG CpuCount;
+	LONGLONG volatile Window; // timestamp ticks, follows the clock calibration
+} DEDUP;
+
+INT
+DedupInit(
+	PDEDUP* ppDedup,
+	ULONG CpuCount,
+	LONGLONG Window
+) {
+	PDEDUP pDedup = (PDEDUP)ExAllocatePool(NonPagedPool, sizeof(DEDUP));
+	if (!pDedup) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	SIZE_T Size = (SIZE_T)CpuCount * DEDUP_SLOTS * sizeof(DEDUPSLOT);
+	pDedup->pMem = ExAllocatePool(NonPagedPool, Size + DEDUP_SLOT_SIZE);
+	if (!pDedup->pMem) {
+		ExFreePool(pDedup);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	ULONG_PTR Aligned = ((ULONG_PTR)pDedup->pMem + DEDUP_SLOT_SIZE - 1) & ~(ULONG_PTR)(DEDUP_SLOT_SIZE - 1);
+	pDedup->Slots = (PDEDUPSLOT)Aligned;
+	RtlZeroMemory(pDedup->Slots, Size);
+	pDedup->CpuCount = CpuCount;
+	pDedup->Window = Window;
+
+	*ppDedup = pDedup;
+	return ERROR_SUCCESS;
+}
+
+VOID
+DedupDeinit(
+	PDEDUP pDedup
+) {
+	ExFreePool(pDedup->pMem);
+	ExFreePool(pDedup);
+}
+
+// by the flushing thread, writers pick the new window up with their next message
+VOID
+DedupSetWindow(
+	PDEDUP pDedup,
+	LONGLONG Window
+) {
+	pDedup->Window = Window;
+}
+
+// 8 bytes at a time, never 0
+static ULONGLONG
+DedupKey(
+	PCSTR Msg,
+	SIZE_T Length
+) {
+	ULONGLONG Hash = 0x9e3779b97f4a7c15ull ^ Length;
+	ULONGLONG Word;
+	SIZE_T i = 0;
+
+	for (; i + sizeof(Word) <= Length; i += sizeof(Word)) {
+		RtlCopyMemory(&Word, Msg + i, sizeof(Word));
+		Hash = (Hash ^ Word) * 0xff51afd7ed558ccdull;
+		Hash ^= Hash >> 32;
+	}
+
+	Word = 0;
+	RtlCopyMemory(&Word, Msg + i, Length - i);
+	Hash = (Hash ^ Word) * 0xc4ceb9fe1a85ec53ull;
+	Hash ^= Hash >> 29;
+
+	return Hash ? Hash : 1;
+}
+
+// TRUE - a repeat within the window, counted. Otherwise the message is to be logged and takes
+// its slot, pRepeat->Count tells if the message it replaces has repeats to report first
+BOOLEAN
+DedupCheck(
+	PDEDUP pDedup,
+	ULONG Cpu,
+	PCSTR Msg,
+	SIZE_T Length,
+	LONGLONG Now,
+	PDEDUPREPEAT pRepeat
+) {
+	ULONGLONG Key = DedupKey(Msg, Length);
+	PDEDUPSLOT Slot = &(pDedup->Slots[(Cpu % pDedup->CpuCount) * DEDUP_SLOTS + (ULONG)(Key >> DEDUP_SLOT_SHIFT)]);
+	pRepeat->Count = 0;
+
+	LONG Version = Slot->Version;
+	if (Version & 1) {
+		return FALSE;
+	}
+
+	if (Slot->Key == Key && Slot->Length == (ULONG)Length && Now - Slot->Since < pDedup->Window) {
+		InterlockedIncrement(&(Slot->Repeats));
+		return TRUE;
+	}
+
+	if (InterlockedCompareExchange(&(Slot->Version), Version + 1, Version) != Version) {
+		return FALSE;
+	}
+
+	LONG Repeats = InterlockedExchange(&(Slot->Repeats), 0);
+	if (Repeats) {
+		pRepeat->Count = (ULONG)Repeats;
+		pRepeat->Length = Slot->Length;
+		RtlCopyMemory(pRepeat->Text, Slot->Text, DEDUP_TEXT_SIZE);
+	}
+
+	SIZE_T TextLength = (Length < DEDUP_TEXT_SIZE) ? Length : DEDUP_TEXT_SIZE - 1;
+	while (TextLength && (Msg[TextLength - 1] == '\n' || Msg[TextLength - 1] == '\r')) {
+		TextLength--;
+	}
+	RtlCopyMemory(Slot->Text, Msg, TextLength);
+	Slot->Text[TextLength] = '\0';
+
+	Slot->Key = Key;
+	Slot->Since = Now;
+	Slot->Length = (ULONG)Length;
+	InterlockedExchange(&(Slot->Version), Version + 2);
+
+	return FALSE;
+}
+
+ULONG
+DedupSlotCount(
+	PDEDUP pDedup
+) {
+	return pDedup->CpuCount * DEDUP_SLOTS;
+}
+
+// flushing thread: takes the repeats of Slot if its window is over, or of any window with IsAll
+BOOLEAN
+DedupClose(
+	PDEDUP pDedup,
+	ULONG Slot,
+	LONGLONG Now,
+	BOOLEAN IsAll,
+	PDEDUPREPEAT pRepeat
+) {
+	PDEDUPSLOT pSlot = &(pDedup->Slots[Slot]);
+	LONG Version = pSlot->Version;
+	if ((Version & 1) || !pSlot->Repeats || (!IsAll && Now - pSlot->Since < pDedup->Window)) {
+		return FALSE;
+	}
+
+	KeMemoryBarrier();
+	RtlCopyMemory(pRepeat->Text, pSlot->Text, DEDUP_TEXT_SIZE);
+	pRepeat->Text[DEDUP_TEXT_SIZE - 1] = '\0';
+	pRepeat->Length = pSlot->Length;
+
+	// replaced meanwhile - the writer took what it replaced, the rest is the new message's
+	LONG Repeats = InterlockedExchange(&(pSlot->Repeats), 0);
+	if (pSlot->Version != Version) {
+		if (Repeats) {
+			InterlockedExchangeAdd(&(pSlot->Repeats), Repeats);
+		}
+		return FALSE;
+	}
+
+	pRepeat->Count = (ULONG)Repeats;
+	return Repeats != 0;
+}
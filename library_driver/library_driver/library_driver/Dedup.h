@@ -0,0 +1,29 @@
+#pragma once
+
+#include <ntddk.h>
+
+// repeated message suppression: a table of recent message fingerprints per processor.
+// A message seen again on the same processor within the window is counted instead of logged,
+// the count is reported when the window closes - the message comes again after it, another one
+// takes its slot, or the flushing thread finds the window over.
+// Messages are told apart by a 64-bit fingerprint and their length only, two different
+// messages that collide on both are counted as repeats of one another
+#define DEDUP_TEXT_SIZE 96 // start of the message kept for the report
+
+typedef struct Dedup* PDEDUP;
+
+// Count repeats of the message starting with Text
+typedef struct DedupRepeat {
+	ULONG Count;
+	ULONG Length; // of the message
+	CHAR Text[DEDUP_TEXT_SIZE];
+} DEDUPREPEAT, *PDEDUPREPEAT;
+
+INT DedupInit(PDEDUP* ppDedup, ULONG CpuCount, LONGLONG Window);
+VOID DedupDeinit(PDEDUP pDedup);
+VOID DedupSetWindow(PDEDUP pDedup, LONGLONG Window);
+
+BOOLEAN DedupCheck(PDEDUP pDedup, ULONG Cpu, PCSTR Msg, SIZE_T Length, LONGLONG Now, PDEDUPREPEAT pRepeat);
+
+ULONG DedupSlotCount(PDEDUP pDedup);
+BOOLEAN DedupClose(PDEDUP pDedup, ULONG Slot, LONGLONG Now, BOOLEAN IsAll, PDEDUPREPEAT pRepeat);
@@ -0,0 +1,445 @@
+#include "DeferredFormat.h"
+
+#include <ntstrsafe.h>
+
+#include "StrScan.h"
+
+#define DF_ARG_NONE 0 // %%
+#define DF_ARG_INT 1
+#define DF_ARG_LONG 2
+#define DF_ARG_INT64 3
+#define DF_ARG_SIZE 4
+#define DF_ARG_PTR 5
+#define DF_ARG_STR 6
+#define DF_ARG_BAD 7
+
+#define DF_SPEC_MAX 48
+
+#ifdef _MSC_VER
+#define DF_INT64_MODIFIER "I64"
+#else
+#define DF_INT64_MODIFIER "ll"
+#endif
+
+
+typedef struct DFConv {
+	PCSTR Start; // '%'
+	PCSTR End; // after the conversion character
+	UCHAR Class;
+	UCHAR Stars; // '*' width and precision, each takes an int argument before the value
+	UCHAR Bits; // 8 or 16 for hh and h
+	BOOLEAN IsSigned;
+	CHAR Spec;
+} DFCONV, *PDFCONV;
+
+typedef struct DFPacked {
+	PCSTR Format;
+	ULONG Count;
+	ULONG Reserved;
+	ULONGLONG Words[1]; // Count words, then %s strings one after another
+} DFPACKED, *PDFPACKED;
+
+#define DF_PACKED_HEADER_SIZE FIELD_OFFSET(DFPACKED, Words)
+
+
+static BOOLEAN
+DFIsDigit(
+	CHAR c
+) {
+	return c >= '0' && c <= '9';
+}
+
+// next conversion of the format at or after p, NULL if there are no more
+static PCSTR
+DFNextConversion(
+	PCSTR p,
+	PDFCONV Conv
+) {
+	while (*p && *p != '%') {
+		p++;
+	}
+
+	if (!*p) {
+		return NULL;
+	}
+
+	Conv->Start = p++;
+	Conv->Stars = 0;
+	Conv->Bits = 0;
+	Conv->IsSigned = FALSE;
+
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+		p++;
+	}
+
+	if (*p == '*') {
+		Conv->Stars++;
+		p++;
+	} else {
+		while (DFIsDigit(*p))
+			p++;
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			Conv->Stars++;
+			p++;
+		} else {
+			while (DFIsDigit(*p))
+				p++;
+		}
+	}
+
+	UCHAR Class = DF_ARG_INT;
+	if (p[0] == 'h') {
+		Conv->Bits = (p[1] == 'h') ? 8 : 16;
+		p += (p[1] == 'h') ? 2 : 1;
+	} else if (p[0] == 'l') {
+		Class = (p[1] == 'l') ? DF_ARG_INT64 : DF_ARG_LONG;
+		p += (p[1] == 'l') ? 2 : 1;
+	} else if (p[0] == 'I' && p[1] == '6' && p[2] == '4') {
+		Class = DF_ARG_INT64;
+		p += 3;
+	} else if (p[0] == 'I' && p[1] == '3' && p[2] == '2') {
+		p += 3;
+	} else if (p[0] == 'I' || p[0] == 'z') {
+		Class = DF_ARG_SIZE;
+		p++;
+	}
+
+	Conv->Spec = *p;
+	switch (*p) {
+	case 'd':
+	case 'i':
+		Conv->IsSigned = TRUE;
+		break;
+
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+	case 'c':
+		break;
+
+	case 'p':
+		Class = DF_ARG_PTR;
+		break;
+
+	case 's':
+		// wide strings are not supported
+		Class = (Class == DF_ARG_INT) ? DF_ARG_STR : DF_ARG_BAD;
+		break;
+
+	case '%':
+		Class = DF_ARG_NONE;
+		break;
+
+	default:
+		Class = DF_ARG_BAD;
+		break;
+	}
+
+	if (*p) {
+		p++;
+	}
+
+	Conv->Class = Class;
+	Conv->End = p;
+
+	return p;
+}
+
+static ULONGLONG
+DFCaptureInt(
+	PDFCONV Conv,
+	va_list* pArgs
+) {
+	switch (Conv->Class) {
+	case DF_ARG_LONG: {
+		long Value = va_arg(*pArgs, long);
+		return Conv->IsSigned ? (ULONGLONG)(LONGLONG)Value : (ULONGLONG)(unsigned long)Value;
+	}
+
+	case DF_ARG_INT64:
+		return (ULONGLONG)va_arg(*pArgs, LONGLONG);
+
+	case DF_ARG_SIZE:
+		return (ULONGLONG)va_arg(*pArgs, SIZE_T);
+
+	default: {
+		int Value = va_arg(*pArgs, int);
+		if (Conv->Bits == 8)
+			return Conv->IsSigned ? (ULONGLONG)(LONGLONG)(CHAR)Value : (UCHAR)Value;
+		if (Conv->Bits == 16)
+			return Conv->IsSigned ? (ULONGLONG)(LONGLONG)(SHORT)Value : (USHORT)Value;
+
+		return Conv->IsSigned ? (ULONGLONG)(LONGLONG)Value : (ULONG)Value;
+	}
+	}
+}
+
+// runs on the caller's thread at any IRQL, must stay cheap
+VOID
+DFCapture(
+	PCSTR Format,
+	va_list Args,
+	PDFARGS pArgs
+) {
+	DFCONV Conv;
+	PCSTR p = Format;
+	va_list Ap;
+	va_copy(Ap, Args);
+
+	pArgs->Count = 0;
+	pArgs->StringsSize = 0;
+
+	while ((p = DFNextConversion(p, &Conv)) != NULL) {
+		if (Conv.Class == DF_ARG_NONE) {
+			continue;
+		}
+
+		if (Conv.Class == DF_ARG_BAD || pArgs->Count + Conv.Stars + 1 > DF_MAX_ARGS) {
+			break;
+		}
+
+		for (UCHAR i = 0; i < Conv.Stars; ++i) {
+			pArgs->Strings[pArgs->Count] = NULL;
+			pArgs->Words[pArgs->Count++] = (ULONGLONG)(LONGLONG)va_arg(Ap, int);
+		}
+
+		ULONG i = pArgs->Count++;
+		pArgs->Strings[i] = NULL;
+
+		if (Conv.Class == DF_ARG_PTR) {
+			pArgs->Words[i] = (ULONG_PTR)va_arg(Ap, PVOID);
+
+		} else if (Conv.Class == DF_ARG_STR) {
+			PCSTR Str = va_arg(Ap, PCSTR);
+			if (!Str) {
+				Str = "(null)";
+			}
+
+			pArgs->Strings[i] = Str;
+			pArgs->Words[i] = StrScanLength(Str) + 1;
+			pArgs->StringsSize += (SIZE_T)pArgs->Words[i];
+
+		} else {
+			pArgs->Words[i] = DFCaptureInt(&Conv, &Ap);
+		}
+	}
+
+	va_end(Ap);
+}
+
+SIZE_T
+DFPackedSize(
+	PDFARGS pArgs
+) {
+	return DF_PACKED_HEADER_SIZE + DFArgsSize(pArgs);
+}
+
+SIZE_T
+DFArgsSize(
+	PDFARGS pArgs
+) {
+	return pArgs->Count * sizeof(ULONGLONG) + pArgs->StringsSize;
+}
+
+// the words, then the %s strings one after another
+VOID
+DFPackArgs(
+	PDFARGS pArgs,
+	PVOID pOut
+) {
+	PULONGLONG Words = (PULONGLONG)pOut;
+	PCHAR Str = (PCHAR)&(Words[pArgs->Count]);
+	for (ULONG i = 0; i < pArgs->Count; ++i) {
+		Words[i] = pArgs->Words[i];
+		if (pArgs->Strings[i]) {
+			RtlCopyMemory(Str, pArgs->Strings[i], (SIZE_T)pArgs->Words[i]);
+			Str += pArgs->Words[i];
+		}
+	}
+}
+
+VOID
+DFPack(
+	PCSTR Format,
+	PDFARGS pArgs,
+	PVOID pOut
+) {
+	PDFPACKED Packed = (PDFPACKED)pOut;
+	Packed->Format = Format;
+	Packed->Count = pArgs->Count;
+	Packed->Reserved = 0;
+
+	DFPackArgs(pArgs, Packed->Words);
+}
+
+PCSTR
+DFPackedFormat(
+	PVOID pPacked
+) {
+	return ((PDFPACKED)pPacked)->Format;
+}
+
+static VOID
+DFAppend(
+	PCHAR pOut,
+	SIZE_T OutSize,
+	PSIZE_T pLength,
+	PCSTR Src,
+	SIZE_T Count
+) {
+	SIZE_T Room = OutSize - 1 - *pLength;
+	if (Count > Room) {
+		Count = Room;
+	}
+
+	RtlCopyMemory(pOut + *pLength, Src, Count);
+	*pLength += Count;
+}
+
+static PCHAR
+DFPutInt(
+	PCHAR p,
+	LONG Value
+) {
+	CHAR Digits[12];
+	INT Count = 0;
+	ULONG Abs = (Value < 0) ? 0u - (ULONG)Value : (ULONG)Value;
+
+	do {
+		Digits[Count++] = (CHAR)('0' + Abs % 10);
+		Abs /= 10;
+	} while (Abs);
+
+	if (Value < 0) {
+		*p++ = '-';
+	}
+
+	while (Count) {
+		*p++ = Digits[--Count];
+	}
+
+	return p;
+}
+
+// single conversion spec for RtlStringCbPrintfA: '*' replaced with the captured
+// values, the length modifier normalized to the 64-bit one
+static VOID
+DFBuildSpec(
+	PDFCONV Conv,
+	PULONGLONG Words,
+	PULONG pIndex,
+	PCHAR Spec
+) {
+	PCSTR p = Conv->Start;
+	PCHAR s = Spec;
+
+	*s++ = *p++; // '%'
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+		*s++ = *p++;
+	}
+
+	if (*p == '*') {
+		s = DFPutInt(s, (LONG)Words[(*pIndex)++]);
+		p++;
+	} else {
+		while (DFIsDigit(*p) && s < Spec + DF_SPEC_MAX - 16)
+			*s++ = *p++;
+	}
+
+	if (*p == '.') {
+		*s++ = *p++;
+		if (*p == '*') {
+			s = DFPutInt(s, (LONG)Words[(*pIndex)++]);
+			p++;
+		} else {
+			while (DFIsDigit(*p) && s < Spec + DF_SPEC_MAX - 16)
+				*s++ = *p++;
+		}
+	}
+
+	if (Conv->Class != DF_ARG_PTR && Conv->Class != DF_ARG_STR && Conv->Spec != 'c') {
+		PCSTR Modifier = DF_INT64_MODIFIER;
+		while (*Modifier) {
+			*s++ = *Modifier++;
+		}
+	}
+
+	*s++ = Conv->Spec;
+	*s = '\0';
+}
+
+// runs in the flushing thread at PASSIVE_LEVEL, returns the length of the text without '\0'
+SIZE_T
+DFFormat(
+	PVOID pPacked,
+	SIZE_T PackedSize,
+	PCHAR pOut,
+	SIZE_T OutSize
+) {
+	PDFPACKED Packed = (PDFPACKED)pPacked;
+	PCSTR Str = (PCSTR)&(Packed->Words[Packed->Count]);
+	PCSTR StrEnd = (PCSTR)pPacked + PackedSize;
+	PCSTR p = Packed->Format;
+	ULONG Index = 0;
+	SIZE_T Length = 0;
+	CHAR Spec[DF_SPEC_MAX];
+	DFCONV Conv;
+
+	if (!OutSize) {
+		return 0;
+	}
+
+	while (Length + 1 < OutSize) {
+		PCSTR Literal = p;
+		p = DFNextConversion(p, &Conv);
+		if (!p) {
+			DFAppend(pOut, OutSize, &Length, Literal, StrScanLength(Literal));
+			break;
+		}
+
+		DFAppend(pOut, OutSize, &Length, Literal, (SIZE_T)(Conv.Start - Literal));
+
+		if (Conv.Class == DF_ARG_NONE) {
+			DFAppend(pOut, OutSize, &Length, "%", 1);
+			continue;
+		}
+
+		// not captured - the rest goes as is
+		if (Conv.Class == DF_ARG_BAD || Index + Conv.Stars + 1 > Packed->Count) {
+			DFAppend(pOut, OutSize, &Length, Conv.Start, StrScanLength(Conv.Start));
+			break;
+		}
+
+		DFBuildSpec(&Conv, Packed->Words, &Index, Spec);
+		ULONGLONG Word = Packed->Words[Index++];
+
+		PCHAR pDst = pOut + Length;
+		SIZE_T DstSize = OutSize - Length;
+		if (Conv.Class == DF_ARG_STR) {
+			if (Str + Word > StrEnd) {
+				break;
+			}
+			RtlStringCbPrintfA(pDst, DstSize, Spec, Str);
+			Str += Word;
+
+		} else if (Conv.Class == DF_ARG_PTR) {
+			RtlStringCbPrintfA(pDst, DstSize, Spec, (PVOID)(ULONG_PTR)Word);
+
+		} else if (Conv.Spec == 'c') {
+			RtlStringCbPrintfA(pDst, DstSize, Spec, (int)Word);
+
+		} else {
+			RtlStringCbPrintfA(pDst, DstSize, Spec, (LONGLONG)Word);
+		}
+
+		Length += StrScanLength(pDst);
+	}
+
+	pOut[Length] = '\0';
+	return Length;
+}
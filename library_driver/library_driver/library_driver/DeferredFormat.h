@@ -0,0 +1,27 @@
+#pragma once
+
+#include <ntddk.h>
+#include <stdarg.h>
+
+// printf-like messages whose formatting is deferred to the flushing thread:
+// the caller only captures the format pointer and the raw argument words.
+// Supported: %d %i %u %o %x %X %c %p %s %% with flags, width, precision ('*' too)
+// and h, hh, l, ll, I64, I32, I, z length modifiers. %s strings are copied,
+// floating point conversions are not supported - the rest of the format is left as is.
+
+#define DF_MAX_ARGS 16
+
+typedef struct DFArgs {
+	ULONG Count;
+	ULONGLONG Words[DF_MAX_ARGS];
+	PCSTR Strings[DF_MAX_ARGS]; // for %s words, Words[i] is then the string size with '\0'
+	SIZE_T StringsSize;
+} DFARGS, *PDFARGS;
+
+VOID DFCapture(PCSTR Format, va_list Args, PDFARGS pArgs);
+SIZE_T DFPackedSize(PDFARGS pArgs);
+VOID DFPack(PCSTR Format, PDFARGS pArgs, PVOID pOut);
+SIZE_T DFArgsSize(PDFARGS pArgs);
+VOID DFPackArgs(PDFARGS pArgs, PVOID pOut); // the arguments alone, for catalog messages
+PCSTR DFPackedFormat(PVOID pPacked);
+SIZE_T DFFormat(PVOID pPacked, SIZE_T PackedSize, PCHAR pOut, SIZE_T OutSize);
@@ -1,34 +1,273 @@
 #include <WinError.h>
 #include "RingBuffer.h"
 #include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "DeferredFormat.h"
+#include "LogFile.h"
+#include "Compress.h"
+#include "StrScan.h"
+#include "Dedup.h"
+#include "Catalog.h"
 
-#define FLUSH_THRESHOLD 50u // in percents
+#define FLUSH_THRESHOLD 50u // in percents, until the first adaptive update or with ADAPTIVE_FLUSH 0
 #define DEFAULT_RING_BUF_SIZE (100ull * 1024ull * 1024ull)
-#define FLUSH_BUF_SIZE DEFAULT_RING_BUF_SIZE
+#define FLUSH_BUF_SIZE (1024ull * 1024ull) // one encoded chunk, rings are drained chunk by chunk
+#define FLUSH_DIRECT_MIN 4096u // bodies at least that large are written straight from the ring
+#define FRAME_BUF_SIZE (KLOGGER_FRAME_HEADER_MAX + 2 * KLOGGER_BLOCK_HEADER_MAX + LZ_COMPRESS_BOUND(FLUSH_BUF_SIZE))
 #define REGISTRY_BUF_SIZE_KEY L"BUF_SIZE"
+#define DEFAULT_PER_CPU_BUF_SIZE 0ull // 0 - one ring is shared by all processors
+#define REGISTRY_PER_CPU_BUF_SIZE_KEY L"PER_CPU_BUF_SIZE"
+#define DEFAULT_WRITE_SLOTS 4u // chunks being written at once
+#define MAX_WRITE_SLOTS 16u
+#define REGISTRY_WRITE_SLOTS_KEY L"WRITE_SLOTS"
+#define DEFAULT_SEGMENT_SIZE_MB 0u // 0 - the log is one LOG_FILE_NAME file, never rotated
+#define REGISTRY_SEGMENT_SIZE_MB_KEY L"SEGMENT_SIZE_MB"
+#define DEFAULT_MAX_SEGMENTS 16u // 0 - all segments are kept
+#define REGISTRY_MAX_SEGMENTS_KEY L"MAX_SEGMENTS"
+#define DEFAULT_COMPRESS 0u // 1 - chunks are written as compressed frames
+#define REGISTRY_COMPRESS_KEY L"COMPRESS"
+#define DEFAULT_INDEX_KB 0u // non-zero - a sidecar index entry every that many KB of the log
+#define REGISTRY_INDEX_KB_KEY L"INDEX_KB"
+#define REGISTRY_LOG_MASK_KEY L"LOG_MASK" // KLoggerMask, KLOGGER_MASK_DEFAULT if not set
+#define REGISTRY_LAST_SEGMENT_KEY L"LAST_SEGMENT" // written by the logger, numbering goes on across loads
 #define FLUSH_TIMEOUT 10000000ll
+#define DEFAULT_OVERFLOW_POLICY KLOGGER_OVERFLOW_DROP
+#define REGISTRY_OVERFLOW_POLICY_KEY L"OVERFLOW_POLICY"
+#define DEFAULT_BLOCK_TIMEOUT_MS 100u // KLOGGER_OVERFLOW_BLOCK, longest wait for ring space
+#define REGISTRY_BLOCK_TIMEOUT_MS_KEY L"BLOCK_TIMEOUT_MS"
+#define BLOCK_POLL_INTERVAL 10000ll // 1ms, blocked writers retry that often
+#define DEFAULT_ADAPTIVE_FLUSH 1u // 0 - fixed FLUSH_THRESHOLD and FLUSH_TIMEOUT
+#define REGISTRY_ADAPTIVE_FLUSH_KEY L"ADAPTIVE_FLUSH"
+#define FLUSH_HEADROOM 25u // percents of a ring left free when a flush started at the threshold ends
+#define MIN_FLUSH_THRESHOLD 5u
+#define MAX_FLUSH_THRESHOLD 75u
+#define MIN_FLUSH_TIMEOUT 100000ll // 10ms
+#define MAX_FLUSH_TIMEOUT 50000000ll // 5s, the longest a message waits for the file when idle
+#define FLUSH_WAKE_LATENCY_US 2000ull // DPC to the flushing thread running, an estimate
+#define INITIAL_DRAIN_RATE (64ull * 1024ull * 1024ull) // bytes per second until a flush measures it
+#define MIN_DRAIN_SAMPLE (64ull * 1024ull) // smaller flushes say little about the disk
 #define START_TIMEOUT 50000000ll
+#define FLUSH_PASS_CHUNKS 4u // per logger and pass of the flushing thread, the others are served in between
+#define FINAL_LOSS_FLUSHES 3u // at most, for the losses left when a logger goes away
+#define DEFAULT_MAX_BUF_SIZE 0ull // 0 - rings keep their size unless KLoggerResize is called
+#define REGISTRY_MAX_BUF_SIZE_KEY L"MAX_BUF_SIZE"
+#define DEFAULT_USE_TSC 1u // 0 - record timestamps are performance counter ticks even with an invariant TSC
+#define REGISTRY_USE_TSC_KEY L"USE_TSC"
+#define TSC_ESTIMATE_TIME 100000ll // 10ms, first estimate of the TSC frequency at KLoggerInit
+#define TSC_CALIBRATION_WINDOW 600000000ll // 60s, flushes refine the frequency until then
+#define DEFAULT_NUMA_LOCAL 0u // 1 - rings are allocated on the node of the processors writing them
+#define REGISTRY_NUMA_LOCAL_KEY L"NUMA_LOCAL"
+#define DEFAULT_LIVE_TAIL 0u // 1 - rings are shared read-only as sections LIVE_TAIL_NAME.<ring>
+#define REGISTRY_LIVE_TAIL_KEY L"LIVE_TAIL"
+#define DEFAULT_DEDUP_MS 0u // non-zero - repeats of a message on a processor within that many ms are counted
+#define REGISTRY_DEDUP_MS_KEY L"DEDUP_MS"
+#define REPEAT_FORMAT "*** last message repeated %u times: %s ***"
+#define LIVE_TAIL_NAME L"KLogger" // "Global\KLogger.0", ... for user mode
+#define LIVE_NAME_PREFIX L"\\BaseNamedObjects\\"
+#define LIVE_NAME_MAX 128
+#define RESIZE_GROW_LOAD 90u // ring fill in percents a flush starts at
+#define RESIZE_GROW_FLUSHES 4u // over RESIZE_GROW_LOAD or with drops within RESIZE_GROW_WINDOW, then the rings double
+#define RESIZE_GROW_WINDOW 10000000ll // 1s
+#define RESIZE_SHRINK_LOAD 10u
+#define RESIZE_SHRINK_DELAY 300000000ll // 30s of flushes under RESIZE_SHRINK_LOAD, then the rings halve
+#define FORMAT_BUF_SIZE 4096 // longer KLoggerLogf messages are truncated
+#define STATS_LINE_SIZE 64 // per-processor counters don't share cache lines
 
+// messages dropped on a ring and not reported by a LOSS record yet. Only touched
+// when the ring is full and by the next writer after that
+typedef union RingLoss {
+	struct {
+		LONGLONG volatile Messages;
+		LONGLONG volatile Bytes;
+	};
+	UCHAR Pad[STATS_LINE_SIZE];
+} RINGLOSS, *PRINGLOSS;
+
+// flushing thread's view of one ring during a merge
+typedef struct MergeSource {
+	PRINGBUFFER pRingBuf;
+	LONGLONG Pos; // next record to read
+	LONGLONG Consumed; // records before it are encoded into chunks
+	PKLOGGER_RECORD Record; // NULL if the ring has nothing committed
+	SIZE_T Size;
+	LONGLONG Reserved; // RBReserved at the last flush control update
+} MERGESOURCE, *PMERGESOURCE;
+
+// chunk on its way to the file, ring space it was encoded from
+// is given back once the write completes
+typedef struct WriteSlot {
+	PCHAR pBuf; // FLUSH_BUF_SIZE
+	PCHAR pFrame; // FRAME_BUF_SIZE, the chunk compressed, NULL if compression is off
+	LOGWRITE Chunk;
+	LOGWRITE Direct; // body of a large message, written from the ring
+	BOOLEAN IsBusy;
+	PLONGLONG Release; // per ring, position to release up to
+	ULONGLONG Records; // encoded into the chunk
+	KLOGGER_LOSS Held; // messages of the chunk, counted as a LOSS record counts them
+	LOGMARK Mark; // the file before the chunk and its catalog, cut back to if a write fails
+	ULONG CatalogWritten; // at Mark
+} WRITESLOT, *PWRITESLOT;
+
+// writers' counters, each processor updates only its own at DISPATCH_LEVEL without
+// interlocked operations. KLoggerGetStats sums them up
+typedef union CpuStats {
+	struct {
+		ULONGLONG Messages;
+		ULONGLONG Bytes;
+		ULONGLONG Dropped;
+		ULONGLONG DroppedBytes;
+		ULONGLONG Overwritten;
+		ULONGLONG OverwrittenBytes;
+		ULONGLONG Suppressed; // repeats counted by DEDUP_MS
+		ULONG MaxLoadFactor;
+	};
+	UCHAR Pad[STATS_LINE_SIZE];
+} CPUSTATS, *PCPUSTATS;
+
+// flushing thread's counters
+typedef struct FlushStats {
+	ULONGLONG DpcFlushes;
+	ULONGLONG TimeoutFlushes;
+	ULONGLONG Chunks;
+	ULONGLONG Bytes; // written to the file
+	LONGLONG Ticks; // spent in FlushRings
+	LONGLONG MaxTicks;
+} FLUSHSTATS, *PFLUSHSTATS;
+
+// adaptive flushing, updated by the flushing thread after every flush from the rates
+// it measures. Writers only read Threshold
+typedef struct FlushControl {
+	BOOLEAN IsAdaptive;
+	LONG volatile Threshold; // percents, LogEnd queues the DPC from it on
+	LONGLONG Timeout; // 100ns units, longest wait of the flushing thread
+	LONGLONG LastTicks; // of the last update
+	ULONGLONG LastDropped; // DroppedBytes of all processors at the last update
+	ULONGLONG RingRate; // ring bytes per second into the busiest ring, drops included
+	ULONGLONG IngestRate; // into all rings
+	ULONGLONG DrainRate; // ring bytes per second FlushRings encodes and writes
+} FLUSHCONTROL, *PFLUSHCONTROL;
+
+// ring size, changed by the flushing thread only: on request or, between MinSize
+// and MaxSize, when the rings stay full or empty for a while
+typedef struct ResizeControl {
+	LONGLONG volatile Requested; // by KLoggerResize, 0 - nothing is
+	SIZE_T Size; // of each current ring
+	SIZE_T MinSize;
+	SIZE_T MaxSize; // 0 - no automatic resizing
+	ULONG HighFlushes; // over RESIZE_GROW_LOAD or with drops since HighSince
+	LONGLONG HighSince; // ticks
+	LONGLONG LowSince; // ticks, the rings are under RESIZE_SHRINK_LOAD since then, 0 - they are not
+	ULONG RetiredCount; // old rings still being drained
+	ULONG Resizes;
+} RESIZECONTROL, *PRESIZECONTROL;
+
+// one log: its rings, file and flushing state. Any number of them, all served
+// by the one flushing thread
 typedef struct KLogger
 {
-	PRINGBUFFER pRingBuf;
+	struct KLogger* Next; // in gFlusher.Loggers
 
-	HANDLE FileHandle;
-	PCHAR pFlushingBuf;
+	PRINGBUFFER* pRingBufs; // one per processor or a single shared one, swapped on resize
+	ULONG RingCount;
+	ULONG SourceCount; // RingCount current rings, then as many retired ones
+	PULONG CpuRings; // ring of each processor when a shared ring is kept per node, NULL otherwise
+	ULONG CpuCount;
+	BOOLEAN IsLive; // rings are in sections user mode maps, they are never resized
+	PRINGLOSS Losses; // per ring, aligned within pLossMem
+	PVOID pLossMem;
+	ULONG Overflow; // KLOGGER_OVERFLOW_*
+	LONGLONG BlockTimeout; // performance counter ticks
+	PDEDUP pDedup; // NULL - every message is logged
+	ULONG DedupMs; // window of pDedup, turned into ticks of the current clock frequency
 
-	HANDLE FlushingThreadHandle;
-	PKTHREAD pFlushingThread;
+	PMERGESOURCE Sources; // SourceCount, pRingBuf of a retired one is NULL unless a resize drains it
+	PMERGESOURCE* Heap; // min-heap of sources by timestamp of the current record
 
-	KEVENT FlushEvent;
-	KEVENT StartEvent;
-	KEVENT StopEvent;
+	PLOGFILE pLogFile;
+	ULONGLONG Sequence; // records encoded since the logger was set up, for the index
+	ULONG CatalogWritten; // IDs the current log file has CATALOG records of since the last full catalog
+	UNICODE_STRING RegistryPath; // copy, LAST_SEGMENT is updated on rotation, empty for KLoggerCreate ones
+	PVOID pHashTable; // of the compressor, NULL if compression is off
+	PWRITESLOT Slots; // written in order, NextSlot is the oldest one
+	ULONG SlotCount;
+	ULONG NextSlot;
+	PWRITESLOT Failed; // the first slot whose write failed, the file is cut back to it once all are complete
+	PCHAR pFormatBuf; // KLOGGER_RING_FORMAT messages are formatted here, CATALOG records are put here
+	LONGLONG Frequency; // of the performance counter, flushing is timed with it
 
 	LONG volatile IsFlushDispatched;
+	LONG volatile IsFlushRequested; // by the DPC, taken by the flushing thread
 	PKDPC pFlushDpc;
+	BOOLEAN HasMore; // the last flush stopped at FLUSH_PASS_CHUNKS
+	LONGLONG Deadline; // performance counter ticks, flushed by then even if not requested
+
+	PCPUSTATS CpuStats; // StatsCount lines, aligned within pStatsMem
+	ULONG StatsCount;
+	PVOID pStatsMem;
+	FLUSHSTATS FlushStats;
+	FLUSHCONTROL Control;
+	RESIZECONTROL Resize;
 
 } KLOGGER;
 
-PKLOGGER gKLogger;
+// the flushing thread and the loggers it serves
+typedef struct Flusher {
+	PKLOGGER Loggers;
+	KEVENT Lock; // synchronization event used as a mutex: the list and flushes
+	KEVENT WakeEvent;
+	KEVENT StartEvent;
+	KEVENT StopEvent;
+	HANDLE ThreadHandle;
+	PKTHREAD pThread;
+} FLUSHER;
+
+FLUSHER gFlusher;
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KLOGGER_TSC
+#endif
+
+// clock of record timestamps, shared by all loggers. The TSC if it is invariant and never
+// goes back from one processor to another, read with a single instruction on every message.
+// Its frequency is measured against the performance counter: estimated by KLoggerInit,
+// then refined by the flushing thread and carried by the SYNC of every chunk.
+// The performance counter otherwise
+typedef struct TimestampClock {
+	BOOLEAN IsTsc;
+	BOOLEAN IsCalibrated; // TSC_CALIBRATION_WINDOW has passed, Frequency stays
+	LONGLONG Frequency; // ticks per second
+	LONGLONG BaseTsc; // taken together with BaseCounter at KLoggerInit
+	LONGLONG BaseCounter;
+	LONGLONG CounterFrequency;
+} TIMESTAMPCLOCK;
+
+TIMESTAMPCLOCK gClock;
+PKLOGGER gKLogger; // the default one, set up from the registry by KLoggerInit
+PCATALOG gCatalog; // message formats registered for KLoggerLogId, shared by all loggers
+ULONG volatile KLoggerMask = KLOGGER_MASK_DEFAULT;
+
+// library's own tracing, off unless KLOGGER_MASK_DIAGNOSTICS is set
+#define KLoggerDiag(...) \
+	do { if (KLoggerMask & KLOGGER_MASK_DIAGNOSTICS) DbgPrint(__VA_ARGS__); } while (0)
+
+static __inline LONGLONG
+ReadTimestamp(VOID) {
+#ifdef KLOGGER_TSC
+	if (gClock.IsTsc)
+		return (LONGLONG)ReadTimeStampCounter();
+#endif
+	return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+// a new ring has a time base before its first flush, for recovery from memory images
+static VOID
+InitTimeBase(
+	PRINGBUFFER pRingBuf
+) {
+	LARGE_INTEGER SystemTime;
+	KeQuerySystemTimePrecise(&SystemTime);
+	RBSetTimeBase(pRingBuf, ReadTimestamp(), SystemTime.QuadPart, gClock.Frequency);
+}
 
 VOID SetWriteEvent(
 	IN PKDPC pthisDpcObject,
@@ -37,366 +276,2631 @@ VOID SetWriteEvent(
 	IN PVOID SystemArgument2
 );
 
-static INT 
-WriteToFile(
-	HANDLE FileHandle,
-	PVOID Buf, 
-	SIZE_T Length
+static BOOLEAN
+MergeFetch(
+	PMERGESOURCE Src
 ) {
-	IO_STATUS_BLOCK IoStatusBlock;
-	NTSTATUS Status = ZwWriteFile(
-		FileHandle,
-		NULL,
-		NULL,
-		NULL,
-		&IoStatusBlock,
-		Buf,
-		(ULONG)Length,
-		NULL,
-		NULL
-	);
+	PVOID pData;
+	if (RBReadNext(Src->pRingBuf, &(Src->Pos), &pData, &(Src->Size)) != ERROR_SUCCESS) {
+		Src->Record = NULL;
+		return FALSE;
+	}
 
-	return Status;
+	Src->Record = (PKLOGGER_RECORD)pData;
+	return TRUE;
 }
 
-VOID 
-FlushingThreadFunc(
-	IN PVOID _Unused
+static VOID
+HeapSiftDown(
+	PMERGESOURCE* Heap,
+	ULONG HeapSize,
+	ULONG i
 ) {
-	UNREFERENCED_PARAMETER(_Unused);
-	KeSetEvent(&(gKLogger->StartEvent), 0, FALSE);
+	while (TRUE) {
+		ULONG Min = i;
+		ULONG Left = 2 * i + 1;
+		ULONG Right = 2 * i + 2;
 
-	PVOID handles[2];
-	handles[0] = (PVOID)&(gKLogger->FlushEvent);
-	handles[1] = (PVOID)&(gKLogger->StopEvent);
+		if (Left < HeapSize && Heap[Left]->Record->Timestamp < Heap[Min]->Record->Timestamp)
+			Min = Left;
+		if (Right < HeapSize && Heap[Right]->Record->Timestamp < Heap[Min]->Record->Timestamp)
+			Min = Right;
 
-	LARGE_INTEGER Timeout;
-	Timeout.QuadPart = -FLUSH_TIMEOUT;
+		if (Min == i)
+			return;
 
-	NTSTATUS Status, WriteStatus;
-	SIZE_T Length = 0;
-	while (TRUE) {
-		Status = KeWaitForMultipleObjects(
-			2,
-			handles,
-			WaitAny,
-			Executive,
-			KernelMode,
-			TRUE,
-			&Timeout,
-			NULL);
+		PMERGESOURCE Tmp = Heap[i];
+		Heap[i] = Heap[Min];
+		Heap[Min] = Tmp;
+		i = Min;
+	}
+}
 
-		if (Status == STATUS_TIMEOUT)
-			DbgPrint("Flushing thread is woken by TIMEOUT\n");
+static PUCHAR
+EncodeSync(
+	PUCHAR Out,
+	LONGLONG Timestamp,
+	LONGLONG SystemTime,
+	LONGLONG Frequency
+) {
+	*Out++ = KLOGGER_REC_SYNC;
+	Out = KLoggerPutVarint(Out, (ULONGLONG)Timestamp);
+	Out = KLoggerPutVarint(Out, (ULONGLONG)SystemTime);
+	return KLoggerPutVarint(Out, (ULONGLONG)Frequency);
+}
 
-		if (Status == STATUS_WAIT_0)
-			DbgPrint("Flushing thread is woken by FLUSH EVENT\n");			
+// of a record merged into a chunk with the given time base
+static LONGLONG
+RecordSystemTime(
+	LONGLONG Timestamp,
+	LONGLONG SyncTimestamp,
+	LONGLONG SystemTime
+) {
+	LONGLONG Delta = Timestamp - SyncTimestamp;
 
-		if (Status == STATUS_TIMEOUT || Status == STATUS_WAIT_0) {
-			Length = FLUSH_BUF_SIZE;
+	return SystemTime + Delta / gClock.Frequency * 10000000ll + Delta % gClock.Frequency * 10000000ll / gClock.Frequency;
+}
 
-			int Err = RBRead(gKLogger->pRingBuf, gKLogger->pFlushingBuf, &Length);
-			if (Err == ERROR_SUCCESS) {
-				WriteStatus = WriteToFile(gKLogger->FileHandle, gKLogger->pFlushingBuf, Length);
-				if (WriteStatus != STATUS_SUCCESS) {
-					DbgPrint("Error: can't write to log file, return code %d\n", WriteStatus);
-				}
+static PUCHAR
+EncodeMessageHeader(
+	PUCHAR Out,
+	PKLOGGER_RECORD Record,
+	SIZE_T Length,
+	PLONGLONG pPrevTimestamp
+) {
+	*Out++ = KLOGGER_REC_MESSAGE;
+	*Out++ = Record->Irql;
+	Out = KLoggerPutVarint(Out, Record->Cpu);
+	Out = KLoggerPutVarint(Out, KLoggerZigZag(Record->Timestamp - *pPrevTimestamp));
+	Out = KLoggerPutVarint(Out, Length);
+	*pPrevTimestamp = Record->Timestamp;
 
-			} else {
-				DbgPrint("Error: can't read from ring_buffer, return code %d\n", Err);
-			}
+	return Out;
+}
 
-		} else if (Status == STATUS_WAIT_1) {
-			KeClearEvent(&gKLogger->StopEvent);
-			PsTerminateSystemThread(ERROR_SUCCESS); // exit
-		}
+static PUCHAR
+EncodeLoss(
+	PUCHAR Out,
+	PKLOGGER_RECORD Record,
+	PLONGLONG pPrevTimestamp
+) {
+	PKLOGGER_LOSS Loss = (PKLOGGER_LOSS)(Record + 1);
 
-		if (Status == STATUS_WAIT_0) {
-			KeClearEvent(&gKLogger->FlushEvent);
-			if (!InterlockedExchange(&(gKLogger->IsFlushDispatched), 0))
-				__debugbreak();
-		}
-	}
+	*Out++ = KLOGGER_REC_LOSS;
+	*Out++ = Record->Irql;
+	Out = KLoggerPutVarint(Out, Record->Cpu);
+	Out = KLoggerPutVarint(Out, KLoggerZigZag(Record->Timestamp - *pPrevTimestamp));
+	Out = KLoggerPutVarint(Out, Loss->Messages);
+	Out = KLoggerPutVarint(Out, Loss->Bytes);
+	*pPrevTimestamp = Record->Timestamp;
+
+	return Out;
 }
 
-SIZE_T GetRingBufSize(
-	PUNICODE_STRING RegistryPath
-) {  
-    HANDLE RegKeyHandle;
-    NTSTATUS Status;
-    OBJECT_ATTRIBUTES OdjAttr;
-    UNICODE_STRING RegKeyPath;
-    ULONG KeyValue = DEFAULT_RING_BUF_SIZE;
- 
-    PKEY_VALUE_PARTIAL_INFORMATION PartInfo;
-    ULONG PartInfoSize;
- 
-    InitializeObjectAttributes(&OdjAttr, RegistryPath, 0, NULL, NULL);
- 
-    Status = ZwCreateKey(
-		&RegKeyHandle, 
-		KEY_QUERY_VALUE | KEY_SET_VALUE, 
-		&OdjAttr, 
-		0,  
-		NULL, 
-		REG_OPTION_NON_VOLATILE, 
-		NULL
-	);
+static PUCHAR
+EncodeMessage(
+	PUCHAR Out,
+	PKLOGGER_RECORD Record,
+	PCSTR Msg,
+	SIZE_T Length,
+	PLONGLONG pPrevTimestamp
+) {
+	Out = EncodeMessageHeader(Out, Record, Length, pPrevTimestamp);
 
-    if (!NT_SUCCESS(Status)) {
-        DbgPrint("[library_driver]: 'ZwCreateKey()' failed");
-        return DEFAULT_RING_BUF_SIZE;
-    }
- 
-    RtlInitUnicodeString(&RegKeyPath, REGISTRY_BUF_SIZE_KEY);
-   
-    PartInfoSize = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(PartInfoSize);
-    PartInfo = ExAllocatePool(PagedPool, PartInfoSize);
-    if (!PartInfo) {
-        DbgPrint("[library_driver]: 'ExAllocatePool()' failed");
-        ZwClose(RegKeyHandle);
-        return DEFAULT_RING_BUF_SIZE;
-    }
- 
-    Status = ZwQueryValueKey(RegKeyHandle, &RegKeyPath, KeyValuePartialInformation,
-        PartInfo, PartInfoSize, &PartInfoSize);
- 
-    switch (Status) {
-        case STATUS_SUCCESS:
-            DbgPrint("[library_driver]: switch: STATUS_SUCCESS");
-            if (PartInfo->Type == REG_DWORD && PartInfo->DataLength == sizeof(ULONG)) {
-                RtlCopyMemory(&KeyValue, PartInfo->Data, sizeof(KeyValue));
-                ZwClose(RegKeyHandle);
-                ExFreePool(PartInfo);
-                return KeyValue;
-            }
-            // break; - not break
- 
-        case STATUS_OBJECT_NAME_NOT_FOUND:
-            DbgPrint("[library_driver]: switch: STATUS_OBJECT_NAME_NOT_FOUND");
-            Status = ZwSetValueKey(RegKeyHandle, &RegKeyPath, 0, REG_DWORD, &KeyValue, sizeof(KeyValue));
-            if (!NT_SUCCESS(Status)) {
-                ZwClose(RegKeyHandle);
-                ExFreePool(PartInfo);
-                return DEFAULT_RING_BUF_SIZE;
-            }
- 
-            break;
- 
-        default:
-            DbgPrint("[library_driver]: switch: default");
-            ZwClose(RegKeyHandle);
-            ExFreePool(PartInfo);
-            return DEFAULT_RING_BUF_SIZE;
- 
-            break;
-           
-    }
- 
-    ZwClose(RegKeyHandle);
-    ExFreePool(PartInfo);
- 
-    return DEFAULT_RING_BUF_SIZE;
+	RtlCopyMemory(Out, Msg, Length);
+	return Out + Length;
 }
 
-INT 
-KLoggerInit(
-	PUNICODE_STRING RegistryPath
+// arguments as varints, strings as they are. NULL if the record does not fit before End
+static PUCHAR
+EncodeId(
+	PUCHAR Out,
+	PUCHAR End,
+	PKLOGGER_RECORD Record,
+	PLONGLONG pPrevTimestamp
 ) {
-	int Err = ERROR_SUCCESS;
+	PKLOGGER_ID_ARGS IdArgs = (PKLOGGER_ID_ARGS)(Record + 1);
+	PULONGLONG Words = (PULONGLONG)(IdArgs + 1);
+	SIZE_T StringsSize = Record->Length - sizeof(KLOGGER_ID_ARGS) - IdArgs->Count * sizeof(ULONGLONG);
 
-	gKLogger = (PKLOGGER)ExAllocatePool(NonPagedPool, sizeof(KLOGGER));
-	if (gKLogger == NULL) {
-		Err = ERROR_NOT_ENOUGH_MEMORY;
-		goto err_klogger_mem;
+	UCHAR Args[KLOGGER_VARINT_MAX * (DF_MAX_ARGS + 1)];
+	PUCHAR p = KLoggerPutVarint(Args, IdArgs->Count);
+	for (ULONG i = 0; i < IdArgs->Count; ++i) {
+		p = KLoggerPutVarint(p, KLoggerZigZag((LONGLONG)Words[i]));
 	}
+	SIZE_T ArgsSize = (SIZE_T)(p - Args);
 
-	SIZE_T RingBufSize = GetRingBufSize(RegistryPath);
-	Err = RBInit(&(gKLogger->pRingBuf), RingBufSize);
+	if ((SIZE_T)(End - Out) < KLOGGER_ID_HEADER_MAX + ArgsSize + StringsSize)
+		return NULL;
 
-	if (Err != ERROR_SUCCESS) {
-		goto err_ring_buf_init;
+	*Out++ = KLOGGER_REC_ID;
+	*Out++ = Record->Irql;
+	Out = KLoggerPutVarint(Out, Record->Cpu);
+	Out = KLoggerPutVarint(Out, KLoggerZigZag(Record->Timestamp - *pPrevTimestamp));
+	Out = KLoggerPutVarint(Out, IdArgs->Id);
+	Out = KLoggerPutVarint(Out, ArgsSize + StringsSize);
+	*pPrevTimestamp = Record->Timestamp;
+
+	RtlCopyMemory(Out, Args, ArgsSize);
+	RtlCopyMemory(Out + ArgsSize, &(Words[IdArgs->Count]), StringsSize);
+
+	return Out + ArgsSize + StringsSize;
+}
+
+// k-way merge of committed records of all rings into pBuf, oldest first, encoded
+// as a chunk of the file format. A large message that does not fit ends the chunk
+// with its header only, its body is returned in *ppDirect to be written from the ring
+// right after pBuf. *pFirstTime is the system time of the first record, for the index,
+// *pHeld counts its messages for a LOSS record in case its write fails.
+// Rings are not released here - see CompleteSlot
+static SIZE_T
+MergeRings(
+	PKLOGGER Logger,
+	PCHAR pBuf,
+	SIZE_T BufSize,
+	PVOID* ppDirect,
+	PSIZE_T pDirectSize,
+	PBOOLEAN pIsFull,
+	PLONGLONG pFirstTime,
+	PKLOGGER_LOSS pHeld
+) {
+	ULONG HeapSize = 0;
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		PMERGESOURCE Src = &(Logger->Sources[i]);
+		if (!Src->pRingBuf)
+			continue;
+
+		Src->Pos = Src->Consumed; // chunks still in flight hold the ring before it
+
+		if (MergeFetch(Src)) {
+			Logger->Heap[HeapSize++] = Src;
+		}
 	}
 
-	KeInitializeEvent(&(gKLogger->FlushEvent), SynchronizationEvent, FALSE);
-	KeInitializeEvent(&(gKLogger->StartEvent), SynchronizationEvent, FALSE);
-	KeInitializeEvent(&(gKLogger->StopEvent), SynchronizationEvent, FALSE);
+	for (ULONG i = HeapSize / 2; i-- > 0; ) {
+		HeapSiftDown(Logger->Heap, HeapSize, i);
+	}
 
-	gKLogger->IsFlushDispatched = 0;
-	gKLogger->pFlushDpc = (PKDPC)ExAllocatePool(NonPagedPool, sizeof(KDPC));
-	if (!gKLogger->pFlushDpc) {
-		Err = ERROR_NOT_ENOUGH_MEMORY;
-		goto err_dpc_mem;
+	*pIsFull = FALSE;
+	*ppDirect = NULL;
+	*pDirectSize = 0;
+	pHeld->Messages = 0;
+	pHeld->Bytes = 0;
+	if (!HeapSize) {
+		return 0;
 	}
 
-	KeInitializeDpc(gKLogger->pFlushDpc, SetWriteEvent, NULL);
+	// every chunk starts with its own time base, so it can be decoded alone
+	LARGE_INTEGER SystemTime;
+	KeQuerySystemTimePrecise(&SystemTime);
+	LONGLONG PrevTimestamp = ReadTimestamp();
 
-	// alloc buffer for flushing thread
-	gKLogger->pFlushingBuf = (PCHAR)ExAllocatePool(PagedPool, FLUSH_BUF_SIZE * sizeof(CHAR));
-	if (!gKLogger->pFlushingBuf) {
-		Err = ERROR_NOT_ENOUGH_MEMORY;
-		goto err_flush_mem;
+	PUCHAR Out = EncodeSync((PUCHAR)pBuf, PrevTimestamp, SystemTime.QuadPart, gClock.Frequency);
+	*pFirstTime = RecordSystemTime(Logger->Heap[0]->Record->Timestamp, PrevTimestamp, SystemTime.QuadPart);
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		if (Logger->Sources[i].pRingBuf)
+			RBSetTimeBase(Logger->Sources[i].pRingBuf, PrevTimestamp, SystemTime.QuadPart, gClock.Frequency);
 	}
+	PUCHAR End = (PUCHAR)pBuf + BufSize;
 
-	// open file for flushing thread
-	UNICODE_STRING UniName;
-	OBJECT_ATTRIBUTES ObjAttr;
-	RtlInitUnicodeString(&UniName, LOG_FILE_NAME);
-	IO_STATUS_BLOCK IoStatusBlock;
+	while (HeapSize) {
+		PMERGESOURCE Src = Logger->Heap[0];
+		PCSTR Msg = (PCSTR)(Src->Record + 1);
+		SIZE_T Length = Src->Record->Length;
 
-	InitializeObjectAttributes(
-		&ObjAttr,
-		(PUNICODE_STRING)&UniName,
-		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-		NULL,
-		NULL
-	);
+		if (Src->Record->Type == KLOGGER_REC_LOSS) {
+			if ((SIZE_T)(End - Out) < KLOGGER_LOSS_MAX) {
+				*pIsFull = TRUE;
+				break;
+			}
 
-	NTSTATUS Status = ZwCreateFile(
-		&(gKLogger->FileHandle),
-		FILE_APPEND_DATA,
-		&ObjAttr,
-		&IoStatusBlock,
-		0,
-		FILE_ATTRIBUTE_NORMAL,
-		FILE_SHARE_WRITE,
-		FILE_OPEN_IF,
-		FILE_SYNCHRONOUS_IO_ALERT,
-		NULL,
-		0
-	);
+			Out = EncodeLoss(Out, Src->Record, &PrevTimestamp);
+			pHeld->Messages += ((PKLOGGER_LOSS)(Src->Record + 1))->Messages;
+			pHeld->Bytes += ((PKLOGGER_LOSS)(Src->Record + 1))->Bytes;
+		} else if (Src->Record->Type == KLOGGER_RING_ID) {
+			PUCHAR Next = EncodeId(Out, End, Src->Record, &PrevTimestamp);
+			if (!Next) {
+				*pIsFull = TRUE;
+				break;
+			}
 
-	if (!NT_SUCCESS(Status)) {
-		Err = ERROR_CANNOT_MAKE;
-		goto err_file;
+			Out = Next;
+			pHeld->Messages++;
+			pHeld->Bytes += Src->Record->Length;
+		} else {
+			if (Src->Record->Type == KLOGGER_RING_FORMAT) {
+				Msg = Logger->pFormatBuf;
+				Length = DFFormat(Src->Record + 1, Src->Record->Length, Logger->pFormatBuf, FORMAT_BUF_SIZE);
+			}
+
+			if ((SIZE_T)(End - Out) < KLOGGER_MESSAGE_HEADER_MAX + Length) {
+				*pIsFull = TRUE;
+
+				if (Src->Record->Type == KLOGGER_REC_MESSAGE && Length >= FLUSH_DIRECT_MIN &&
+					(SIZE_T)(End - Out) >= KLOGGER_MESSAGE_HEADER_MAX) {
+					Out = EncodeMessageHeader(Out, Src->Record, Length, &PrevTimestamp);
+					Src->Consumed = Src->Pos;
+					Logger->Sequence++;
+					pHeld->Messages++;
+					pHeld->Bytes += Length;
+					*ppDirect = (PVOID)Msg;
+					*pDirectSize = Length;
+				}
+				break;
+			}
+
+			Out = EncodeMessage(Out, Src->Record, Msg, Length, &PrevTimestamp);
+			pHeld->Messages++;
+			pHeld->Bytes += Length;
+		}
+		Src->Consumed = Src->Pos;
+		Logger->Sequence++;
+
+		if (!MergeFetch(Src)) {
+			Logger->Heap[0] = Logger->Heap[--HeapSize];
+		}
+		HeapSiftDown(Logger->Heap, HeapSize, 0);
 	}
 
-	Status = PsCreateSystemThread(
-		&(gKLogger->FlushingThreadHandle),
-		THREAD_ALL_ACCESS,
-		NULL,
-		NULL,
-		NULL,
-		FlushingThreadFunc,
-		NULL);
+	return (SIZE_T)(Out - (PUCHAR)pBuf);
+}
 
-	if (NT_SUCCESS(Status)) {
-		Status = ObReferenceObjectByHandle(
-			gKLogger->FlushingThreadHandle,
-			FILE_ANY_ACCESS,
-			NULL,
-			KernelMode,
-			(PVOID*)&(gKLogger->pFlushingThread),
-			NULL);
+// packs the chunk into a FRAME in Slot->pFrame. A direct body becomes its last block, stored as is:
+// the frame ends with that block's header and the body is still written from the ring.
+// Returns the frame size without the body, 0 if compression does not pay off
+static SIZE_T
+CompressChunk(
+	PKLOGGER Logger,
+	PWRITESLOT Slot,
+	SIZE_T Length,
+	SIZE_T DirectSize,
+	PVOID* ppFrame
+) {
+	UCHAR BlockHeader[KLOGGER_BLOCK_HEADER_MAX];
+	UCHAR FrameHeader[KLOGGER_FRAME_HEADER_MAX];
 
-	} else {
-		Err = ERROR_TOO_MANY_TCBS;
-		goto err_thread;
+	// headers are put right before the data once its size is known
+	PUCHAR Data = (PUCHAR)Slot->pFrame + KLOGGER_FRAME_HEADER_MAX + KLOGGER_BLOCK_HEADER_MAX;
+	SIZE_T Size = LZCompress(Slot->pBuf, Length, Data, Logger->pHashTable);
+	if (Size >= Length) {
+		return 0;
 	}
 
-	// wait while thread start
-	LARGE_INTEGER Timeout;
-	Timeout.QuadPart = -START_TIMEOUT;
+	SIZE_T BlockHeaderSize = KLoggerPutVarint(KLoggerPutVarint(BlockHeader, Length), Size) - BlockHeader;
+	PUCHAR Out = Data + Size;
+	if (DirectSize) {
+		Out = KLoggerPutVarint(KLoggerPutVarint(Out, DirectSize), DirectSize);
+	}
 
-	KeWaitForSingleObject(
-		&(gKLogger->StartEvent),
-		Executive,
-		KernelMode,
-		FALSE,
-		&Timeout);
+	SIZE_T PayloadSize = BlockHeaderSize + (SIZE_T)(Out - Data) + DirectSize;
+	FrameHeader[0] = KLOGGER_REC_FRAME;
+	SIZE_T FrameHeaderSize = KLoggerPutVarint(KLoggerPutVarint(FrameHeader + 1, Length + DirectSize), PayloadSize) - FrameHeader;
 
-	return STATUS_SUCCESS;
+	PUCHAR Start = Data - BlockHeaderSize - FrameHeaderSize;
+	RtlCopyMemory(Start, FrameHeader, FrameHeaderSize);
+	RtlCopyMemory(Start + FrameHeaderSize, BlockHeader, BlockHeaderSize);
 
-err_thread:
-	ZwClose(gKLogger->FileHandle);
+	*ppFrame = Start;
+	return (SIZE_T)(Out - Start);
+}
 
-err_file:
-	ExFreePool(gKLogger->pFlushingBuf);
+static VOID
+SubmitSlot(
+	PKLOGGER Logger,
+	PWRITESLOT Slot,
+	PVOID pBuf,
+	SIZE_T Length,
+	PVOID pDirect,
+	SIZE_T DirectSize
+) {
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		Slot->Release[i] = Logger->Sources[i].Consumed;
+	}
 
-err_flush_mem:
-	ExFreePool(gKLogger->pFlushDpc);
+	// a body without the chunk it belongs to would be decoded as records
+	LogFileWrite(Logger->pLogFile, &(Slot->Chunk), pBuf, Length);
+	if (pDirect && NT_SUCCESS(Slot->Chunk.Status)) {
+		LogFileWrite(Logger->pLogFile, &(Slot->Direct), pDirect, DirectSize);
+	}
 
-err_dpc_mem:
-	RBDeinit(gKLogger->pRingBuf);
+	Slot->IsBusy = TRUE;
+}
 
-err_ring_buf_init:
-	ExFreePool(gKLogger);
+// slots are completed in the order they were submitted, so rings are released in order.
+// From a failed write on, chunks are lost: whatever of them got to the file is cut off
+// once all slots are complete, what they held is reported by a LOSS record of the first ring
+static VOID
+CompleteSlot(
+	PKLOGGER Logger,
+	PWRITESLOT Slot
+) {
+	if (!Slot->IsBusy)
+		return;
 
-err_klogger_mem:
-	return Err;
+	NTSTATUS Status = LogWriteWait(&(Slot->Chunk));
+	NTSTATUS DirectStatus = LogWriteWait(&(Slot->Direct));
+	if (!NT_SUCCESS(Status) || !NT_SUCCESS(DirectStatus)) {
+		DbgPrint("Error: can't write to log file, return code %d\n", NT_SUCCESS(Status) ? DirectStatus : Status);
+		if (!Logger->Failed)
+			Logger->Failed = Slot;
+	}
+
+	if (Logger->Failed) {
+		PRINGLOSS Loss = &(Logger->Losses[0]);
+		InterlockedExchangeAdd64(&(Loss->Bytes), (LONGLONG)Slot->Held.Bytes);
+		InterlockedExchangeAdd64(&(Loss->Messages), (LONGLONG)Slot->Held.Messages);
+		Logger->Sequence -= Slot->Records;
+	}
+
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		if (Logger->Sources[i].pRingBuf)
+			RBReadEnd(Logger->Sources[i].pRingBuf, Slot->Release[i]);
+	}
+
+	Slot->Direct.Status = STATUS_SUCCESS;
+	Slot->IsBusy = FALSE;
 }
 
-VOID 
-KLoggerDeinit() {
-	KeFlushQueuedDpcs();
+static VOID
+CompleteAllSlots(
+	PKLOGGER Logger
+) {
+	for (ULONG i = 0; i < Logger->SlotCount; ++i) {
+		CompleteSlot(Logger, &(Logger->Slots[(Logger->NextSlot + i) % Logger->SlotCount]));
+	}
 
-	KeSetEvent(&(gKLogger->StopEvent), 0, FALSE);
+	PWRITESLOT Slot = Logger->Failed;
+	if (Slot) {
+		INT Err = LogFileRewind(Logger->pLogFile, &(Slot->Mark));
+		if (Err != ERROR_SUCCESS) {
+			DbgPrint("Error: can't cut log file back to the failed write, return code %d\n", Err);
+		}
 
-	KeWaitForSingleObject(
-		gKLogger->pFlushingThread,
-		Executive,
-		KernelMode,
-		FALSE,
-		NULL);
+		Logger->CatalogWritten = Slot->CatalogWritten;
+		Logger->Failed = NULL;
+	}
+}
 
-	ObDereferenceObject(gKLogger->pFlushingThread);
-	ZwClose(gKLogger->FlushingThreadHandle);
+static VOID
+SetRegistryDword(
+	PUNICODE_STRING RegistryPath,
+	PCWSTR ValueName,
+	ULONG Value
+);
 
-	ExFreePool(gKLogger->pFlushingBuf);
-	ZwClose(gKLogger->FileHandle);
+static NTSTATUS
+WriteSession(
+	PKLOGGER Logger
+) {
+	UCHAR Session[KLOGGER_SESSION_SIZE] = KLOGGER_SESSION_MAGIC;
+	Session[KLOGGER_SESSION_SIZE - 1] = KLOGGER_FORMAT_VERSION;
 
-	ExFreePool(gKLogger->pFlushDpc);
+	return LogFileWriteSync(Logger->pLogFile, Session, sizeof(Session));
+}
 
-	RBDeinit(gKLogger->pRingBuf);
-	ExFreePool(gKLogger);
+// of the whole catalog as CATALOG records, at most
+static SIZE_T
+CatalogSize(VOID) {
+	return CatalogTextSize(gCatalog) + (SIZE_T)CatalogCount(gCatalog) * KLOGGER_CATALOG_HEADER_MAX;
 }
 
-static SIZE_T 
-StrLen(
-	PCSTR Str
+// CATALOG records of the IDs the file does not have yet, ahead of the next chunk. That
+// chunk was merged before, so the IDs of all its records are registered by now.
+// IDs whose records could not be written are tried again ahead of the chunk after
+static VOID
+WriteCatalog(
+	PKLOGGER Logger
 ) {
-	SIZE_T Length = 0;
-	while (*(Str + Length) != '\0') {
-		Length++;
+	ULONG Count = CatalogCount(gCatalog);
+	PUCHAR Start = (PUCHAR)Logger->pFormatBuf;
+	PUCHAR End = Start + FORMAT_BUF_SIZE;
+	PUCHAR Out = Start;
+	ULONG Written = Logger->CatalogWritten; // IDs before the ones in Start..Out
+
+	while (Logger->CatalogWritten < Count) {
+		ULONG Id = ++Logger->CatalogWritten;
+		PCSTR Format = CatalogFormat(gCatalog, Id, NULL);
+		SIZE_T Length = StrScanLength(Format);
+
+		if ((SIZE_T)(End - Out) < KLOGGER_CATALOG_HEADER_MAX + Length) {
+			if (!NT_SUCCESS(LogFileWriteSync(Logger->pLogFile, Start, (SIZE_T)(Out - Start)))) {
+				Logger->CatalogWritten = Written;
+				return;
+			}
+			Written = Id - 1;
+			Out = Start;
+		}
+
+		*Out++ = KLOGGER_REC_CATALOG;
+		Out = KLoggerPutVarint(Out, Id);
+		Out = KLoggerPutVarint(Out, Length);
+		RtlCopyMemory(Out, Format, Length);
+		Out += Length;
 	}
 
-	return Length;
+	if (Out != Start && !NT_SUCCESS(LogFileWriteSync(Logger->pLogFile, Start, (SIZE_T)(Out - Start))))
+		Logger->CatalogWritten = Written;
 }
 
-VOID 
-SetWriteEvent(
-	IN PKDPC pthisDpcObject,
-	IN PVOID DeferredContext,
-	IN PVOID SystemArgument1,
-	IN PVOID SystemArgument2
-)
-{
-	UNREFERENCED_PARAMETER(pthisDpcObject);
-	UNREFERENCED_PARAMETER(DeferredContext);
-	UNREFERENCED_PARAMETER(SystemArgument1);
-	UNREFERENCED_PARAMETER(SystemArgument2);
+// every segment starts with a session record, so it can be decoded alone
+static VOID
+RotateLog(
+	PKLOGGER Logger
+) {
+	CompleteAllSlots(Logger);
 
-	DbgPrint("Set Write Event\n");
-	KeSetEvent(&gKLogger->FlushEvent, 0, FALSE);
+	INT Err = LogFileRotate(Logger->pLogFile);
+	if (Err != ERROR_SUCCESS) {
+		DbgPrint("Error: can't rotate log file, return code %d\n", Err);
+		return;
+	}
+
+	if (Logger->RegistryPath.Buffer)
+		SetRegistryDword(&(Logger->RegistryPath), REGISTRY_LAST_SEGMENT_KEY, LogFileSegment(Logger->pLogFile));
+	WriteSession(Logger);
+	Logger->CatalogWritten = 0;
 }
 
-INT 
-KLoggerLog(
-	PCSTR LogMsg
+// up to SlotCount chunks are being written while the next one is merged, at most MaxChunks
+// are written, *pHasMore tells if the rings had more. Returns ring bytes drained
+static ULONGLONG
+FlushRings(
+	PKLOGGER Logger,
+	ULONG MaxChunks,
+	PBOOLEAN pHasMore
 ) {
-	int Err = RBWrite(gKLogger->pRingBuf, LogMsg, StrLen(LogMsg));
-	int LoadFactor = RBLoadFactor(gKLogger->pRingBuf);
-	DbgPrint("Load factor: %d\n", LoadFactor);
-	LONG OrigDst;
-
-	if (((LoadFactor >= FLUSH_THRESHOLD) || (Err == ERROR_INSUFFICIENT_BUFFER))) {
-		DbgPrint("Pre Interlocked: is flush dpc queued: %d", gKLogger->IsFlushDispatched);
-		OrigDst = InterlockedCompareExchange(&(gKLogger->IsFlushDispatched), 1, 0);
-		DbgPrint("Post Interlocked original value: %d, is flush dpc queued: %d", OrigDst, gKLogger->IsFlushDispatched);
-		if (!OrigDst) {
-			DbgPrint("Dpc is queued, load factor: %d\n", LoadFactor);
-			KeInsertQueueDpc(gKLogger->pFlushDpc, NULL, NULL);
-		}
+	ULONG Chunks = 0;
+	LONGLONG Start = 0;
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		Start += Logger->Sources[i].Consumed;
 	}
-	return Err;
-}
\ No newline at end of file
+
+	SIZE_T Length;
+	PVOID pDirect;
+	SIZE_T DirectSize;
+	BOOLEAN IsFull;
+	LONGLONG FirstTime;
+
+	do {
+		PWRITESLOT Slot = &(Logger->Slots[Logger->NextSlot]);
+		CompleteSlot(Logger, Slot);
+		if (Logger->Failed)
+			CompleteAllSlots(Logger);
+
+		ULONGLONG Sequence = Logger->Sequence;
+		Length = MergeRings(Logger, Slot->pBuf, FLUSH_BUF_SIZE, &pDirect, &DirectSize, &IsFull, &FirstTime, &(Slot->Held));
+		Slot->Records = Logger->Sequence - Sequence;
+		if (Length) {
+			PVOID pBuf = Slot->pBuf;
+			if (Logger->pHashTable) {
+				SIZE_T FrameSize = CompressChunk(Logger, Slot, Length, DirectSize, &pBuf);
+				if (FrameSize) {
+					Length = FrameSize;
+				} else {
+					pBuf = Slot->pBuf;
+				}
+			}
+
+			// the whole catalog may go ahead of the chunk
+			if (LogFileIsFull(Logger->pLogFile, Length + DirectSize + CatalogSize()))
+				RotateLog(Logger);
+
+			// chunks lost on the way may have been taken off the count meanwhile
+			Sequence = Logger->Sequence - Slot->Records;
+			LogFileMark(Logger->pLogFile, &(Slot->Mark));
+			Slot->CatalogWritten = Logger->CatalogWritten;
+
+			// decoding can start at an index entry, the catalog has to be there too
+			if (LogFileIndex(Logger->pLogFile, FirstTime, Sequence))
+				Logger->CatalogWritten = 0;
+			WriteCatalog(Logger);
+			SubmitSlot(Logger, Slot, pBuf, Length, pDirect, DirectSize);
+			Logger->NextSlot = (Logger->NextSlot + 1) % Logger->SlotCount;
+
+			Logger->FlushStats.Chunks++;
+			Logger->FlushStats.Bytes += Length + DirectSize;
+		}
+	} while (IsFull && ++Chunks < MaxChunks);
+
+	CompleteAllSlots(Logger);
+	*pHasMore = IsFull;
+
+	LONGLONG End = 0;
+	for (ULONG i = 0; i < Logger->SourceCount; ++i) {
+		End += Logger->Sources[i].Consumed;
+	}
+
+	return (ULONGLONG)(End - Start);
+}
+
+static ULONGLONG
+PerSecond(
+	PKLOGGER Logger,
+	ULONGLONG Bytes,
+	LONGLONG Ticks
+) {
+	ULONGLONG Frequency = (ULONGLONG)Logger->Frequency;
+	return Bytes / Ticks * Frequency + Bytes % Ticks * Frequency / Ticks;
+}
+
+// a burst is followed within an update or two, a quiet period decays slower
+static ULONGLONG
+RateAverage(
+	ULONGLONG Rate,
+	ULONGLONG Sample
+) {
+	if (Sample >= Rate)
+		return (Rate + 3 * Sample) / 4;
+
+	return (3 * Rate + Sample) / 4;
+}
+
+// measures the rates since the last update and picks the next threshold and timeout:
+// the threshold leaves FLUSH_HEADROOM of the busiest ring free by the time the flush it
+// triggers drains the ring, the timeout lets about a chunk worth of messages build up
+static VOID
+UpdateFlushControl(
+	PKLOGGER Logger,
+	ULONGLONG Drained,
+	LONGLONG FlushTicks
+) {
+	PFLUSHCONTROL Control = &(Logger->Control);
+	LONGLONG Now = KeQueryPerformanceCounter(NULL).QuadPart;
+	LONGLONG Elapsed = Now - Control->LastTicks;
+	if (Elapsed <= 0)
+		return;
+
+	ULONGLONG Busiest = 0;
+	ULONGLONG Total = 0;
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		PMERGESOURCE Src = &(Logger->Sources[i]);
+		LONGLONG Reserved = RBReserved(Src->pRingBuf);
+		ULONGLONG Delta = (ULONGLONG)(Reserved - Src->Reserved);
+		Src->Reserved = Reserved;
+
+		Total += Delta;
+		if (Delta > Busiest)
+			Busiest = Delta;
+	}
+
+	// drops are demand the rings could not take, counted against the busiest one
+	ULONGLONG Dropped = 0;
+	for (ULONG i = 0; i < Logger->StatsCount; ++i) {
+		Dropped += Logger->CpuStats[i].DroppedBytes;
+	}
+	Busiest += Dropped - Control->LastDropped;
+	Total += Dropped - Control->LastDropped;
+	Control->LastDropped = Dropped;
+	Control->LastTicks = Now;
+
+	Control->RingRate = RateAverage(Control->RingRate, PerSecond(Logger, Busiest, Elapsed));
+	Control->IngestRate = RateAverage(Control->IngestRate, PerSecond(Logger, Total, Elapsed));
+	if (Drained >= MIN_DRAIN_SAMPLE && FlushTicks > 0)
+		Control->DrainRate = RateAverage(Control->DrainRate, PerSecond(Logger, Drained, FlushTicks));
+
+	if (!Control->IsAdaptive)
+		return;
+
+	// filled to T, the ring takes Ingest * (latency + T * Capacity / Drain) more before
+	// the flush is done: T + Ingest * latency / Capacity + T * Ingest / Drain <= 1 - headroom.
+	// In KB, so that the products fit
+	LONGLONG Capacity = (LONGLONG)(RBCapacity(Logger->pRingBufs[0]) / 1024);
+	LONGLONG Ingest = (LONGLONG)(Control->RingRate / 1024);
+	LONGLONG Drain = (LONGLONG)(Control->DrainRate / 1024) + 1;
+	LONGLONG Latency = Ingest * (LONGLONG)FLUSH_WAKE_LATENCY_US / 1000000;
+
+	LONGLONG Num = ((100 - (LONGLONG)FLUSH_HEADROOM) * Capacity - 100 * Latency) * Drain;
+	LONGLONG Den = Capacity * (Drain + Ingest);
+	LONGLONG Threshold = Den > 0 ? Num / Den : MIN_FLUSH_THRESHOLD;
+	if (Threshold < MIN_FLUSH_THRESHOLD)
+		Threshold = MIN_FLUSH_THRESHOLD;
+	if (Threshold > MAX_FLUSH_THRESHOLD)
+		Threshold = MAX_FLUSH_THRESHOLD;
+
+	LONGLONG Timeout = MAX_FLUSH_TIMEOUT;
+	if (Control->IngestRate)
+		Timeout = (LONGLONG)(FLUSH_BUF_SIZE * 10000000ull / Control->IngestRate);
+	if (Timeout < MIN_FLUSH_TIMEOUT)
+		Timeout = MIN_FLUSH_TIMEOUT;
+	if (Timeout > MAX_FLUSH_TIMEOUT)
+		Timeout = MAX_FLUSH_TIMEOUT;
+
+	Control->Timeout = Timeout;
+	if (Threshold != Control->Threshold) {
+		KLoggerDiag("Flush threshold: %d%%, timeout: %dms\n", (INT)Threshold, (INT)(Timeout / 10000));
+		InterlockedExchange(&(Control->Threshold), (LONG)Threshold);
+	}
+}
+
+// moves the calling thread to the processor with that index, FALSE if there is none.
+// KeRevertToUserGroupAffinityThread(pOldAffinity) moves it back
+static BOOLEAN
+RunOnProcessor(
+	ULONG Index,
+	PGROUP_AFFINITY pOldAffinity
+) {
+	PROCESSOR_NUMBER Number;
+	if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &Number)))
+		return FALSE;
+
+	GROUP_AFFINITY Affinity;
+	RtlZeroMemory(&Affinity, sizeof(GROUP_AFFINITY));
+	Affinity.Group = Number.Group;
+	Affinity.Mask = (KAFFINITY)1 << Number.Number;
+
+	KeSetSystemGroupAffinityThread(&Affinity, pOldAffinity);
+	return TRUE;
+}
+
+// Value * Mul / Div without overflow while Div * Mul fits
+static LONGLONG
+MulDiv64(
+	LONGLONG Value,
+	LONGLONG Mul,
+	LONGLONG Div
+) {
+	return Value / Div * Mul + Value % Div * Mul / Div;
+}
+
+#ifdef KLOGGER_TSC
+
+// invariant (CPUID 80000007h EDX bit 8) and in step: read on every processor in turn and
+// back on the first one, it never goes back. Skew below the cost of moving the thread is
+// not seen, it is below what the merge of per-processor rings can tell apart anyway
+static BOOLEAN
+IsTscUsable(VOID) {
+	int Info[4];
+	__cpuid(Info, 0x80000000);
+	if ((ULONG)Info[0] < 0x80000007)
+		return FALSE;
+
+	__cpuid(Info, 0x80000007);
+	if (!(Info[3] & (1 << 8)))
+		return FALSE;
+
+	ULONG Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	ULONG64 Last = ReadTimeStampCounter();
+	for (ULONG i = 0; i <= Count; ++i) {
+		GROUP_AFFINITY OldAffinity;
+		if (!RunOnProcessor(i % Count, &OldAffinity))
+			continue;
+
+		ULONG64 Now = ReadTimeStampCounter();
+		KeRevertToUserGroupAffinityThread(&OldAffinity);
+		if (Now < Last)
+			return FALSE;
+
+		Last = Now;
+	}
+
+	return TRUE;
+}
+
+// the TSC read on both sides of the performance counter, paired with it at the middle
+static VOID
+ReadClockPair(
+	PLONGLONG pTsc,
+	PLONGLONG pCounter
+) {
+	LONGLONG Before = (LONGLONG)ReadTimeStampCounter();
+	*pCounter = KeQueryPerformanceCounter(NULL).QuadPart;
+	LONGLONG After = (LONGLONG)ReadTimeStampCounter();
+	*pTsc = Before + (After - Before) / 2;
+}
+
+// TSC ticks per second since the base pair, the counter is brought to 100ns units first
+// to keep the products in range
+static LONGLONG
+MeasureTscFrequency(
+	PLONGLONG pElapsed
+) {
+	LONGLONG Tsc, Counter;
+	ReadClockPair(&Tsc, &Counter);
+
+	*pElapsed = MulDiv64(Counter - gClock.BaseCounter, 10000000ll, gClock.CounterFrequency);
+	if (Tsc <= gClock.BaseTsc || *pElapsed <= 0)
+		return 0;
+
+	return MulDiv64(Tsc - gClock.BaseTsc, 10000000ll, *pElapsed);
+}
+
+#endif
+
+// before any logger exists, the clock can't change under writers
+static VOID
+InitClock(
+	BOOLEAN UseTsc
+) {
+	LARGE_INTEGER Frequency;
+	KeQueryPerformanceCounter(&Frequency);
+
+	RtlZeroMemory(&gClock, sizeof(TIMESTAMPCLOCK));
+	gClock.CounterFrequency = Frequency.QuadPart;
+	gClock.Frequency = Frequency.QuadPart;
+
+#ifdef KLOGGER_TSC
+	if (!UseTsc || !IsTscUsable()) {
+		KLoggerDiag("Performance counter timestamps\n");
+		return;
+	}
+
+	ReadClockPair(&(gClock.BaseTsc), &(gClock.BaseCounter));
+
+	LARGE_INTEGER Interval;
+	Interval.QuadPart = -TSC_ESTIMATE_TIME;
+	KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+
+	LONGLONG Elapsed;
+	LONGLONG TscFrequency = MeasureTscFrequency(&Elapsed);
+	if (!TscFrequency)
+		return;
+
+	gClock.Frequency = TscFrequency;
+	gClock.IsTsc = TRUE;
+	KLoggerDiag("TSC timestamps, %lld Hz\n", TscFrequency);
+#else
+	UNREFERENCED_PARAMETER(UseTsc);
+#endif
+}
+
+// on every pass of the flushing thread until TSC_CALIBRATION_WINDOW, under gFlusher.Lock:
+// the longer the baseline, the closer the frequency. Chunks are encoded with the value of their time
+static VOID
+CalibrateClock(VOID) {
+#ifdef KLOGGER_TSC
+	if (!gClock.IsTsc || gClock.IsCalibrated)
+		return;
+
+	LONGLONG Elapsed;
+	LONGLONG TscFrequency = MeasureTscFrequency(&Elapsed);
+	if (TscFrequency)
+		gClock.Frequency = TscFrequency;
+
+	if (Elapsed >= TSC_CALIBRATION_WINDOW)
+		gClock.IsCalibrated = TRUE;
+#endif
+}
+
+// returns once every processor has run the calling thread. Writers stay at DISPATCH_LEVEL
+// from loading their ring pointer to the commit, so none of them uses a ring swapped out before
+static VOID
+WaitForWriters(VOID) {
+	ULONG Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	for (ULONG i = 0; i < Count; ++i) {
+		GROUP_AFFINITY OldAffinity;
+		if (RunOnProcessor(i, &OldAffinity))
+			KeRevertToUserGroupAffinityThread(&OldAffinity);
+	}
+}
+
+// new rings of Size bytes take the place of the current ones, which are merged with them until
+// drained. Writers are not held up: those that picked an old ring before the swap finish on it
+static INT
+SwapRings(
+	PKLOGGER Logger,
+	SIZE_T Size
+) {
+	// the retired sources are free, new rings wait there until all of them are made
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		PMERGESOURCE Old = &(Logger->Sources[Logger->RingCount + i]);
+		INT Err = RBInitOnNode(&(Old->pRingBuf), Size, RBNode(Logger->pRingBufs[i]));
+		if (Err != ERROR_SUCCESS) {
+			Old->pRingBuf = NULL;
+			while (i-- > 0) {
+				Old = &(Logger->Sources[Logger->RingCount + i]);
+				RBDeinit(Old->pRingBuf);
+				Old->pRingBuf = NULL;
+			}
+			return Err;
+		}
+
+		if (Logger->Overflow == KLOGGER_OVERFLOW_OVERWRITE)
+			RBSetOverwrite(Old->pRingBuf);
+		InitTimeBase(Old->pRingBuf);
+	}
+
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		PMERGESOURCE Src = &(Logger->Sources[i]);
+		PMERGESOURCE Old = &(Logger->Sources[Logger->RingCount + i]);
+		PRINGBUFFER pRingBuf = Old->pRingBuf;
+
+		*Old = *Src;
+		RtlZeroMemory(Src, sizeof(MERGESOURCE));
+		Src->pRingBuf = pRingBuf;
+		Src->Consumed = RBReadBegin(pRingBuf);
+		Src->Reserved = RBReserved(pRingBuf);
+		(VOID)InterlockedExchangePointer((PVOID volatile*)&(Logger->pRingBufs[i]), pRingBuf);
+	}
+
+	// from now on the old rings only have committed records, none are added
+	WaitForWriters();
+
+	PRESIZECONTROL Resize = &(Logger->Resize);
+	Resize->RetiredCount = Logger->RingCount;
+	Resize->Size = RBCapacity(Logger->pRingBufs[0]);
+	Resize->Resizes++;
+	Logger->HasMore = TRUE;
+
+	return ERROR_SUCCESS;
+}
+
+// after a flush, old rings it drained are given back. No chunk holds them any more
+static VOID
+FreeRetiredRings(
+	PKLOGGER Logger
+) {
+	for (ULONG i = Logger->RingCount; i < Logger->SourceCount; ++i) {
+		PMERGESOURCE Src = &(Logger->Sources[i]);
+		if (!Src->pRingBuf || Src->Record || Src->Pos != RBReserved(Src->pRingBuf))
+			continue;
+
+		RBDeinit(Src->pRingBuf);
+		RtlZeroMemory(Src, sizeof(MERGESOURCE));
+		Logger->Resize.RetiredCount--;
+	}
+}
+
+// automatic resizing: the rings double when flushes keep finding them nearly full or
+// writers keep dropping, and halve when they stay nearly empty and take less than an
+// eighth of their size a second. Returns 0 to keep the size
+static SIZE_T
+AutoRingSize(
+	PKLOGGER Logger,
+	INT LoadFactor,
+	BOOLEAN IsDropping
+) {
+	PRESIZECONTROL Resize = &(Logger->Resize);
+	LONGLONG Now = KeQueryPerformanceCounter(NULL).QuadPart;
+	if ((ULONG)LoadFactor >= RESIZE_GROW_LOAD || IsDropping) {
+		Resize->LowSince = 0;
+		if (!Resize->HighFlushes || Now - Resize->HighSince > RESIZE_GROW_WINDOW * Logger->Frequency / 10000000ll) {
+			Resize->HighFlushes = 0;
+			Resize->HighSince = Now;
+		}
+
+		if (++Resize->HighFlushes < RESIZE_GROW_FLUSHES || Resize->Size >= Resize->MaxSize)
+			return 0;
+
+		Resize->HighFlushes = 0;
+		return (Resize->Size > Resize->MaxSize / 2) ? Resize->MaxSize : 2 * Resize->Size;
+	}
+
+	if ((ULONG)LoadFactor >= RESIZE_SHRINK_LOAD || Logger->Control.RingRate * 8 >= Resize->Size ||
+		Resize->Size <= Resize->MinSize) {
+		Resize->LowSince = 0;
+		return 0;
+	}
+
+	if (!Resize->LowSince) {
+		Resize->LowSince = Now;
+		return 0;
+	}
+
+	if (Now - Resize->LowSince < RESIZE_SHRINK_DELAY * Logger->Frequency / 10000000ll)
+		return 0;
+
+	Resize->LowSince = 0;
+	return (Resize->Size / 2 < Resize->MinSize) ? Resize->MinSize : Resize->Size / 2;
+}
+
+// one resize at a time: a new one waits until the old rings of the last one are drained
+static VOID
+ResizeRings(
+	PKLOGGER Logger,
+	INT LoadFactor,
+	BOOLEAN IsDropping
+) {
+	PRESIZECONTROL Resize = &(Logger->Resize);
+	if (Resize->RetiredCount) {
+		FreeRetiredRings(Logger);
+		if (Resize->RetiredCount)
+			return;
+	}
+
+	SIZE_T Size = (SIZE_T)InterlockedExchange64(&(Resize->Requested), 0);
+	if (Size) {
+		Resize->MinSize = Size; // automatic resizing does not shrink them below that
+		Resize->HighFlushes = 0;
+		Resize->LowSince = 0;
+	} else if (Resize->MaxSize) {
+		Size = AutoRingSize(Logger, LoadFactor, IsDropping);
+	}
+
+	if (!Size || Size == Resize->Size)
+		return;
+
+	KLoggerDiag("Ring size: %d KB -> %d KB\n", (INT)(Resize->Size / 1024), (INT)(Size / 1024));
+	INT Err = SwapRings(Logger, Size);
+	if (Err != ERROR_SUCCESS) {
+		DbgPrint("Error: can't resize rings, return code %d\n", Err);
+	}
+}
+
+// reports the repeats of message windows that are over, of all of them with IsAll. Logged at
+// DISPATCH_LEVEL, so a full ring drops the report instead of waiting for this thread
+static VOID
+CloseRepeats(
+	PKLOGGER Logger,
+	BOOLEAN IsAll
+) {
+	if (!Logger->pDedup)
+		return;
+
+	// the frequency changes until the clock is calibrated
+	DedupSetWindow(Logger->pDedup, (LONGLONG)Logger->DedupMs * gClock.Frequency / 1000);
+
+	DEDUPREPEAT Repeat;
+	LONGLONG Now = ReadTimestamp();
+	ULONG SlotCount = DedupSlotCount(Logger->pDedup);
+	for (ULONG i = 0; i < SlotCount; ++i) {
+		if (DedupClose(Logger->pDedup, i, Now, IsAll, &Repeat)) {
+			KIRQL OldIrql;
+			KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+			KLoggerLogfTo(Logger, REPEAT_FORMAT, Repeat.Count, Repeat.Text);
+			KeLowerIrql(OldIrql);
+		}
+	}
+}
+
+// flushes the logger if a writer asked for it, its deadline passed or its last flush was cut short
+static VOID
+FlushLogger(
+	PKLOGGER Logger,
+	LONGLONG Now
+) {
+	CloseRepeats(Logger, FALSE);
+
+	BOOLEAN IsRequested = InterlockedExchange(&(Logger->IsFlushRequested), 0) != 0;
+	if (IsRequested) {
+		KLoggerDiag("Flushing thread is woken by FLUSH EVENT\n");
+		InterlockedExchange(&(Logger->IsFlushDispatched), 0);
+	}
+
+	BOOLEAN IsDue = Now >= Logger->Deadline;
+	if (!IsRequested && !IsDue && !Logger->HasMore)
+		return;
+
+	PFLUSHSTATS Stats = &(Logger->FlushStats);
+	if (IsRequested) {
+		Stats->DpcFlushes++;
+	} else if (!Logger->HasMore) {
+		KLoggerDiag("Flushing thread is woken by TIMEOUT\n");
+		Stats->TimeoutFlushes++;
+	}
+
+	INT LoadFactor = 0;
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		INT RingLoad = RBLoadFactor(Logger->pRingBufs[i]);
+		if (RingLoad > LoadFactor)
+			LoadFactor = RingLoad;
+	}
+	ULONGLONG Dropped = Logger->Control.LastDropped;
+
+	ULONGLONG Drained = FlushRings(Logger, FLUSH_PASS_CHUNKS, &(Logger->HasMore));
+
+	LONGLONG End = KeQueryPerformanceCounter(NULL).QuadPart;
+	LONGLONG Ticks = End - Now;
+	Stats->Ticks += Ticks;
+	if (Ticks > Stats->MaxTicks)
+		Stats->MaxTicks = Ticks;
+
+	UpdateFlushControl(Logger, Drained, Ticks);
+	ResizeRings(Logger, LoadFactor, Logger->Control.LastDropped != Dropped);
+	Logger->Deadline = End + Logger->Control.Timeout * Logger->Frequency / 10000000ll;
+}
+
+// one pass over all loggers, each gets at most FLUSH_PASS_CHUNKS chunks, so a busy one
+// can't hold up the others. Returns how long the thread may wait, in 100ns units
+static LONGLONG
+FlushLoggers(VOID) {
+	LONGLONG Wait = MAX_FLUSH_TIMEOUT;
+
+	KeWaitForSingleObject(&(gFlusher.Lock), Executive, KernelMode, FALSE, NULL);
+	CalibrateClock();
+	for (PKLOGGER Logger = gFlusher.Loggers; Logger; Logger = Logger->Next) {
+		FlushLogger(Logger, KeQueryPerformanceCounter(NULL).QuadPart);
+
+		LONGLONG Left = Logger->Deadline - KeQueryPerformanceCounter(NULL).QuadPart;
+		if (Logger->HasMore || Left <= 0) {
+			Wait = 0;
+		} else if (Left * 10000000ll / Logger->Frequency < Wait) {
+			Wait = Left * 10000000ll / Logger->Frequency;
+		}
+	}
+	KeSetEvent(&(gFlusher.Lock), 0, FALSE);
+
+	return Wait;
+}
+
+VOID 
+FlushingThreadFunc(
+	IN PVOID _Unused
+) {
+	UNREFERENCED_PARAMETER(_Unused);
+	KeSetEvent(&(gFlusher.StartEvent), 0, FALSE);
+
+	PVOID handles[2];
+	handles[0] = (PVOID)&(gFlusher.WakeEvent);
+	handles[1] = (PVOID)&(gFlusher.StopEvent);
+
+	LARGE_INTEGER Timeout;
+	Timeout.QuadPart = -MAX_FLUSH_TIMEOUT;
+
+	NTSTATUS Status;
+	while (TRUE) {
+		Status = KeWaitForMultipleObjects(
+			2,
+			handles,
+			WaitAny,
+			Executive,
+			KernelMode,
+			TRUE,
+			&Timeout,
+			NULL);
+
+		if (Status == STATUS_WAIT_1) {
+			KeClearEvent(&gFlusher.StopEvent);
+			PsTerminateSystemThread(ERROR_SUCCESS); // exit
+		}
+
+		Timeout.QuadPart = -FlushLoggers();
+	}
+}
+
+static ULONG GetRegistryDword(
+	PUNICODE_STRING RegistryPath,
+	PCWSTR ValueName,
+	ULONG DefaultValue
+) {  
+    HANDLE RegKeyHandle;
+    NTSTATUS Status;
+    OBJECT_ATTRIBUTES OdjAttr;
+    UNICODE_STRING RegKeyPath;
+    ULONG KeyValue = DefaultValue;
+ 
+    PKEY_VALUE_PARTIAL_INFORMATION PartInfo;
+    ULONG PartInfoSize;
+ 
+    InitializeObjectAttributes(&OdjAttr, RegistryPath, 0, NULL, NULL);
+ 
+    Status = ZwCreateKey(
+		&RegKeyHandle, 
+		KEY_QUERY_VALUE | KEY_SET_VALUE, 
+		&OdjAttr, 
+		0,  
+		NULL, 
+		REG_OPTION_NON_VOLATILE, 
+		NULL
+	);
+
+    if (!NT_SUCCESS(Status)) {
+        DbgPrint("[library_driver]: 'ZwCreateKey()' failed");
+        return DefaultValue;
+    }
+ 
+    RtlInitUnicodeString(&RegKeyPath, ValueName);
+   
+    PartInfoSize = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(PartInfoSize);
+    PartInfo = ExAllocatePool(PagedPool, PartInfoSize);
+    if (!PartInfo) {
+        DbgPrint("[library_driver]: 'ExAllocatePool()' failed");
+        ZwClose(RegKeyHandle);
+        return DefaultValue;
+    }
+ 
+    Status = ZwQueryValueKey(RegKeyHandle, &RegKeyPath, KeyValuePartialInformation,
+        PartInfo, PartInfoSize, &PartInfoSize);
+ 
+    switch (Status) {
+        case STATUS_SUCCESS:
+            KLoggerDiag("[library_driver]: switch: STATUS_SUCCESS");
+            if (PartInfo->Type == REG_DWORD && PartInfo->DataLength == sizeof(ULONG)) {
+                RtlCopyMemory(&KeyValue, PartInfo->Data, sizeof(KeyValue));
+                ZwClose(RegKeyHandle);
+                ExFreePool(PartInfo);
+                return KeyValue;
+            }
+            // break; - not break
+ 
+        case STATUS_OBJECT_NAME_NOT_FOUND:
+            KLoggerDiag("[library_driver]: switch: STATUS_OBJECT_NAME_NOT_FOUND");
+            Status = ZwSetValueKey(RegKeyHandle, &RegKeyPath, 0, REG_DWORD, &KeyValue, sizeof(KeyValue));
+            if (!NT_SUCCESS(Status)) {
+                ZwClose(RegKeyHandle);
+                ExFreePool(PartInfo);
+                return DefaultValue;
+            }
+ 
+            break;
+ 
+        default:
+            KLoggerDiag("[library_driver]: switch: default");
+            ZwClose(RegKeyHandle);
+            ExFreePool(PartInfo);
+            return DefaultValue;
+ 
+            break;
+           
+    }
+ 
+    ZwClose(RegKeyHandle);
+    ExFreePool(PartInfo);
+ 
+    return DefaultValue;
+}
+
+static VOID
+SetRegistryDword(
+	PUNICODE_STRING RegistryPath,
+	PCWSTR ValueName,
+	ULONG Value
+) {
+	HANDLE RegKeyHandle;
+	OBJECT_ATTRIBUTES ObjAttr;
+	UNICODE_STRING ValueNameString;
+
+	InitializeObjectAttributes(&ObjAttr, RegistryPath, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	NTSTATUS Status = ZwCreateKey(
+		&RegKeyHandle,
+		KEY_SET_VALUE,
+		&ObjAttr,
+		0,
+		NULL,
+		REG_OPTION_NON_VOLATILE,
+		NULL
+	);
+
+	if (!NT_SUCCESS(Status)) {
+		DbgPrint("[library_driver]: 'ZwCreateKey()' failed");
+		return;
+	}
+
+	RtlInitUnicodeString(&ValueNameString, ValueName);
+	ZwSetValueKey(RegKeyHandle, &ValueNameString, 0, REG_DWORD, &Value, sizeof(Value));
+	ZwClose(RegKeyHandle);
+}
+
+// the default logger's settings, every value is read from the registry
+static VOID
+GetRegistryConfig(
+	PUNICODE_STRING RegistryPath,
+	PKLOGGER_CONFIG Config
+) {
+	RtlZeroMemory(Config, sizeof(KLOGGER_CONFIG));
+	Config->BufSize = GetRegistryDword(RegistryPath, REGISTRY_BUF_SIZE_KEY, DEFAULT_RING_BUF_SIZE);
+	Config->PerCpuBufSize = GetRegistryDword(RegistryPath, REGISTRY_PER_CPU_BUF_SIZE_KEY, DEFAULT_PER_CPU_BUF_SIZE);
+	Config->MaxBufSize = GetRegistryDword(RegistryPath, REGISTRY_MAX_BUF_SIZE_KEY, DEFAULT_MAX_BUF_SIZE);
+	Config->WriteSlots = GetRegistryDword(RegistryPath, REGISTRY_WRITE_SLOTS_KEY, DEFAULT_WRITE_SLOTS);
+	Config->SegmentSizeMb = GetRegistryDword(RegistryPath, REGISTRY_SEGMENT_SIZE_MB_KEY, DEFAULT_SEGMENT_SIZE_MB);
+	Config->MaxSegments = GetRegistryDword(RegistryPath, REGISTRY_MAX_SEGMENTS_KEY, DEFAULT_MAX_SEGMENTS);
+	Config->Compress = GetRegistryDword(RegistryPath, REGISTRY_COMPRESS_KEY, DEFAULT_COMPRESS);
+	Config->DedupMs = GetRegistryDword(RegistryPath, REGISTRY_DEDUP_MS_KEY, DEFAULT_DEDUP_MS);
+	Config->IndexKb = GetRegistryDword(RegistryPath, REGISTRY_INDEX_KB_KEY, DEFAULT_INDEX_KB);
+	Config->Overflow = GetRegistryDword(RegistryPath, REGISTRY_OVERFLOW_POLICY_KEY, DEFAULT_OVERFLOW_POLICY);
+	Config->BlockTimeoutMs = GetRegistryDword(RegistryPath, REGISTRY_BLOCK_TIMEOUT_MS_KEY, DEFAULT_BLOCK_TIMEOUT_MS);
+	Config->FixedFlush = GetRegistryDword(RegistryPath, REGISTRY_ADAPTIVE_FLUSH_KEY, DEFAULT_ADAPTIVE_FLUSH) == 0;
+	Config->NumaLocal = GetRegistryDword(RegistryPath, REGISTRY_NUMA_LOCAL_KEY, DEFAULT_NUMA_LOCAL);
+	Config->LiveName = GetRegistryDword(RegistryPath, REGISTRY_LIVE_TAIL_KEY, DEFAULT_LIVE_TAIL) ? LIVE_TAIL_NAME : NULL;
+	Config->FileName = Config->SegmentSizeMb ? LOG_SEGMENT_NAME : LOG_FILE_NAME;
+}
+
+static ULONG
+GetWriteSlotCount(
+	const KLOGGER_CONFIG* Config
+) {
+	if (!Config->WriteSlots)
+		return DEFAULT_WRITE_SLOTS;
+
+	return (Config->WriteSlots > MAX_WRITE_SLOTS) ? MAX_WRITE_SLOTS : Config->WriteSlots;
+}
+
+static VOID
+DeinitRings(
+	PKLOGGER Logger
+) {
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		RBDeinit(Logger->pRingBufs[i]);
+	}
+
+	for (ULONG i = Logger->RingCount; i < Logger->SourceCount; ++i) {
+		if (Logger->Sources[i].pRingBuf)
+			RBDeinit(Logger->Sources[i].pRingBuf);
+	}
+
+	if (Logger->CpuRings)
+		ExFreePool(Logger->CpuRings);
+	ExFreePool(Logger->pLossMem);
+	ExFreePool(Logger->Heap);
+	ExFreePool(Logger->Sources);
+	ExFreePool(Logger->pRingBufs);
+}
+
+// node of the processor with that index, 0 if no node claims it
+static ULONG
+ProcessorNode(
+	ULONG Index
+) {
+	PROCESSOR_NUMBER Number;
+	if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(Index, &Number)))
+		return 0;
+
+	USHORT HighestNode = KeQueryHighestNodeNumber();
+	for (USHORT Node = 0; Node <= HighestNode; ++Node) {
+		GROUP_AFFINITY Affinity;
+		USHORT Count;
+		KeQueryNodeActiveAffinity(Node, &Affinity, &Count);
+		if (Count && Affinity.Group == Number.Group && (Affinity.Mask & ((KAFFINITY)1 << Number.Number)))
+			return Node;
+	}
+
+	return 0;
+}
+
+// NUMA_LOCAL with a shared ring: one per node that has processors, CpuRings tells
+// which one a processor writes to. Ring i is placed on pNodes[i]
+static INT
+MapNodeRings(
+	PKLOGGER Logger,
+	PULONG pRingCount,
+	PULONG* ppNodes
+) {
+	ULONG CpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	ULONG NodeCount = (ULONG)KeQueryHighestNodeNumber() + 1;
+
+	PULONG CpuRings = (PULONG)ExAllocatePool(NonPagedPool, CpuCount * sizeof(ULONG));
+	PULONG pNodes = (PULONG)ExAllocatePool(PagedPool, NodeCount * sizeof(ULONG));
+	PULONG NodeRings = (PULONG)ExAllocatePool(PagedPool, NodeCount * sizeof(ULONG));
+	if (!CpuRings || !pNodes || !NodeRings) {
+		if (CpuRings)
+			ExFreePool(CpuRings);
+		if (pNodes)
+			ExFreePool(pNodes);
+		if (NodeRings)
+			ExFreePool(NodeRings);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (ULONG Node = 0; Node < NodeCount; ++Node) {
+		NodeRings[Node] = MAXULONG;
+	}
+
+	ULONG RingCount = 0;
+	for (ULONG Cpu = 0; Cpu < CpuCount; ++Cpu) {
+		ULONG Node = ProcessorNode(Cpu);
+		if (NodeRings[Node] == MAXULONG) {
+			pNodes[RingCount] = Node;
+			NodeRings[Node] = RingCount++;
+		}
+
+		CpuRings[Cpu] = NodeRings[Node];
+	}
+
+	ExFreePool(NodeRings);
+
+	// a single node needs no map
+	if (RingCount == 1) {
+		ExFreePool(CpuRings);
+		CpuRings = NULL;
+	}
+
+	Logger->CpuRings = CpuRings;
+	Logger->CpuCount = CpuCount;
+	*pRingCount = RingCount;
+	*ppNodes = pNodes;
+	return ERROR_SUCCESS;
+}
+
+// "\BaseNamedObjects\<LiveName>.<Ring>", LiveName is cut to fit LIVE_NAME_MAX
+static VOID
+LiveRingName(
+	PCWSTR LiveName,
+	ULONG Ring,
+	PWCHAR pName
+) {
+	SIZE_T Length = 0;
+	for (PCWSTR Prefix = LIVE_NAME_PREFIX; *Prefix; ++Prefix) {
+		pName[Length++] = *Prefix;
+	}
+
+	// room for ".<10 digits>"
+	while (*LiveName && Length < LIVE_NAME_MAX - 12) {
+		pName[Length++] = *LiveName++;
+	}
+
+	pName[Length++] = L'.';
+	WCHAR Digits[10];
+	ULONG DigitCount = 0;
+	do {
+		Digits[DigitCount++] = (WCHAR)(L'0' + Ring % 10);
+		Ring /= 10;
+	} while (Ring);
+
+	while (DigitCount) {
+		pName[Length++] = Digits[--DigitCount];
+	}
+	pName[Length] = L'\0';
+}
+
+// a live ring is in a section, else on its node. A section that can't be created,
+// e.g. a name still held by a reader of the previous load, leaves that ring private
+static INT
+InitRing(
+	PRINGBUFFER* pRingBuf,
+	SIZE_T Size,
+	ULONG Node,
+	PCWSTR LiveName,
+	ULONG Ring
+) {
+	if (LiveName) {
+		WCHAR Name[LIVE_NAME_MAX];
+		LiveRingName(LiveName, Ring, Name);
+
+		INT Err = RBInitShared(pRingBuf, Size, Name);
+		if (Err == ERROR_SUCCESS)
+			return ERROR_SUCCESS;
+
+		KLoggerDiag("Live ring %d: section not created (%d)\n", (INT)Ring, Err);
+	}
+
+	return RBInitOnNode(pRingBuf, Size, Node);
+}
+
+static INT
+InitRings(
+	PKLOGGER Logger,
+	const KLOGGER_CONFIG* Config
+) {
+	SIZE_T RingBufSize = Config->PerCpuBufSize;
+	ULONG RingCount = 1;
+	PULONG pNodes = NULL; // of the shared rings with NUMA_LOCAL
+
+	Logger->CpuRings = NULL;
+	Logger->CpuCount = 0;
+
+	if (RingBufSize) {
+		RingCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	} else {
+		RingBufSize = Config->BufSize ? Config->BufSize : DEFAULT_RING_BUF_SIZE;
+		if (Config->NumaLocal) {
+			INT Err = MapNodeRings(Logger, &RingCount, &pNodes);
+			if (Err != ERROR_SUCCESS)
+				return Err;
+		}
+	}
+
+	Logger->IsLive = Config->LiveName != NULL;
+	Logger->Overflow = Config->Overflow;
+	if (Logger->Overflow > KLOGGER_OVERFLOW_BLOCK)
+		Logger->Overflow = DEFAULT_OVERFLOW_POLICY;
+
+	Logger->RingCount = 0;
+	Logger->SourceCount = 2 * RingCount;
+	Logger->pRingBufs = (PRINGBUFFER*)ExAllocatePool(NonPagedPool, RingCount * sizeof(PRINGBUFFER));
+	Logger->Sources = (PMERGESOURCE)ExAllocatePool(PagedPool, Logger->SourceCount * sizeof(MERGESOURCE));
+	Logger->Heap = (PMERGESOURCE*)ExAllocatePool(PagedPool, Logger->SourceCount * sizeof(PMERGESOURCE));
+	Logger->pLossMem = ExAllocatePool(NonPagedPool, (RingCount + 1) * sizeof(RINGLOSS));
+	if (!Logger->pRingBufs || !Logger->Sources || !Logger->Heap || !Logger->pLossMem) {
+		goto err_mem;
+	}
+
+	ULONG_PTR Aligned = ((ULONG_PTR)Logger->pLossMem + STATS_LINE_SIZE - 1) & ~(ULONG_PTR)(STATS_LINE_SIZE - 1);
+	Logger->Losses = (PRINGLOSS)Aligned;
+	RtlZeroMemory(Logger->Losses, RingCount * sizeof(RINGLOSS));
+	RtlZeroMemory(Logger->Sources, Logger->SourceCount * sizeof(MERGESOURCE));
+
+	for (ULONG i = 0; i < RingCount; ++i) {
+		ULONG Node = MM_ANY_NODE_OK;
+		if (Config->NumaLocal)
+			Node = pNodes ? pNodes[i] : ProcessorNode(i);
+
+		int Err = InitRing(&(Logger->pRingBufs[i]), RingBufSize, Node, Config->LiveName, i);
+		if (Err != ERROR_SUCCESS) {
+			if (pNodes)
+				ExFreePool(pNodes);
+			DeinitRings(Logger);
+			return Err;
+		}
+
+		if (Logger->Overflow == KLOGGER_OVERFLOW_OVERWRITE)
+			RBSetOverwrite(Logger->pRingBufs[i]);
+		InitTimeBase(Logger->pRingBufs[i]);
+
+		Logger->Sources[i].pRingBuf = Logger->pRingBufs[i];
+		Logger->Sources[i].Consumed = RBReadBegin(Logger->pRingBufs[i]);
+		Logger->RingCount++;
+	}
+
+	if (pNodes)
+		ExFreePool(pNodes);
+
+	PRESIZECONTROL Resize = &(Logger->Resize);
+	RtlZeroMemory(Resize, sizeof(RESIZECONTROL));
+	Resize->Size = RBCapacity(Logger->pRingBufs[0]);
+	Resize->MinSize = Resize->Size;
+	if (Config->MaxBufSize > Resize->Size && !Logger->IsLive)
+		Resize->MaxSize = Config->MaxBufSize;
+
+	return ERROR_SUCCESS;
+
+err_mem:
+	if (pNodes)
+		ExFreePool(pNodes);
+	if (Logger->CpuRings)
+		ExFreePool(Logger->CpuRings);
+	if (Logger->pRingBufs)
+		ExFreePool(Logger->pRingBufs);
+	if (Logger->Sources)
+		ExFreePool(Logger->Sources);
+	if (Logger->Heap)
+		ExFreePool(Logger->Heap);
+	if (Logger->pLossMem)
+		ExFreePool(Logger->pLossMem);
+
+	return ERROR_NOT_ENOUGH_MEMORY;
+}
+
+static VOID
+DeinitSlots(
+	PKLOGGER Logger
+) {
+	for (ULONG i = 0; i < Logger->SlotCount; ++i) {
+		PWRITESLOT Slot = &(Logger->Slots[i]);
+		LogWriteDeinit(&(Slot->Direct));
+		LogWriteDeinit(&(Slot->Chunk));
+		if (Slot->pFrame)
+			ExFreePool(Slot->pFrame);
+		ExFreePool(Slot->pBuf);
+	}
+
+	if (Logger->pHashTable)
+		ExFreePool(Logger->pHashTable);
+
+	ExFreePool(Logger->Slots[0].Release);
+	ExFreePool(Logger->Slots);
+}
+
+static INT
+InitStats(
+	PKLOGGER Logger
+) {
+	Logger->StatsCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	Logger->pStatsMem = ExAllocatePool(NonPagedPool, (Logger->StatsCount + 1) * sizeof(CPUSTATS));
+	if (!Logger->pStatsMem) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	ULONG_PTR Aligned = ((ULONG_PTR)Logger->pStatsMem + STATS_LINE_SIZE - 1) & ~(ULONG_PTR)(STATS_LINE_SIZE - 1);
+	Logger->CpuStats = (PCPUSTATS)Aligned;
+	RtlZeroMemory(Logger->CpuStats, Logger->StatsCount * sizeof(CPUSTATS));
+	RtlZeroMemory(&(Logger->FlushStats), sizeof(FLUSHSTATS));
+
+	return ERROR_SUCCESS;
+}
+
+// after InitRings and InitStats, once the timestamp frequency is known
+static VOID
+InitFlushControl(
+	PKLOGGER Logger,
+	const KLOGGER_CONFIG* Config
+) {
+	PFLUSHCONTROL Control = &(Logger->Control);
+	RtlZeroMemory(Control, sizeof(FLUSHCONTROL));
+
+	Control->IsAdaptive = !Config->FixedFlush;
+	Control->Threshold = FLUSH_THRESHOLD;
+	Control->Timeout = FLUSH_TIMEOUT;
+	Control->LastTicks = KeQueryPerformanceCounter(NULL).QuadPart;
+	Control->DrainRate = INITIAL_DRAIN_RATE;
+	Logger->HasMore = FALSE;
+	Logger->Deadline = Control->LastTicks + FLUSH_TIMEOUT * Logger->Frequency / 10000000ll;
+
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		Logger->Sources[i].Reserved = RBReserved(Logger->pRingBufs[i]);
+	}
+}
+
+// after InitRings - every slot keeps a release position per ring
+static INT
+InitSlots(
+	PKLOGGER Logger,
+	const KLOGGER_CONFIG* Config
+) {
+	ULONG SlotCount = GetWriteSlotCount(Config);
+	BOOLEAN IsCompressed = Config->Compress != 0;
+	INT Err = ERROR_SUCCESS;
+
+	Logger->SlotCount = 0;
+	Logger->NextSlot = 0;
+	Logger->Failed = NULL;
+	Logger->pHashTable = NULL;
+	Logger->Slots = (PWRITESLOT)ExAllocatePool(NonPagedPool, SlotCount * sizeof(WRITESLOT));
+	if (!Logger->Slots) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	PLONGLONG Release = (PLONGLONG)ExAllocatePool(NonPagedPool, SlotCount * Logger->SourceCount * sizeof(LONGLONG));
+	if (!Release) {
+		ExFreePool(Logger->Slots);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	if (IsCompressed) {
+		Logger->pHashTable = ExAllocatePool(PagedPool, LZ_HASH_TABLE_SIZE);
+		if (!Logger->pHashTable) {
+			Err = ERROR_NOT_ENOUGH_MEMORY;
+			goto err_slot;
+		}
+	}
+
+	for (ULONG i = 0; i < SlotCount; ++i) {
+		PWRITESLOT Slot = &(Logger->Slots[i]);
+		Slot->IsBusy = FALSE;
+		Slot->Release = Release + i * Logger->SourceCount;
+
+		Slot->pFrame = NULL;
+		Slot->pBuf = (PCHAR)ExAllocatePool(PagedPool, FLUSH_BUF_SIZE * sizeof(CHAR));
+		if (!Slot->pBuf) {
+			Err = ERROR_NOT_ENOUGH_MEMORY;
+			goto err_slot;
+		}
+
+		if (IsCompressed) {
+			Slot->pFrame = (PCHAR)ExAllocatePool(PagedPool, FRAME_BUF_SIZE * sizeof(CHAR));
+			if (!Slot->pFrame) {
+				Err = ERROR_NOT_ENOUGH_MEMORY;
+				goto err_frame;
+			}
+		}
+
+		Err = LogWriteInit(&(Slot->Chunk));
+		if (Err != ERROR_SUCCESS) {
+			goto err_chunk;
+		}
+
+		Err = LogWriteInit(&(Slot->Direct));
+		if (Err != ERROR_SUCCESS) {
+			goto err_direct;
+		}
+
+		Logger->SlotCount++;
+	}
+
+	return ERROR_SUCCESS;
+
+err_direct:
+	LogWriteDeinit(&(Logger->Slots[Logger->SlotCount].Chunk));
+
+err_chunk:
+	if (Logger->Slots[Logger->SlotCount].pFrame)
+		ExFreePool(Logger->Slots[Logger->SlotCount].pFrame);
+
+err_frame:
+	ExFreePool(Logger->Slots[Logger->SlotCount].pBuf);
+
+err_slot:
+	if (Logger->SlotCount) {
+		DeinitSlots(Logger);
+	} else {
+		if (Logger->pHashTable)
+			ExFreePool(Logger->pHashTable);
+		ExFreePool(Release);
+		ExFreePool(Logger->Slots);
+	}
+
+	return Err;
+}
+
+// a logger with its own rings and file, linked to the flushing thread's list. RegistryPath is
+// where the default logger keeps LAST_SEGMENT, NULL for others
+static INT
+InitLogger(
+	PKLOGGER* ppLogger,
+	const KLOGGER_CONFIG* Config,
+	PUNICODE_STRING RegistryPath,
+	ULONG Segment
+) {
+	int Err = ERROR_SUCCESS;
+
+	if (!Config->FileName)
+		return ERROR_BAD_ARGUMENTS;
+
+	PKLOGGER Logger = (PKLOGGER)ExAllocatePool(NonPagedPool, sizeof(KLOGGER));
+	if (Logger == NULL) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_klogger_mem;
+	}
+
+	Err = InitRings(Logger, Config);
+	if (Err != ERROR_SUCCESS) {
+		goto err_ring_buf_init;
+	}
+
+	Logger->IsFlushDispatched = 0;
+	Logger->IsFlushRequested = 0;
+	Logger->pFlushDpc = (PKDPC)ExAllocatePool(NonPagedPool, sizeof(KDPC));
+	if (!Logger->pFlushDpc) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_dpc_mem;
+	}
+
+	KeInitializeDpc(Logger->pFlushDpc, SetWriteEvent, Logger);
+
+	Err = InitStats(Logger);
+	if (Err != ERROR_SUCCESS) {
+		goto err_stats_mem;
+	}
+
+	// chunk buffers for flushing thread
+	Err = InitSlots(Logger, Config);
+	if (Err != ERROR_SUCCESS) {
+		goto err_slots_mem;
+	}
+
+	Logger->pFormatBuf = (PCHAR)ExAllocatePool(PagedPool, FORMAT_BUF_SIZE);
+	if (!Logger->pFormatBuf) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_format_mem;
+	}
+
+	Logger->pDedup = NULL;
+	Logger->DedupMs = Config->DedupMs;
+	if (Config->DedupMs) {
+		Err = DedupInit(&(Logger->pDedup), Logger->StatsCount, (LONGLONG)Config->DedupMs * gClock.Frequency / 1000);
+		if (Err != ERROR_SUCCESS) {
+			goto err_dedup;
+		}
+	}
+
+	// open file for flushing thread
+	Logger->RegistryPath.Length = 0;
+	Logger->RegistryPath.MaximumLength = 0;
+	Logger->RegistryPath.Buffer = NULL;
+	if (RegistryPath) {
+		Logger->RegistryPath.MaximumLength = RegistryPath->Length;
+		Logger->RegistryPath.Buffer = (PWCH)ExAllocatePool(PagedPool, RegistryPath->Length ? RegistryPath->Length : 1);
+		if (!Logger->RegistryPath.Buffer) {
+			Err = ERROR_NOT_ENOUGH_MEMORY;
+			goto err_registry_mem;
+		}
+
+		RtlCopyUnicodeString(&(Logger->RegistryPath), RegistryPath);
+	}
+
+	Err = LogFileOpen(
+		&(Logger->pLogFile),
+		Config->FileName,
+		(ULONGLONG)Config->SegmentSizeMb * 1024ull * 1024ull,
+		Config->MaxSegments,
+		Segment,
+		Config->IndexKb * 1024u);
+
+	if (Err != ERROR_SUCCESS) {
+		goto err_file;
+	}
+
+	LARGE_INTEGER Frequency;
+	KeQueryPerformanceCounter(&Frequency);
+	Logger->Frequency = Frequency.QuadPart;
+	Logger->BlockTimeout = (LONGLONG)(Config->BlockTimeoutMs ? Config->BlockTimeoutMs : DEFAULT_BLOCK_TIMEOUT_MS) *
+		Logger->Frequency / 1000;
+
+	Logger->Sequence = 0;
+	Logger->CatalogWritten = 0;
+	InitFlushControl(Logger, Config);
+	WriteSession(Logger);
+
+	KeWaitForSingleObject(&(gFlusher.Lock), Executive, KernelMode, FALSE, NULL);
+	Logger->Next = gFlusher.Loggers;
+	gFlusher.Loggers = Logger;
+	KeSetEvent(&(gFlusher.Lock), 0, FALSE);
+
+	*ppLogger = Logger;
+	return ERROR_SUCCESS;
+
+err_file:
+	if (Logger->RegistryPath.Buffer)
+		ExFreePool(Logger->RegistryPath.Buffer);
+
+err_registry_mem:
+	if (Logger->pDedup)
+		DedupDeinit(Logger->pDedup);
+
+err_dedup:
+	ExFreePool(Logger->pFormatBuf);
+
+err_format_mem:
+	DeinitSlots(Logger);
+
+err_slots_mem:
+	ExFreePool(Logger->pStatsMem);
+
+err_stats_mem:
+	ExFreePool(Logger->pFlushDpc);
+
+err_dpc_mem:
+	DeinitRings(Logger);
+
+err_ring_buf_init:
+	ExFreePool(Logger);
+
+err_klogger_mem:
+	return Err;
+}
+
+static BOOLEAN
+ReportLosses(
+	PKLOGGER Logger
+);
+
+// unlinks the logger and writes out what is left in its rings,
+// nothing may be logged to it any more. The rest is flushed under gFlusher.Lock, like
+// any flush: the flushing thread would calibrate the clock under it for the other loggers
+static VOID
+DeinitLogger(
+	PKLOGGER Logger
+) {
+	KeWaitForSingleObject(&(gFlusher.Lock), Executive, KernelMode, FALSE, NULL);
+	for (PKLOGGER* pLink = &(gFlusher.Loggers); *pLink; pLink = &((*pLink)->Next)) {
+		if (*pLink == Logger) {
+			*pLink = Logger->Next;
+			break;
+		}
+	}
+	CalibrateClock(); // the rest may be flushed here at once
+
+	KeFlushQueuedDpcs();
+	CloseRepeats(Logger, TRUE);
+
+	BOOLEAN HasMore;
+	do {
+		FlushRings(Logger, MAXULONG, &HasMore);
+	} while (HasMore);
+
+	// drops after the last message that got through and chunks whose write failed, no writer
+	// is left to report them. A file that keeps failing can't hold up the rest
+	for (ULONG i = 0; i < FINAL_LOSS_FLUSHES && ReportLosses(Logger); ++i) {
+		do {
+			FlushRings(Logger, MAXULONG, &HasMore);
+		} while (HasMore);
+	}
+	KeSetEvent(&(gFlusher.Lock), 0, FALSE);
+
+	ExFreePool(Logger->pFormatBuf);
+	if (Logger->pDedup)
+		DedupDeinit(Logger->pDedup);
+	LogFileClose(Logger->pLogFile);
+	if (Logger->RegistryPath.Buffer)
+		ExFreePool(Logger->RegistryPath.Buffer);
+	DeinitSlots(Logger);
+
+	ExFreePool(Logger->pStatsMem);
+	ExFreePool(Logger->pFlushDpc);
+
+	DeinitRings(Logger);
+	ExFreePool(Logger);
+}
+
+static INT
+StartFlusher(VOID) {
+	gFlusher.Loggers = NULL;
+	KeInitializeEvent(&(gFlusher.Lock), SynchronizationEvent, TRUE);
+	KeInitializeEvent(&(gFlusher.WakeEvent), SynchronizationEvent, FALSE);
+	KeInitializeEvent(&(gFlusher.StartEvent), SynchronizationEvent, FALSE);
+	KeInitializeEvent(&(gFlusher.StopEvent), SynchronizationEvent, FALSE);
+
+	NTSTATUS Status = PsCreateSystemThread(
+		&(gFlusher.ThreadHandle),
+		THREAD_ALL_ACCESS,
+		NULL,
+		NULL,
+		NULL,
+		FlushingThreadFunc,
+		NULL);
+
+	if (!NT_SUCCESS(Status))
+		return ERROR_TOO_MANY_TCBS;
+
+	ObReferenceObjectByHandle(
+		gFlusher.ThreadHandle,
+		FILE_ANY_ACCESS,
+		NULL,
+		KernelMode,
+		(PVOID*)&(gFlusher.pThread),
+		NULL);
+
+	// wait while thread start
+	LARGE_INTEGER Timeout;
+	Timeout.QuadPart = -START_TIMEOUT;
+
+	KeWaitForSingleObject(
+		&(gFlusher.StartEvent),
+		Executive,
+		KernelMode,
+		FALSE,
+		&Timeout);
+
+	return ERROR_SUCCESS;
+}
+
+static VOID
+StopFlusher(VOID) {
+	KeSetEvent(&(gFlusher.StopEvent), 0, FALSE);
+
+	KeWaitForSingleObject(
+		gFlusher.pThread,
+		Executive,
+		KernelMode,
+		FALSE,
+		NULL);
+
+	ObDereferenceObject(gFlusher.pThread);
+	ZwClose(gFlusher.ThreadHandle);
+}
+
+// the flushing thread and the default logger, set up from the registry
+INT
+KLoggerInit(
+	PUNICODE_STRING RegistryPath
+) {
+	KLoggerMask = GetRegistryDword(RegistryPath, REGISTRY_LOG_MASK_KEY, KLOGGER_MASK_DEFAULT);
+	InitClock(GetRegistryDword(RegistryPath, REGISTRY_USE_TSC_KEY, DEFAULT_USE_TSC) != 0);
+
+	KLOGGER_CONFIG Config;
+	GetRegistryConfig(RegistryPath, &Config);
+
+	// a new segment on every load
+	ULONG Segment = 0;
+	if (Config.SegmentSizeMb) {
+		Segment = GetRegistryDword(RegistryPath, REGISTRY_LAST_SEGMENT_KEY, 0) + 1;
+		SetRegistryDword(RegistryPath, REGISTRY_LAST_SEGMENT_KEY, Segment);
+	}
+
+	INT Err = CatalogInit(&gCatalog);
+	if (Err != ERROR_SUCCESS) {
+		return Err;
+	}
+
+	Err = StartFlusher();
+	if (Err != ERROR_SUCCESS) {
+		goto err_flusher;
+	}
+
+	Err = InitLogger(&gKLogger, &Config, RegistryPath, Segment);
+	if (Err != ERROR_SUCCESS) {
+		StopFlusher();
+		goto err_flusher;
+	}
+
+	return ERROR_SUCCESS;
+
+err_flusher:
+	CatalogDeinit(gCatalog);
+	gCatalog = NULL;
+	return Err;
+}
+
+// loggers the clients did not destroy go away together with the default one
+VOID
+KLoggerDeinit() {
+	StopFlusher();
+
+	while (gFlusher.Loggers) {
+		DeinitLogger(gFlusher.Loggers);
+	}
+	gKLogger = NULL;
+
+	CatalogDeinit(gCatalog);
+	gCatalog = NULL;
+}
+
+// a logger of its own: rings, file and settings. It is served by the same
+// flushing thread as all the others. It has no LAST_SEGMENT, segment numbering goes on
+// after the highest one on disk instead
+INT
+KLoggerCreate(
+	PKLOGGER* ppLogger,
+	const KLOGGER_CONFIG* pConfig
+) {
+	if (!ppLogger || !pConfig || !pConfig->FileName)
+		return ERROR_BAD_ARGUMENTS;
+
+	ULONG Segment = 0;
+	if (pConfig->SegmentSizeMb) {
+		Segment = LogFileLastSegment(pConfig->FileName) + 1;
+	}
+
+	return InitLogger(ppLogger, pConfig, NULL, Segment);
+}
+
+// what is left in its rings is written out first. The default logger is only torn down
+// by KLoggerDeinit
+INT
+KLoggerDestroy(
+	PKLOGGER Logger
+) {
+	if (!Logger)
+		return ERROR_BAD_ARGUMENTS;
+
+	if (Logger == gKLogger)
+		return ERROR_NOT_SUPPORTED;
+
+	DeinitLogger(Logger);
+	return ERROR_SUCCESS;
+}
+
+VOID
+SetWriteEvent(
+	IN PKDPC pthisDpcObject,
+	IN PVOID DeferredContext,
+	IN PVOID SystemArgument1,
+	IN PVOID SystemArgument2
+)
+{
+	UNREFERENCED_PARAMETER(pthisDpcObject);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	PKLOGGER Logger = (PKLOGGER)DeferredContext;
+
+	KLoggerDiag("Set Write Event\n");
+	InterlockedExchange(&(Logger->IsFlushRequested), 1);
+	KeSetEvent(&(gFlusher.WakeEvent), 0, FALSE);
+}
+
+static ULONG
+CurrentRing(
+	PKLOGGER Logger,
+	ULONG Cpu
+) {
+	if (Logger->RingCount == 1)
+		return 0;
+
+	if (Logger->CpuRings)
+		return Logger->CpuRings[Cpu % Logger->CpuCount];
+
+	return Cpu % Logger->RingCount;
+}
+
+// a record being written by the calling thread
+typedef struct LogContext {
+	PRINGBUFFER pRingBuf;
+	ULONG Ring;
+	PKLOGGER_RECORD Record; // committed by LogEnd
+	SIZE_T Length; // of all messages
+	ULONG Count;
+	ULONG Cpu;
+	KIRQL Irql;
+	KIRQL OldIrql;
+	BOOLEAN IsRepeat; // counted by the dedup table, nothing was reserved
+} LOGCONTEXT, *PLOGCONTEXT;
+
+static VOID
+FillRecord(
+	PLOGCONTEXT Ctx,
+	PKLOGGER_RECORD Record,
+	UCHAR Type,
+	SIZE_T Length,
+	LONGLONG Timestamp
+) {
+	Record->Timestamp = Timestamp;
+	Record->Length = (ULONG)Length;
+	Record->Type = Type;
+	Record->Irql = Ctx->Irql;
+	Record->Cpu = (USHORT)Ctx->Cpu;
+}
+
+static VOID
+WakeFlushingThread(
+	PKLOGGER Logger,
+	INT LoadFactor
+) {
+	if (!InterlockedCompareExchange(&(Logger->IsFlushDispatched), 1, 0)) {
+		KLoggerDiag("Dpc is queued, load factor: %d\n", LoadFactor);
+		KeInsertQueueDpc(Logger->pFlushDpc, NULL, NULL);
+	}
+}
+
+// LOSS record for what was dropped on the ring since the last one, ahead of the
+// message being logged. Counts go back if the ring is still full
+static VOID
+LogLoss(
+	PKLOGGER Logger,
+	PLOGCONTEXT Ctx
+) {
+	PRINGLOSS Loss = &(Logger->Losses[Ctx->Ring]);
+	LONGLONG Messages = InterlockedExchange64(&(Loss->Messages), 0);
+	if (!Messages)
+		return;
+
+	LONGLONG Bytes = InterlockedExchange64(&(Loss->Bytes), 0);
+
+	PKLOGGER_RECORD Record;
+	SIZE_T Size = sizeof(KLOGGER_RECORD) + sizeof(KLOGGER_LOSS);
+	if (RBReserve(Ctx->pRingBuf, Size, (PVOID*)&Record) != ERROR_SUCCESS) {
+		InterlockedExchangeAdd64(&(Loss->Bytes), Bytes);
+		InterlockedExchangeAdd64(&(Loss->Messages), Messages);
+		return;
+	}
+
+	FillRecord(Ctx, Record, KLOGGER_REC_LOSS, sizeof(KLOGGER_LOSS), ReadTimestamp());
+	PKLOGGER_LOSS Payload = (PKLOGGER_LOSS)(Record + 1);
+	Payload->Messages = (ULONGLONG)Messages;
+	Payload->Bytes = (ULONGLONG)Bytes;
+	RBCommit(Record, Size);
+}
+
+// LOSS records for the losses still pending on the rings, each on the first processor of its
+// ring. TRUE if there were any
+static BOOLEAN
+ReportLosses(
+	PKLOGGER Logger
+) {
+	BOOLEAN IsReported = FALSE;
+	for (ULONG i = 0; i < Logger->RingCount; ++i) {
+		if (!Logger->Losses[i].Messages)
+			continue;
+
+		LOGCONTEXT Ctx;
+		RtlZeroMemory(&Ctx, sizeof(Ctx));
+		while (CurrentRing(Logger, Ctx.Cpu) != i)
+			Ctx.Cpu++;
+		Ctx.Ring = i;
+		Ctx.pRingBuf = Logger->pRingBufs[i];
+		LogLoss(Logger, &Ctx);
+		IsReported = TRUE;
+	}
+
+	return IsReported;
+}
+
+// the ring is full: drops the oldest messages or waits for the flushing thread
+// as the overflow policy says
+static INT
+LogOverflow(
+	PKLOGGER Logger,
+	PLOGCONTEXT Ctx,
+	SIZE_T Space,
+	PVOID* ppSpan
+) {
+	INT Err = ERROR_INSUFFICIENT_BUFFER;
+	if (Space > RBCapacity(Ctx->pRingBuf))
+		return Err;
+
+	if (Logger->Overflow == KLOGGER_OVERFLOW_OVERWRITE) {
+		PCPUSTATS Stats = &(Logger->CpuStats[Ctx->Cpu % Logger->StatsCount]);
+		KLOGGER_RECORD Record;
+		SIZE_T Size;
+		while (Err == ERROR_INSUFFICIENT_BUFFER &&
+			RBDiscard(Ctx->pRingBuf, &Record, sizeof(KLOGGER_RECORD), &Size) == ERROR_SUCCESS) {
+			if (Size && Record.Type != KLOGGER_REC_LOSS) {
+				Stats->Overwritten++;
+				Stats->OverwrittenBytes += Record.Length;
+			}
+			Err = RBReserveSpan(Ctx->pRingBuf, Space, ppSpan);
+		}
+
+		return Err;
+	}
+
+	// waiting is only allowed to callers that came at PASSIVE_LEVEL
+	if (Ctx->OldIrql != PASSIVE_LEVEL)
+		return Err;
+
+	LONGLONG Deadline = KeQueryPerformanceCounter(NULL).QuadPart + Logger->BlockTimeout;
+	LARGE_INTEGER Interval;
+	Interval.QuadPart = -BLOCK_POLL_INTERVAL;
+	do {
+		WakeFlushingThread(Logger, RBLoadFactor(Ctx->pRingBuf));
+		KeLowerIrql(PASSIVE_LEVEL);
+		KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+		KeRaiseIrql(DISPATCH_LEVEL, &(Ctx->OldIrql));
+
+		// may be another processor now
+		Ctx->Cpu = KeGetCurrentProcessorNumberEx(NULL);
+		Ctx->Ring = CurrentRing(Logger, Ctx->Cpu);
+		Ctx->pRingBuf = Logger->pRingBufs[Ctx->Ring];
+		Err = RBReserveSpan(Ctx->pRingBuf, Space, ppSpan);
+	} while (Err == ERROR_INSUFFICIENT_BUFFER && KeQueryPerformanceCounter(NULL).QuadPart < Deadline);
+
+	return Err;
+}
+
+// Space ring bytes on the context's ring, the policy only matters once it is full
+static INT
+LogReserve(
+	PKLOGGER Logger,
+	PLOGCONTEXT Ctx,
+	SIZE_T Space,
+	PVOID* ppSpan
+) {
+	INT Err = RBReserveSpan(Ctx->pRingBuf, Space, ppSpan);
+	if (Err == ERROR_SUCCESS || Logger->Overflow == KLOGGER_OVERFLOW_DROP)
+		return Err;
+
+	return LogOverflow(Logger, Ctx, Space, ppSpan);
+}
+
+static VOID
+CaptureRepeat(
+	PDFARGS pArgs,
+	...
+) {
+	va_list Ap;
+	va_start(Ap, pArgs);
+	DFCapture(REPEAT_FORMAT, Ap, pArgs);
+	va_end(Ap);
+}
+
+// TRUE if Msg repeats within the window and is only counted. Otherwise it takes its slot and
+// what the slot counted for the message before is reported ahead of it, like a LOSS record.
+// The report is reserved as the message is, by the overflow policy. If it still doesn't fit,
+// the repeats it counted are lost
+static BOOLEAN
+LogRepeat(
+	PKLOGGER Logger,
+	PLOGCONTEXT Ctx,
+	PCSTR Msg,
+	SIZE_T Length
+) {
+	DEDUPREPEAT Repeat;
+	if (DedupCheck(Logger->pDedup, Ctx->Cpu, Msg, Length, ReadTimestamp(), &Repeat))
+		return TRUE;
+
+	if (!Repeat.Count)
+		return FALSE;
+
+	DFARGS Args;
+	CaptureRepeat(&Args, Repeat.Count, Repeat.Text);
+	SIZE_T PackedSize = DFPackedSize(&Args);
+
+	SIZE_T Size = sizeof(KLOGGER_RECORD) + PackedSize;
+	SIZE_T Space = RBRecordSpace(Size);
+	PVOID pSpan;
+	if (!Space || LogReserve(Logger, Ctx, Space, &pSpan) != ERROR_SUCCESS) {
+		PRINGLOSS Loss = &(Logger->Losses[Ctx->Ring]);
+		InterlockedExchangeAdd64(&(Loss->Bytes), (LONGLONG)Repeat.Count * Repeat.Length);
+		InterlockedExchangeAdd64(&(Loss->Messages), (LONGLONG)Repeat.Count);
+		return FALSE;
+	}
+
+	PKLOGGER_RECORD Record = (PKLOGGER_RECORD)RBSpanRecord(&pSpan, Size);
+	FillRecord(Ctx, Record, KLOGGER_RING_FORMAT, PackedSize, ReadTimestamp());
+	DFPack(REPEAT_FORMAT, &Args, Record + 1);
+	RBCommit(Record, Size);
+
+	return FALSE;
+}
+
+// stays on this processor's ring until LogEnd, records have to be
+// reserved, filled and committed in between
+static VOID
+LogEnter(
+	PKLOGGER Logger,
+	SIZE_T Length,
+	ULONG Count,
+	PLOGCONTEXT Ctx
+) {
+	KIRQL Irql = KeGetCurrentIrql();
+	Ctx->Irql = Irql;
+	Ctx->OldIrql = Irql;
+	if (Irql < DISPATCH_LEVEL)
+		KeRaiseIrql(DISPATCH_LEVEL, &(Ctx->OldIrql));
+
+	ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+	Ctx->Cpu = Cpu;
+	Ctx->Length = Length;
+	Ctx->Count = Count;
+	Ctx->Record = NULL;
+	Ctx->IsRepeat = FALSE;
+	Ctx->Ring = CurrentRing(Logger, Cpu);
+	Ctx->pRingBuf = Logger->pRingBufs[Ctx->Ring];
+
+	if (Logger->Losses[Ctx->Ring].Messages)
+		LogLoss(Logger, Ctx);
+}
+
+// reserves the record with Length bytes of message, on success it has to be
+// filled and passed to LogEnd without leaving the processor. With DEDUP_MS a repeat of
+// Msg is counted instead: ERROR_SUCCESS with no record, Ctx->IsRepeat is set
+static INT
+LogBegin(
+	PKLOGGER Logger,
+	UCHAR Type,
+	PCSTR Msg,
+	SIZE_T Length,
+	PLOGCONTEXT Ctx
+) {
+	LogEnter(Logger, Length, 1, Ctx);
+
+	if (Msg && Logger->pDedup && LogRepeat(Logger, Ctx, Msg, Length)) {
+		Ctx->IsRepeat = TRUE;
+		return ERROR_SUCCESS;
+	}
+
+	SIZE_T Size = sizeof(KLOGGER_RECORD) + Length;
+	SIZE_T Space = RBRecordSpace(Size);
+	if (!Space)
+		return ERROR_INSUFFICIENT_BUFFER;
+
+	PVOID pSpan;
+	int Err = LogReserve(Logger, Ctx, Space, &pSpan);
+	if (Err == ERROR_SUCCESS) {
+		Ctx->Record = (PKLOGGER_RECORD)RBSpanRecord(&pSpan, Size);
+		FillRecord(Ctx, Ctx->Record, Type, Length, ReadTimestamp());
+	}
+
+	return Err;
+}
+
+// commits the record if Err is ERROR_SUCCESS and wakes the flushing thread if needed
+static INT
+LogEnd(
+	PKLOGGER Logger,
+	PLOGCONTEXT Ctx,
+	INT Err
+) {
+	if (Err == ERROR_SUCCESS && Ctx->Record)
+		RBCommit(Ctx->Record, sizeof(KLOGGER_RECORD) + Ctx->Record->Length);
+
+	// still on the processor the counters belong to
+	PCPUSTATS Stats = &(Logger->CpuStats[Ctx->Cpu % Logger->StatsCount]);
+	if (Ctx->IsRepeat) {
+		Stats->Suppressed += Ctx->Count;
+	} else if (Err == ERROR_SUCCESS) {
+		Stats->Messages += Ctx->Count;
+		Stats->Bytes += Ctx->Length;
+	} else {
+		Stats->Dropped += Ctx->Count;
+		Stats->DroppedBytes += Ctx->Length;
+
+		// reported by the next writer that gets space on this ring
+		PRINGLOSS Loss = &(Logger->Losses[Ctx->Ring]);
+		InterlockedExchangeAdd64(&(Loss->Bytes), (LONGLONG)Ctx->Length);
+		InterlockedExchangeAdd64(&(Loss->Messages), (LONGLONG)Ctx->Count);
+	}
+
+	int LoadFactor = RBLoadFactor(Ctx->pRingBuf);
+	if ((ULONG)LoadFactor > Stats->MaxLoadFactor)
+		Stats->MaxLoadFactor = (ULONG)LoadFactor;
+
+	if (Ctx->OldIrql < DISPATCH_LEVEL)
+		KeLowerIrql(Ctx->OldIrql);
+
+	if (((LoadFactor >= Logger->Control.Threshold) || (Err == ERROR_INSUFFICIENT_BUFFER)))
+		WakeFlushingThread(Logger, LoadFactor);
+
+	return Err;
+}
+
+INT 
+KLoggerLog(
+	PCSTR LogMsg
+) {
+	return KLoggerLogNTo(gKLogger, LogMsg, StrScanLength(LogMsg));
+}
+
+INT
+KLoggerLogTo(
+	PKLOGGER Logger,
+	PCSTR LogMsg
+) {
+	return KLoggerLogNTo(Logger, LogMsg, StrScanLength(LogMsg));
+}
+
+// counted message, does not have to be null-terminated
+INT
+KLoggerLogN(
+	PCSTR LogMsg,
+	SIZE_T Length
+) {
+	return KLoggerLogNTo(gKLogger, LogMsg, Length);
+}
+
+INT
+KLoggerLogNTo(
+	PKLOGGER Logger,
+	PCSTR LogMsg,
+	SIZE_T Length
+) {
+	LOGCONTEXT Ctx;
+	int Err = LogBegin(Logger, KLOGGER_REC_MESSAGE, LogMsg, Length, &Ctx);
+	if (Err == ERROR_SUCCESS && Ctx.Record)
+		RtlCopyMemory(Ctx.Record + 1, LogMsg, Length);
+
+	return LogEnd(Logger, &Ctx, Err);
+}
+
+// one reservation and one flush check for the whole batch. It is seen by the flushing thread
+// all at once, contiguous and in order: the first record is committed last and the reader
+// stops at the first uncommitted one
+INT
+KLoggerLogV(
+	const KLOGGER_ENTRY* Entries,
+	ULONG Count
+) {
+	return KLoggerLogVTo(gKLogger, Entries, Count);
+}
+
+INT
+KLoggerLogVTo(
+	PKLOGGER Logger,
+	const KLOGGER_ENTRY* Entries,
+	ULONG Count
+) {
+	if (!Entries || !Count)
+		return ERROR_BAD_ARGUMENTS;
+
+	SIZE_T Space = 0;
+	SIZE_T Length = 0;
+	for (ULONG i = 0; i < Count; ++i) {
+		SIZE_T RecordSpace = RBRecordSpace(sizeof(KLOGGER_RECORD) + Entries[i].Length);
+		if (!RecordSpace)
+			return ERROR_INSUFFICIENT_BUFFER;
+
+		Space += RecordSpace;
+		Length += Entries[i].Length;
+	}
+
+	LOGCONTEXT Ctx;
+	LogEnter(Logger, Length, Count, &Ctx);
+
+	PVOID pSpan;
+	int Err = LogReserve(Logger, &Ctx, Space, &pSpan);
+	if (Err == ERROR_SUCCESS) {
+		LONGLONG Timestamp = ReadTimestamp();
+		for (ULONG i = 0; i < Count; ++i) {
+			SIZE_T Size = sizeof(KLOGGER_RECORD) + Entries[i].Length;
+			PKLOGGER_RECORD Record = (PKLOGGER_RECORD)RBSpanRecord(&pSpan, Size);
+			FillRecord(&Ctx, Record, KLOGGER_REC_MESSAGE, Entries[i].Length, Timestamp);
+			RtlCopyMemory(Record + 1, Entries[i].Msg, Entries[i].Length);
+
+			if (i) {
+				RBCommit(Record, Size);
+			} else {
+				Ctx.Record = Record;
+			}
+		}
+	}
+
+	return LogEnd(Logger, &Ctx, Err);
+}
+
+static INT
+LogFormat(
+	PKLOGGER Logger,
+	PCSTR Format,
+	va_list Ap
+) {
+	DFARGS Args;
+	DFCapture(Format, Ap, &Args);
+
+	SIZE_T Length = DFPackedSize(&Args);
+
+	LOGCONTEXT Ctx;
+	int Err = LogBegin(Logger, KLOGGER_RING_FORMAT, NULL, Length, &Ctx);
+	if (Err == ERROR_SUCCESS)
+		DFPack(Format, &Args, Ctx.Record + 1);
+
+	return LogEnd(Logger, &Ctx, Err);
+}
+
+// Format has to stay valid until the message is flushed (a string literal),
+// %s arguments are copied
+INT
+KLoggerLogf(
+	PCSTR Format,
+	...
+) {
+	va_list Ap;
+	va_start(Ap, Format);
+	INT Err = LogFormat(gKLogger, Format, Ap);
+	va_end(Ap);
+
+	return Err;
+}
+
+INT
+KLoggerLogfTo(
+	PKLOGGER Logger,
+	PCSTR Format,
+	...
+) {
+	va_list Ap;
+	va_start(Ap, Format);
+	INT Err = LogFormat(Logger, Format, Ap);
+	va_end(Ap);
+
+	return Err;
+}
+
+// PASSIVE_LEVEL, usually at load. *pId is the ID for KLoggerLogId, the same for the same text
+INT
+KLoggerRegister(
+	PCSTR Format,
+	PULONG pId
+) {
+	return CatalogRegister(gCatalog, Format, pId);
+}
+
+// KLOGGER_MESSAGE entries from First up to Last, see KLOGGER_DEFINE_MESSAGE. Gaps the linker
+// left between them are zero and skipped. Returns the first error, the rest are still registered
+INT
+KLoggerRegisterCatalog(
+	PKLOGGER_MESSAGE First,
+	PKLOGGER_MESSAGE Last
+) {
+	INT Ret = ERROR_SUCCESS;
+	for (PKLOGGER_MESSAGE Message = First; Message < Last; ++Message) {
+		if (!Message->Format)
+			continue;
+
+		INT Err = CatalogRegister(gCatalog, Message->Format, &(Message->Id));
+		if (Err != ERROR_SUCCESS && Ret == ERROR_SUCCESS)
+			Ret = Err;
+	}
+
+	return Ret;
+}
+
+static INT
+LogId(
+	PKLOGGER Logger,
+	ULONG Id,
+	va_list Ap
+) {
+	BOOLEAN HasArgs;
+	PCSTR Format = CatalogFormat(gCatalog, Id, &HasArgs);
+	if (!Format)
+		return ERROR_BAD_ARGUMENTS;
+
+	DFARGS Args;
+	Args.Count = 0;
+	Args.StringsSize = 0;
+	if (HasArgs)
+		DFCapture(Format, Ap, &Args);
+
+	// would not fit a formatted message either, formatted and truncated as KLoggerLogf ones
+	if (Args.StringsSize > FORMAT_BUF_SIZE)
+		return LogFormat(Logger, Format, Ap);
+
+	SIZE_T Length = sizeof(KLOGGER_ID_ARGS) + DFArgsSize(&Args);
+
+	LOGCONTEXT Ctx;
+	int Err = LogBegin(Logger, KLOGGER_RING_ID, NULL, Length, &Ctx);
+	if (Err == ERROR_SUCCESS) {
+		PKLOGGER_ID_ARGS IdArgs = (PKLOGGER_ID_ARGS)(Ctx.Record + 1);
+		IdArgs->Id = Id;
+		IdArgs->Count = Args.Count;
+		DFPackArgs(&Args, IdArgs + 1);
+	}
+
+	return LogEnd(Logger, &Ctx, Err);
+}
+
+// a registered message: its ID and arguments go to the ring and the file, the
+// format is written to the file once. Arguments are taken as by KLoggerLogf
+INT
+KLoggerLogId(
+	ULONG Id,
+	...
+) {
+	va_list Ap;
+	va_start(Ap, Id);
+	INT Err = LogId(gKLogger, Id, Ap);
+	va_end(Ap);
+
+	return Err;
+}
+
+INT
+KLoggerLogIdTo(
+	PKLOGGER Logger,
+	ULONG Id,
+	...
+) {
+	va_list Ap;
+	va_start(Ap, Id);
+	INT Err = LogId(Logger, Id, Ap);
+	va_end(Ap);
+
+	return Err;
+}
+
+// the flushing thread swaps in rings of BufSize bytes on its next pass, writers go on
+// meanwhile. With MAX_BUF_SIZE automatic resizing does not shrink them below BufSize.
+// Live rings keep their size, readers have them mapped
+INT
+KLoggerResize(
+	SIZE_T BufSize
+) {
+	return KLoggerResizeOf(gKLogger, BufSize);
+}
+
+INT
+KLoggerResizeOf(
+	PKLOGGER Logger,
+	SIZE_T BufSize
+) {
+	if (!Logger || !BufSize)
+		return ERROR_BAD_ARGUMENTS;
+
+	if (Logger->IsLive)
+		return ERROR_NOT_SUPPORTED;
+
+	InterlockedExchange64(&(Logger->Resize.Requested), (LONGLONG)BufSize);
+	InterlockedExchange(&(Logger->IsFlushRequested), 1);
+	KeSetEvent(&(gFlusher.WakeEvent), 0, FALSE);
+
+	return ERROR_SUCCESS;
+}
+
+// takes effect for the next message, KLOGGER_LOG callers read the mask directly
+VOID
+KLoggerSetMask(
+	ULONG Mask
+) {
+	InterlockedExchange((LONG volatile*)&KLoggerMask, (LONG)Mask);
+}
+
+static ULONGLONG
+TicksToUs(
+	PKLOGGER Logger,
+	LONGLONG Ticks
+) {
+	return (ULONGLONG)(Ticks / Logger->Frequency * 1000000ll + Ticks % Logger->Frequency * 1000000ll / Logger->Frequency);
+}
+
+// counters since KLoggerInit, read without stopping writers: a snapshot may be slightly behind
+INT
+KLoggerGetStats(
+	PKLOGGER_STATS pStats
+) {
+	return KLoggerGetStatsOf(gKLogger, pStats);
+}
+
+// since KLoggerCreate
+INT
+KLoggerGetStatsOf(
+	PKLOGGER Logger,
+	PKLOGGER_STATS pStats
+) {
+	if (!Logger || !pStats)
+		return ERROR_BAD_ARGUMENTS;
+
+	RtlZeroMemory(pStats, sizeof(KLOGGER_STATS));
+	for (ULONG i = 0; i < Logger->StatsCount; ++i) {
+		PCPUSTATS Stats = &(Logger->CpuStats[i]);
+		pStats->MessagesLogged += Stats->Messages;
+		pStats->BytesLogged += Stats->Bytes;
+		pStats->MessagesDropped += Stats->Dropped;
+		pStats->BytesDropped += Stats->DroppedBytes;
+		pStats->MessagesOverwritten += Stats->Overwritten;
+		pStats->BytesOverwritten += Stats->OverwrittenBytes;
+		pStats->MessagesSuppressed += Stats->Suppressed;
+		if (Stats->MaxLoadFactor > pStats->MaxLoadFactor)
+			pStats->MaxLoadFactor = Stats->MaxLoadFactor;
+	}
+
+	PFLUSHSTATS Flush = &(Logger->FlushStats);
+	pStats->DpcFlushes = Flush->DpcFlushes;
+	pStats->TimeoutFlushes = Flush->TimeoutFlushes;
+	pStats->FlushedChunks = Flush->Chunks;
+	pStats->FlushedBytes = Flush->Bytes;
+	pStats->FlushTimeUs = TicksToUs(Logger, Flush->Ticks);
+	pStats->MaxFlushTimeUs = TicksToUs(Logger, Flush->MaxTicks);
+	if (pStats->FlushTimeUs) {
+		pStats->FlushBytesPerSec = pStats->FlushedBytes / pStats->FlushTimeUs * 1000000ull +
+			pStats->FlushedBytes % pStats->FlushTimeUs * 1000000ull / pStats->FlushTimeUs;
+	}
+
+	PFLUSHCONTROL Control = &(Logger->Control);
+	pStats->FlushThreshold = (ULONG)Control->Threshold;
+	pStats->FlushTimeoutMs = (ULONG)(Control->Timeout / 10000);
+	pStats->IngestBytesPerSec = Control->IngestRate;
+	pStats->DrainBytesPerSec = Control->DrainRate;
+	pStats->RingBufSize = Logger->Resize.Size;
+	pStats->RingResizes = Logger->Resize.Resizes;
+
+	return ERROR_SUCCESS;
+}
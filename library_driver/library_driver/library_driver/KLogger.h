@@ -3,9 +3,110 @@
 #include <ntddk.h>
 
 #define LOG_FILE_NAME L"\\??\\C:\\klogger.log"
+#define LOG_SEGMENT_NAME L"\\??\\C:\\klogger" // segments are klogger.000001.log, ...
 
 typedef struct KLogger* PKLOGGER;
 
+// levels, from the least severe. Callers may define KLOGGER_COMPILE_LEVEL before including
+// this header: macros of lower levels compile to nothing
+#define KLOGGER_LEVEL_TRACE 0
+#define KLOGGER_LEVEL_DEBUG 1
+#define KLOGGER_LEVEL_INFO 2
+#define KLOGGER_LEVEL_WARNING 3
+#define KLOGGER_LEVEL_ERROR 4
+
+// runtime mask, KLoggerMask: bits 0-4 enable levels, bits 8-31 categories 0-23,
+// a message is logged if both its level and its category are enabled.
+// Categories are taken modulo KLOGGER_CATEGORY_COUNT, so one out of range shares
+// the bit of another category instead of enabling a level or shifting past bit 31
+#define KLOGGER_CATEGORY_COUNT 24
+#define KLOGGER_MASK_LEVEL(Level) (1ul << (Level))
+#define KLOGGER_MASK_CATEGORY(Category) (1ul << (8 + (ULONG)(Category) % KLOGGER_CATEGORY_COUNT))
+#define KLOGGER_MASK_DIAGNOSTICS (1ul << 7) // library's own DbgPrint tracing
+#define KLOGGER_MASK_DEFAULT (0xffffff00ul | KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_INFO) | \
+	KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_WARNING) | KLOGGER_MASK_LEVEL(KLOGGER_LEVEL_ERROR))
+
+// what writers do when their ring is full, OVERFLOW_POLICY in the registry
+#define KLOGGER_OVERFLOW_DROP 0 // the message is dropped, a LOSS record in the log tells how many were
+#define KLOGGER_OVERFLOW_OVERWRITE 1 // the oldest messages not being flushed yet are dropped instead
+#define KLOGGER_OVERFLOW_BLOCK 2 // callers at PASSIVE_LEVEL wait up to BLOCK_TIMEOUT_MS, others drop
+
+// settings of a KLoggerCreate logger, zero fields take the defaults of the registry keys
+typedef struct KLoggerConfig {
+	PCWSTR FileName; // full NT path, with no extension if SegmentSizeMb is set
+	SIZE_T BufSize; // of the shared ring
+	SIZE_T PerCpuBufSize; // non-zero - a ring of this size per processor
+	SIZE_T MaxBufSize; // non-zero - rings are resized between their size and this one as the load goes
+	ULONG WriteSlots;
+	ULONG SegmentSizeMb; // zero - a single file
+	ULONG MaxSegments; // zero - all are kept
+	ULONG Compress;
+	ULONG IndexKb; // non-zero - a sidecar index entry every that many KB of the log, for tools/klseek
+	ULONG DedupMs; // non-zero - repeats of a message on a processor within that many ms are counted, not logged
+	ULONG Overflow; // KLOGGER_OVERFLOW_*
+	ULONG BlockTimeoutMs;
+	ULONG FixedFlush; // non-zero - flush threshold and timeout don't adapt
+	ULONG NumaLocal; // non-zero - rings are allocated on the node of the processors writing them
+	PCWSTR LiveName; // non-NULL - rings are shared read-only as sections "<LiveName>.<ring>" for tools/kltail
+} KLOGGER_CONFIG, *PKLOGGER_CONFIG;
+
+// a catalog message: the format is registered once, KLoggerLogId then logs its ID
+// and arguments only. Id is 0 until the format is registered
+typedef struct KLoggerMessage {
+	PCSTR Format;
+	ULONG Id;
+} KLOGGER_MESSAGE, *PKLOGGER_MESSAGE;
+
+// one message of a KLoggerLogV batch, not necessarily null-terminated
+typedef struct KLoggerEntry {
+	PCSTR Msg;
+	SIZE_T Length;
+} KLOGGER_ENTRY, *PKLOGGER_ENTRY;
+
+typedef struct KLoggerStats {
+	ULONGLONG MessagesLogged;
+	ULONGLONG BytesLogged; // of messages as stored in the ring
+	ULONGLONG MessagesDropped; // the ring was full
+	ULONGLONG BytesDropped;
+	ULONGLONG MessagesOverwritten; // OVERFLOW_POLICY 1, oldest ones dropped for new ones
+	ULONGLONG BytesOverwritten;
+	ULONGLONG MessagesSuppressed; // DEDUP_MS repeats, reported by "last message repeated" records
+	ULONG MaxLoadFactor; // highest ring fill seen by a writer, in percents
+	ULONGLONG DpcFlushes; // woken by a writer over the flush threshold
+	ULONGLONG TimeoutFlushes;
+	ULONGLONG FlushedChunks;
+	ULONGLONG FlushedBytes; // written to the log file
+	ULONGLONG FlushTimeUs;
+	ULONGLONG MaxFlushTimeUs; // longest single flush
+	ULONGLONG FlushBytesPerSec; // FlushedBytes over FlushTimeUs
+	ULONG FlushThreshold; // ring fill in percents writers wake the flushing thread at
+	ULONG FlushTimeoutMs; // longest wait of the flushing thread
+	ULONGLONG IngestBytesPerSec; // recent ring bytes per second, drops included
+	ULONGLONG DrainBytesPerSec; // recent ring bytes per second a flush drains
+	ULONGLONG RingBufSize; // of each ring now
+	ULONG RingResizes;
+} KLOGGER_STATS, *PKLOGGER_STATS;
+
 INT KLoggerInit(PUNICODE_STRING RegistryPath);
 VOID KLoggerDeinit();
 INT KLoggerLog(PCSTR log_msg);
+INT KLoggerLogN(PCSTR log_msg, SIZE_T length);
+INT KLoggerLogf(PCSTR format, ...);
+INT KLoggerLogV(const KLOGGER_ENTRY* Entries, ULONG Count);
+INT KLoggerGetStats(PKLOGGER_STATS pStats);
+VOID KLoggerSetMask(ULONG Mask);
+INT KLoggerCreate(PKLOGGER* ppLogger, const KLOGGER_CONFIG* pConfig);
+INT KLoggerDestroy(PKLOGGER Logger);
+INT KLoggerLogTo(PKLOGGER Logger, PCSTR log_msg);
+INT KLoggerLogNTo(PKLOGGER Logger, PCSTR log_msg, SIZE_T length);
+INT KLoggerLogfTo(PKLOGGER Logger, PCSTR format, ...);
+INT KLoggerLogVTo(PKLOGGER Logger, const KLOGGER_ENTRY* Entries, ULONG Count);
+INT KLoggerGetStatsOf(PKLOGGER Logger, PKLOGGER_STATS pStats);
+INT KLoggerResize(SIZE_T BufSize);
+INT KLoggerResizeOf(PKLOGGER Logger, SIZE_T BufSize);
+INT KLoggerRegister(PCSTR Format, PULONG pId);
+INT KLoggerRegisterCatalog(PKLOGGER_MESSAGE First, PKLOGGER_MESSAGE Last);
+INT KLoggerLogId(ULONG Id, ...);
+INT KLoggerLogIdTo(PKLOGGER Logger, ULONG Id, ...);
+
+extern ULONG volatile KLoggerMask;
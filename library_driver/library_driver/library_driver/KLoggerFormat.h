@@ -0,0 +1,194 @@
+#pragma once
+
+// On-disk format of the log file, shared by the driver and the host tools (tools/).
+// The file is a stream of records, each one starts with its type byte:
+//
+//   SESSION  'K' 'L' 'O' 'G' version
+//            written once by KLoggerInit, the file is appended to by every load
+//   SYNC     type varint(timestamp) varint(system time) varint(frequency)
+//            time base, starts every chunk written by the flushing thread
+//   MESSAGE  type irql varint(cpu) varint(zigzag(timestamp - previous)) varint(length) bytes[length]
+//   FRAME    type varint(raw size) varint(payload size) payload
+//            records of a chunk when compression is on. The payload is a run of blocks
+//            varint(raw size) varint(stored size) bytes[stored size], in Compress.h format or
+//            as is if the sizes are equal. Raw bytes of all blocks are whole records, never a FRAME
+//   LOSS     type irql varint(cpu) varint(zigzag(timestamp - previous)) varint(messages) varint(bytes)
+//            messages dropped on a full ring since the previous LOSS of that ring, written
+//            ahead of the next message that fits
+//   CATALOG  type varint(id) varint(length) bytes[length]
+//            format text of a message ID registered with the catalog, IDs are given out by each
+//            load. The whole catalog is written ahead of the first chunk of every file and of
+//            every chunk with an index entry, IDs registered later ahead of the next chunk
+//   ID       type irql varint(cpu) varint(zigzag(timestamp - previous)) varint(id) varint(length) args[length]
+//            message of a catalog format, args are varint(count), count varints of the argument
+//            words (zigzag, as signed) and the %s strings with their '\0', each one as long as its word
+//
+// Timestamps are ticks of the logger's clock at the given frequency: the TSC, or the performance
+// counter if the TSC can't be used. Each SYNC carries the TSC frequency as calibrated when its
+// chunk was written. Previous is the timestamp of the previous record of the chunk, of its SYNC
+// for the first one. System time is taken together with the SYNC timestamp, in 100ns units since 1601.
+// Varints are little-endian base 128, zigzag maps signed deltas to small unsigned values.
+
+#define KLOGGER_FORMAT_VERSION 3 // 2 - LOSS records, 3 - CATALOG and ID records
+
+#define KLOGGER_REC_SESSION 'K'
+#define KLOGGER_REC_SYNC 0x01
+#define KLOGGER_REC_MESSAGE 0x02
+#define KLOGGER_REC_FRAME 0x03
+#define KLOGGER_REC_LOSS 0x04
+#define KLOGGER_REC_CATALOG 0x05
+#define KLOGGER_REC_ID 0x06
+
+#define KLOGGER_SESSION_MAGIC "KLOG"
+#define KLOGGER_SESSION_SIZE 5
+
+#define KLOGGER_VARINT_MAX 10
+#define KLOGGER_SYNC_MAX (1 + 3 * KLOGGER_VARINT_MAX)
+#define KLOGGER_MESSAGE_HEADER_MAX (2 + 3 * KLOGGER_VARINT_MAX)
+#define KLOGGER_FRAME_HEADER_MAX (1 + 2 * KLOGGER_VARINT_MAX)
+#define KLOGGER_BLOCK_HEADER_MAX (2 * KLOGGER_VARINT_MAX)
+#define KLOGGER_LOSS_MAX (2 + 4 * KLOGGER_VARINT_MAX)
+#define KLOGGER_CATALOG_HEADER_MAX (1 + 2 * KLOGGER_VARINT_MAX)
+#define KLOGGER_ID_HEADER_MAX (2 + 4 * KLOGGER_VARINT_MAX)
+
+// Sidecar index "<log file>.idx", written by the flushing thread with INDEX_KB set and read by
+// tools/klseek: 'K' 'L' 'I' 'X' version, then KLOGGER_INDEX_ENTRY records, little-endian. An entry
+// is added for the first chunk written to a log file by a load and then for the first chunk after
+// every INDEX_KB of the file. It points at the CATALOG records written ahead of the chunk, or at its
+// SYNC or FRAME record, so decoding can start there.
+// Sequence counts the messages and LOSS records the load wrote before the chunk, it is 0 on the
+// first entry of every load. SystemTime is that of the first record of the chunk: records are
+// merged by timestamp, but a message committed late can still be older than the chunk's first one
+
+#define KLOGGER_INDEX_MAGIC "KLIX"
+#define KLOGGER_INDEX_HEADER_SIZE 5
+#define KLOGGER_INDEX_VERSION 1
+
+typedef struct KLoggerIndexEntry {
+	unsigned long long Offset; // of the chunk in the log file
+	long long SystemTime; // 100ns units since 1601
+	unsigned long long Sequence;
+} KLOGGER_INDEX_ENTRY, *PKLOGGER_INDEX_ENTRY;
+
+// Rings in memory (RingBuffer.c), what is not flushed yet is recovered from memory images
+// by tools/klrecover, and live rings are followed by tools/kltail. A ring is one allocation,
+// the header then Capacity bytes of records.
+// Header fields at fixed offsets, little-endian:
+//
+//   0    magic[8]  KLOGGER_RING_MAGIC, cleared when the ring is freed
+//   8    u32       version, KLOGGER_RING_VERSION
+//   12   u32       header size, records start there
+//   16   u64       capacity
+//   64   i64       head, monotonic position of the next reservation
+//   128  i64       tail, monotonic position, records before it are released by every
+//                  required reader
+//   152  i64       timestamp, time base of the last flush as in SYNC
+//   160  i64       system time
+//   168  i64       frequency, 0 - not flushed yet
+//   176  i64       release, records before it are being zeroed by a reader
+//
+// Reader positions follow in the header, they are internal to RingBuffer.c.
+//
+// The record at position p starts at offset p % capacity: u32 length (header and alignment
+// included, a multiple of KLOGGER_RING_RECORD_ALIGN), u32 state (payload size <<
+// KLOGGER_RING_SIZE_SHIFT | flags), payload. State 0 - reserved, not committed yet.
+// Payloads are a KLOGGER_RECORD followed by its message.
+//
+// A live reader keeps its own position. A record at p is read once its state is committed,
+// then kept only if p is still at or after both tail and release: records are zeroed and
+// taken by writers again after release and tail pass them
+
+#define KLOGGER_RING_MAGIC "KLOGRING"
+#define KLOGGER_RING_MAGIC_SIZE 8
+#define KLOGGER_RING_VERSION 1
+#define KLOGGER_RING_VERSION_OFFSET 8
+#define KLOGGER_RING_HEADER_SIZE_OFFSET 12
+#define KLOGGER_RING_CAPACITY_OFFSET 16
+#define KLOGGER_RING_HEAD_OFFSET 64
+#define KLOGGER_RING_TAIL_OFFSET 128
+#define KLOGGER_RING_SYNC_OFFSET 152
+#define KLOGGER_RING_RELEASE_OFFSET 176
+
+#define KLOGGER_RING_RECORD_ALIGN 8
+#define KLOGGER_RING_RECORD_HEADER_SIZE 8
+#define KLOGGER_RING_COMMITTED 0x1
+#define KLOGGER_RING_PADDING 0x2
+#define KLOGGER_RING_SIZE_SHIFT 8
+
+// ring-only record type: the message is a packed format with its arguments
+// (DeferredFormat.h), the flushing thread formats it into KLOGGER_REC_MESSAGE
+#define KLOGGER_RING_FORMAT 0x80
+
+// ring-only record type: a catalog message, KLOGGER_ID_ARGS followed by Count argument
+// words and the %s strings. Nothing in it points into driver memory
+#define KLOGGER_RING_ID 0x81
+
+// every message in a ring is prefixed with it, rings are merged by Timestamp.
+// The flushing thread encodes it into the compact file format above
+typedef struct KLoggerRecord {
+	long long Timestamp;
+	unsigned int Length; // of the message that follows
+	unsigned char Type;
+	unsigned char Irql;
+	unsigned short Cpu;
+} KLOGGER_RECORD, *PKLOGGER_RECORD;
+
+// ring payload of a KLOGGER_REC_LOSS record
+typedef struct KLoggerLoss {
+	unsigned long long Messages;
+	unsigned long long Bytes;
+} KLOGGER_LOSS, *PKLOGGER_LOSS;
+
+// ring payload of a KLOGGER_RING_ID record
+typedef struct KLoggerIdArgs {
+	unsigned int Id;
+	unsigned int Count;
+} KLOGGER_ID_ARGS, *PKLOGGER_ID_ARGS;
+
+static __inline unsigned char*
+KLoggerPutVarint(
+	unsigned char* p,
+	unsigned long long v
+) {
+	while (v >= 0x80) {
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+
+	return p;
+}
+
+// NULL if the varint is truncated or too long
+static __inline const unsigned char*
+KLoggerGetVarint(
+	const unsigned char* p,
+	const unsigned char* End,
+	unsigned long long* v
+) {
+	unsigned long long Result = 0;
+	for (unsigned Shift = 0; p < End && Shift < 64; Shift += 7) {
+		unsigned char Byte = *p++;
+		Result |= (unsigned long long)(Byte & 0x7f) << Shift;
+		if (!(Byte & 0x80)) {
+			*v = Result;
+			return p;
+		}
+	}
+
+	return 0;
+}
+
+static __inline unsigned long long
+KLoggerZigZag(
+	long long v
+) {
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static __inline long long
+KLoggerUnZigZag(
+	unsigned long long v
+) {
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
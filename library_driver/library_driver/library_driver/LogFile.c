@@ -0,0 +1,699 @@
+#include "LogFile.h"
+#include "KLoggerFormat.h"
+
+#include <winerror.h>
+
+#define LOG_NAME_MAX 260
+#define LOG_SEGMENT_SUFFIX L".log"
+#define LOG_SEGMENT_DIGITS 6
+#define LOG_INDEX_SUFFIX L".idx"
+#define LOG_INDEX_SUFFIX_LENGTH 4
+#define LOG_LIST_BUF_SIZE 4096
+
+// sidecar index of the open log file, written by the flushing thread
+typedef struct LogIndex {
+	HANDLE FileHandle; // NULL - no index
+	LONGLONG Offset; // of the next entry
+	LONGLONG Indexed; // log offset of the last entry, -1 - none in this file yet
+	LOGWRITE Write;
+	KLOGGER_INDEX_ENTRY Entry; // being written
+} LOGINDEX, *PLOGINDEX;
+
+typedef struct LogFile {
+	HANDLE FileHandle;
+	LONGLONG Offset; // of the next write, the end of the file
+	LOGWRITE SyncWrite;
+
+	ULONGLONG SegmentSize; // 0 - no segments
+	ULONG MaxSegments; // 0 - all are kept
+	ULONG Segment; // number of the open one
+	WCHAR Name[LOG_NAME_MAX];
+
+	ULONG IndexInterval; // bytes, 0 - no index
+	LOGINDEX Index;
+} LOGFILE;
+
+
+INT
+LogWriteInit(
+	PLOGWRITE Write
+) {
+	OBJECT_ATTRIBUTES ObjAttr;
+	InitializeObjectAttributes(&ObjAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	NTSTATUS Status = ZwCreateEvent(&(Write->Event), EVENT_ALL_ACCESS, &ObjAttr, NotificationEvent, FALSE);
+	if (!NT_SUCCESS(Status)) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	Write->Status = STATUS_SUCCESS;
+	Write->IsPending = FALSE;
+
+	return ERROR_SUCCESS;
+}
+
+VOID
+LogWriteDeinit(
+	PLOGWRITE Write
+) {
+	LogWriteWait(Write);
+	ZwClose(Write->Event);
+}
+
+// "<Name>.<Segment>.log"
+static VOID
+SegmentName(
+	PLOGFILE LogFile,
+	ULONG Segment,
+	PWCHAR pName
+) {
+	SIZE_T Length = 0;
+	while (LogFile->Name[Length]) {
+		pName[Length] = LogFile->Name[Length];
+		Length++;
+	}
+
+	pName[Length++] = L'.';
+	for (INT i = LOG_SEGMENT_DIGITS - 1; i >= 0; --i) {
+		pName[Length + i] = (WCHAR)(L'0' + Segment % 10);
+		Segment /= 10;
+	}
+	Length += LOG_SEGMENT_DIGITS;
+
+	PCWSTR Suffix = LOG_SEGMENT_SUFFIX;
+	while (*Suffix) {
+		pName[Length++] = *Suffix++;
+	}
+	pName[Length] = L'\0';
+}
+
+static VOID
+InitFileAttributes(
+	POBJECT_ATTRIBUTES pObjAttr,
+	PUNICODE_STRING pUniName,
+	PCWSTR FileName
+) {
+	RtlInitUnicodeString(pUniName, FileName);
+
+	InitializeObjectAttributes(
+		pObjAttr,
+		pUniName,
+		OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+		NULL,
+		NULL
+	);
+}
+
+// "<FileName>.idx"
+static VOID
+IndexName(
+	PCWSTR FileName,
+	PWCHAR pName
+) {
+	SIZE_T Length = 0;
+	while (FileName[Length] && Length < LOG_NAME_MAX - LOG_INDEX_SUFFIX_LENGTH - 1) {
+		pName[Length] = FileName[Length];
+		Length++;
+	}
+
+	PCWSTR Suffix = LOG_INDEX_SUFFIX;
+	while (*Suffix) {
+		pName[Length++] = *Suffix++;
+	}
+	pName[Length] = L'\0';
+}
+
+static VOID
+WriteAt(
+	HANDLE FileHandle,
+	PLOGWRITE Write,
+	PLONGLONG pOffset,
+	PVOID Buf,
+	SIZE_T Length
+) {
+	LARGE_INTEGER ByteOffset;
+	ByteOffset.QuadPart = *pOffset;
+
+	NTSTATUS Status = ZwWriteFile(
+		FileHandle,
+		Write->Event,
+		NULL,
+		NULL,
+		&(Write->IoStatusBlock),
+		Buf,
+		(ULONG)Length,
+		&ByteOffset,
+		NULL
+	);
+
+	// a write that failed right away wrote nothing, the next one takes its place so the file
+	// has no hole. STATUS_PENDING is a success status
+	if (NT_SUCCESS(Status)) {
+		*pOffset += Length;
+	}
+
+	Write->IsPending = (Status == STATUS_PENDING);
+	Write->Status = Status;
+}
+
+// cuts the file at Offset
+static INT
+SetEnd(
+	HANDLE FileHandle,
+	LONGLONG Offset
+) {
+	IO_STATUS_BLOCK IoStatusBlock;
+	FILE_END_OF_FILE_INFORMATION Info;
+	Info.EndOfFile.QuadPart = Offset;
+
+	NTSTATUS Status = ZwSetInformationFile(
+		FileHandle,
+		&IoStatusBlock,
+		&Info,
+		sizeof(Info),
+		FileEndOfFileInformation
+	);
+
+	return NT_SUCCESS(Status) ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+}
+
+// waits for the index entry in flight. One that failed after it was started is the last
+// write to the index, the next entry takes its place
+static VOID
+WaitIndex(
+	PLOGINDEX Index
+) {
+	BOOLEAN IsPending = Index->Write.IsPending;
+	if (!NT_SUCCESS(LogWriteWait(&(Index->Write)))) {
+		DbgPrint("Error: can't write to log index, return code %d\n", Index->Write.Status);
+		if (IsPending)
+			Index->Offset -= sizeof(Index->Entry);
+		Index->Write.Status = STATUS_SUCCESS;
+	}
+}
+
+// the single log file is appended to, a segment is created anew with the segment size as its
+// allocation size. That only reserves clusters, the end of file stays at what was written
+static INT
+OpenFile(
+	PLOGFILE LogFile,
+	PCWSTR FileName,
+	ULONGLONG SegmentSize,
+	PHANDLE pFileHandle,
+	PLONGLONG pOffset
+) {
+	UNICODE_STRING UniName;
+	OBJECT_ATTRIBUTES ObjAttr;
+	IO_STATUS_BLOCK IoStatusBlock;
+	InitFileAttributes(&ObjAttr, &UniName, FileName);
+
+	LARGE_INTEGER AllocationSize;
+	AllocationSize.QuadPart = (LONGLONG)SegmentSize;
+
+	// no FILE_SYNCHRONOUS_IO_* - writes are asynchronous and go to explicit offsets.
+	// Shared for reading, so kldecode and klseek can read a log that is being written
+	NTSTATUS Status = ZwCreateFile(
+		pFileHandle,
+		FILE_WRITE_DATA,
+		&ObjAttr,
+		&IoStatusBlock,
+		SegmentSize ? &AllocationSize : NULL,
+		FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		LogFile->SegmentSize ? FILE_OVERWRITE_IF : FILE_OPEN_IF,
+		FILE_NON_DIRECTORY_FILE,
+		NULL,
+		0
+	);
+
+	if (!NT_SUCCESS(Status)) {
+		return ERROR_CANNOT_MAKE;
+	}
+
+	FILE_STANDARD_INFORMATION Info;
+	Status = ZwQueryInformationFile(
+		*pFileHandle,
+		&IoStatusBlock,
+		&Info,
+		sizeof(Info),
+		FileStandardInformation
+	);
+
+	if (!NT_SUCCESS(Status)) {
+		ZwClose(*pFileHandle);
+		return ERROR_CANNOT_MAKE;
+	}
+
+	*pOffset = Info.EndOfFile.QuadPart;
+	return ERROR_SUCCESS;
+}
+
+// the index follows its log file: appended to or created anew with it. The log goes on
+// without an index if it can't be opened
+static VOID
+OpenIndex(
+	PLOGFILE LogFile,
+	PCWSTR FileName
+) {
+	WCHAR Name[LOG_NAME_MAX];
+	PLOGINDEX Index = &(LogFile->Index);
+
+	Index->FileHandle = NULL;
+	Index->Indexed = -1;
+	if (!LogFile->IndexInterval) {
+		return;
+	}
+
+	IndexName(FileName, Name);
+	if (OpenFile(LogFile, Name, 0, &(Index->FileHandle), &(Index->Offset)) != ERROR_SUCCESS) {
+		DbgPrint("Error: can't open log index, the log is not indexed\n");
+		Index->FileHandle = NULL;
+		return;
+	}
+
+	if (!Index->Offset) {
+		UCHAR Header[KLOGGER_INDEX_HEADER_SIZE] = KLOGGER_INDEX_MAGIC;
+		Header[KLOGGER_INDEX_HEADER_SIZE - 1] = KLOGGER_INDEX_VERSION;
+
+		WriteAt(Index->FileHandle, &(Index->Write), &(Index->Offset), Header, sizeof(Header));
+		if (!NT_SUCCESS(LogWriteWait(&(Index->Write)))) {
+			DbgPrint("Error: can't write log index header, the log is not indexed\n");
+			ZwClose(Index->FileHandle);
+			Index->FileHandle = NULL;
+			Index->Write.Status = STATUS_SUCCESS;
+		}
+	}
+}
+
+static VOID
+CloseIndex(
+	PLOGFILE LogFile
+) {
+	if (LogFile->Index.FileHandle) {
+		WaitIndex(&(LogFile->Index));
+		ZwClose(LogFile->Index.FileHandle);
+		LogFile->Index.FileHandle = NULL;
+	}
+}
+
+static VOID
+DeleteSegment(
+	PCWSTR Name
+) {
+	UNICODE_STRING UniName;
+	OBJECT_ATTRIBUTES ObjAttr;
+	WCHAR IdxName[LOG_NAME_MAX];
+
+	InitFileAttributes(&ObjAttr, &UniName, Name);
+	ZwDeleteFile(&ObjAttr);
+
+	IndexName(Name, IdxName);
+	InitFileAttributes(&ObjAttr, &UniName, IdxName);
+	ZwDeleteFile(&ObjAttr);
+}
+
+// highest number of the "<FileName>.NNNNNN.log" segments in the directory of FileName,
+// 0 - none or the directory can't be listed. The ones numbered up to Prune are deleted
+// with their index on the way, whatever left them behind. PASSIVE_LEVEL
+static ULONG
+ScanSegments(
+	PCWSTR FileName,
+	ULONG Prune
+) {
+	WCHAR Dir[LOG_NAME_MAX];
+	WCHAR Pattern[LOG_NAME_MAX];
+	WCHAR Path[LOG_NAME_MAX];
+	ULONG Last = 0;
+
+	SIZE_T Length = 0;
+	SIZE_T NameStart = 0;
+	while (FileName[Length] && Length < LOG_NAME_MAX - LOG_SEGMENT_DIGITS - 6) {
+		Dir[Length] = FileName[Length];
+		if (FileName[Length] == L'\\') {
+			NameStart = Length + 1;
+		}
+		Length++;
+	}
+
+	// "\??\C:" would be the volume, its root is "\??\C:\"
+	if (!NameStart) {
+		return 0;
+	}
+	Dir[NameStart] = L'\0';
+
+	SIZE_T NameLength = Length - NameStart;
+	for (SIZE_T i = 0; i < NameLength; ++i) {
+		Pattern[i] = FileName[NameStart + i];
+	}
+	Pattern[NameLength] = L'.';
+	Pattern[NameLength + 1] = L'*';
+	Pattern[NameLength + 2] = L'\0';
+
+	UNICODE_STRING UniName;
+	OBJECT_ATTRIBUTES ObjAttr;
+	IO_STATUS_BLOCK IoStatusBlock;
+	HANDLE DirHandle;
+	InitFileAttributes(&ObjAttr, &UniName, Dir);
+
+	NTSTATUS Status = ZwCreateFile(
+		&DirHandle,
+		FILE_LIST_DIRECTORY | SYNCHRONIZE,
+		&ObjAttr,
+		&IoStatusBlock,
+		NULL,
+		0,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_OPEN,
+		FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+		NULL,
+		0
+	);
+
+	if (!NT_SUCCESS(Status)) {
+		return 0;
+	}
+
+	PUCHAR Buf = (PUCHAR)ExAllocatePool(NonPagedPool, LOG_LIST_BUF_SIZE);
+	if (!Buf) {
+		ZwClose(DirHandle);
+		return 0;
+	}
+
+	UNICODE_STRING UniPattern;
+	RtlInitUnicodeString(&UniPattern, Pattern);
+
+	// names are checked in full, the pattern only narrows the listing
+	SIZE_T SegmentLength = NameLength + 1 + LOG_SEGMENT_DIGITS + (sizeof(LOG_SEGMENT_SUFFIX) / sizeof(WCHAR) - 1);
+	BOOLEAN IsFirst = TRUE;
+	while (TRUE) {
+		Status = ZwQueryDirectoryFile(
+			DirHandle,
+			NULL,
+			NULL,
+			NULL,
+			&IoStatusBlock,
+			Buf,
+			LOG_LIST_BUF_SIZE,
+			FileNamesInformation,
+			FALSE,
+			IsFirst ? &UniPattern : NULL,
+			IsFirst
+		);
+		IsFirst = FALSE;
+
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		PFILE_NAMES_INFORMATION Info = (PFILE_NAMES_INFORMATION)Buf;
+		while (TRUE) {
+			PCWSTR Name = Info->FileName;
+			if (Info->FileNameLength / sizeof(WCHAR) == SegmentLength) {
+				ULONG Segment = 0;
+				SIZE_T i = NameLength + 1;
+				for (; i < NameLength + 1 + LOG_SEGMENT_DIGITS && Name[i] >= L'0' && Name[i] <= L'9'; ++i) {
+					Segment = Segment * 10 + (ULONG)(Name[i] - L'0');
+				}
+
+				BOOLEAN IsSegment = (i == NameLength + 1 + LOG_SEGMENT_DIGITS);
+				if (IsSegment && Segment > Last) {
+					Last = Segment;
+				}
+
+				if (IsSegment && Segment && Segment <= Prune) {
+					for (SIZE_T j = 0; j < NameStart; ++j) {
+						Path[j] = FileName[j];
+					}
+					for (SIZE_T j = 0; j < SegmentLength; ++j) {
+						Path[NameStart + j] = Name[j];
+					}
+					Path[NameStart + SegmentLength] = L'\0';
+					DeleteSegment(Path);
+				}
+			}
+
+			if (!Info->NextEntryOffset) {
+				break;
+			}
+			Info = (PFILE_NAMES_INFORMATION)((PUCHAR)Info + Info->NextEntryOffset);
+		}
+	}
+
+	ExFreePool(Buf);
+	ZwClose(DirHandle);
+
+	return Last;
+}
+
+ULONG
+LogFileLastSegment(
+	PCWSTR FileName
+) {
+	return ScanSegments(FileName, 0);
+}
+
+// only MaxSegments up to the open one are kept, older ones a crash or a change
+// of MAX_SEGMENTS left behind included
+static VOID
+PruneSegments(
+	PLOGFILE LogFile
+) {
+	if (LogFile->MaxSegments && LogFile->Segment > LogFile->MaxSegments)
+		ScanSegments(LogFile->Name, LogFile->Segment - LogFile->MaxSegments);
+}
+
+INT
+LogFileOpen(
+	PLOGFILE* pLogFile,
+	PCWSTR FileName,
+	ULONGLONG SegmentSize,
+	ULONG MaxSegments,
+	ULONG Segment,
+	ULONG IndexInterval
+) {
+	INT Err = ERROR_SUCCESS;
+	WCHAR Name[LOG_NAME_MAX];
+
+	PLOGFILE LogFile = (PLOGFILE)ExAllocatePool(NonPagedPool, sizeof(LOGFILE));
+	if (!LogFile) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_mem;
+	}
+
+	SIZE_T Length = 0;
+	while (FileName[Length] && Length < LOG_NAME_MAX - LOG_SEGMENT_DIGITS - 6) {
+		LogFile->Name[Length] = FileName[Length];
+		Length++;
+	}
+	LogFile->Name[Length] = L'\0';
+
+	LogFile->SegmentSize = SegmentSize;
+	LogFile->MaxSegments = MaxSegments;
+	LogFile->Segment = Segment;
+	LogFile->IndexInterval = IndexInterval;
+
+	Err = LogWriteInit(&(LogFile->SyncWrite));
+	if (Err != ERROR_SUCCESS) {
+		goto err_event;
+	}
+
+	Err = LogWriteInit(&(LogFile->Index.Write));
+	if (Err != ERROR_SUCCESS) {
+		goto err_index_event;
+	}
+
+	if (SegmentSize) {
+		SegmentName(LogFile, Segment, Name);
+		FileName = Name;
+	}
+
+	Err = OpenFile(LogFile, FileName, SegmentSize, &(LogFile->FileHandle), &(LogFile->Offset));
+	if (Err != ERROR_SUCCESS) {
+		goto err_file;
+	}
+
+	OpenIndex(LogFile, FileName);
+	if (SegmentSize)
+		PruneSegments(LogFile);
+	*pLogFile = LogFile;
+
+	return ERROR_SUCCESS;
+
+err_file:
+	LogWriteDeinit(&(LogFile->Index.Write));
+
+err_index_event:
+	LogWriteDeinit(&(LogFile->SyncWrite));
+
+err_event:
+	ExFreePool(LogFile);
+
+err_mem:
+	return Err;
+}
+
+// every write started with LogFileWrite has to be waited for before
+VOID
+LogFileClose(
+	PLOGFILE LogFile
+) {
+	CloseIndex(LogFile);
+	ZwClose(LogFile->FileHandle);
+	LogWriteDeinit(&(LogFile->Index.Write));
+	LogWriteDeinit(&(LogFile->SyncWrite));
+	ExFreePool(LogFile);
+}
+
+// a write of Length would go past the end of the segment, an empty segment is never full
+BOOLEAN
+LogFileIsFull(
+	PLOGFILE LogFile,
+	SIZE_T Length
+) {
+	return LogFile->SegmentSize && LogFile->Offset &&
+		(ULONGLONG)LogFile->Offset + Length > LogFile->SegmentSize;
+}
+
+ULONG
+LogFileSegment(
+	PLOGFILE LogFile
+) {
+	return LogFile->Segment;
+}
+
+// switches to the next segment and deletes the ones over MaxSegments.
+// Every write has to be waited for before. On failure the current segment stays open
+INT
+LogFileRotate(
+	PLOGFILE LogFile
+) {
+	WCHAR Name[LOG_NAME_MAX];
+	HANDLE FileHandle;
+	LONGLONG Offset;
+
+	if (!LogFile->SegmentSize) {
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	SegmentName(LogFile, LogFile->Segment + 1, Name);
+	INT Err = OpenFile(LogFile, Name, LogFile->SegmentSize, &FileHandle, &Offset);
+	if (Err != ERROR_SUCCESS) {
+		return Err;
+	}
+
+	ZwClose(LogFile->FileHandle);
+	LogFile->FileHandle = FileHandle;
+	LogFile->Offset = Offset;
+	LogFile->Segment++;
+
+	CloseIndex(LogFile);
+	OpenIndex(LogFile, Name);
+	PruneSegments(LogFile);
+
+	return ERROR_SUCCESS;
+}
+
+// adds an entry for the chunk written next if IndexInterval bytes were written since the last one,
+// or if it is the first chunk of the file. SystemTime is that of its first record, Sequence the
+// number of records written before it since the logger was set up. One entry is in flight at a
+// time, by the next one the log has grown by IndexInterval. TRUE if the entry was added
+BOOLEAN
+LogFileIndex(
+	PLOGFILE LogFile,
+	LONGLONG SystemTime,
+	ULONGLONG Sequence
+) {
+	PLOGINDEX Index = &(LogFile->Index);
+	if (!Index->FileHandle ||
+		(Index->Indexed >= 0 && LogFile->Offset - Index->Indexed < (LONGLONG)LogFile->IndexInterval)) {
+		return FALSE;
+	}
+
+	WaitIndex(Index);
+
+	Index->Entry.Offset = (ULONGLONG)LogFile->Offset;
+	Index->Entry.SystemTime = SystemTime;
+	Index->Entry.Sequence = Sequence;
+	Index->Indexed = LogFile->Offset;
+
+	WriteAt(Index->FileHandle, &(Index->Write), &(Index->Offset), &(Index->Entry), sizeof(Index->Entry));
+	return TRUE;
+}
+
+// starts writing Buf at the end of the file, Buf has to stay valid until LogWriteWait.
+// Writes are done by one thread - the flushing one, so offsets need no sync
+VOID
+LogFileWrite(
+	PLOGFILE LogFile,
+	PLOGWRITE Write,
+	PVOID Buf,
+	SIZE_T Length
+) {
+	WriteAt(LogFile->FileHandle, Write, &(LogFile->Offset), Buf, Length);
+}
+
+NTSTATUS
+LogWriteWait(
+	PLOGWRITE Write
+) {
+	if (Write->IsPending) {
+		ZwWaitForSingleObject(Write->Event, FALSE, NULL);
+		Write->Status = Write->IoStatusBlock.Status;
+		Write->IsPending = FALSE;
+	}
+
+	return Write->Status;
+}
+
+NTSTATUS
+LogFileWriteSync(
+	PLOGFILE LogFile,
+	PVOID Buf,
+	SIZE_T Length
+) {
+	LogFileWrite(LogFile, &(LogFile->SyncWrite), Buf, Length);
+
+	// nothing was started after it, the next write takes its place
+	BOOLEAN IsPending = LogFile->SyncWrite.IsPending;
+	NTSTATUS Status = LogWriteWait(&(LogFile->SyncWrite));
+	if (IsPending && !NT_SUCCESS(Status))
+		LogFile->Offset -= (LONGLONG)Length;
+
+	return Status;
+}
+
+VOID
+LogFileMark(
+	PLOGFILE LogFile,
+	PLOGMARK Mark
+) {
+	Mark->Offset = LogFile->Offset;
+	Mark->IndexOffset = LogFile->Index.Offset;
+	Mark->Indexed = LogFile->Index.Indexed;
+}
+
+// cuts the file and its index back to Mark, taken in the same file, so a write that failed
+// after it was started leaves no hole. Whatever was written after the mark goes with it.
+// Every write has to be waited for before
+INT
+LogFileRewind(
+	PLOGFILE LogFile,
+	PLOGMARK Mark
+) {
+	PLOGINDEX Index = &(LogFile->Index);
+
+	INT Err = SetEnd(LogFile->FileHandle, Mark->Offset);
+	LogFile->Offset = Mark->Offset;
+
+	if (Index->FileHandle) {
+		WaitIndex(Index);
+		if (Mark->IndexOffset < Index->Offset) {
+			if (SetEnd(Index->FileHandle, Mark->IndexOffset) != ERROR_SUCCESS)
+				Err = ERROR_WRITE_FAULT;
+			Index->Offset = Mark->IndexOffset;
+		}
+		Index->Indexed = Mark->Indexed;
+	}
+
+	return Err;
+}
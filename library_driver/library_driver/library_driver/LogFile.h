@@ -0,0 +1,43 @@
+#pragma once
+
+#include <ntddk.h>
+
+// log file written with asynchronous writes at explicit offsets,
+// any number of them can be in flight at once.
+// With a segment size the log goes to numbered segments "<name>.000001.log", ...
+// each one created with the segment size as its allocation size, otherwise to one file that is appended to.
+// With an index interval every log file gets a sidecar index "<file>.idx", see KLoggerFormat.h
+typedef struct LogFile* PLOGFILE;
+
+typedef struct LogWrite {
+	HANDLE Event;
+	IO_STATUS_BLOCK IoStatusBlock;
+	NTSTATUS Status;
+	BOOLEAN IsPending;
+} LOGWRITE, *PLOGWRITE;
+
+// where the file and its index end, to cut them back to if a write after it fails
+typedef struct LogMark {
+	LONGLONG Offset;
+	LONGLONG IndexOffset;
+	LONGLONG Indexed;
+} LOGMARK, *PLOGMARK;
+
+ULONG LogFileLastSegment(PCWSTR FileName);
+INT LogFileOpen(PLOGFILE* pLogFile, PCWSTR FileName, ULONGLONG SegmentSize, ULONG MaxSegments, ULONG Segment, ULONG IndexInterval);
+VOID LogFileClose(PLOGFILE LogFile);
+
+BOOLEAN LogFileIsFull(PLOGFILE LogFile, SIZE_T Length);
+INT LogFileRotate(PLOGFILE LogFile);
+ULONG LogFileSegment(PLOGFILE LogFile);
+
+INT LogWriteInit(PLOGWRITE Write);
+VOID LogWriteDeinit(PLOGWRITE Write);
+
+BOOLEAN LogFileIndex(PLOGFILE LogFile, LONGLONG SystemTime, ULONGLONG Sequence);
+VOID LogFileWrite(PLOGFILE LogFile, PLOGWRITE Write, PVOID Buf, SIZE_T Length);
+NTSTATUS LogWriteWait(PLOGWRITE Write);
+NTSTATUS LogFileWriteSync(PLOGFILE LogFile, PVOID Buf, SIZE_T Length);
+
+VOID LogFileMark(PLOGFILE LogFile, PLOGMARK Mark);
+INT LogFileRewind(PLOGFILE LogFile, PLOGMARK Mark);
@@ -1,26 +1,157 @@
 #include "RingBuffer.h"
+#include "KLoggerFormat.h"
+#include "SharedMem.h"
 
 #include <winerror.h>
 
-
+#define RB_RECORD_ALIGN ((ULONGLONG)KLOGGER_RING_RECORD_ALIGN)
+#define RB_RECORD_COMMITTED KLOGGER_RING_COMMITTED
+#define RB_RECORD_PADDING KLOGGER_RING_PADDING
+#define RB_RECORD_SIZE_SHIFT KLOGGER_RING_SIZE_SHIFT
+#define RB_CACHE_LINE 64 // writers' and the reader's fields don't share lines
+#define RB_MAX_READERS 8 // registered by RBAddReader, besides the flushing thread
+
+#define RB_ALIGN_UP(x) (((x) + RB_RECORD_ALIGN - 1) & ~(RB_RECORD_ALIGN - 1))
+
+
+// every record starts with this header, State is written last - it commits the record
+typedef struct RingRecord {
+	ULONG Length; // bytes taken in the ring, header and alignment included
+	LONG volatile State; // payload size << RB_RECORD_SIZE_SHIFT | flags
+} RINGRECORD, *PRINGRECORD;
+
+// a reader besides the primary one (RBReadNext), on a line of its own
+typedef struct RingReader {
+	union {
+		struct {
+			LONGLONG volatile Pos; // everything before it is read
+			LONGLONG HeadCache; // at or behind Head
+			LONG volatile State; // RB_READER_*
+			ULONGLONG Lagged; // optional readers: bytes skipped because they were released
+		};
+		UCHAR Pad[RB_CACHE_LINE];
+	};
+} RINGREADER, *PRINGREADER;
+
+enum {
+	RB_READER_FREE,
+	RB_READER_ADDING,
+	RB_READER_REQUIRED, // space is not reclaimed before Pos
+	RB_READER_OPTIONAL // skipped ahead when what it has not read is reclaimed
+};
+
+// monotonic positions, offset in Data is (Pos % Capacity). Writers move Head and readers
+// move Tail, each on its own cache line with a copy of the other side's position that is
+// only refreshed when it looks like the ring is full or empty. Tail is the slowest required
+// reader: the primary one, the flushing thread, or one added by RBAddReader.
+// Data follows this header in the same allocation, the layout is described in KLoggerFormat.h
 typedef struct RingBuffer {
-	PCHAR Data;
-	PCHAR Head;
-	PCHAR Tail;
+	// set up by RBInitOnNode or RBInitShared
+	union {
+		struct {
+			CHAR Magic[KLOGGER_RING_MAGIC_SIZE];
+			ULONG Version;
+			ULONG HeaderSize;
+			ULONGLONG Capacity;
+			PCHAR Data;
+			PVOID pMem; // the allocation, before alignment
+			ULONG Node; // the ring was asked for there, MM_ANY_NODE_OK - anywhere
+			BOOLEAN IsOverwrite;
+			BOOLEAN IsContiguous; // pMem is from MmAllocateContiguousNodeMemory
+			BOOLEAN IsShared; // pMem is the PSHAREDMEM the ring is in
+		};
+		UCHAR ConstPad[RB_CACHE_LINE];
+	};
+
+	union {
+		struct {
+			LONGLONG volatile Head; // reserved by writers
+			LONGLONG volatile TailCache; // at or behind Tail
+		};
+		UCHAR HeadPad[RB_CACHE_LINE];
+	};
+
+	union {
+		struct {
+			LONGLONG volatile Tail; // released by the reader
+			LONGLONG HeadCache; // at or behind Head
+			LONGLONG ReadClaim; // overwrite mode, where records the reader holds end
+			LONGLONG SyncTimestamp; // RBSetTimeBase, for recovery only
+			LONGLONG SyncSystemTime;
+			LONGLONG SyncFrequency;
+			LONGLONG volatile Release; // records before it are being zeroed, for live readers
+			LONGLONG volatile ReadPos; // of the primary reader, Tail unless others are slower
+		};
+		UCHAR TailPad[RB_CACHE_LINE];
+	};
+
+	// overwrite mode only: records before Claim are held by the reader or being discarded
+	// by a writer, both take them with CAS
+	union {
+		LONGLONG volatile Claim;
+		UCHAR ClaimPad[RB_CACHE_LINE];
+	};
+
+	RINGREADER Readers[RB_MAX_READERS];
+} RINGBUFFER;
 
-	ULONGLONG Capacity;
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, Version) == KLOGGER_RING_VERSION_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, HeaderSize) == KLOGGER_RING_HEADER_SIZE_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, Capacity) == KLOGGER_RING_CAPACITY_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, Head) == KLOGGER_RING_HEAD_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, Tail) == KLOGGER_RING_TAIL_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, SyncTimestamp) == KLOGGER_RING_SYNC_OFFSET);
+C_ASSERT(FIELD_OFFSET(RINGBUFFER, Release) == KLOGGER_RING_RELEASE_OFFSET);
+C_ASSERT(sizeof(RINGRECORD) == KLOGGER_RING_RECORD_HEADER_SIZE);
+
+
+// the header at RingBufMem, cache line aligned, and Size bytes of records after it
+static PRINGBUFFER
+InitHeader(
+	PVOID RingBufMem,
+	SIZE_T Size,
+	PVOID pMem,
+	ULONG Node
+) {
+	PRINGBUFFER RingBuf = (PRINGBUFFER)RingBufMem;
+	RtlZeroMemory(RingBuf, sizeof(RINGBUFFER));
+	RingBuf->pMem = pMem;
+	RingBuf->Node = Node;
+	RingBuf->Version = KLOGGER_RING_VERSION;
+	RingBuf->HeaderSize = sizeof(RINGBUFFER);
+	RingBuf->Capacity = Size;
+	RingBuf->Data = (PCHAR)(RingBuf + 1);
 
-	KSPIN_LOCK SplockTail;
-	KSPIN_LOCK SplockHead;
-	KSPIN_LOCK SplockWrite;
+	// zeroed memory is what tells the reader that a record is not committed yet
+	RtlZeroMemory(RingBuf->Data, Size);
 
-} RINGBUFFER;
+	return RingBuf;
+}
 
+// last, a ring found in a memory image or a live section is complete
+static VOID
+SetMagic(
+	PRINGBUFFER RingBuf
+) {
+	KeMemoryBarrier();
+	RtlCopyMemory(RingBuf->Magic, KLOGGER_RING_MAGIC, KLOGGER_RING_MAGIC_SIZE);
+}
 
 INT
 RBInit(
 	PRINGBUFFER* pRingBuf,
 	SIZE_T Size
+) {
+	return RBInitOnNode(pRingBuf, Size, MM_ANY_NODE_OK);
+}
+
+// the ring is taken from Node, physically contiguous, if the node has the memory; else from
+// the nonpaged pool. Contiguous memory also lets the ring be mapped with large pages
+INT
+RBInitOnNode(
+	PRINGBUFFER* pRingBuf,
+	SIZE_T Size,
+	ULONG Node
 ) {
 	INT Err = ERROR_SUCCESS;
 
@@ -29,245 +160,650 @@ RBInit(
 		goto err_ret;
 	}
 
-	PRINGBUFFER RingBuf = (PRINGBUFFER)ExAllocatePool(NonPagedPool, sizeof(RINGBUFFER));
-	if (!RingBuf) {
-		Err = ERROR_NOT_ENOUGH_MEMORY;
+	// records are aligned, so must be the capacity
+	Size &= ~(RB_RECORD_ALIGN - 1);
+	if (Size < 2 * sizeof(RINGRECORD)) {
+		Err = ERROR_BAD_ARGUMENTS;
 		goto err_ret;
 	}
 
-	*pRingBuf = RingBuf;
+	// the header is aligned to a cache line, records follow it
+	SIZE_T MemSize = sizeof(RINGBUFFER) + RB_CACHE_LINE - 1 + Size;
+	PVOID pMem = NULL;
+	BOOLEAN IsContiguous = FALSE;
+	if (Node != MM_ANY_NODE_OK) {
+		PHYSICAL_ADDRESS Lowest;
+		PHYSICAL_ADDRESS Highest;
+		PHYSICAL_ADDRESS Boundary;
+		Lowest.QuadPart = 0;
+		Highest.QuadPart = -1;
+		Boundary.QuadPart = 0;
+
+		pMem = MmAllocateContiguousNodeMemory(MemSize, Lowest, Highest, Boundary, PAGE_READWRITE, Node);
+		IsContiguous = pMem != NULL;
+	}
 
-	RingBuf->Data = (PCHAR)ExAllocatePool(NonPagedPool, Size * sizeof(CHAR));
-	if (!RingBuf->Data) {
+	if (!pMem) {
+		pMem = ExAllocatePool(NonPagedPool, MemSize);
+	}
+
+	if (!pMem) {
 		Err = ERROR_NOT_ENOUGH_MEMORY;
-		ExFreePool(RingBuf);
 		goto err_ret;
 	}
 
-	RingBuf->Head = RingBuf->Data;
-	RingBuf->Tail = RingBuf->Data;
-	RingBuf->Capacity = Size;
+	PVOID Aligned = (PVOID)(((ULONG_PTR)pMem + RB_CACHE_LINE - 1) & ~(ULONG_PTR)(RB_CACHE_LINE - 1));
+	PRINGBUFFER RingBuf = InitHeader(Aligned, Size, pMem, Node);
+	RingBuf->IsContiguous = IsContiguous;
+	SetMagic(RingBuf);
 
-	KeInitializeSpinLock(&(RingBuf->SplockHead));
-	KeInitializeSpinLock(&(RingBuf->SplockTail));
-	KeInitializeSpinLock(&(RingBuf->SplockWrite));
+	*pRingBuf = RingBuf;
 
 err_ret:
 	return Err;
 }
 
+// the ring, header included, is put in a named section (SharedMem.h) user mode can map
+// read-only and follow the records in, see KLoggerFormat.h
 INT
-RBDeinit(
-	PRINGBUFFER pRingBuf
+RBInitShared(
+	PRINGBUFFER* pRingBuf,
+	SIZE_T Size,
+	PCWSTR Name
 ) {
 	if (!pRingBuf) {
 		return ERROR_BAD_ARGUMENTS;
 	}
 
-	ExFreePool(pRingBuf->Data);
-	ExFreePool(pRingBuf);
+	Size &= ~(RB_RECORD_ALIGN - 1);
+	if (Size < 2 * sizeof(RINGRECORD)) {
+		return ERROR_BAD_ARGUMENTS;
+	}
+
+	PSHAREDMEM Shared;
+	INT Err = SharedMemCreate(&Shared, Name, sizeof(RINGBUFFER) + Size);
+	if (Err != ERROR_SUCCESS) {
+		return Err;
+	}
+
+	PRINGBUFFER RingBuf = InitHeader(SharedMemAddress(Shared), Size, Shared, MM_ANY_NODE_OK);
+	RingBuf->IsShared = TRUE;
+	SetMagic(RingBuf);
 
+	*pRingBuf = RingBuf;
 	return ERROR_SUCCESS;
 }
 
-static VOID
-SpinlockExchange(
-	PCHAR* pSrc,
-	PCHAR* pDst, 
-	PKSPIN_LOCK Splock
+INT
+RBDeinit(
+	PRINGBUFFER pRingBuf
 ) {
-	KIRQL OldIrql;
+	if (!pRingBuf) {
+		return ERROR_BAD_ARGUMENTS;
+	}
 
-	KeRaiseIrql(HIGH_LEVEL, &OldIrql);
-	KeAcquireSpinLockAtDpcLevel(Splock);
+	// freed memory keeps its contents, a stale ring must not be recovered from an image.
+	// Live readers see the ring is gone
+	RtlZeroMemory(pRingBuf->Magic, KLOGGER_RING_MAGIC_SIZE);
 
-	*pDst = *pSrc;
+	if (pRingBuf->IsShared) {
+		SharedMemClose((PSHAREDMEM)pRingBuf->pMem);
+	} else if (pRingBuf->IsContiguous) {
+		MmFreeContiguousMemory(pRingBuf->pMem);
+	} else {
+		ExFreePool(pRingBuf->pMem);
+	}
 
-	KeReleaseSpinLockFromDpcLevel(Splock);
-	KeLowerIrql(OldIrql);
-} 
+	return ERROR_SUCCESS;
+}
 
 SIZE_T
 RBSize(
-	PCHAR Head,
-	PCHAR Tail,
-	SIZE_T Capacity
+	PRINGBUFFER pRingBuf
 ) {
-	if (Head >= Tail) {
-		return (SIZE_T)(Head - Tail);
+	LONGLONG Tail = pRingBuf->Tail;
+	LONGLONG Head = pRingBuf->Head;
 
-	} else {
-		return (SIZE_T)(Capacity - (Tail - Head));
-	}
+	return (SIZE_T)(Head - Tail);
 }
 
-static SIZE_T
-RBFreeSize(
-	PCHAR Head,
-	PCHAR Tail,
-	SIZE_T Capacity
+SIZE_T
+RBCapacity(
+	PRINGBUFFER pRingBuf
 ) {
-	return Capacity - RBSize(Head, Tail, Capacity);
+	return (SIZE_T)pRingBuf->Capacity;
 }
 
-static INT
-RingDataWrite(
-	PCHAR SrcBuf,
-	SIZE_T SrcBufSize,
-	PCHAR Data,
-	SIZE_T Capacity,
-	PCHAR Head,
-	PCHAR Tail,
-	PCHAR* NewHead
-) {
-	if (Head >= Tail) {
-		SIZE_T DistToFinish = Capacity - (Head - Data);
-		if (SrcBufSize > DistToFinish) {
-			RtlCopyMemory(Head, SrcBuf, DistToFinish);
-			RtlCopyMemory(Data, SrcBuf + DistToFinish, SrcBufSize - DistToFinish);
-			*NewHead = Data + SrcBufSize - DistToFinish;
-
-		} else {
-			RtlCopyMemory(Head, SrcBuf, SrcBufSize);
-			*NewHead = Head + SrcBufSize;
+// node the ring was asked for, MM_ANY_NODE_OK if none
+ULONG
+RBNode(
+	PRINGBUFFER pRingBuf
+) {
+	return pRingBuf->Node;
+}
+
+// time base of the last flush, kept in the header for recovery from memory images.
+// Reader only
+VOID
+RBSetTimeBase(
+	PRINGBUFFER pRingBuf,
+	LONGLONG Timestamp,
+	LONGLONG SystemTime,
+	LONGLONG Frequency
+) {
+	pRingBuf->SyncTimestamp = Timestamp;
+	pRingBuf->SyncSystemTime = SystemTime;
+	pRingBuf->SyncFrequency = Frequency;
+}
+
+// writers may RBDiscard the oldest records the reader has not taken yet,
+// before the ring is used
+VOID
+RBSetOverwrite(
+	PRINGBUFFER pRingBuf
+) {
+	pRingBuf->IsOverwrite = TRUE;
+}
+
+// monotonic, ring bytes reserved by writers so far - padding included
+LONGLONG
+RBReserved(
+	PRINGBUFFER pRingBuf
+) {
+	return pRingBuf->Head;
+}
+
+// ring bytes taken by a record with Size bytes of payload, 0 if it is too large for any ring
+SIZE_T
+RBRecordSpace(
+	SIZE_T Size
+) {
+	if (Size > (MAXULONG >> RB_RECORD_SIZE_SHIFT)) {
+		return 0;
+	}
+
+	return (SIZE_T)RB_ALIGN_UP(sizeof(RINGRECORD) + Size);
+}
+
+// lock-free reservation of Space contiguous bytes for records (RBRecordSpace each),
+// a span never wraps: if it does not fit before the end of Data, the rest of the lap
+// is taken by a padding record. The span has to be carved into records with RBSpanRecord.
+// The caller stays at DISPATCH_LEVEL or above until all of them are committed
+INT
+RBReserveSpan(
+	PRINGBUFFER pRingBuf,
+	SIZE_T Space,
+	PVOID* ppSpan
+) {
+	ULONGLONG Capacity = pRingBuf->Capacity;
+	ULONGLONG Length = Space;
+
+	if (!Length || Length > Capacity) {
+		return ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	LONGLONG Head, NewHead;
+	ULONGLONG Offset, Padding;
+	do {
+		Head = pRingBuf->Head;
+
+		Offset = (ULONGLONG)Head % Capacity;
+		Padding = (Capacity - Offset < Length) ? Capacity - Offset : 0;
+		NewHead = Head + (LONGLONG)(Padding + Length);
+
+		// the reader's line is only read when the ring looks full
+		if ((ULONGLONG)(NewHead - pRingBuf->TailCache) > Capacity) {
+			LONGLONG Tail = pRingBuf->Tail;
+			if ((ULONGLONG)(NewHead - Tail) > Capacity) {
+				return ERROR_INSUFFICIENT_BUFFER;
+			}
+
+			// other writers may have put an older one, it is only refreshed sooner then
+			pRingBuf->TailCache = Tail;
 		}
+	} while (InterlockedCompareExchange64(&(pRingBuf->Head), NewHead, Head) != Head);
 
-	} else {
-		RtlCopyMemory(Head, SrcBuf, SrcBufSize);
-		*NewHead = Head + SrcBufSize;
+	if (Padding) {
+		PRINGRECORD Pad = (PRINGRECORD)(pRingBuf->Data + Offset);
+		Pad->Length = (ULONG)Padding;
+		InterlockedExchange(&(Pad->State), RB_RECORD_PADDING | RB_RECORD_COMMITTED);
+		Offset = 0;
 	}
 
+	*ppSpan = pRingBuf->Data + Offset;
+
 	return ERROR_SUCCESS;
 }
 
-INT 
+// next record of a reserved span, in order, returns its data
+PVOID
+RBSpanRecord(
+	PVOID* ppSpan,
+	SIZE_T Size
+) {
+	PRINGRECORD Record = (PRINGRECORD)*ppSpan;
+	Record->Length = (ULONG)RBRecordSpace(Size);
+	*ppSpan = (PCHAR)Record + Record->Length;
+
+	return Record + 1;
+}
+
+// lock-free reservation of a single record, see RBReserveSpan
+INT
+RBReserve(
+	PRINGBUFFER pRingBuf,
+	SIZE_T Size,
+	PVOID* ppData
+) {
+	PVOID pSpan;
+	INT Err = RBReserveSpan(pRingBuf, RBRecordSpace(Size), &pSpan);
+	if (Err == ERROR_SUCCESS) {
+		*ppData = RBSpanRecord(&pSpan, Size);
+	}
+
+	return Err;
+}
+
+VOID
+RBCommit(
+	PVOID pData,
+	SIZE_T Size
+) {
+	PRINGRECORD Record = (PRINGRECORD)pData - 1;
+	InterlockedExchange(&(Record->State), (LONG)((Size << RB_RECORD_SIZE_SHIFT) | RB_RECORD_COMMITTED));
+}
+
+// any number of concurrent writers, no locks:
+// the record is reserved with CAS on Head, filled and then committed by its own State
+INT
 RBWrite(
-	PRINGBUFFER pRingBuf, 
-	PCHAR pBuf, 
+	PRINGBUFFER pRingBuf,
+	PCHAR pBuf,
 	SIZE_T Size
 ) {
 	if (!pRingBuf) {
 		return ERROR_BAD_ARGUMENTS;
 	}
 
-	KIRQL OldIrql;
-	KeRaiseIrql(HIGH_LEVEL, &OldIrql);
-	KeAcquireSpinLockAtDpcLevel(&(pRingBuf->SplockWrite));
-
-	PCHAR Head, Tail; // get value with spinlock and then use copy
-	SpinlockExchange(&(pRingBuf->Head), &Head, &(pRingBuf->SplockHead));
-	SpinlockExchange(&(pRingBuf->Tail), &Tail, &(pRingBuf->SplockTail));
-
-	int Err;
-	if (Size > RBFreeSize(Head, Tail, pRingBuf->Capacity)) {
-		Err = ERROR_INSUFFICIENT_BUFFER;
-		goto out;
+	// the reader waits for every reserved record to be committed, so don't get preempted in between
+	KIRQL OldIrql = KeGetCurrentIrql();
+	if (OldIrql < DISPATCH_LEVEL) {
+		KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
 	}
 
-	PCHAR NewHead;
-	Err = RingDataWrite(
-			pBuf, 
-			Size, 
-			pRingBuf->Data, 
-			pRingBuf->Capacity,
-			Head,
-			Tail, 
-			&NewHead
-	);
+	PVOID pData;
+	INT Err = RBReserve(pRingBuf, Size, &pData);
 	if (Err != ERROR_SUCCESS) {
 		goto out;
 	}
 
-	SpinlockExchange(&NewHead, &(pRingBuf->Head), &(pRingBuf->SplockHead));
+	RtlCopyMemory(pData, pBuf, Size);
+	RBCommit(pData, Size);
 
 out:
-	KeReleaseSpinLockFromDpcLevel(&(pRingBuf->SplockWrite));
-	KeLowerIrql(OldIrql);
+	if (OldIrql < DISPATCH_LEVEL) {
+		KeLowerIrql(OldIrql);
+	}
 
 	return Err;
 }
 
-static INT 
-RingDataRead(
-	PCHAR pDstBuf,
-	SIZE_T DstBufSize,
-	PCHAR Data,
-	SIZE_T Capacity,
-	PCHAR Head,
-	PCHAR Tail,
-	PSIZE_T pRetSize,
-	PCHAR* NewTail
+// the primary reader, the flushing thread: one at a time, no sync with other readers
+LONGLONG
+RBReadBegin(
+	PRINGBUFFER pRingBuf
+) {
+	return pRingBuf->ReadPos;
+}
+
+// next committed record at or after *pPos. Only the primary reader claims records from
+// discarding writers, in overwrite mode
+static INT
+ReadNext(
+	PRINGBUFFER pRingBuf,
+	PLONGLONG pHeadCache,
+	BOOLEAN IsPrimary,
+	PLONGLONG pPos,
+	PVOID* ppData,
+	PSIZE_T pSize
+) {
+	// in overwrite mode writers may have discarded records the reader let go of
+	LONGLONG Tail = pRingBuf->Tail;
+	if (*pPos < Tail) {
+		*pPos = Tail;
+	}
+
+	// the writers' line is only read when the reader catches up with the last Head it saw
+	LONGLONG Head = *pHeadCache;
+	while (TRUE) {
+		if (*pPos >= Head) {
+			Head = pRingBuf->Head;
+			*pHeadCache = Head;
+			if (*pPos >= Head) {
+				break;
+			}
+		}
+
+		ULONGLONG Offset = (ULONGLONG)*pPos % pRingBuf->Capacity;
+		PRINGRECORD Record = (PRINGRECORD)(pRingBuf->Data + Offset);
+		LONG State = Record->State;
+		if (!(State & RB_RECORD_COMMITTED)) {
+			break; // reserved, but the writer is not done yet
+		}
+
+		KeMemoryBarrier();
+		ULONG Length = Record->Length;
+		if (!IsPrimary) {
+			// space an optional reader has not read may be reused under it, *pPos might be
+			// in the middle of a newer record - never go outside of Data, RBReaderEnd tells
+			if (*pPos < pRingBuf->Release || Length < sizeof(RINGRECORD) || Length > pRingBuf->Capacity - Offset ||
+				((ULONG)State >> RB_RECORD_SIZE_SHIFT) > Length - sizeof(RINGRECORD)) {
+				break;
+			}
+		}
+
+		if (IsPrimary && pRingBuf->IsOverwrite && *pPos >= pRingBuf->ReadClaim) {
+			LONGLONG Next = *pPos + Length;
+			if (InterlockedCompareExchange64(&(pRingBuf->Claim), Next, *pPos) != *pPos) {
+				// discarded by writers, they release it shortly - go on after it
+				LONGLONG Claim;
+				while ((Claim = pRingBuf->Claim) != pRingBuf->Tail) {
+					YieldProcessor();
+				}
+
+				*pPos = Claim;
+				pRingBuf->ReadClaim = Claim;
+				continue;
+			}
+
+			pRingBuf->ReadClaim = Next;
+		}
+
+		*pPos += Length;
+
+		if (!(State & RB_RECORD_PADDING)) {
+			*ppData = Record + 1;
+			*pSize = (ULONG)State >> RB_RECORD_SIZE_SHIFT;
+			return ERROR_SUCCESS;
+		}
+	}
+
+	return ERROR_NO_MORE_ITEMS;
+}
+
+// record at *pPos stays in place until RBReadEnd releases it, *pPos is moved to the next one
+INT
+RBReadNext(
+	PRINGBUFFER pRingBuf,
+	PLONGLONG pPos,
+	PVOID* ppData,
+	PSIZE_T pSize
 ) {
-	SIZE_T Size = RBSize(Head, Tail, Capacity);
-	SIZE_T RetSize = (DstBufSize < Size) ? DstBufSize : Size;
-	*pRetSize = RetSize;
+	return ReadNext(pRingBuf, &(pRingBuf->HeadCache), TRUE, pPos, ppData, pSize);
+}
 
-	if (Head >= Tail) {
-		RtlCopyMemory(pDstBuf, Tail, RetSize);
-		*NewTail = Tail + RetSize;
+// the slowest required reader
+static LONGLONG
+RequiredPos(
+	PRINGBUFFER pRingBuf
+) {
+	LONGLONG Pos = pRingBuf->ReadPos;
+	for (ULONG i = 0; i < RB_MAX_READERS; ++i) {
+		PRINGREADER Reader = &(pRingBuf->Readers[i]);
+		if (Reader->State == RB_READER_REQUIRED && Reader->Pos < Pos) {
+			Pos = Reader->Pos;
+		}
+	}
 
-	} else {
-		SIZE_T DistToFlush = Capacity - (Tail - Data);
-		if (RetSize <= DistToFlush) {
-			RtlCopyMemory(pDstBuf, Tail, RetSize);
-			*NewTail = Tail + RetSize;
-
-		} else {
-			RtlCopyMemory(pDstBuf, Tail, DistToFlush);
-			RtlCopyMemory(pDstBuf + DistToFlush, Data, RetSize - DistToFlush);
-			*NewTail = Data + RetSize - DistToFlush;
+	return Pos;
+}
+
+// gives writers what all required readers are done with. Release equals Tail unless records
+// are being zeroed, whoever moves it zeroes them. A reader that finds someone else at it leaves,
+// the one zeroing looks again when done and sees its position
+static VOID
+Reclaim(
+	PRINGBUFFER pRingBuf
+) {
+	while (TRUE) {
+		LONGLONG Tail = pRingBuf->Tail;
+		LONGLONG Pos = RequiredPos(pRingBuf);
+		if (Pos <= Tail) {
+			return; // nothing held or, in overwrite mode, discarded meanwhile
 		}
+
+		// a live reader that took a record before Release drops what it read
+		if (InterlockedCompareExchange64(&(pRingBuf->Release), Pos, Tail) != Tail) {
+			return;
+		}
+
+		ULONGLONG Size = (ULONGLONG)(Pos - Tail);
+		ULONGLONG Offset = (ULONGLONG)Tail % pRingBuf->Capacity;
+		ULONGLONG First = (Size < pRingBuf->Capacity - Offset) ? Size : pRingBuf->Capacity - Offset;
+
+		// zeroed memory is what tells the reader that a record is not committed yet
+		RtlZeroMemory(pRingBuf->Data + Offset, First);
+		RtlZeroMemory(pRingBuf->Data, Size - First);
+
+		InterlockedExchange64(&(pRingBuf->Tail), Pos);
+	}
+}
+
+// the primary reader is done with everything before Pos
+VOID
+RBReadEnd(
+	PRINGBUFFER pRingBuf,
+	LONGLONG Pos
+) {
+	if (Pos > pRingBuf->ReadPos) {
+		InterlockedExchange64(&(pRingBuf->ReadPos), Pos);
+	}
+
+	Reclaim(pRingBuf);
+}
+
+// another reader of the same records, they are not copied for it. It starts at the records
+// written from now on. A required one holds ring space until it is done with it, writers drop
+// or overwrite meanwhile; an optional one never holds writers back and is skipped ahead when
+// the space it has not read is reclaimed. In overwrite mode readers can only be optional
+INT
+RBAddReader(
+	PRINGBUFFER pRingBuf,
+	BOOLEAN IsRequired,
+	PULONG pReader
+) {
+	if (!pRingBuf || !pReader) {
+		return ERROR_BAD_ARGUMENTS;
+	}
+
+	if (IsRequired && pRingBuf->IsOverwrite) {
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	for (ULONG i = 0; i < RB_MAX_READERS; ++i) {
+		PRINGREADER Reader = &(pRingBuf->Readers[i]);
+		if (InterlockedCompareExchange(&(Reader->State), RB_READER_ADDING, RB_READER_FREE) != RB_READER_FREE) {
+			continue;
+		}
+
+		// Head is never behind what is being reclaimed, counted from here on
+		Reader->Lagged = 0;
+		Reader->HeadCache = pRingBuf->Head;
+		InterlockedExchange64(&(Reader->Pos), Reader->HeadCache);
+		InterlockedExchange(&(Reader->State), IsRequired ? RB_READER_REQUIRED : RB_READER_OPTIONAL);
+
+		*pReader = i;
+		return ERROR_SUCCESS;
 	}
 
+	return ERROR_NO_MORE_ITEMS;
+}
+
+// what a required reader held goes back to writers
+VOID
+RBRemoveReader(
+	PRINGBUFFER pRingBuf,
+	ULONG Reader
+) {
+	InterlockedExchange(&(pRingBuf->Readers[Reader].State), RB_READER_FREE);
+	Reclaim(pRingBuf);
+}
+
+// position of the reader's next record. An optional reader that fell behind is moved past
+// what was reclaimed, see RBReaderLagged
+LONGLONG
+RBReaderBegin(
+	PRINGBUFFER pRingBuf,
+	ULONG Reader
+) {
+	PRINGREADER pReader = &(pRingBuf->Readers[Reader]);
+	if (pReader->State == RB_READER_OPTIONAL) {
+		LONGLONG Release = pRingBuf->Release;
+		if (pReader->Pos < Release) {
+			pReader->Lagged += (ULONGLONG)(Release - pReader->Pos);
+			InterlockedExchange64(&(pReader->Pos), Release);
+		}
+	}
+
+	return pReader->Pos;
+}
+
+// as RBReadNext, for any number of readers at once. Records of a required reader stay in place
+// until its RBReaderEnd, those of an optional one only as long as RBReaderEnd says so
+INT
+RBReaderNext(
+	PRINGBUFFER pRingBuf,
+	ULONG Reader,
+	PLONGLONG pPos,
+	PVOID* ppData,
+	PSIZE_T pSize
+) {
+	return ReadNext(pRingBuf, &(pRingBuf->Readers[Reader].HeadCache), FALSE, pPos, ppData, pSize);
+}
+
+// the reader is done with everything before Pos. An optional reader gets ERROR_OPERATION_ABORTED
+// if part of what it read since RBReaderBegin was reclaimed under it: that data has to be dropped
+// and counts as lagged, the reader goes on after what was reclaimed
+INT
+RBReaderEnd(
+	PRINGBUFFER pRingBuf,
+	ULONG Reader,
+	LONGLONG Pos
+) {
+	PRINGREADER pReader = &(pRingBuf->Readers[Reader]);
+	if (pReader->State == RB_READER_OPTIONAL) {
+		KeMemoryBarrier();
+		LONGLONG Release = pRingBuf->Release;
+		if (pReader->Pos < Release) {
+			LONGLONG Next = (Pos > Release) ? Pos : Release;
+			pReader->Lagged += (ULONGLONG)(Next - pReader->Pos);
+			InterlockedExchange64(&(pReader->Pos), Next);
+			return ERROR_OPERATION_ABORTED;
+		}
+
+		InterlockedExchange64(&(pReader->Pos), Pos);
+		return ERROR_SUCCESS;
+	}
+
+	if (Pos > pReader->Pos) {
+		InterlockedExchange64(&(pReader->Pos), Pos);
+	}
+
+	Reclaim(pRingBuf);
 	return ERROR_SUCCESS;
 }
 
-// there is only one reader - fluhsing thread -> no sync
-INT 
+// bytes an optional reader lost: skipped over because they were reclaimed before it read them,
+// or read in a batch RBReaderEnd had it drop
+ULONGLONG
+RBReaderLagged(
+	PRINGBUFFER pRingBuf,
+	ULONG Reader
+) {
+	return pRingBuf->Readers[Reader].Lagged;
+}
+
+// overwrite mode: frees the oldest record for a writer if the reader holds nothing.
+// *pSize is its payload size, 0 for padding, up to HeaderSize bytes of the payload are
+// copied to pHeader first. The caller is at DISPATCH_LEVEL or above
+INT
+RBDiscard(
+	PRINGBUFFER pRingBuf,
+	PVOID pHeader,
+	SIZE_T HeaderSize,
+	PSIZE_T pSize
+) {
+	if (!pRingBuf->IsOverwrite) {
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	LONGLONG Tail = pRingBuf->Tail;
+	if (pRingBuf->Claim != Tail || Tail == pRingBuf->Head) {
+		return ERROR_NO_MORE_ITEMS;
+	}
+
+	PRINGRECORD Record = (PRINGRECORD)(pRingBuf->Data + (ULONGLONG)Tail % pRingBuf->Capacity);
+	LONG State = Record->State;
+	if (!(State & RB_RECORD_COMMITTED)) {
+		return ERROR_NO_MORE_ITEMS;
+	}
+
+	KeMemoryBarrier();
+	ULONG Length = Record->Length;
+	if (InterlockedCompareExchange64(&(pRingBuf->Claim), Tail + Length, Tail) != Tail) {
+		return ERROR_NO_MORE_ITEMS; // taken by the reader or another writer
+	}
+
+	*pSize = (State & RB_RECORD_PADDING) ? 0 : (ULONG)State >> RB_RECORD_SIZE_SHIFT;
+	RtlCopyMemory(pHeader, Record + 1, (*pSize < HeaderSize) ? *pSize : HeaderSize);
+
+	// records never wrap
+	InterlockedExchange64(&(pRingBuf->Release), Tail + Length);
+	RtlZeroMemory(Record, Length);
+	InterlockedExchange64(&(pRingBuf->Tail), Tail + Length);
+
+	return ERROR_SUCCESS;
+}
+
+INT
 RBRead(
-	PRINGBUFFER pRingBuf, 
-	PCHAR pBuf, 
+	PRINGBUFFER pRingBuf,
+	PCHAR pBuf,
 	PSIZE_T pSize
 ) {
 	if (!pRingBuf || !pSize) {
 		return ERROR_BAD_ARGUMENTS;
 	}
 
-	// TODO: res
-	PCHAR Head, Tail; // get value with sync and then use copy
-	SpinlockExchange(&(pRingBuf->Head), &Head, &(pRingBuf->SplockHead));
-	SpinlockExchange(&(pRingBuf->Tail), &Tail, &(pRingBuf->SplockTail));
-
-	SIZE_T RetSize;
-	PCHAR NewTail;
-	int Err = RingDataRead(
-				pBuf, 
-				*pSize, 
-				pRingBuf->Data, 
-				pRingBuf->Capacity, 
-				Head, 
-				Tail, 
-				&RetSize, 
-				&NewTail
-	);
-	if (Err != ERROR_SUCCESS) {
-		goto out;
+	LONGLONG Pos = RBReadBegin(pRingBuf);
+	LONGLONG Next = Pos;
+	SIZE_T RetSize = 0;
+	INT Err = ERROR_SUCCESS;
+
+	PVOID pData;
+	SIZE_T Size;
+	while (RBReadNext(pRingBuf, &Next, &pData, &Size) == ERROR_SUCCESS) {
+		if (RetSize + Size > *pSize) {
+			if (!RetSize) {
+				Err = ERROR_INSUFFICIENT_BUFFER;
+			}
+			break;
+		}
+
+		RtlCopyMemory(pBuf + RetSize, pData, Size);
+		RetSize += Size;
+		Pos = Next;
 	}
 
 	*pSize = RetSize;
-	SpinlockExchange(&NewTail, &(pRingBuf->Tail), &(pRingBuf->SplockTail));
+	RBReadEnd(pRingBuf, Pos);
 
-out:
 	return Err;
 }
 
-INT 
+INT
 RBLoadFactor(
 	PRINGBUFFER pRingBuf
 ) {
-	PCHAR Head, Tail; // get value with spinlock and then use copy
-	SpinlockExchange(&(pRingBuf->Head), &Head, &(pRingBuf->SplockHead));
-	SpinlockExchange(&(pRingBuf->Tail), &Tail, &(pRingBuf->SplockTail));
-
-	return (INT)(100 * RBSize(Head, Tail, pRingBuf->Capacity)) / pRingBuf->Capacity;
+	return (INT)((100 * RBSize(pRingBuf)) / pRingBuf->Capacity);
 }
@@ -5,8 +5,35 @@
 typedef struct RingBuffer* PRINGBUFFER;
 
 INT RBInit(PRINGBUFFER* pRingBuf, SIZE_T Size);
+INT RBInitOnNode(PRINGBUFFER* pRingBuf, SIZE_T Size, ULONG Node);
+INT RBInitShared(PRINGBUFFER* pRingBuf, SIZE_T Size, PCWSTR Name);
 INT RBDeinit(PRINGBUFFER pRingBuf);
 INT RBWrite(PRINGBUFFER pRingBuf, PCHAR pBuf, SIZE_T Size);
 INT RBRead(PRINGBUFFER pRingBuf, PCHAR pBuf, PSIZE_T pSize);
-SIZE_T RBSize(PCHAR Head, PCHAR Tail, SIZE_T Capacity);
+
+INT RBReserve(PRINGBUFFER pRingBuf, SIZE_T Size, PVOID* ppData);
+SIZE_T RBRecordSpace(SIZE_T Size);
+INT RBReserveSpan(PRINGBUFFER pRingBuf, SIZE_T Space, PVOID* ppSpan);
+PVOID RBSpanRecord(PVOID* ppSpan, SIZE_T Size);
+VOID RBCommit(PVOID pData, SIZE_T Size);
+
+VOID RBSetOverwrite(PRINGBUFFER pRingBuf);
+VOID RBSetTimeBase(PRINGBUFFER pRingBuf, LONGLONG Timestamp, LONGLONG SystemTime, LONGLONG Frequency);
+INT RBDiscard(PRINGBUFFER pRingBuf, PVOID pHeader, SIZE_T HeaderSize, PSIZE_T pSize);
+
+LONGLONG RBReadBegin(PRINGBUFFER pRingBuf);
+INT RBReadNext(PRINGBUFFER pRingBuf, PLONGLONG pPos, PVOID* ppData, PSIZE_T pSize);
+VOID RBReadEnd(PRINGBUFFER pRingBuf, LONGLONG Pos);
+
+INT RBAddReader(PRINGBUFFER pRingBuf, BOOLEAN IsRequired, PULONG pReader);
+VOID RBRemoveReader(PRINGBUFFER pRingBuf, ULONG Reader);
+LONGLONG RBReaderBegin(PRINGBUFFER pRingBuf, ULONG Reader);
+INT RBReaderNext(PRINGBUFFER pRingBuf, ULONG Reader, PLONGLONG pPos, PVOID* ppData, PSIZE_T pSize);
+INT RBReaderEnd(PRINGBUFFER pRingBuf, ULONG Reader, LONGLONG Pos);
+ULONGLONG RBReaderLagged(PRINGBUFFER pRingBuf, ULONG Reader);
+
+SIZE_T RBSize(PRINGBUFFER pRingBuf);
+SIZE_T RBCapacity(PRINGBUFFER pRingBuf);
+ULONG RBNode(PRINGBUFFER pRingBuf);
+LONGLONG RBReserved(PRINGBUFFER pRingBuf);
 INT RBLoadFactor(PRINGBUFFER pRingBuf);
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "SharedMem.h"
+
+#include <winerror.h>
+
+typedef struct SharedMem {
+	HANDLE SectionHandle;
+	PVOID pSection;
+	PVOID pView; // pageable, in system space
+	PMDL pMdl; // locks the view
+	PVOID pAddress; // nonpaged mapping of the locked pages
+} SHAREDMEM;
+
+
+// Name is a full object name, "\BaseNamedObjects\..." to be opened as "Global\..." from
+// user mode. The section gets the default security of a kernel object: SYSTEM may write it,
+// Administrators may only map it for reading. A name that is taken fails the call, nobody
+// else's section is ever written
+INT
+SharedMemCreate(
+	PSHAREDMEM* pShared,
+	PCWSTR Name,
+	SIZE_T Size
+) {
+	INT Err = ERROR_SUCCESS;
+
+	// an MDL describes less than 4GB
+	if (!pShared || !Name || !Size || Size > MAXULONG - PAGE_SIZE) {
+		Err = ERROR_BAD_ARGUMENTS;
+		goto err_ret;
+	}
+
+	PSHAREDMEM Shared = (PSHAREDMEM)ExAllocatePool(NonPagedPool, sizeof(SHAREDMEM));
+	if (!Shared) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_ret;
+	}
+
+	UNICODE_STRING UniName;
+	OBJECT_ATTRIBUTES ObjAttr;
+	RtlInitUnicodeString(&UniName, Name);
+	InitializeObjectAttributes(&ObjAttr, &UniName, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	LARGE_INTEGER MaximumSize;
+	MaximumSize.QuadPart = (LONGLONG)Size;
+
+	NTSTATUS Status = ZwCreateSection(
+		&(Shared->SectionHandle),
+		SECTION_ALL_ACCESS,
+		&ObjAttr,
+		&MaximumSize,
+		PAGE_READWRITE,
+		SEC_COMMIT,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		Err = (Status == STATUS_OBJECT_NAME_COLLISION) ? ERROR_ALREADY_EXISTS : ERROR_CANNOT_MAKE;
+		goto err_section;
+	}
+
+	Status = ObReferenceObjectByHandle(
+		Shared->SectionHandle,
+		SECTION_ALL_ACCESS,
+		NULL,
+		KernelMode,
+		&(Shared->pSection),
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		Err = ERROR_CANNOT_MAKE;
+		goto err_reference;
+	}
+
+	SIZE_T ViewSize = Size;
+	Shared->pView = NULL;
+	Status = MmMapViewInSystemSpace(Shared->pSection, &(Shared->pView), &ViewSize);
+	if (!NT_SUCCESS(Status)) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_view;
+	}
+
+	Shared->pMdl = IoAllocateMdl(Shared->pView, (ULONG)Size, FALSE, FALSE, NULL);
+	if (!Shared->pMdl) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_mdl;
+	}
+
+	__try {
+		MmProbeAndLockPages(Shared->pMdl, KernelMode, IoWriteAccess);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_lock;
+	}
+
+	Shared->pAddress = MmGetSystemAddressForMdlSafe(Shared->pMdl, NormalPagePriority | MdlMappingNoExecute);
+	if (!Shared->pAddress) {
+		Err = ERROR_NOT_ENOUGH_MEMORY;
+		goto err_address;
+	}
+
+	*pShared = Shared;
+	return ERROR_SUCCESS;
+
+err_address:
+	MmUnlockPages(Shared->pMdl);
+
+err_lock:
+	IoFreeMdl(Shared->pMdl);
+
+err_mdl:
+	MmUnmapViewInSystemSpace(Shared->pView);
+
+err_view:
+	ObDereferenceObject(Shared->pSection);
+
+err_reference:
+	ZwClose(Shared->SectionHandle);
+
+err_section:
+	ExFreePool(Shared);
+
+err_ret:
+	return Err;
+}
+
+// user mode views stay valid, the section goes away with the last of them
+VOID
+SharedMemClose(
+	PSHAREDMEM Shared
+) {
+	MmUnlockPages(Shared->pMdl);
+	IoFreeMdl(Shared->pMdl);
+	MmUnmapViewInSystemSpace(Shared->pView);
+	ObDereferenceObject(Shared->pSection);
+	ZwClose(Shared->SectionHandle);
+	ExFreePool(Shared);
+}
+
+// page aligned, Size bytes, zeroed when created
+PVOID
+SharedMemAddress(
+	PSHAREDMEM Shared
+) {
+	return Shared->pAddress;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <ntddk.h>
+
+// memory of a named section, for user mode to map read-only while the driver writes it.
+// The view is locked and mapped by an MDL, so it can be written at any IRQL
+typedef struct SharedMem* PSHAREDMEM;
+
+INT SharedMemCreate(PSHAREDMEM* pShared, PCWSTR Name, SIZE_T Size);
+VOID SharedMemClose(PSHAREDMEM Shared);
+PVOID SharedMemAddress(PSHAREDMEM Shared);
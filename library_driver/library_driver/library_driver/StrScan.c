@@ -0,0 +1,70 @@
+#include "StrScan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define STRSCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef STRSCAN_SSE2
+
+static __inline ULONG
+StrScanZeros(
+	const __m128i* p
+) {
+	return (ULONG)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(p), _mm_setzero_si128()));
+}
+
+// aligned loads only: an aligned block never crosses into the next page, so reading past
+// the terminator can't fault. Bytes before Str in the first block are shifted out.
+// AVX2 is not used, kernel code has to save the YMM state around it
+SIZE_T
+StrScanLength(
+	PCSTR Str
+) {
+	ULONG Skip = (ULONG)((ULONG_PTR)Str & 15);
+	const __m128i* p = (const __m128i*)(Str - Skip);
+	ULONG Index = 0;
+
+	ULONG Mask = StrScanZeros(p) >> Skip;
+	if (BitScanForward(&Index, Mask))
+		return Index;
+
+	// one more block up to 32 byte alignment, then two blocks of the same 32 bytes at a time
+	++p;
+	if ((ULONG_PTR)p & 16) {
+		Mask = StrScanZeros(p);
+		if (BitScanForward(&Index, Mask))
+			return (SIZE_T)((PCSTR)p - Str) + Index;
+		++p;
+	}
+
+	while (TRUE) {
+		__m128i Zero = _mm_setzero_si128();
+		__m128i Low = _mm_cmpeq_epi8(_mm_load_si128(p), Zero);
+		__m128i High = _mm_cmpeq_epi8(_mm_load_si128(p + 1), Zero);
+
+		if (_mm_movemask_epi8(_mm_or_si128(Low, High))) {
+			Mask = (ULONG)_mm_movemask_epi8(Low) | ((ULONG)_mm_movemask_epi8(High) << 16);
+			BitScanForward(&Index, Mask);
+			return (SIZE_T)((PCSTR)p - Str) + Index;
+		}
+
+		p += 2;
+	}
+}
+
+#else
+
+SIZE_T
+StrScanLength(
+	PCSTR Str
+) {
+	SIZE_T Length = 0;
+	while (Str[Length] != '\0') {
+		Length++;
+	}
+
+	return Length;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <ntddk.h>
+
+// length of a null-terminated message, SSE2 on x86 and x64, byte by byte elsewhere.
+// May read up to the end of the aligned 16 byte block holding the terminator, never past its page
+SIZE_T StrScanLength(PCSTR Str);
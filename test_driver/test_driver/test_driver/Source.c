@@ -8,6 +8,10 @@
 HANDLE ThreadHandle;
 PKTHREAD pThread;
 
+KLOGGER_DEFINE_MESSAGE(CatalogConstant, "[klogtest 1]: catalog message\r\n");
+KLOGGER_DEFINE_MESSAGE(CatalogArgs, "[klogtest 1]: catalog message %d of %s at IRQL %u\r\n");
+KLOGGER_CATALOG_BOUNDS();
+
 NTSTATUS DriverEntry(
 	_In_ struct _DRIVER_OBJECT *DriverObject, 
 	_In_ PUNICODE_STRING RegistryPath
@@ -102,6 +106,27 @@ VOID ThreadFunc(
 			KeDelayExecutionThread(KernelMode, FALSE, &Interval);
 	}
 
+	KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+	DbgPrint("1 ...");
+	DbgPrint("1 Levels: DEBUG is off by default, category 1 is turned off");
+
+	KLOG_DEBUG(0, "[klogtest 1]: debug, not logged\r\n");
+	KLOG_INFO(0, "[klogtest 1]: info\r\n");
+	KLOGF_WARNING(1, "[klogtest 1]: warning in category %d\r\n", 1);
+
+	KLoggerSetMask(KLoggerMask & ~KLOGGER_MASK_CATEGORY(1));
+	KLOGF_ERROR(1, "[klogtest 1]: error in category %d, not logged\r\n", 1);
+	KLOG_ERROR(0, "[klogtest 1]: error\r\n");
+	KLoggerSetMask(KLOGGER_MASK_DEFAULT);
+
+	DbgPrint("1 ...");
+	DbgPrint("1 Catalog: messages logged by ID, ids %lu and %lu", CatalogConstant.Id, CatalogArgs.Id);
+
+	KLoggerLogId(CatalogConstant.Id);
+	for (INT i = 0; i < 3; ++i) {
+		KLoggerLogId(CatalogArgs.Id, i, "test_driver", (ULONG)KeGetCurrentIrql());
+	}
+
 	PsTerminateSystemThread(ERROR_SUCCESS);
 }
 
@@ -116,6 +141,10 @@ DriverEntry(
 	DbgPrint("[test_driver_1]: 'DriverEntry()' is executed");
 	DriverObject->DriverUnload = DriverUnload;
 
+	INT Err = KLOGGER_REGISTER_CATALOG();
+	if (Err != ERROR_SUCCESS) {
+		DbgPrint("[test_driver_1]: 'KLoggerRegisterCatalog()' returned err = %d", Err);
+	}
 
 	DbgPrint("[test_driver_1]: 'PsCreateSystemThread()' is started");
 	NTSTATUS status = PsCreateSystemThread(
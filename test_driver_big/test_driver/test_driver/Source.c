@@ -113,6 +113,17 @@ VOID ThreadFunc(
 			KeDelayExecutionThread(KernelMode, FALSE, &Interval);
 	}
 
+	KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+
+	KLOGGER_STATS Stats;
+	if (KLoggerGetStats(&Stats) == ERROR_SUCCESS) {
+		DbgPrint("1 Stats: logged %llu (%llu bytes), dropped %llu (%llu bytes), max load factor %lu%%",
+			Stats.MessagesLogged, Stats.BytesLogged, Stats.MessagesDropped, Stats.BytesDropped, Stats.MaxLoadFactor);
+		DbgPrint("1 Stats: flushes %llu by DPC, %llu by TIMEOUT, %llu chunks, %llu bytes in %llu us (max %llu us), %llu bytes/s",
+			Stats.DpcFlushes, Stats.TimeoutFlushes, Stats.FlushedChunks, Stats.FlushedBytes,
+			Stats.FlushTimeUs, Stats.MaxFlushTimeUs, Stats.FlushBytesPerSec);
+	}
+
 	PsTerminateSystemThread(ERROR_SUCCESS);
 }
 
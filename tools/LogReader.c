@@ -0,0 +1,536 @@
+#include "LogReader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "KLoggerFormat.h"
+#include "Compress.h"
+
+#define TICKS_PER_SECOND 10000000ll
+#define ID_ARGS_MAX 64 // more than the driver captures
+#define SPEC_MAX 48
+#define EPOCH_DIFFERENCE 11644473600ll // seconds between 1601 and 1970
+
+void
+LogReaderInit(
+	LOGREADER* Reader,
+	const void* Buf,
+	size_t Size
+) {
+	memset(Reader, 0, sizeof(*Reader));
+	Reader->Start = (const unsigned char*)Buf;
+	Reader->Pos = Reader->Start;
+	Reader->End = Reader->Start + Size;
+	Reader->Frequency = TICKS_PER_SECOND;
+}
+
+static void
+ClearCatalog(
+	LOGREADER* Reader
+) {
+	for (size_t i = 0; i < Reader->CatalogCapacity; ++i) {
+		free(Reader->Catalog[i]);
+		Reader->Catalog[i] = NULL;
+	}
+}
+
+void
+LogReaderFree(
+	LOGREADER* Reader
+) {
+	free(Reader->Frame);
+	Reader->Frame = NULL;
+	Reader->FrameCapacity = 0;
+
+	ClearCatalog(Reader);
+	free(Reader->Catalog);
+	Reader->Catalog = NULL;
+	Reader->CatalogCapacity = 0;
+}
+
+size_t
+LogReaderOffset(
+	const LOGREADER* Reader
+) {
+	return (size_t)((Reader->InFrame ? Reader->OuterPos : Reader->Pos) - Reader->Start);
+}
+
+// restores the raw records of a FRAME payload into Reader->Frame, -1 if it is corrupted
+static int
+ReadFrame(
+	LOGREADER* Reader,
+	const unsigned char* p,
+	const unsigned char* End,
+	size_t RawSize
+) {
+	if (RawSize > Reader->FrameCapacity) {
+		unsigned char* Frame = (unsigned char*)realloc(Reader->Frame, RawSize);
+		if (!Frame) {
+			return -1;
+		}
+		Reader->Frame = Frame;
+		Reader->FrameCapacity = RawSize;
+	}
+
+	size_t Done = 0;
+	while (p < End) {
+		unsigned long long Raw, Stored;
+		if (!(p = KLoggerGetVarint(p, End, &Raw)) ||
+			!(p = KLoggerGetVarint(p, End, &Stored)) ||
+			Stored > (unsigned long long)(End - p) ||
+			Raw > RawSize - Done) {
+			return -1;
+		}
+
+		if (Stored == Raw) {
+			memcpy(Reader->Frame + Done, p, (size_t)Raw);
+		} else if (LZDecompress(p, (size_t)Stored, Reader->Frame + Done, (size_t)Raw) != Raw) {
+			return -1;
+		}
+
+		p += Stored;
+		Done += (size_t)Raw;
+	}
+
+	return Done == RawSize ? 0 : -1;
+}
+
+// -1 if out of memory
+static int
+AddCatalog(
+	LOGREADER* Reader,
+	unsigned long long Id,
+	const unsigned char* Text,
+	size_t Length
+) {
+	if (Id >= Reader->CatalogCapacity) {
+		if (Id >= SIZE_MAX / sizeof(char*) / 2) {
+			return -1;
+		}
+
+		size_t Capacity = Reader->CatalogCapacity ? Reader->CatalogCapacity : 64;
+		while (Capacity <= Id) {
+			Capacity *= 2;
+		}
+
+		char** Catalog = (char**)realloc(Reader->Catalog, Capacity * sizeof(char*));
+		if (!Catalog) {
+			return -1;
+		}
+		memset(Catalog + Reader->CatalogCapacity, 0, (Capacity - Reader->CatalogCapacity) * sizeof(char*));
+		Reader->Catalog = Catalog;
+		Reader->CatalogCapacity = Capacity;
+	}
+
+	char* Format = (char*)malloc(Length + 1);
+	if (!Format) {
+		return -1;
+	}
+	memcpy(Format, Text, Length);
+	Format[Length] = '\0';
+
+	free(Reader->Catalog[Id]);
+	Reader->Catalog[Id] = Format;
+	return 0;
+}
+
+static void
+Append(
+	char* Out,
+	size_t* pLength,
+	const char* Src,
+	size_t Count
+) {
+	size_t Room = LOG_ID_TEXT_MAX - 1 - *pLength;
+	if (Count > Room) {
+		Count = Room;
+	}
+
+	memcpy(Out + *pLength, Src, Count);
+	*pLength += Count;
+}
+
+// the arguments of an ID record put into its catalog format the way the driver formats
+// KLoggerLogf messages (DeferredFormat.c): integers were widened to 64 bits when captured,
+// from a conversion with no argument left on the format goes as it is. -1 if the arguments
+// are corrupted
+static int
+FormatId(
+	LOGREADER* Reader,
+	const char* Format,
+	const unsigned char* p,
+	const unsigned char* End,
+	size_t* pLength
+) {
+	unsigned long long Count, Word;
+	long long Words[ID_ARGS_MAX];
+	if (!(p = KLoggerGetVarint(p, End, &Count)) || Count > ID_ARGS_MAX) {
+		return -1;
+	}
+
+	for (unsigned i = 0; i < Count; ++i) {
+		if (!(p = KLoggerGetVarint(p, End, &Word))) {
+			return -1;
+		}
+		Words[i] = KLoggerUnZigZag(Word);
+	}
+
+	char* Out = Reader->IdText;
+	size_t Length = 0;
+	unsigned Index = 0;
+	const char* f = Format;
+	const char* Percent;
+	while ((Percent = strchr(f, '%')) != NULL && Length + 1 < LOG_ID_TEXT_MAX) {
+		Append(Out, &Length, f, (size_t)(Percent - f));
+
+		// flags, width and precision are kept, '*' replaced with its argument word
+		char Spec[SPEC_MAX];
+		char* s = Spec;
+		const char* c = Percent;
+		*s++ = *c++;
+		while (*c == '-' || *c == '+' || *c == ' ' || *c == '#' || *c == '0') {
+			*s++ = *c++;
+		}
+
+		int IsMissing = 0;
+		for (int Part = 0; Part < 2; ++Part) {
+			if (Part && *c != '.') {
+				break;
+			} else if (Part) {
+				*s++ = *c++;
+			}
+
+			if (*c == '*') {
+				IsMissing |= (Index >= Count);
+				s += snprintf(s, 16, "%d", IsMissing ? 0 : (int)Words[Index++]);
+				c++;
+			} else {
+				while (*c >= '0' && *c <= '9' && s < Spec + SPEC_MAX - 16) {
+					*s++ = *c++;
+				}
+			}
+		}
+
+		int IsWide = 0; // h, l, I and z make %s a wide string, which is not captured
+		if (c[0] == 'h' || c[0] == 'l') {
+			IsWide = 1;
+			c += (c[1] == c[0]) ? 2 : 1;
+		} else if (c[0] == 'I' && ((c[1] == '6' && c[2] == '4') || (c[1] == '3' && c[2] == '2'))) {
+			c += 3;
+		} else if (c[0] == 'I' || c[0] == 'z') {
+			IsWide = 1;
+			c++;
+		}
+
+		if (*c == '%') {
+			Append(Out, &Length, "%", 1);
+			f = c + 1;
+			continue;
+		}
+
+		if (IsMissing || Index >= Count || !*c || !strchr("diuoxXcps", *c) || (*c == 's' && IsWide)) {
+			break;
+		}
+
+		char* Dst = Out + Length;
+		size_t DstSize = LOG_ID_TEXT_MAX - Length;
+		long long Value = Words[Index++];
+		if (*c == 's') {
+			if (Value <= 0 || Value > End - p || p[Value - 1]) {
+				return -1;
+			}
+			strcpy(s, "s");
+			snprintf(Dst, DstSize, Spec, (const char*)p);
+			p += Value;
+		} else if (*c == 'p') {
+			// as the kernel prints pointers
+			snprintf(Dst, DstSize, "%016llX", (unsigned long long)Value);
+		} else if (*c == 'c') {
+			strcpy(s, "c");
+			snprintf(Dst, DstSize, Spec, (int)Value);
+		} else {
+			s[0] = 'l';
+			s[1] = 'l';
+			s[2] = *c;
+			s[3] = '\0';
+			snprintf(Dst, DstSize, Spec, Value);
+		}
+
+		Length += strlen(Dst);
+		f = c + 1;
+	}
+
+	// the rest of the format, from the conversion that could not be done if any
+	const char* Rest = Percent ? Percent : f;
+	Append(Out, &Length, Rest, strlen(Rest));
+
+	*pLength = Length;
+	return 0;
+}
+
+static int64_t
+TicksToSystemTime(
+	const LOGREADER* Reader,
+	int64_t Timestamp
+) {
+	int64_t Delta = Timestamp - Reader->SyncTimestamp;
+	int64_t Seconds = Delta / Reader->Frequency;
+	int64_t Rest = Delta % Reader->Frequency;
+
+	return Reader->SyncSystemTime + Seconds * TICKS_PER_SECOND + Rest * TICKS_PER_SECOND / Reader->Frequency;
+}
+
+int
+LogReaderNext(
+	LOGREADER* Reader,
+	LOGRECORD* Record
+) {
+	const unsigned char* p = Reader->Pos;
+	const unsigned char* End = Reader->End;
+	unsigned long long Timestamp, SystemTime, Frequency, Cpu, Delta, Length, RawSize, Messages, Bytes, Id;
+
+	for (;;) {
+		if (p >= End) {
+			if (!Reader->InFrame) {
+				break;
+			}
+
+			Reader->InFrame = 0;
+			p = Reader->OuterPos;
+			End = Reader->OuterEnd;
+			Reader->Pos = p;
+			Reader->End = End;
+			continue;
+		}
+
+		switch (*p) {
+		case KLOGGER_REC_SESSION:
+			if (End - p < KLOGGER_SESSION_SIZE || memcmp(p, KLOGGER_SESSION_MAGIC, 4)) {
+				return LOG_READ_ERROR;
+			}
+			p += KLOGGER_SESSION_SIZE;
+
+			// IDs are given out by each load
+			ClearCatalog(Reader);
+			break;
+
+		case KLOGGER_REC_CATALOG:
+			if (!(p = KLoggerGetVarint(p + 1, End, &Id)) ||
+				!(p = KLoggerGetVarint(p, End, &Length)) ||
+				Length > (unsigned long long)(End - p) ||
+				AddCatalog(Reader, Id, p, (size_t)Length) != 0) {
+				return LOG_READ_ERROR;
+			}
+
+			p += Length;
+			break;
+
+		case KLOGGER_REC_SYNC:
+			if (!(p = KLoggerGetVarint(p + 1, End, &Timestamp)) ||
+				!(p = KLoggerGetVarint(p, End, &SystemTime)) ||
+				!(p = KLoggerGetVarint(p, End, &Frequency)) ||
+				!Frequency) {
+				return LOG_READ_ERROR;
+			}
+
+			Reader->SyncTimestamp = (int64_t)Timestamp;
+			Reader->SyncSystemTime = (int64_t)SystemTime;
+			Reader->Frequency = (int64_t)Frequency;
+			Reader->PrevTimestamp = (int64_t)Timestamp;
+			break;
+
+		case KLOGGER_REC_MESSAGE:
+			if (End - p < 2) {
+				return LOG_READ_ERROR;
+			}
+
+			Record->Type = p[0];
+			Record->Irql = p[1];
+			if (!(p = KLoggerGetVarint(p + 2, End, &Cpu)) ||
+				!(p = KLoggerGetVarint(p, End, &Delta)) ||
+				!(p = KLoggerGetVarint(p, End, &Length)) ||
+				Length > (unsigned long long)(End - p)) {
+				return LOG_READ_ERROR;
+			}
+
+			Reader->PrevTimestamp += KLoggerUnZigZag(Delta);
+			Record->Cpu = (unsigned)Cpu;
+			Record->Timestamp = Reader->PrevTimestamp;
+			Record->SystemTime = TicksToSystemTime(Reader, Record->Timestamp);
+			Record->Data = (const char*)p;
+			Record->Length = (size_t)Length;
+
+			Reader->Pos = p + Length;
+			return LOG_READ_RECORD;
+
+		case KLOGGER_REC_LOSS:
+			if (End - p < 2) {
+				return LOG_READ_ERROR;
+			}
+
+			Record->Type = p[0];
+			Record->Irql = p[1];
+			if (!(p = KLoggerGetVarint(p + 2, End, &Cpu)) ||
+				!(p = KLoggerGetVarint(p, End, &Delta)) ||
+				!(p = KLoggerGetVarint(p, End, &Messages)) ||
+				!(p = KLoggerGetVarint(p, End, &Bytes))) {
+				return LOG_READ_ERROR;
+			}
+
+			Reader->PrevTimestamp += KLoggerUnZigZag(Delta);
+			Record->Cpu = (unsigned)Cpu;
+			Record->Timestamp = Reader->PrevTimestamp;
+			Record->SystemTime = TicksToSystemTime(Reader, Record->Timestamp);
+			Record->Data = Reader->LossText;
+			Record->Length = (size_t)snprintf(Reader->LossText, sizeof(Reader->LossText),
+				"*** %llu messages / %llu bytes lost ***", Messages, Bytes);
+
+			Reader->Pos = p;
+			return LOG_READ_RECORD;
+
+		case KLOGGER_REC_ID:
+			if (End - p < 2) {
+				return LOG_READ_ERROR;
+			}
+
+			Record->Type = p[0];
+			Record->Irql = p[1];
+			if (!(p = KLoggerGetVarint(p + 2, End, &Cpu)) ||
+				!(p = KLoggerGetVarint(p, End, &Delta)) ||
+				!(p = KLoggerGetVarint(p, End, &Id)) ||
+				!(p = KLoggerGetVarint(p, End, &Length)) ||
+				Length > (unsigned long long)(End - p)) {
+				return LOG_READ_ERROR;
+			}
+
+			Reader->PrevTimestamp += KLoggerUnZigZag(Delta);
+			Record->Cpu = (unsigned)Cpu;
+			Record->Timestamp = Reader->PrevTimestamp;
+			Record->SystemTime = TicksToSystemTime(Reader, Record->Timestamp);
+			Record->Data = Reader->IdText;
+
+			if (Id < Reader->CatalogCapacity && Reader->Catalog[Id]) {
+				if (FormatId(Reader, Reader->Catalog[Id], p, p + Length, &Record->Length) != 0) {
+					return LOG_READ_ERROR;
+				}
+			} else {
+				Record->Length = (size_t)snprintf(Reader->IdText, sizeof(Reader->IdText),
+					"*** message %llu of a catalog not in this file, %llu bytes of arguments ***", Id, Length);
+			}
+
+			Reader->Pos = p + Length;
+			return LOG_READ_RECORD;
+
+		case KLOGGER_REC_FRAME:
+			if (Reader->InFrame ||
+				!(p = KLoggerGetVarint(p + 1, End, &RawSize)) ||
+				!(p = KLoggerGetVarint(p, End, &Length)) ||
+				Length > (unsigned long long)(End - p) ||
+				RawSize > SIZE_MAX ||
+				ReadFrame(Reader, p, p + Length, (size_t)RawSize) != 0) {
+				return LOG_READ_ERROR;
+			}
+
+			Reader->InFrame = 1;
+			Reader->OuterPos = p + Length;
+			Reader->OuterEnd = End;
+			p = Reader->Frame;
+			End = p + RawSize;
+			Reader->End = End;
+			break;
+
+		default:
+			return LOG_READ_ERROR;
+		}
+
+		Reader->Pos = p;
+	}
+
+	return LOG_READ_END;
+}
+
+static char*
+PutDigits(
+	char* Out,
+	unsigned Value,
+	int Width
+) {
+	for (int i = Width - 1; i >= 0; --i) {
+		Out[i] = (char)('0' + Value % 10);
+		Value /= 10;
+	}
+
+	return Out + Width;
+}
+
+static char*
+PutUnsigned(
+	char* Out,
+	unsigned Value
+) {
+	char Digits[10];
+	int Count = 0;
+	do {
+		Digits[Count++] = (char)('0' + Value % 10);
+		Value /= 10;
+	} while (Value);
+
+	while (Count) {
+		*Out++ = Digits[--Count];
+	}
+
+	return Out;
+}
+
+size_t
+LogFormatRecord(
+	const LOGRECORD* Record,
+	char* Out
+) {
+	// date and time change rarely compared to the record rate
+	static __thread int64_t CachedSecond = -1;
+	static __thread char CachedDate[20];
+
+	char* p = Out;
+	int64_t Second = Record->SystemTime / TICKS_PER_SECOND;
+	int64_t Fraction = Record->SystemTime % TICKS_PER_SECOND;
+	if (Fraction < 0) {
+		Second -= 1;
+		Fraction += TICKS_PER_SECOND;
+	}
+
+	if (Second != CachedSecond) {
+		time_t Unix = (time_t)(Second - EPOCH_DIFFERENCE);
+		struct tm Tm;
+		gmtime_r(&Unix, &Tm);
+		strftime(CachedDate, sizeof(CachedDate), "%Y-%m-%d %H:%M:%S", &Tm);
+		CachedSecond = Second;
+	}
+
+	memcpy(p, CachedDate, 19);
+	p += 19;
+	*p++ = '.';
+	p = PutDigits(p, (unsigned)Fraction, 7);
+
+	memcpy(p, " cpu ", 5);
+	p = PutUnsigned(p + 5, Record->Cpu);
+	memcpy(p, " irql ", 6);
+	p = PutUnsigned(p + 6, Record->Irql);
+	*p++ = ':';
+	*p++ = ' ';
+
+	memcpy(p, Record->Data, Record->Length);
+	p += Record->Length;
+
+	// messages usually carry their own line end
+	size_t Length = Record->Length;
+	while (Length && (Record->Data[Length - 1] == '\n' || Record->Data[Length - 1] == '\r')) {
+		Length--;
+		p--;
+	}
+	*p++ = '\n';
+
+	return (size_t)(p - Out);
+}
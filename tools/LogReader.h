@@ -0,0 +1,65 @@
+#pragma once
+
+// host-side reader of the log file format (KLoggerFormat.h)
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct LogRecord {
+	int Type;
+	unsigned Irql;
+	unsigned Cpu;
+	int64_t Timestamp; // performance counter ticks
+	int64_t SystemTime; // 100ns since 1601, from the time base of the chunk
+	const char* Data;
+	size_t Length;
+} LOGRECORD;
+
+#define LOG_ID_TEXT_MAX 8192 // ID records are formatted here, longer text is truncated
+
+typedef struct LogReader {
+	const unsigned char* Start;
+	const unsigned char* Pos;
+	const unsigned char* End;
+
+	// inside a FRAME Pos and End walk its decompressed records, the file resumes at Outer*
+	int InFrame;
+	const unsigned char* OuterPos;
+	const unsigned char* OuterEnd;
+	unsigned char* Frame;
+	size_t FrameCapacity;
+
+	int64_t SyncTimestamp;
+	int64_t SyncSystemTime;
+	int64_t Frequency;
+	int64_t PrevTimestamp;
+
+	char LossText[64]; // Data of the last LOSS record
+
+	// formats by ID, from the CATALOG records since the last SESSION
+	char** Catalog;
+	size_t CatalogCapacity;
+	char IdText[LOG_ID_TEXT_MAX]; // Data of the last ID record
+} LOGREADER;
+
+enum {
+	LOG_READ_ERROR = -1,
+	LOG_READ_END = 0,
+	LOG_READ_RECORD = 1
+};
+
+void LogReaderInit(LOGREADER* Reader, const void* Buf, size_t Size);
+void LogReaderFree(LOGREADER* Reader);
+
+// SYNC, SESSION, FRAME and CATALOG records are consumed internally, messages, LOSS and ID
+// records are returned, LOSS as "*** N messages / M bytes lost ***" and ID ones formatted
+// with the catalog format of their ID. Record->Data is valid until the next call
+int LogReaderNext(LOGREADER* Reader, LOGRECORD* Record);
+
+// file offset of the next record, of its frame for compressed ones
+size_t LogReaderOffset(const LOGREADER* Reader);
+
+// "YYYY-MM-DD hh:mm:ss.fffffff cpu N irql N: message\n", returns the length written,
+// Out must have room for LOG_FORMAT_OVERHEAD + Record->Length bytes
+#define LOG_FORMAT_OVERHEAD 80
+size_t LogFormatRecord(const LOGRECORD* Record, char* Out);
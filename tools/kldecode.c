@@ -0,0 +1,123 @@
+// converts binary log files to text: kldecode klogger.log [-o out.txt]
+// or, for a rotated log, kldecode klogger.*.log [-o out.txt] - segments go in the given order
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LogReader.h"
+
+#define OUT_BUF_SIZE (4u * 1024u * 1024u)
+
+typedef struct OutBuf {
+	FILE* File;
+	char* Buf;
+	size_t Used;
+} OUTBUF;
+
+static int
+DecodeFile(
+	const char* InPath,
+	OUTBUF* Out
+) {
+	int Fd = open(InPath, O_RDONLY);
+	struct stat St;
+	if (Fd < 0 || fstat(Fd, &St)) {
+		perror(InPath);
+		return 1;
+	}
+
+	const void* In = NULL;
+	if (St.st_size) {
+		In = mmap(NULL, (size_t)St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+		if (In == MAP_FAILED) {
+			perror("mmap");
+			close(Fd);
+			return 1;
+		}
+		madvise((void*)In, (size_t)St.st_size, MADV_SEQUENTIAL);
+	}
+
+	LOGREADER Reader;
+	LOGRECORD Record;
+	int Ret;
+	LogReaderInit(&Reader, In, (size_t)St.st_size);
+
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		size_t Needed = LOG_FORMAT_OVERHEAD + Record.Length;
+		if (Out->Used + Needed > OUT_BUF_SIZE) {
+			fwrite(Out->Buf, 1, Out->Used, Out->File);
+			Out->Used = 0;
+		}
+
+		if (Needed > OUT_BUF_SIZE) {
+			char* Big = malloc(Needed);
+			fwrite(Big, 1, LogFormatRecord(&Record, Big), Out->File);
+			free(Big);
+			continue;
+		}
+
+		Out->Used += LogFormatRecord(&Record, Out->Buf + Out->Used);
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		fprintf(stderr, "%s: corrupted record at offset %zu\n", InPath, LogReaderOffset(&Reader));
+	}
+	LogReaderFree(&Reader);
+
+	if (St.st_size) {
+		munmap((void*)In, (size_t)St.st_size);
+	}
+	close(Fd);
+
+	return Ret == LOG_READ_ERROR;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* OutPath = NULL;
+	int InCount = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			OutPath = argv[++i];
+		} else {
+			argv[++InCount] = argv[i];
+		}
+	}
+
+	if (!InCount) {
+		fprintf(stderr, "usage: %s klogger.log... [-o out.txt]\n", argv[0]);
+		return 2;
+	}
+
+	OUTBUF Out;
+	Out.File = OutPath ? fopen(OutPath, "wb") : stdout;
+	if (!Out.File) {
+		perror(OutPath);
+		return 1;
+	}
+
+	Out.Buf = malloc(OUT_BUF_SIZE);
+	Out.Used = 0;
+
+	int Ret = 0;
+	for (int i = 1; i <= InCount; ++i) {
+		Ret |= DecodeFile(argv[i], &Out);
+	}
+
+	fwrite(Out.Buf, 1, Out.Used, Out.File);
+	if (Out.File != stdout) {
+		fclose(Out.File);
+	}
+
+	free(Out.Buf);
+	return Ret;
+}
@@ -0,0 +1,474 @@
+// recovers what the rings still held from a memory image: klrecover image [-o recovered.log] [-j threads] [-l]
+// Rings are found by the header RingBuffer.c puts in front of their records (KLoggerFormat.h),
+// which is cache line aligned. The image is memory-mapped and scanned by -j threads, records
+// between tail and head of every ring are merged by timestamp and written as a log file for
+// kldecode. -l only lists the rings found
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLoggerFormat.h"
+
+#define SCAN_ALIGN 64 // ring headers are cache line aligned
+#define SCAN_STEP (64u * 1024u * 1024u) // of the image taken by a thread at a time
+#define RING_SYNC_SIZE 24 // timestamp, system time, frequency
+#define OUT_BUF_SIZE (4u * 1024u * 1024u)
+#define TICKS_PER_SECOND 10000000ll
+
+typedef struct RecoveredRecord {
+	KLOGGER_RECORD Header;
+	const unsigned char* Body; // Header.Length bytes in the image
+} RECOVEREDRECORD;
+
+typedef struct Ring {
+	size_t Offset; // of the header in the image
+	unsigned long long Capacity;
+	long long Head;
+	long long Tail;
+	long long SyncTimestamp;
+	long long SyncSystemTime;
+	long long SyncFrequency;
+	const unsigned char* Data;
+
+	RECOVEREDRECORD* Records; // in ring order
+	size_t Count;
+	size_t Next; // merged so far
+	size_t Uncommitted; // reserved by writers that did not finish
+	long long BrokenAt; // position the record framing stopped making sense at, -1 - none
+} RING;
+
+typedef struct Scan {
+	const unsigned char* Image;
+	size_t Size;
+	size_t NextStep; // taken by the threads with __sync_fetch_and_add
+	size_t NextRing;
+
+	pthread_mutex_t Lock; // Rings
+	RING* Rings;
+	size_t RingCount;
+	size_t RingCapacity;
+} SCAN;
+
+static long long
+ReadI64(
+	const unsigned char* p
+) {
+	long long v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned
+ReadU32(
+	const unsigned char* p
+) {
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// a header the image actually holds a ring behind, not only the magic
+static int
+ReadRingHeader(
+	const SCAN* Scan,
+	size_t Offset,
+	RING* Ring
+) {
+	const unsigned char* p = Scan->Image + Offset;
+	unsigned HeaderSize = ReadU32(p + KLOGGER_RING_HEADER_SIZE_OFFSET);
+	if (ReadU32(p + KLOGGER_RING_VERSION_OFFSET) != KLOGGER_RING_VERSION ||
+		HeaderSize < KLOGGER_RING_SYNC_OFFSET + RING_SYNC_SIZE ||
+		HeaderSize % KLOGGER_RING_RECORD_ALIGN ||
+		HeaderSize > Scan->Size - Offset) {
+		return 0;
+	}
+
+	memset(Ring, 0, sizeof(*Ring));
+	Ring->Offset = Offset;
+	Ring->Capacity = (unsigned long long)ReadI64(p + KLOGGER_RING_CAPACITY_OFFSET);
+	Ring->Head = ReadI64(p + KLOGGER_RING_HEAD_OFFSET);
+	Ring->Tail = ReadI64(p + KLOGGER_RING_TAIL_OFFSET);
+	Ring->SyncTimestamp = ReadI64(p + KLOGGER_RING_SYNC_OFFSET);
+	Ring->SyncSystemTime = ReadI64(p + KLOGGER_RING_SYNC_OFFSET + 8);
+	Ring->SyncFrequency = ReadI64(p + KLOGGER_RING_SYNC_OFFSET + 16);
+	Ring->Data = p + HeaderSize;
+	Ring->BrokenAt = -1;
+
+	return Ring->Capacity >= 2 * KLOGGER_RING_RECORD_HEADER_SIZE &&
+		!(Ring->Capacity % KLOGGER_RING_RECORD_ALIGN) &&
+		Ring->Capacity <= Scan->Size - Offset - HeaderSize &&
+		Ring->Tail >= 0 &&
+		Ring->Head >= Ring->Tail &&
+		(unsigned long long)(Ring->Head - Ring->Tail) <= Ring->Capacity;
+}
+
+static void
+AddRing(
+	SCAN* Scan,
+	const RING* Ring
+) {
+	pthread_mutex_lock(&Scan->Lock);
+	if (Scan->RingCount == Scan->RingCapacity) {
+		Scan->RingCapacity = Scan->RingCapacity ? 2 * Scan->RingCapacity : 16;
+		Scan->Rings = (RING*)realloc(Scan->Rings, Scan->RingCapacity * sizeof(RING));
+	}
+	Scan->Rings[Scan->RingCount++] = *Ring;
+	pthread_mutex_unlock(&Scan->Lock);
+}
+
+static void*
+ScanThread(
+	void* Arg
+) {
+	SCAN* Scan = (SCAN*)Arg;
+	unsigned long long Magic;
+	memcpy(&Magic, KLOGGER_RING_MAGIC, sizeof(Magic));
+
+	size_t Begin;
+	while ((Begin = __sync_fetch_and_add(&Scan->NextStep, SCAN_STEP)) < Scan->Size) {
+		size_t End = (Scan->Size - Begin > SCAN_STEP) ? Begin + SCAN_STEP : Scan->Size;
+		for (size_t Offset = Begin; Offset + SCAN_ALIGN <= End; Offset += SCAN_ALIGN) {
+			unsigned long long Word;
+			memcpy(&Word, Scan->Image + Offset, sizeof(Word));
+			if (Word != Magic) {
+				continue;
+			}
+
+			RING Ring;
+			if (ReadRingHeader(Scan, Offset, &Ring)) {
+				AddRing(Scan, &Ring);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// walks the records from tail to head. Records writers did not commit are skipped while
+// their length holds, the walk stops where the framing breaks
+static void
+RecoverRing(
+	RING* Ring
+) {
+	size_t Capacity = 0;
+	long long Pos = Ring->Tail;
+	while (Pos < Ring->Head) {
+		unsigned long long Offset = (unsigned long long)Pos % Ring->Capacity;
+		if (Ring->Capacity - Offset < KLOGGER_RING_RECORD_HEADER_SIZE) {
+			break;
+		}
+
+		const unsigned char* p = Ring->Data + Offset;
+		unsigned Length = ReadU32(p);
+		unsigned State = ReadU32(p + 4);
+		if (Length < KLOGGER_RING_RECORD_HEADER_SIZE ||
+			Length % KLOGGER_RING_RECORD_ALIGN ||
+			Length > Ring->Capacity - Offset) {
+			break;
+		}
+
+		Pos += Length;
+		if (!(State & KLOGGER_RING_COMMITTED)) {
+			Ring->Uncommitted++;
+			continue;
+		}
+
+		if (State & KLOGGER_RING_PADDING) {
+			continue;
+		}
+
+		RECOVEREDRECORD Record;
+		size_t Size = State >> KLOGGER_RING_SIZE_SHIFT;
+		if (Size < sizeof(KLOGGER_RECORD) || Size > Length - KLOGGER_RING_RECORD_HEADER_SIZE) {
+			Pos -= Length;
+			break;
+		}
+
+		memcpy(&Record.Header, p + KLOGGER_RING_RECORD_HEADER_SIZE, sizeof(KLOGGER_RECORD));
+		if (Record.Header.Length > Size - sizeof(KLOGGER_RECORD)) {
+			Pos -= Length;
+			break;
+		}
+
+		Record.Body = p + KLOGGER_RING_RECORD_HEADER_SIZE + sizeof(KLOGGER_RECORD);
+		if (Ring->Count == Capacity) {
+			Capacity = Capacity ? 2 * Capacity : 1024;
+			Ring->Records = (RECOVEREDRECORD*)realloc(Ring->Records, Capacity * sizeof(RECOVEREDRECORD));
+		}
+		Ring->Records[Ring->Count++] = Record;
+	}
+
+	if (Pos < Ring->Head) {
+		Ring->BrokenAt = Pos;
+	}
+}
+
+static void*
+RecoverThread(
+	void* Arg
+) {
+	SCAN* Scan = (SCAN*)Arg;
+
+	size_t i;
+	while ((i = __sync_fetch_and_add(&Scan->NextRing, 1)) < Scan->RingCount) {
+		RecoverRing(&Scan->Rings[i]);
+	}
+
+	return NULL;
+}
+
+static void
+RunThreads(
+	SCAN* Scan,
+	int ThreadCount,
+	void* (*Func)(void*)
+) {
+	pthread_t* Threads = (pthread_t*)calloc((size_t)ThreadCount, sizeof(pthread_t));
+	for (int i = 0; i < ThreadCount; ++i) {
+		pthread_create(&Threads[i], NULL, Func, Scan);
+	}
+	for (int i = 0; i < ThreadCount; ++i) {
+		pthread_join(Threads[i], NULL);
+	}
+	free(Threads);
+}
+
+static int
+CompareRings(
+	const void* a,
+	const void* b
+) {
+	const RING* Left = (const RING*)a;
+	const RING* Right = (const RING*)b;
+	return (Left->Offset > Right->Offset) - (Left->Offset < Right->Offset);
+}
+
+static void
+Flush(
+	FILE* File,
+	unsigned char* Buf,
+	size_t* pUsed,
+	size_t Needed
+) {
+	if (*pUsed + Needed > OUT_BUF_SIZE) {
+		fwrite(Buf, 1, *pUsed, File);
+		*pUsed = 0;
+	}
+}
+
+// a session, one SYNC with the newest time base of the rings, then all records merged
+// by timestamp the way the flushing thread does it
+static size_t
+WriteLog(
+	SCAN* Scan,
+	FILE* File
+) {
+	const RING* Base = NULL;
+	for (size_t i = 0; i < Scan->RingCount; ++i) {
+		const RING* Ring = &Scan->Rings[i];
+		if (Ring->SyncFrequency > 0 && (!Base || Ring->SyncSystemTime > Base->SyncSystemTime)) {
+			Base = Ring;
+		}
+	}
+
+	long long SyncTimestamp = Base ? Base->SyncTimestamp : 0;
+	long long SyncSystemTime = Base ? Base->SyncSystemTime : 0;
+	long long Frequency = Base ? Base->SyncFrequency : TICKS_PER_SECOND;
+	if (!Base) {
+		fprintf(stderr, "no ring was ever flushed, times are relative to an unknown start\n");
+	}
+
+	unsigned char* Buf = (unsigned char*)malloc(OUT_BUF_SIZE);
+	size_t Used = 0;
+
+	unsigned char Session[KLOGGER_SESSION_SIZE] = KLOGGER_SESSION_MAGIC;
+	Session[KLOGGER_SESSION_SIZE - 1] = KLOGGER_FORMAT_VERSION;
+	memcpy(Buf, Session, sizeof(Session));
+	Used += sizeof(Session);
+
+	unsigned char* Out = Buf + Used;
+	*Out++ = KLOGGER_REC_SYNC;
+	Out = KLoggerPutVarint(Out, (unsigned long long)SyncTimestamp);
+	Out = KLoggerPutVarint(Out, (unsigned long long)SyncSystemTime);
+	Out = KLoggerPutVarint(Out, (unsigned long long)Frequency);
+	Used = (size_t)(Out - Buf);
+
+	long long PrevTimestamp = SyncTimestamp;
+	size_t Written = 0;
+	while (1) {
+		RING* Min = NULL;
+		for (size_t i = 0; i < Scan->RingCount; ++i) {
+			RING* Ring = &Scan->Rings[i];
+			if (Ring->Next < Ring->Count &&
+				(!Min || Ring->Records[Ring->Next].Header.Timestamp < Min->Records[Min->Next].Header.Timestamp)) {
+				Min = Ring;
+			}
+		}
+
+		if (!Min) {
+			break;
+		}
+
+		const RECOVEREDRECORD* Record = &Min->Records[Min->Next++];
+		const KLOGGER_RECORD* Header = &Record->Header;
+		const unsigned char* Body = Record->Body;
+		size_t Length = Header->Length;
+		char Text[96];
+
+		if (Header->Type == KLOGGER_RING_FORMAT) {
+			// the format string is a pointer into the driver image, it can't be followed here
+			Length = (size_t)snprintf(Text, sizeof(Text), "[deferred format message, %u bytes not recovered]\n", Header->Length);
+			Body = (const unsigned char*)Text;
+		} else if (Header->Type == KLOGGER_RING_ID && Length >= sizeof(KLOGGER_ID_ARGS)) {
+			// formats are registered in driver memory and written to the log file only
+			KLOGGER_ID_ARGS Args;
+			memcpy(&Args, Body, sizeof(Args));
+			Length = (size_t)snprintf(Text, sizeof(Text), "[catalog message %u, %u arguments not recovered]\n", Args.Id, Args.Count);
+			Body = (const unsigned char*)Text;
+		} else if (Header->Type != KLOGGER_REC_MESSAGE &&
+			!(Header->Type == KLOGGER_REC_LOSS && Length == sizeof(KLOGGER_LOSS))) {
+			continue;
+		}
+
+		Flush(File, Buf, &Used, KLOGGER_LOSS_MAX + KLOGGER_MESSAGE_HEADER_MAX);
+		Out = Buf + Used;
+		*Out++ = (Header->Type == KLOGGER_REC_LOSS) ? KLOGGER_REC_LOSS : KLOGGER_REC_MESSAGE;
+		*Out++ = Header->Irql;
+		Out = KLoggerPutVarint(Out, Header->Cpu);
+		Out = KLoggerPutVarint(Out, KLoggerZigZag(Header->Timestamp - PrevTimestamp));
+		PrevTimestamp = Header->Timestamp;
+
+		if (Header->Type == KLOGGER_REC_LOSS) {
+			KLOGGER_LOSS Loss;
+			memcpy(&Loss, Body, sizeof(Loss));
+			Out = KLoggerPutVarint(Out, Loss.Messages);
+			Out = KLoggerPutVarint(Out, Loss.Bytes);
+			Used = (size_t)(Out - Buf);
+		} else {
+			Out = KLoggerPutVarint(Out, Length);
+			Used = (size_t)(Out - Buf);
+			if (Length > OUT_BUF_SIZE - Used) {
+				fwrite(Buf, 1, Used, File);
+				fwrite(Body, 1, Length, File);
+				Used = 0;
+			} else {
+				Flush(File, Buf, &Used, Length);
+				memcpy(Buf + Used, Body, Length);
+				Used += Length;
+			}
+		}
+
+		Written++;
+	}
+
+	fwrite(Buf, 1, Used, File);
+	free(Buf);
+	return Written;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* InPath = NULL;
+	const char* OutPath = "recovered.log";
+	int ThreadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int IsList = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			OutPath = argv[++i];
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			ThreadCount = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-l")) {
+			IsList = 1;
+		} else if (!InPath) {
+			InPath = argv[i];
+		} else {
+			InPath = NULL;
+			break;
+		}
+	}
+
+	if (!InPath) {
+		fprintf(stderr, "usage: %s image [-o recovered.log] [-j threads] [-l]\n", argv[0]);
+		return 2;
+	}
+
+	if (ThreadCount < 1) {
+		ThreadCount = 1;
+	}
+
+	int Fd = open(InPath, O_RDONLY);
+	struct stat St;
+	if (Fd < 0 || fstat(Fd, &St)) {
+		perror(InPath);
+		return 1;
+	}
+
+	SCAN Scan;
+	memset(&Scan, 0, sizeof(Scan));
+	pthread_mutex_init(&Scan.Lock, NULL);
+	Scan.Size = (size_t)St.st_size;
+	if (Scan.Size) {
+		Scan.Image = (const unsigned char*)mmap(NULL, Scan.Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+		if (Scan.Image == MAP_FAILED) {
+			perror("mmap");
+			close(Fd);
+			return 1;
+		}
+		madvise((void*)Scan.Image, Scan.Size, MADV_SEQUENTIAL);
+	}
+
+	RunThreads(&Scan, ThreadCount, ScanThread);
+	qsort(Scan.Rings, Scan.RingCount, sizeof(RING), CompareRings);
+	RunThreads(&Scan, ThreadCount, RecoverThread);
+
+	for (size_t i = 0; i < Scan.RingCount; ++i) {
+		const RING* Ring = &Scan.Rings[i];
+		fprintf(IsList ? stdout : stderr,
+			"ring at 0x%zx: capacity %llu, %lld bytes unflushed, %zu records, %zu uncommitted",
+			Ring->Offset,
+			Ring->Capacity,
+			Ring->Head - Ring->Tail,
+			Ring->Count,
+			Ring->Uncommitted);
+		if (Ring->BrokenAt >= 0) {
+			fprintf(IsList ? stdout : stderr, ", framing breaks %lld bytes before head", Ring->Head - Ring->BrokenAt);
+		}
+		fprintf(IsList ? stdout : stderr, "\n");
+	}
+
+	int Ret = 0;
+	if (!IsList) {
+		FILE* Out = fopen(OutPath, "wb");
+		if (!Out) {
+			perror(OutPath);
+			Ret = 1;
+		} else {
+			size_t Written = WriteLog(&Scan, Out);
+			fclose(Out);
+			fprintf(stderr, "%zu rings, %zu records written to %s\n", Scan.RingCount, Written, OutPath);
+		}
+	}
+
+	for (size_t i = 0; i < Scan.RingCount; ++i) {
+		free(Scan.Rings[i].Records);
+	}
+	free(Scan.Rings);
+
+	if (Scan.Size) {
+		munmap((void*)Scan.Image, Scan.Size);
+	}
+	close(Fd);
+
+	return Ret || !Scan.RingCount;
+}
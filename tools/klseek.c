@@ -0,0 +1,476 @@
+// extracts a time or sequence range of an indexed log without reading all of it:
+// klseek klogger.log... -t from_ms,to_ms [-o out.txt]
+// klseek klogger.log... -q first,last [-s session] [-o out.txt]
+// klseek klogger.log... -l
+// The driver writes the sidecar "<file>.idx" with INDEX_KB set, see KLoggerFormat.h. Times are
+// milliseconds since 1970 UTC (date +%s%3N), either end may be left out. Sequence numbers count
+// the messages and LOSS records of one load from 0, sessions (loads) are numbered from 1 across
+// the given files, the last one by default. Segments go in the given order, as for kldecode.
+// The entries are binary-searched, decoding starts one entry before the range and stops one entry
+// after it, since a message committed late can be older than the first one of its chunk.
+// -l lists the entries. Files without an index are decoded from the start for -t
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLoggerFormat.h"
+#include "LogReader.h"
+
+#define OUT_BUF_SIZE (4u * 1024u * 1024u)
+#define TICKS_PER_MS 10000ll
+#define EPOCH_DIFFERENCE_MS 11644473600000ll // between 1601 and 1970
+#define NO_SEQUENCE UINT64_MAX // entry standing for a file without an index
+
+typedef struct LogInput {
+	const char* Path;
+	const unsigned char* Data;
+	size_t Size;
+} LOGINPUT;
+
+typedef struct IndexEntry {
+	int File;
+	uint64_t Offset;
+	int64_t SystemTime;
+	uint64_t Sequence;
+} INDEXENTRY;
+
+typedef struct Seek {
+	LOGINPUT* Files;
+	int FileCount;
+	INDEXENTRY* Entries;
+	size_t EntryCount;
+	size_t EntryCapacity;
+} SEEK;
+
+typedef struct OutBuf {
+	FILE* File;
+	char* Buf;
+	size_t Used;
+} OUTBUF;
+
+static int
+MapFile(
+	const char* Path,
+	const unsigned char** pData,
+	size_t* pSize
+) {
+	int Fd = open(Path, O_RDONLY);
+	struct stat St;
+	if (Fd < 0 || fstat(Fd, &St)) {
+		if (Fd >= 0) {
+			close(Fd);
+		}
+		return -1;
+	}
+
+	*pData = NULL;
+	*pSize = (size_t)St.st_size;
+	if (St.st_size) {
+		*pData = mmap(NULL, (size_t)St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+		if (*pData == MAP_FAILED) {
+			close(Fd);
+			return -1;
+		}
+	}
+
+	close(Fd);
+	return 0;
+}
+
+static void
+AddEntry(
+	SEEK* Seek,
+	const INDEXENTRY* Entry
+) {
+	if (Seek->EntryCount == Seek->EntryCapacity) {
+		Seek->EntryCapacity = Seek->EntryCapacity ? 2 * Seek->EntryCapacity : 1024;
+		Seek->Entries = realloc(Seek->Entries, Seek->EntryCapacity * sizeof(INDEXENTRY));
+	}
+
+	Seek->Entries[Seek->EntryCount++] = *Entry;
+}
+
+// entries of a file without an index, or past its end after a crash, are left out.
+// A file that is not indexed gets one entry at its start with the time of the previous one,
+// so times stay sorted for the search
+static int
+LoadIndex(
+	SEEK* Seek,
+	int File
+) {
+	LOGINPUT* Input = &(Seek->Files[File]);
+	size_t PathLength = strlen(Input->Path);
+	char* Path = malloc(PathLength + sizeof(".idx"));
+	memcpy(Path, Input->Path, PathLength);
+	memcpy(Path + PathLength, ".idx", sizeof(".idx"));
+
+	const unsigned char* Data;
+	size_t Size;
+	int Ret = MapFile(Path, &Data, &Size);
+	if (!Ret && (Size < KLOGGER_INDEX_HEADER_SIZE || memcmp(Data, KLOGGER_INDEX_MAGIC, 4))) {
+		fprintf(stderr, "%s: not a log index\n", Path);
+		if (Size) {
+			munmap((void*)Data, Size);
+		}
+		Ret = -1;
+	}
+
+	if (Ret) {
+		INDEXENTRY Entry;
+		Entry.File = File;
+		Entry.Offset = 0;
+		Entry.SystemTime = Seek->EntryCount ? Seek->Entries[Seek->EntryCount - 1].SystemTime : INT64_MIN;
+		Entry.Sequence = NO_SEQUENCE;
+		AddEntry(Seek, &Entry);
+
+		free(Path);
+		return -1;
+	}
+
+	for (size_t Pos = KLOGGER_INDEX_HEADER_SIZE; Pos + sizeof(KLOGGER_INDEX_ENTRY) <= Size; Pos += sizeof(KLOGGER_INDEX_ENTRY)) {
+		KLOGGER_INDEX_ENTRY Raw;
+		memcpy(&Raw, Data + Pos, sizeof(Raw));
+		if (Raw.Offset >= Input->Size) {
+			break;
+		}
+
+		INDEXENTRY Entry;
+		Entry.File = File;
+		Entry.Offset = Raw.Offset;
+		Entry.SystemTime = Raw.SystemTime;
+		Entry.Sequence = Raw.Sequence;
+		AddEntry(Seek, &Entry);
+	}
+
+	munmap((void*)Data, Size);
+	free(Path);
+	return 0;
+}
+
+// first entry in [Begin, End) with a time after Time
+static size_t
+UpperBoundTime(
+	const SEEK* Seek,
+	size_t Begin,
+	size_t End,
+	int64_t Time
+) {
+	while (Begin < End) {
+		size_t Middle = Begin + (End - Begin) / 2;
+		if (Seek->Entries[Middle].SystemTime <= Time) {
+			Begin = Middle + 1;
+		} else {
+			End = Middle;
+		}
+	}
+
+	return Begin;
+}
+
+// first entry in [Begin, End) with a sequence number after Sequence
+static size_t
+UpperBoundSequence(
+	const SEEK* Seek,
+	size_t Begin,
+	size_t End,
+	uint64_t Sequence
+) {
+	while (Begin < End) {
+		size_t Middle = Begin + (End - Begin) / 2;
+		if (Seek->Entries[Middle].Sequence <= Sequence) {
+			Begin = Middle + 1;
+		} else {
+			End = Middle;
+		}
+	}
+
+	return Begin;
+}
+
+static void
+Emit(
+	OUTBUF* Out,
+	const LOGRECORD* Record
+) {
+	size_t Needed = LOG_FORMAT_OVERHEAD + Record->Length;
+	if (Out->Used + Needed > OUT_BUF_SIZE) {
+		fwrite(Out->Buf, 1, Out->Used, Out->File);
+		Out->Used = 0;
+	}
+
+	if (Needed > OUT_BUF_SIZE) {
+		char* Big = malloc(Needed);
+		fwrite(Big, 1, LogFormatRecord(Record, Big), Out->File);
+		free(Big);
+		return;
+	}
+
+	Out->Used += LogFormatRecord(Record, Out->Buf + Out->Used);
+}
+
+// decodes from entry Start up to entry Stop (Seek->EntryCount - to the end of the last file).
+// Times are kept within [From, To], sequence numbers within [First, Last] counted from
+// Sequence at Start, past Last decoding ends
+static int
+Extract(
+	const SEEK* Seek,
+	size_t Start,
+	size_t Stop,
+	int64_t From,
+	int64_t To,
+	uint64_t Sequence,
+	uint64_t First,
+	uint64_t Last,
+	OUTBUF* Out
+) {
+	int StopFile = (Stop < Seek->EntryCount) ? Seek->Entries[Stop].File : Seek->FileCount;
+	uint64_t StopOffset = (Stop < Seek->EntryCount) ? Seek->Entries[Stop].Offset : 0;
+	int Ret = 0;
+
+	for (int File = Seek->Entries[Start].File; File < Seek->FileCount; ++File) {
+		const LOGINPUT* Input = &(Seek->Files[File]);
+		size_t Base = (File == Seek->Entries[Start].File) ? (size_t)Seek->Entries[Start].Offset : 0;
+		if (File == StopFile && Base >= StopOffset) {
+			break;
+		}
+
+		LOGREADER Reader;
+		LOGRECORD Record;
+		int Read = LOG_READ_END;
+		LogReaderInit(&Reader, Input->Data + Base, Input->Size - Base);
+
+		while (!(File == StopFile && Base + LogReaderOffset(&Reader) >= StopOffset) &&
+			(Read = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+			if (Sequence > Last) {
+				break;
+			}
+
+			if (Record.SystemTime >= From && Record.SystemTime <= To && Sequence >= First) {
+				Emit(Out, &Record);
+			}
+			Sequence++;
+		}
+
+		if (Read == LOG_READ_ERROR) {
+			fprintf(stderr, "%s: corrupted record at offset %zu\n", Input->Path, Base + LogReaderOffset(&Reader));
+			Ret = 1;
+		}
+		LogReaderFree(&Reader);
+
+		if (File == StopFile || Sequence > Last) {
+			break;
+		}
+	}
+
+	return Ret;
+}
+
+static void
+ListEntries(
+	const SEEK* Seek
+) {
+	printf("file,offset,time_ms,sequence\n");
+	for (size_t i = 0; i < Seek->EntryCount; ++i) {
+		const INDEXENTRY* Entry = &(Seek->Entries[i]);
+		if (Entry->Sequence == NO_SEQUENCE) {
+			continue;
+		}
+
+		printf("%s,%llu,%lld,%llu\n",
+			Seek->Files[Entry->File].Path,
+			(unsigned long long)Entry->Offset,
+			(long long)(Entry->SystemTime / TICKS_PER_MS - EPOCH_DIFFERENCE_MS),
+			(unsigned long long)Entry->Sequence);
+	}
+}
+
+// "a,b", "a," or ",b", missing ends are left as they are
+static int
+ParseRange(
+	const char* Arg,
+	long long* pFrom,
+	long long* pTo
+) {
+	char* End;
+	if (*Arg != ',') {
+		*pFrom = strtoll(Arg, &End, 0);
+		if (End == Arg) {
+			return -1;
+		}
+		Arg = End;
+	}
+
+	if (*Arg++ != ',') {
+		return -1;
+	}
+
+	if (*Arg) {
+		*pTo = strtoll(Arg, &End, 0);
+		if (*End) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+Usage(
+	const char* Name
+) {
+	fprintf(stderr, "usage: %s klogger.log... (-t from_ms,to_ms | -q first,last [-s session] | -l) [-o out.txt]\n", Name);
+	return 2;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* OutPath = NULL;
+	long long FromMs = LLONG_MIN, ToMs = LLONG_MAX; // not given
+	long long First = 0, Last = LLONG_MAX;
+	long long Session = 0;
+	int IsTime = 0, IsSequence = 0, IsList = 0;
+	int InCount = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			OutPath = argv[++i];
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			if (ParseRange(argv[++i], &FromMs, &ToMs)) {
+				return Usage(argv[0]);
+			}
+			IsTime = 1;
+		} else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+			if (ParseRange(argv[++i], &First, &Last) || First < 0) {
+				return Usage(argv[0]);
+			}
+			IsSequence = 1;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			Session = atoll(argv[++i]);
+		} else if (!strcmp(argv[i], "-l")) {
+			IsList = 1;
+		} else {
+			argv[++InCount] = argv[i];
+		}
+	}
+
+	if (!InCount || IsTime + IsSequence + IsList != 1) {
+		return Usage(argv[0]);
+	}
+
+	SEEK Seek = { 0 };
+	Seek.Files = calloc((size_t)InCount, sizeof(LOGINPUT));
+	Seek.FileCount = InCount;
+	int Unindexed = 0;
+	for (int i = 0; i < InCount; ++i) {
+		Seek.Files[i].Path = argv[i + 1];
+		if (MapFile(Seek.Files[i].Path, &(Seek.Files[i].Data), &(Seek.Files[i].Size))) {
+			perror(Seek.Files[i].Path);
+			return 1;
+		}
+
+		if (LoadIndex(&Seek, i)) {
+			fprintf(stderr, "%s: no index, decoded from the start\n", Seek.Files[i].Path);
+			Unindexed++;
+		}
+	}
+
+	if (IsList) {
+		ListEntries(&Seek);
+		return 0;
+	}
+
+	if (!Seek.EntryCount) {
+		return 0;
+	}
+
+	size_t Start, Stop;
+	int64_t From = INT64_MIN, To = INT64_MAX;
+	uint64_t Sequence = 0, FirstSequence = 0, LastSequence = UINT64_MAX;
+
+	if (IsTime) {
+		if (FromMs != LLONG_MIN) {
+			From = (FromMs + EPOCH_DIFFERENCE_MS) * TICKS_PER_MS;
+		}
+		if (ToMs != LLONG_MAX) {
+			To = (ToMs + EPOCH_DIFFERENCE_MS) * TICKS_PER_MS + TICKS_PER_MS - 1;
+		}
+
+		// one entry of slack on either side
+		Start = UpperBoundTime(&Seek, 0, Seek.EntryCount, From);
+		Start = (Start >= 2) ? Start - 2 : 0;
+		Stop = UpperBoundTime(&Seek, 0, Seek.EntryCount, To);
+		Stop = (Stop + 1 < Seek.EntryCount) ? Stop + 1 : Seek.EntryCount;
+	} else {
+		if (Unindexed) {
+			fprintf(stderr, "-q needs every file indexed\n");
+			return 1;
+		}
+
+		// a load starts with sequence number 0, it ends where the next one starts
+		long long Sessions = 0;
+		for (size_t i = 0; i < Seek.EntryCount; ++i) {
+			Sessions += !Seek.Entries[i].Sequence;
+		}
+
+		if (Session <= 0) {
+			Session = Sessions;
+		}
+
+		if (Session < 1 || Session > Sessions) {
+			fprintf(stderr, "no session %lld, the files have %lld\n", Session, Sessions);
+			return 1;
+		}
+
+		size_t Begin = 0, End = Seek.EntryCount;
+		for (size_t i = 0, Count = 0; i < Seek.EntryCount; ++i) {
+			if (Seek.Entries[i].Sequence) {
+				continue;
+			}
+
+			Count++;
+			if ((long long)Count == Session) {
+				Begin = i;
+			} else if ((long long)Count == Session + 1) {
+				End = i;
+				break;
+			}
+		}
+
+		Start = UpperBoundSequence(&Seek, Begin, End, (uint64_t)First);
+		Start = (Start > Begin) ? Start - 1 : Begin;
+		Stop = End;
+		Sequence = Seek.Entries[Start].Sequence;
+		FirstSequence = (uint64_t)First;
+		LastSequence = (uint64_t)Last;
+	}
+
+	OUTBUF Out;
+	Out.File = OutPath ? fopen(OutPath, "wb") : stdout;
+	if (!Out.File) {
+		perror(OutPath);
+		return 1;
+	}
+
+	Out.Buf = malloc(OUT_BUF_SIZE);
+	Out.Used = 0;
+
+	int Ret = Extract(&Seek, Start, Stop, From, To, Sequence, FirstSequence, LastSequence, &Out);
+
+	fwrite(Out.Buf, 1, Out.Used, Out.File);
+	if (Out.File != stdout) {
+		fclose(Out.File);
+	}
+
+	free(Out.Buf);
+	return Ret;
+}
@@ -0,0 +1,424 @@
+// follows live rings as they are written: kltail [name] [-n] [-i interval_us]
+// The driver shares them with LIVE_TAIL (KLOGGER_CONFIG LiveName) as sections "<name>.<ring>",
+// "Global\<name>.<ring>" for user mode on Windows. Here they are "$KLOGGER_SHM_DIR/<name>.<ring>",
+// /dev/shm by default, the user-mode build puts them there. The name is KLogger by default.
+// Rings are mapped read-only and records are formatted straight from them, nothing is copied
+// and the flushing thread is not waited for. What the rings still hold is printed first, -n starts
+// at new records. Records a poll finds are merged by timestamp across rings, records the flushing
+// thread released before they were read are counted as missed. Polls are -i microseconds apart
+// while there is nothing new, kltail exits when all rings are gone
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "KLoggerFormat.h"
+#include "LogReader.h"
+
+#define DEFAULT_NAME "KLogger"
+#define DEFAULT_INTERVAL_US 100
+#define MAX_RINGS 1024
+#define TICKS_PER_SECOND 10000000ll
+#define TEXT_MAX 96 // placeholders and LOSS records
+
+typedef struct LiveRing {
+	int Index;
+	const unsigned char* Base; // the header, mapped read-only
+	size_t MapSize;
+	const unsigned char* Data;
+	unsigned long long Capacity;
+	int IsGone; // the magic was cleared, the ring is freed
+
+	long long Pos; // of the next record to print
+	unsigned Length; // of the record at Pos, as PeekRecord found it
+	long long End; // of the committed records the current poll found
+	unsigned long long Missed; // bytes released before they were read
+
+	long long SyncTimestamp;
+	long long SyncSystemTime;
+	long long SyncFrequency;
+} LIVERING;
+
+typedef struct Output {
+	char* Buf;
+	size_t Used;
+	size_t Capacity;
+} OUTPUT;
+
+static long long
+Load64(
+	const LIVERING* Ring,
+	size_t Offset
+) {
+	return __atomic_load_n((const long long*)(Ring->Base + Offset), __ATOMIC_ACQUIRE);
+}
+
+static unsigned
+Load32(
+	const unsigned char* p
+) {
+	return __atomic_load_n((const unsigned*)p, __ATOMIC_ACQUIRE);
+}
+
+// records before it may be zeroed or written again any time
+static long long
+Floor(
+	const LIVERING* Ring
+) {
+	long long Tail = Load64(Ring, KLOGGER_RING_TAIL_OFFSET);
+	long long Release = Load64(Ring, KLOGGER_RING_RELEASE_OFFSET);
+	return (Release > Tail) ? Release : Tail;
+}
+
+static int
+OpenRing(
+	const char* Path,
+	int Index,
+	LIVERING* Ring
+) {
+	int Fd = open(Path, O_RDONLY | O_CLOEXEC);
+	struct stat St;
+	if (Fd < 0 || fstat(Fd, &St)) {
+		if (Fd >= 0) {
+			close(Fd);
+		}
+		return 0;
+	}
+
+	memset(Ring, 0, sizeof(*Ring));
+	Ring->Index = Index;
+	Ring->MapSize = (size_t)St.st_size;
+	if (Ring->MapSize < KLOGGER_RING_RELEASE_OFFSET + 8) {
+		close(Fd);
+		fprintf(stderr, "%s: not a live ring\n", Path);
+		return 0;
+	}
+
+	Ring->Base = (const unsigned char*)mmap(NULL, Ring->MapSize, PROT_READ, MAP_SHARED, Fd, 0);
+	close(Fd);
+	if (Ring->Base == MAP_FAILED) {
+		perror(Path);
+		return 0;
+	}
+
+	unsigned HeaderSize;
+	memcpy(&HeaderSize, Ring->Base + KLOGGER_RING_HEADER_SIZE_OFFSET, sizeof(HeaderSize));
+	memcpy(&Ring->Capacity, Ring->Base + KLOGGER_RING_CAPACITY_OFFSET, sizeof(Ring->Capacity));
+	if (memcmp(Ring->Base, KLOGGER_RING_MAGIC, KLOGGER_RING_MAGIC_SIZE) ||
+		Load32(Ring->Base + KLOGGER_RING_VERSION_OFFSET) != KLOGGER_RING_VERSION ||
+		HeaderSize < KLOGGER_RING_RELEASE_OFFSET + 8 ||
+		HeaderSize > Ring->MapSize ||
+		Ring->Capacity < 2 * KLOGGER_RING_RECORD_HEADER_SIZE ||
+		Ring->Capacity % KLOGGER_RING_RECORD_ALIGN ||
+		Ring->Capacity > Ring->MapSize - HeaderSize) {
+		fprintf(stderr, "%s: not a live ring\n", Path);
+		munmap((void*)Ring->Base, Ring->MapSize);
+		return 0;
+	}
+
+	Ring->Data = Ring->Base + HeaderSize;
+	return 1;
+}
+
+// the time base is rewritten by every flush, a copy that changed while it was read is taken again
+static void
+ReadTimeBase(
+	LIVERING* Ring
+) {
+	long long Timestamp;
+	do {
+		Timestamp = Load64(Ring, KLOGGER_RING_SYNC_OFFSET);
+		Ring->SyncSystemTime = Load64(Ring, KLOGGER_RING_SYNC_OFFSET + 8);
+		Ring->SyncFrequency = Load64(Ring, KLOGGER_RING_SYNC_OFFSET + 16);
+	} while (Timestamp != Load64(Ring, KLOGGER_RING_SYNC_OFFSET));
+
+	Ring->SyncTimestamp = Timestamp;
+	if (Ring->SyncFrequency <= 0) {
+		Ring->SyncFrequency = TICKS_PER_SECOND;
+	}
+}
+
+// moves Pos past what was released, End past the records committed so far
+static void
+PollRing(
+	LIVERING* Ring
+) {
+	if (memcmp(Ring->Base, KLOGGER_RING_MAGIC, KLOGGER_RING_MAGIC_SIZE)) {
+		Ring->IsGone = 1;
+		Ring->End = Ring->Pos;
+		return;
+	}
+
+	long long Released = Floor(Ring);
+	if (Ring->Pos < Released) {
+		Ring->Missed += (unsigned long long)(Released - Ring->Pos);
+		Ring->Pos = Released;
+	}
+
+	long long Head = Load64(Ring, KLOGGER_RING_HEAD_OFFSET);
+	long long Pos = Ring->Pos;
+	while (Pos < Head) {
+		unsigned long long Offset = (unsigned long long)Pos % Ring->Capacity;
+		const unsigned char* p = Ring->Data + Offset;
+		if (!(Load32(p + 4) & KLOGGER_RING_COMMITTED)) {
+			break;
+		}
+
+		// zeroed or reused under us, the next poll starts after the release
+		unsigned Length = Load32(p);
+		if (Length < KLOGGER_RING_RECORD_HEADER_SIZE ||
+			Length % KLOGGER_RING_RECORD_ALIGN ||
+			Length > Ring->Capacity - Offset) {
+			break;
+		}
+
+		Pos += Length;
+	}
+
+	Ring->End = Pos;
+	ReadTimeBase(Ring);
+}
+
+static char*
+Reserve(
+	OUTPUT* Out,
+	size_t Size
+) {
+	if (Out->Used + Size > Out->Capacity) {
+		Out->Capacity = 2 * (Out->Used + Size);
+		Out->Buf = (char*)realloc(Out->Buf, Out->Capacity);
+	}
+
+	return Out->Buf + Out->Used;
+}
+
+// header and body of the record at Pos, padding is skipped. 0 if Pos reached End or the
+// record is no longer there
+static int
+PeekRecord(
+	LIVERING* Ring,
+	KLOGGER_RECORD* Header,
+	const unsigned char** ppBody
+) {
+	while (Ring->Pos < Ring->End) {
+		const unsigned char* p = Ring->Data + (unsigned long long)Ring->Pos % Ring->Capacity;
+		unsigned Length = Load32(p);
+		unsigned State = Load32(p + 4);
+		size_t Size = State >> KLOGGER_RING_SIZE_SHIFT;
+		if (!(State & KLOGGER_RING_COMMITTED) || Length < KLOGGER_RING_RECORD_HEADER_SIZE) {
+			Ring->End = Ring->Pos;
+			return 0;
+		}
+
+		if (State & KLOGGER_RING_PADDING) {
+			Ring->Pos += Length;
+			continue;
+		}
+
+		if (Size < sizeof(KLOGGER_RECORD) || Size > Length - KLOGGER_RING_RECORD_HEADER_SIZE) {
+			Ring->End = Ring->Pos;
+			return 0;
+		}
+
+		memcpy(Header, p + KLOGGER_RING_RECORD_HEADER_SIZE, sizeof(KLOGGER_RECORD));
+		if (Header->Length > Size - sizeof(KLOGGER_RECORD)) {
+			Ring->End = Ring->Pos;
+			return 0;
+		}
+
+		*ppBody = p + KLOGGER_RING_RECORD_HEADER_SIZE + sizeof(KLOGGER_RECORD);
+		Ring->Length = Length;
+		return 1;
+	}
+
+	return 0;
+}
+
+static size_t
+FormatRecord(
+	const LIVERING* Ring,
+	const KLOGGER_RECORD* Header,
+	const unsigned char* Body,
+	char* Out
+) {
+	char Text[TEXT_MAX];
+	LOGRECORD Record;
+	Record.Type = Header->Type;
+	Record.Irql = Header->Irql;
+	Record.Cpu = Header->Cpu;
+	Record.Timestamp = Header->Timestamp;
+
+	long long Delta = Header->Timestamp - Ring->SyncTimestamp;
+	Record.SystemTime = Ring->SyncSystemTime + Delta / Ring->SyncFrequency * TICKS_PER_SECOND +
+		Delta % Ring->SyncFrequency * TICKS_PER_SECOND / Ring->SyncFrequency;
+
+	if (Header->Type == KLOGGER_REC_LOSS && Header->Length == sizeof(KLOGGER_LOSS)) {
+		KLOGGER_LOSS Loss;
+		memcpy(&Loss, Body, sizeof(Loss));
+		Record.Data = Text;
+		Record.Length = (size_t)snprintf(Text, sizeof(Text), "*** %llu messages / %llu bytes lost ***",
+			Loss.Messages, Loss.Bytes);
+	} else if (Header->Type == KLOGGER_REC_MESSAGE) {
+		Record.Data = (const char*)Body;
+		Record.Length = Header->Length;
+	} else if (Header->Type == KLOGGER_RING_ID && Header->Length >= sizeof(KLOGGER_ID_ARGS)) {
+		// the catalog is in the log file only
+		KLOGGER_ID_ARGS Args;
+		memcpy(&Args, Body, sizeof(Args));
+		Record.Data = Text;
+		Record.Length = (size_t)snprintf(Text, sizeof(Text), "[catalog message %u, %u arguments, in the log file only]",
+			Args.Id, Args.Count);
+	} else {
+		// the format string is a pointer into the driver image, it is only formatted by the flushing thread
+		Record.Data = Text;
+		Record.Length = (size_t)snprintf(Text, sizeof(Text), "[deferred format message, %u bytes, in the log file only]",
+			Header->Length);
+	}
+
+	return LogFormatRecord(&Record, Out);
+}
+
+// prints what the rings hold up to their End, merged by timestamp, returns the records printed
+static size_t
+PrintRecords(
+	LIVERING* Rings,
+	int RingCount,
+	OUTPUT* Out
+) {
+	size_t Printed = 0;
+	while (1) {
+		LIVERING* Min = NULL;
+		KLOGGER_RECORD MinHeader = { 0 };
+		const unsigned char* MinBody = NULL;
+		for (int i = 0; i < RingCount; ++i) {
+			KLOGGER_RECORD Header;
+			const unsigned char* Body;
+			if (PeekRecord(&Rings[i], &Header, &Body) && (!Min || Header.Timestamp < MinHeader.Timestamp)) {
+				Min = &Rings[i];
+				MinHeader = Header;
+				MinBody = Body;
+			}
+		}
+
+		if (!Min) {
+			break;
+		}
+
+		size_t Length = FormatRecord(Min, &MinHeader, MinBody,
+			Reserve(Out, LOG_FORMAT_OVERHEAD + TEXT_MAX + MinHeader.Length));
+
+		// kept only if the flushing thread did not release it while it was formatted
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		long long Released = Floor(Min);
+		if (Min->Pos < Released) {
+			Min->Missed += (unsigned long long)(Released - Min->Pos);
+			Min->Pos = Released;
+			if (Min->End < Released) {
+				Min->End = Released;
+			}
+			continue;
+		}
+
+		Out->Used += Length;
+		Min->Pos += Min->Length;
+		Printed++;
+	}
+
+	return Printed;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* Name = NULL;
+	int IsNewOnly = 0;
+	long IntervalUs = DEFAULT_INTERVAL_US;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-n")) {
+			IsNewOnly = 1;
+		} else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			IntervalUs = atol(argv[++i]);
+		} else if (!Name && argv[i][0] != '-') {
+			Name = argv[i];
+		} else {
+			fprintf(stderr, "usage: %s [name] [-n] [-i interval_us]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	const char* Dir = getenv("KLOGGER_SHM_DIR");
+	LIVERING* Rings = (LIVERING*)calloc(MAX_RINGS, sizeof(LIVERING));
+	int RingCount = 0;
+	for (; RingCount < MAX_RINGS; ++RingCount) {
+		char Path[4096];
+		snprintf(Path, sizeof(Path), "%s/%s.%d", Dir ? Dir : "/dev/shm", Name ? Name : DEFAULT_NAME, RingCount);
+		if (!OpenRing(Path, RingCount, &Rings[RingCount])) {
+			break;
+		}
+
+		LIVERING* Ring = &Rings[RingCount];
+		Ring->Pos = IsNewOnly ? Load64(Ring, KLOGGER_RING_HEAD_OFFSET) : Floor(Ring);
+	}
+
+	if (!RingCount) {
+		fprintf(stderr, "no live rings %s.0, ... in %s\n", Name ? Name : DEFAULT_NAME, Dir ? Dir : "/dev/shm");
+		free(Rings);
+		return 1;
+	}
+
+	fprintf(stderr, "following %d rings\n", RingCount);
+
+	OUTPUT Out = { NULL, 0, 0 };
+	struct timespec Interval = { IntervalUs / 1000000, IntervalUs % 1000000 * 1000 };
+	unsigned long long Reported = 0;
+	while (1) {
+		int Gone = 0;
+		unsigned long long Missed = 0;
+		for (int i = 0; i < RingCount; ++i) {
+			PollRing(&Rings[i]);
+			Gone += Rings[i].IsGone;
+		}
+
+		size_t Printed = PrintRecords(Rings, RingCount, &Out);
+		if (Out.Used) {
+			fwrite(Out.Buf, 1, Out.Used, stdout);
+			fflush(stdout);
+			Out.Used = 0;
+		}
+
+		for (int i = 0; i < RingCount; ++i) {
+			Missed += Rings[i].Missed;
+		}
+		if (Missed != Reported) {
+			fprintf(stderr, "%llu bytes released by the flushing thread before they were read\n", Missed - Reported);
+			Reported = Missed;
+		}
+
+		if (Gone == RingCount) {
+			break;
+		}
+
+		if (!Printed) {
+			nanosleep(&Interval, NULL);
+		}
+	}
+
+	for (int i = 0; i < RingCount; ++i) {
+		munmap((void*)Rings[i].Base, Rings[i].MapSize);
+	}
+	free(Out.Buf);
+	free(Rings);
+
+	return 0;
+}
@@ -0,0 +1,362 @@
+// catalog messages (KLoggerLogId) across segments and index entries. A new format is registered
+// every FORMAT_EVERY messages while numbered ID messages are logged into 1 MB segments with an
+// index, writers waiting for ring space. Every segment is decoded on its own, from its start and
+// from each of its index entries up to the next one, and a time range of a middle segment is
+// extracted with tools/klseek from that file alone. Each ID record has to come out formatted,
+// never as a message of a catalog not in the file, and the messages have to be all there, in
+// order, with the sequence number of their index entry
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define MESSAGES 40000
+#define FORMAT_EVERY 500
+#define MAX_PAD 150
+#define MSG_SIZE (64 + MAX_PAD)
+#define MAX_SEGMENTS 64
+#define EPOCH_DIFFERENCE_MS 11644473600000ll // between 1601 and 1970
+#define NO_CATALOG "*** message " // LogReader.c's text for an ID without a catalog format
+
+typedef struct Segment {
+	unsigned Number;
+	char* Log;
+	size_t Size;
+	char* Index;
+	size_t IndexSize;
+} SEGMENT;
+
+static char Pad[MAX_PAD + 1];
+
+// text message Seq has to decode to
+static size_t
+MakeMessage(
+	char* Msg,
+	unsigned Seq
+) {
+	return (size_t)snprintf(Msg, MSG_SIZE, "cat%u m%u %.*s %d\n", Seq / FORMAT_EVERY, Seq, (int)(Seq % MAX_PAD), Pad, (int)Seq * 3);
+}
+
+// the message number of a decoded record, -1 if it is not the text expected
+static long long
+CheckRecord(
+	const LOGRECORD* Record,
+	const char* Where
+) {
+	if (Record->Length >= sizeof(NO_CATALOG) && !memcmp(Record->Data, NO_CATALOG, sizeof(NO_CATALOG) - 1)) {
+		CheckError("%s: %.*s", Where, (int)Record->Length, Record->Data);
+		return -1;
+	}
+
+	unsigned Format, Seq;
+	char Msg[MSG_SIZE];
+	if (Record->Type != KLOGGER_REC_ID || sscanf(Record->Data, "cat%u m%u", &Format, &Seq) != 2 ||
+		Seq >= MESSAGES || Record->Length != MakeMessage(Msg, Seq) || memcmp(Record->Data, Msg, Record->Length)) {
+		CheckError("%s: record of type %d: %.*s", Where, Record->Type, (int)(Record->Length > 48 ? 48 : Record->Length), Record->Data);
+		return -1;
+	}
+
+	return Seq;
+}
+
+// from its start, the messages following the last segment's
+static void
+CheckSegment(
+	const SEGMENT* Segment,
+	unsigned* pNext
+) {
+	char Where[64];
+	snprintf(Where, sizeof(Where), "segment %u", Segment->Number);
+
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Segment->Log, Segment->Size);
+
+	int Ret;
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		long long Seq = CheckRecord(&Record, Where);
+		if (Seq < 0) {
+			continue;
+		}
+		if (Seq != *pNext) {
+			CheckError("%s: message %lld where %u was expected", Where, Seq, *pNext);
+		}
+		*pNext = (unsigned)Seq + 1;
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("%s: corrupted at offset %zu", Where, LogReaderOffset(&Reader));
+	}
+	LogReaderFree(&Reader);
+}
+
+// from each entry up to the next one, starting with the message of its sequence number.
+// Returns the entry count
+static size_t
+CheckEntries(
+	const SEGMENT* Segment
+) {
+	if (Segment->IndexSize < KLOGGER_INDEX_HEADER_SIZE || memcmp(Segment->Index, KLOGGER_INDEX_MAGIC, 4)) {
+		CheckError("segment %u: index has no header", Segment->Number);
+		return 0;
+	}
+
+	size_t Entries = (Segment->IndexSize - KLOGGER_INDEX_HEADER_SIZE) / sizeof(KLOGGER_INDEX_ENTRY);
+	for (size_t i = 0; i < Entries; ++i) {
+		KLOGGER_INDEX_ENTRY Entry, Next;
+		memcpy(&Entry, Segment->Index + KLOGGER_INDEX_HEADER_SIZE + i * sizeof(Entry), sizeof(Entry));
+		Next.Offset = Segment->Size;
+		if (i + 1 < Entries) {
+			memcpy(&Next, Segment->Index + KLOGGER_INDEX_HEADER_SIZE + (i + 1) * sizeof(Next), sizeof(Next));
+		}
+		if (Entry.Offset >= Next.Offset || Next.Offset > Segment->Size) {
+			CheckError("segment %u, index entry %zu: offset %llu, past the next one or the log", Segment->Number, i, Entry.Offset);
+			continue;
+		}
+
+		char Where[64];
+		snprintf(Where, sizeof(Where), "segment %u, index entry %zu", Segment->Number, i);
+
+		LOGREADER Reader;
+		LOGRECORD Record;
+		LogReaderInit(&Reader, Segment->Log + Entry.Offset, Next.Offset - Entry.Offset);
+		unsigned long long Expected = Entry.Sequence;
+		int Ret;
+		while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+			long long Seq = CheckRecord(&Record, Where);
+			if (Seq >= 0 && (unsigned long long)Seq != Expected) {
+				CheckError("%s: message %lld where %llu was expected", Where, Seq, Expected);
+				break;
+			}
+			Expected++;
+		}
+		if (Ret == LOG_READ_ERROR) {
+			CheckError("%s: corrupted at offset %zu", Where, LogReaderOffset(&Reader));
+		}
+		LogReaderFree(&Reader);
+	}
+
+	return Entries;
+}
+
+// klseek -t over the milliseconds of one index entry, given the segment file alone
+static void
+CheckSeek(
+	const char* Tool,
+	const char* Path,
+	const SEGMENT* Segment,
+	const char* OutPath
+) {
+	size_t Entries = (Segment->IndexSize - KLOGGER_INDEX_HEADER_SIZE) / sizeof(KLOGGER_INDEX_ENTRY);
+	if (Entries < 3) {
+		CheckError("segment %u: %zu index entries, klseek needs a middle one", Segment->Number, Entries);
+		return;
+	}
+
+	KLOGGER_INDEX_ENTRY Entry;
+	memcpy(&Entry, Segment->Index + KLOGGER_INDEX_HEADER_SIZE + Entries / 2 * sizeof(Entry), sizeof(Entry));
+	long long Ms = Entry.SystemTime / 10000 - EPOCH_DIFFERENCE_MS;
+
+	char Command[512];
+	snprintf(Command, sizeof(Command), "%s %s -t %lld,%lld -o %s", Tool, Path, Ms, Ms, OutPath);
+	if (system(Command) != 0) {
+		CheckError("%s failed", Command);
+		return;
+	}
+
+	size_t Size = 0;
+	char* Out = CheckReadFile(OutPath, &Size);
+	unlink(OutPath);
+	if (!Out) {
+		CheckErrors++;
+		return;
+	}
+
+	// "... cpu N irql N: message\n"
+	unsigned long long Lines = 0;
+	long long Last = -1;
+	char* Line = Out;
+	while (Line < Out + Size) {
+		char* End = memchr(Line, '\n', (size_t)(Out + Size - Line));
+		End = End ? End : Out + Size;
+		unsigned Format, Seq;
+		const char* Text = strstr(Line, ": ");
+		if (!Text || Text > End || sscanf(Text, ": cat%u m%u", &Format, &Seq) != 2 || (long long)Seq <= Last) {
+			CheckError("klseek: %.*s", (int)(End - Line > 64 ? 64 : End - Line), Line);
+		} else {
+			Last = Seq;
+		}
+		Lines++;
+		Line = End + 1;
+	}
+
+	if (!Lines || Last < (long long)Entry.Sequence) {
+		CheckError("klseek: %llu messages, none from index entry %zu of segment %u", Lines, Entries / 2, Segment->Number);
+	}
+	printf("klseek: %llu messages of segment %u, %lld ms\n", Lines, Segment->Number, Ms);
+	free(Out);
+}
+
+static int
+CompareSegments(
+	const void* A,
+	const void* B
+) {
+	unsigned a = ((const SEGMENT*)A)->Number, b = ((const SEGMENT*)B)->Number;
+	return (a > b) - (a < b);
+}
+
+// one load into 1 MB segments, indexed or not, then each segment is checked on its own
+static void
+CheckLoad(
+	const char* Tool,
+	BOOLEAN IsIndexed
+) {
+	char Root[] = "/tmp/catalogcheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		CheckErrors++;
+		return;
+	}
+
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_BUF_SIZE", "262144", 1);
+	setenv("KLOGGER_OVERFLOW_POLICY", "2", 1);
+	setenv("KLOGGER_BLOCK_TIMEOUT_MS", "10000", 1);
+	setenv("KLOGGER_SEGMENT_SIZE_MB", "1", 1);
+	setenv("KLOGGER_MAX_SEGMENTS", "0", 1);
+	if (IsIndexed) {
+		setenv("KLOGGER_INDEX_KB", "64", 1);
+	} else {
+		unsetenv("KLOGGER_INDEX_KB");
+	}
+
+	UNICODE_STRING RegistryPath;
+	RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\catalogcheck");
+	if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+		CheckError("KLoggerInit failed");
+		rmdir(Root);
+		return;
+	}
+
+	// formats registered later go ahead of the next chunk, of whatever segment it is in
+	ULONG Id = 0;
+	for (unsigned i = 0; i < MESSAGES; ++i) {
+		if (!(i % FORMAT_EVERY)) {
+			char Format[64];
+			snprintf(Format, sizeof(Format), "cat%u m%%u %%s %%d\n", i / FORMAT_EVERY);
+			if (KLoggerRegister(Format, &Id) != ERROR_SUCCESS) {
+				CheckError("format %u: not registered", i / FORMAT_EVERY);
+			}
+		}
+		if (KLoggerLogId(Id, i, Pad + MAX_PAD - i % MAX_PAD, (int)i * 3) != ERROR_SUCCESS) {
+			CheckError("message %u: not logged", i);
+		}
+	}
+	KLoggerDeinit();
+
+	SEGMENT Segments[MAX_SEGMENTS];
+	int Count = 0;
+	DIR* Dir = opendir(Root);
+	struct dirent* Ent;
+	while (Dir && (Ent = readdir(Dir)) != NULL) {
+		char Path[sizeof(Root) + sizeof(Ent->d_name) + 8];
+		snprintf(Path, sizeof(Path), "%s/%s", Root, Ent->d_name);
+
+		unsigned Number;
+		char Tail;
+		if (sscanf(Ent->d_name, "klogger.%u.log%c", &Number, &Tail) != 1 || Count == MAX_SEGMENTS) {
+			continue;
+		}
+
+		SEGMENT* Segment = &Segments[Count++];
+		memset(Segment, 0, sizeof(SEGMENT));
+		Segment->Number = Number;
+		Segment->Log = CheckReadFile(Path, &(Segment->Size));
+		if (IsIndexed) {
+			snprintf(Path, sizeof(Path), "%s/%s.idx", Root, Ent->d_name);
+			Segment->Index = CheckReadFile(Path, &(Segment->IndexSize));
+		}
+		if (!Segment->Log || (IsIndexed && !Segment->Index)) {
+			CheckError("segment %u: no log or no index", Number);
+			free(Segment->Log);
+			free(Segment->Index);
+			Count--;
+		}
+	}
+	if (Dir) {
+		closedir(Dir);
+	}
+	qsort(Segments, (size_t)Count, sizeof(SEGMENT), CompareSegments);
+
+	unsigned Next = 0;
+	size_t Entries = 0;
+	for (int i = 0; i < Count; ++i) {
+		CheckSegment(&Segments[i], &Next);
+		if (IsIndexed) {
+			Entries += CheckEntries(&Segments[i]);
+		}
+	}
+	if (Next != MESSAGES) {
+		CheckError("decoded up to message %u of %u", Next, MESSAGES);
+	}
+
+	if (Count < 3) {
+		CheckError("%d segments, the formats have to span a few", Count);
+	} else if (IsIndexed) {
+		char Path[sizeof(Root) + 64], OutPath[sizeof(Root) + 64];
+		snprintf(Path, sizeof(Path), "%s/klogger.%06u.log", Root, Segments[Count / 2].Number);
+		snprintf(OutPath, sizeof(OutPath), "%s/seek.txt", Root);
+		CheckSeek(Tool, Path, &Segments[Count / 2], OutPath);
+	}
+
+	printf("%s: %d messages, %d formats, %d segments, %zu index entries\n",
+		IsIndexed ? "indexed" : "not indexed", MESSAGES, MESSAGES / FORMAT_EVERY, Count, Entries);
+
+	for (int i = 0; i < Count; ++i) {
+		free(Segments[i].Log);
+		free(Segments[i].Index);
+	}
+
+	Dir = opendir(Root);
+	while (Dir && (Ent = readdir(Dir)) != NULL) {
+		char Path[sizeof(Root) + sizeof(Ent->d_name) + 8];
+		snprintf(Path, sizeof(Path), "%s/%s", Root, Ent->d_name);
+		if (Ent->d_name[0] != '.') {
+			unlink(Path);
+		}
+	}
+	if (Dir) {
+		closedir(Dir);
+	}
+	rmdir(Root);
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* Tool = "../tools/klseek";
+	if (argc == 3 && !strcmp(argv[1], "-k")) {
+		Tool = argv[2];
+	} else if (argc != 1) {
+		fprintf(stderr, "usage: %s [-k klseek]\n", argv[0]);
+		return 2;
+	}
+
+	memset(Pad, 'c', MAX_PAD);
+	CheckLoad(Tool, TRUE);
+	CheckLoad(Tool, FALSE);
+	printf("%llu errors\n", CheckErrors);
+
+	return CheckErrors ? 1 : 0;
+}
@@ -0,0 +1,49 @@
+#include "check.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+unsigned long long CheckErrors = 0;
+
+void
+CheckError(
+	const char* Format,
+	...
+) {
+	if (CheckErrors++ < CHECK_ERRORS_SHOWN) {
+		va_list Args;
+		va_start(Args, Format);
+		vfprintf(stderr, Format, Args);
+		va_end(Args);
+		fputc('\n', stderr);
+	}
+}
+
+char*
+CheckReadFile(
+	const char* Path,
+	size_t* pSize
+) {
+	FILE* File = fopen(Path, "rb");
+	if (!File) {
+		perror(Path);
+		return NULL;
+	}
+
+	fseek(File, 0, SEEK_END);
+	long Size = ftell(File);
+	fseek(File, 0, SEEK_SET);
+
+	char* Buf = malloc(Size > 0 ? (size_t)Size : 1);
+	if (!Buf || fread(Buf, 1, (size_t)Size, File) != (size_t)Size) {
+		perror(Path);
+		free(Buf);
+		fclose(File);
+		return NULL;
+	}
+
+	fclose(File);
+	*pSize = (size_t)Size;
+	return Buf;
+}
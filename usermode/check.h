@@ -0,0 +1,16 @@
+#pragma once
+
+// shared by the correctness checks (*check.c, run by `make check`). Errors are counted and the
+// first few printed, a check exits with 1 if there was any
+
+#include <stddef.h>
+
+#define CHECK_ERRORS_SHOWN 10
+
+extern unsigned long long CheckErrors;
+
+// printf-like, one line on stderr
+void CheckError(const char* Format, ...);
+
+// the whole file in a malloc'ed buffer, NULL if it can't be read
+char* CheckReadFile(const char* Path, size_t* pSize);
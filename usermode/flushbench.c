@@ -0,0 +1,160 @@
+// KLogger.c end to end against a slow file: 1..N write slots of the flushing thread,
+// the shim's asynchronous writes stand in for the device (see include/ntddk.h)
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+
+typedef struct BenchCtx {
+	PCSTR Msg;
+	volatile LONG Stop;
+} BENCHCTX;
+
+typedef struct ProducerStat {
+	BENCHCTX* Ctx;
+	ULONGLONG Written;
+	ULONGLONG Dropped;
+} PRODUCERSTAT;
+
+static double
+NowSec(void) {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+static void*
+ProducerFunc(
+	void* Arg
+) {
+	PRODUCERSTAT* Stat = (PRODUCERSTAT*)Arg;
+
+	while (!Stat->Ctx->Stop) {
+		if (KLoggerLog(Stat->Ctx->Msg) == ERROR_SUCCESS) {
+			Stat->Written++;
+		} else {
+			Stat->Dropped++;
+		}
+	}
+
+	return NULL;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	int MaxSlots = 8;
+	int Producers = 2;
+	SIZE_T MsgSize = 64;
+	const char* RingSize = "4194304";
+	const char* Delay = "2000";
+	double Duration = 1.0;
+	const char* Compress = "0";
+
+	int Opt;
+	while ((Opt = getopt(argc, argv, "s:p:m:r:d:t:z")) != -1) {
+		switch (Opt) {
+		case 's': MaxSlots = atoi(optarg); break;
+		case 'p': Producers = atoi(optarg); break;
+		case 'm': MsgSize = strtoull(optarg, NULL, 0); break;
+		case 'r': RingSize = optarg; break;
+		case 'd': Delay = optarg; break;
+		case 't': Duration = atof(optarg); break;
+		case 'z': Compress = "1"; break;
+		default:
+			fprintf(stderr, "usage: %s [-s max_write_slots] [-p producers] [-m msg_size] [-r per_cpu_ring_size] [-d write_delay_us] [-t seconds] [-z]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	char Root[] = "/tmp/flushbench.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	char Path[sizeof(Root) + 16];
+	snprintf(Path, sizeof(Path), "%s/klogger.log", Root);
+
+	// the device: every write takes Delay, as many in parallel as there are slots
+	char IoThreads[16];
+	snprintf(IoThreads, sizeof(IoThreads), "%d", MaxSlots * 2);
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_PER_CPU_BUF_SIZE", RingSize, 1);
+	setenv("KLOGGER_COMPRESS", Compress, 1);
+	setenv("KLOGGER_SHIM_WRITE_DELAY_US", Delay, 0);
+	setenv("KLOGGER_SHIM_IO_THREADS", IoThreads, 0);
+
+	PCHAR Msg = malloc(MsgSize + 1);
+	memset(Msg, 'x', MsgSize);
+	Msg[MsgSize] = '\0';
+
+	printf("write_slots,producers,msg_size,written_per_sec,dropped_per_sec,file_mb_per_sec\n");
+
+	for (int Slots = 1; Slots <= MaxSlots; Slots *= 2) {
+		char Value[16];
+		snprintf(Value, sizeof(Value), "%d", Slots);
+		setenv("KLOGGER_WRITE_SLOTS", Value, 1);
+		unlink(Path);
+
+		UNICODE_STRING RegistryPath;
+		RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\flushbench");
+		if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+			fprintf(stderr, "KLoggerInit failed\n");
+			return 1;
+		}
+
+		BENCHCTX Ctx = { 0 };
+		Ctx.Msg = Msg;
+		PRODUCERSTAT* Stats = calloc(Producers, sizeof(PRODUCERSTAT));
+		pthread_t* Threads = calloc(Producers, sizeof(pthread_t));
+
+		double Start = NowSec();
+		for (int i = 0; i < Producers; ++i) {
+			Stats[i].Ctx = &Ctx;
+			pthread_create(&Threads[i], NULL, ProducerFunc, &Stats[i]);
+		}
+
+		usleep((useconds_t)(Duration * 1e6));
+		Ctx.Stop = 1;
+
+		ULONGLONG Written = 0, Dropped = 0;
+		for (int i = 0; i < Producers; ++i) {
+			pthread_join(Threads[i], NULL);
+			Written += Stats[i].Written;
+			Dropped += Stats[i].Dropped;
+		}
+
+		struct stat St;
+		double Elapsed = NowSec() - Start;
+		KLoggerDeinit();
+		if (stat(Path, &St)) {
+			St.st_size = 0;
+		}
+
+		printf("%d,%d,%zu,%.0f,%.0f,%.1f\n",
+			Slots,
+			Producers,
+			MsgSize,
+			Written / Elapsed,
+			Dropped / Elapsed,
+			St.st_size / Elapsed / (1024.0 * 1024.0));
+
+		free(Threads);
+		free(Stats);
+	}
+
+	unlink(Path);
+	rmdir(Root);
+	free(Msg);
+
+	return 0;
+}
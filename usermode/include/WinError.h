@@ -0,0 +1,4 @@
+#pragma once
+
+// KLogger.c includes it with this spelling
+#include "winerror.h"
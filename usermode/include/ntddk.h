@@ -0,0 +1,509 @@
+#pragma once
+
+// user-mode stand-in for the parts of ntddk.h used by the library driver,
+// lets RingBuffer.c and KLogger.c be built and benchmarked unmodified on Linux
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <wchar.h>
+
+#include "ntdef.h"
+
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+typedef CCHAR KPROCESSOR_MODE;
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL 15
+
+#define KernelMode 0
+#define UserMode 1
+
+typedef enum _POOL_TYPE {
+	NonPagedPool,
+	PagedPool
+} POOL_TYPE;
+
+// irql is tracked per thread, it only has to be consistent, not enforced. Sections at
+// DISPATCH_LEVEL and above are counted, so that waiting for them to end can stand in for
+// running on every processor, see KeSetSystemGroupAffinityThread
+extern __thread KIRQL ShimCurrentIrql;
+VOID ShimEnterDispatch(VOID);
+VOID ShimLeaveDispatch(VOID);
+
+static inline KIRQL
+KeGetCurrentIrql(void) {
+	return ShimCurrentIrql;
+}
+
+static inline VOID
+KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql) {
+	*OldIrql = ShimCurrentIrql;
+	if (ShimCurrentIrql < DISPATCH_LEVEL && NewIrql >= DISPATCH_LEVEL)
+		ShimEnterDispatch();
+	ShimCurrentIrql = NewIrql;
+}
+
+static inline VOID
+KeLowerIrql(KIRQL NewIrql) {
+	if (ShimCurrentIrql >= DISPATCH_LEVEL && NewIrql < DISPATCH_LEVEL)
+		ShimLeaveDispatch();
+	ShimCurrentIrql = NewIrql;
+}
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock);
+VOID ShimAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql);
+#define KeAcquireSpinLock(SpinLock, OldIrql) ShimAcquireSpinLock((SpinLock), (OldIrql))
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+
+PVOID ExAllocatePool(POOL_TYPE PoolType, SIZE_T NumberOfBytes);
+VOID ExFreePool(PVOID P);
+
+// shim only: pool and node memory allocations not freed yet, for leak checks
+LONG ShimAllocations(VOID);
+
+// node memory: mapped on its own, transparent huge pages asked for, placed on the node
+// with mbind where the system has it
+#define MM_ANY_NODE_OK 0x80000000
+#define PAGE_READWRITE 0x04
+#define PAGE_SIZE 4096
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+PVOID MmAllocateContiguousNodeMemory(SIZE_T NumberOfBytes, PHYSICAL_ADDRESS LowestAcceptableAddress,
+	PHYSICAL_ADDRESS HighestAcceptableAddress, PHYSICAL_ADDRESS BoundaryAddressMultiple, ULONG Protect, ULONG PreferredNode);
+VOID MmFreeContiguousMemory(PVOID BaseAddress);
+
+#define RtlCopyMemory(Dst, Src, Len) memcpy((Dst), (Src), (Len))
+#define RtlMoveMemory(Dst, Src, Len) memmove((Dst), (Src), (Len))
+#define RtlZeroMemory(Dst, Len) memset((Dst), 0, (Len))
+#define RtlFillMemory(Dst, Len, Fill) memset((Dst), (Fill), (Len))
+#define RtlCompareMemory(A, B, Len) ShimCompareMemory((A), (B), (Len))
+SIZE_T ShimCompareMemory(const VOID* A, const VOID* B, SIZE_T Length);
+
+#define KeMemoryBarrier() __sync_synchronize()
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define YieldProcessor() __builtin_ia32_pause()
+#define ReadTimeStampCounter() ((ULONG64)__rdtsc())
+
+// MSVC's __cpuid(Info, Leaf) in place of the GCC macro
+static inline VOID
+ShimCpuid(int Info[4], int Leaf) {
+	unsigned int a, b, c, d;
+	__cpuid_count((unsigned int)Leaf, 0, a, b, c, d);
+	Info[0] = (int)a;
+	Info[1] = (int)b;
+	Info[2] = (int)c;
+	Info[3] = (int)d;
+}
+#undef __cpuid
+#define __cpuid(Info, Leaf) ShimCpuid((Info), (Leaf))
+#else
+#define YieldProcessor() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define InterlockedIncrement(p) __sync_add_and_fetch((p), 1)
+#define InterlockedDecrement(p) __sync_sub_and_fetch((p), 1)
+#define InterlockedIncrement64(p) __sync_add_and_fetch((p), 1)
+#define InterlockedExchangeAdd(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedExchangeAdd64(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedOr(p, v) __sync_fetch_and_or((p), (v))
+#define InterlockedAnd(p, v) __sync_fetch_and_and((p), (v))
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+#define InterlockedCompareExchange64(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+#define InterlockedCompareExchangePointer(p, v, c) __sync_val_compare_and_swap((p), (c), (v))
+
+#define __debugbreak() __builtin_trap()
+#define BitScanForward(Index, Mask) ((Mask) ? (*(Index) = (ULONG)__builtin_ctz(Mask), (BOOLEAN)1) : (BOOLEAN)0)
+
+// printed to stderr only if KLOGGER_SHIM_DEBUG is set
+ULONG DbgPrint(PCSTR Format, ...);
+
+// processors: the real ones, or KLOGGER_SHIM_CPUS stand-ins. A thread is on the processor
+// KeSetSystemGroupAffinityThread set it to, otherwise on the real one it runs on, modulo the count
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+typedef struct _PROCESSOR_NUMBER {
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG ProcIndex, PPROCESSOR_NUMBER ProcNumber);
+
+typedef ULONG_PTR KAFFINITY;
+
+typedef struct _GROUP_AFFINITY {
+	KAFFINITY Mask;
+	USHORT Group;
+	USHORT Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+// nodes are read from /sys/devices/system/node, one node with all processors if it is not there
+// or KLOGGER_SHIM_CPUS is set
+USHORT KeQueryHighestNodeNumber(VOID);
+VOID KeQueryNodeActiveAffinity(USHORT NodeNumber, PGROUP_AFFINITY Affinity, PUSHORT Count);
+
+// threads are not moved, switching waits for the DISPATCH_LEVEL sections in progress instead.
+// The thread is then on the lowest processor of the mask for KeGetCurrentProcessorNumberEx
+VOID KeSetSystemGroupAffinityThread(PGROUP_AFFINITY Affinity, PGROUP_AFFINITY PreviousAffinity);
+VOID KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY PreviousAffinity);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+
+// dispatcher objects: events and threads share one header so they can be waited on together
+
+typedef enum _EVENT_TYPE {
+	NotificationEvent,
+	SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+	Executive
+} KWAIT_REASON;
+
+typedef enum _WAIT_TYPE {
+	WaitAll,
+	WaitAny
+} WAIT_TYPE;
+
+typedef struct _DISPATCHER_HEADER {
+	LONG Type;
+	LONG volatile SignalState;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT {
+	DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KTHREAD *PKTHREAD, *PETHREAD;
+typedef VOID (*PKSTART_ROUTINE)(PVOID StartContext);
+
+typedef struct _KWAIT_BLOCK *PKWAIT_BLOCK;
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, LONG Increment, BOOLEAN Wait);
+VOID KeClearEvent(PRKEVENT Event);
+LONG KeResetEvent(PRKEVENT Event);
+LONG KeReadStateEvent(PRKEVENT Event);
+
+NTSTATUS KeWaitForSingleObject(
+	PVOID Object,
+	KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout);
+
+NTSTATUS KeWaitForMultipleObjects(
+	ULONG Count,
+	PVOID Object[],
+	WAIT_TYPE WaitType,
+	KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout,
+	PKWAIT_BLOCK WaitBlockArray);
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval);
+
+// dpc: runs the routine right away on the calling thread
+
+typedef struct _KDPC *PKDPC, *PRKDPC;
+typedef VOID (*PKDEFERRED_ROUTINE)(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+
+typedef struct _KDPC {
+	PKDEFERRED_ROUTINE DeferredRoutine;
+	PVOID DeferredContext;
+} KDPC;
+
+VOID KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext);
+BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2);
+VOID KeFlushQueuedDpcs(VOID);
+
+// threads
+
+#define THREAD_ALL_ACCESS 0x1fffff
+#define FILE_ANY_ACCESS 0
+
+typedef struct _OBJECT_ATTRIBUTES {
+	ULONG Length;
+	HANDLE RootDirectory;
+	PUNICODE_STRING ObjectName;
+	ULONG Attributes;
+	PVOID SecurityDescriptor;
+	PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define OBJ_CASE_INSENSITIVE 0x40
+#define OBJ_KERNEL_HANDLE 0x200
+
+#define InitializeObjectAttributes(p, n, a, r, s) do { \
+	(p)->Length = sizeof(OBJECT_ATTRIBUTES); \
+	(p)->RootDirectory = (r); \
+	(p)->Attributes = (a); \
+	(p)->ObjectName = (n); \
+	(p)->SecurityDescriptor = (s); \
+	(p)->SecurityQualityOfService = NULL; \
+} while (0)
+
+NTSTATUS PsCreateSystemThread(
+	PHANDLE ThreadHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	HANDLE ProcessHandle,
+	PVOID ClientId,
+	PKSTART_ROUTINE StartRoutine,
+	PVOID StartContext);
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus);
+
+NTSTATUS ObReferenceObjectByHandle(
+	HANDLE Handle,
+	ULONG DesiredAccess,
+	PVOID ObjectType,
+	KPROCESSOR_MODE AccessMode,
+	PVOID* Object,
+	PVOID HandleInformation);
+
+VOID ObDereferenceObject(PVOID Object);
+
+// files: "\??\C:\name" is opened as "$KLOGGER_ROOT/name" (current directory by default).
+// Handles opened without FILE_SYNCHRONOUS_IO_* take writes asynchronously: they are done by
+// KLOGGER_SHIM_IO_THREADS threads (2 by default), each one taking KLOGGER_SHIM_WRITE_DELAY_US
+// more to stand in for a slow device. With KLOGGER_SHIM_FAIL_WRITE=N every Nth of those writes
+// completes with STATUS_DISK_FULL and writes nothing. Directories opened with FILE_DIRECTORY_FILE
+// can be listed with FileNamesInformation, patterns are matched with fnmatch
+
+typedef struct _IO_STATUS_BLOCK {
+	NTSTATUS Status;
+	ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef VOID (*PIO_APC_ROUTINE)(PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved);
+
+#define FILE_LIST_DIRECTORY 0x0001
+#define FILE_APPEND_DATA 0x0004
+#define FILE_WRITE_DATA 0x0002
+#define GENERIC_WRITE 0x40000000
+#define SYNCHRONIZE 0x00100000
+#define DELETE 0x00010000
+
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define FILE_SHARE_DELETE 0x4
+
+#define FILE_SUPERSEDE 0
+#define FILE_OPEN 1
+#define FILE_CREATE 2
+#define FILE_OPEN_IF 3
+#define FILE_OVERWRITE 4
+#define FILE_OVERWRITE_IF 5
+
+#define FILE_DIRECTORY_FILE 0x1
+#define FILE_WRITE_THROUGH 0x2
+#define FILE_SYNCHRONOUS_IO_ALERT 0x10
+#define FILE_SYNCHRONOUS_IO_NONALERT 0x20
+#define FILE_NON_DIRECTORY_FILE 0x40
+
+#define FILE_USE_FILE_POINTER_POSITION 0xfffffffe
+#define FILE_WRITE_TO_END_OF_FILE 0xffffffff
+
+NTSTATUS ZwCreateFile(
+	PHANDLE FileHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PLARGE_INTEGER AllocationSize,
+	ULONG FileAttributes,
+	ULONG ShareAccess,
+	ULONG CreateDisposition,
+	ULONG CreateOptions,
+	PVOID EaBuffer,
+	ULONG EaLength);
+
+NTSTATUS ZwWriteFile(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID Buffer,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset,
+	PULONG Key);
+
+typedef enum _FILE_INFORMATION_CLASS {
+	FileStandardInformation = 5,
+	FileNamesInformation = 12,
+	FileEndOfFileInformation = 20
+} FILE_INFORMATION_CLASS;
+
+typedef struct _FILE_STANDARD_INFORMATION {
+	LARGE_INTEGER AllocationSize;
+	LARGE_INTEGER EndOfFile;
+	ULONG NumberOfLinks;
+	BOOLEAN DeletePending;
+	BOOLEAN Directory;
+} FILE_STANDARD_INFORMATION, *PFILE_STANDARD_INFORMATION;
+
+NTSTATUS ZwQueryInformationFile(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass);
+
+typedef struct _FILE_END_OF_FILE_INFORMATION {
+	LARGE_INTEGER EndOfFile;
+} FILE_END_OF_FILE_INFORMATION, *PFILE_END_OF_FILE_INFORMATION;
+
+// FileEndOfFileInformation only
+NTSTATUS ZwSetInformationFile(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass);
+
+typedef struct _FILE_NAMES_INFORMATION {
+	ULONG NextEntryOffset;
+	ULONG FileIndex;
+	ULONG FileNameLength; // bytes, no terminator
+	WCHAR FileName[1];
+} FILE_NAMES_INFORMATION, *PFILE_NAMES_INFORMATION;
+
+NTSTATUS ZwQueryDirectoryFile(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass,
+	BOOLEAN ReturnSingleEntry,
+	PUNICODE_STRING FileName,
+	BOOLEAN RestartScan);
+
+NTSTATUS ZwDeleteFile(POBJECT_ATTRIBUTES ObjectAttributes);
+NTSTATUS ZwClose(HANDLE Handle);
+
+// event handles, for asynchronous ZwWriteFile
+
+#define EVENT_ALL_ACCESS 0x1f0003
+
+NTSTATUS ZwCreateEvent(
+	PHANDLE EventHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	EVENT_TYPE EventType,
+	BOOLEAN InitialState);
+
+NTSTATUS ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+
+// registry: value "NAME" is read from the environment variable KLOGGER_NAME, written values go there too
+
+#define KEY_QUERY_VALUE 0x1
+#define KEY_SET_VALUE 0x2
+#define REG_OPTION_NON_VOLATILE 0
+#define REG_DWORD 4
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+	KeyValueBasicInformation,
+	KeyValueFullInformation,
+	KeyValuePartialInformation
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+	ULONG TitleIndex;
+	ULONG Type;
+	ULONG DataLength;
+	UCHAR Data[1];
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+NTSTATUS ZwCreateKey(
+	PHANDLE KeyHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	ULONG TitleIndex,
+	PUNICODE_STRING Class,
+	ULONG CreateOptions,
+	PULONG Disposition);
+
+NTSTATUS ZwQueryValueKey(
+	HANDLE KeyHandle,
+	PUNICODE_STRING ValueName,
+	KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+	PVOID KeyValueInformation,
+	ULONG Length,
+	PULONG ResultLength);
+
+NTSTATUS ZwSetValueKey(
+	HANDLE KeyHandle,
+	PUNICODE_STRING ValueName,
+	ULONG TitleIndex,
+	ULONG Type,
+	PVOID Data,
+	ULONG DataSize);
+
+// sections: a named one is a file "$KLOGGER_SHM_DIR/<last part of the name>" (/dev/shm by default)
+// mapped shared, so other processes can map it too. It is unlinked when its handle is closed,
+// mappings stay valid. MDLs only remember the range, pages are locked with mlock where allowed
+
+#define SECTION_ALL_ACCESS 0xf001f
+#define SEC_COMMIT 0x8000000
+
+NTSTATUS ZwCreateSection(
+	PHANDLE SectionHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PLARGE_INTEGER MaximumSize,
+	ULONG SectionPageProtection,
+	ULONG AllocationAttributes,
+	HANDLE FileHandle);
+
+NTSTATUS MmMapViewInSystemSpace(PVOID Section, PVOID* MappedBase, PSIZE_T ViewSize);
+NTSTATUS MmUnmapViewInSystemSpace(PVOID MappedBase);
+
+typedef struct _MDL {
+	PVOID StartVa;
+	ULONG ByteCount;
+} MDL, *PMDL;
+
+typedef enum _LOCK_OPERATION {
+	IoReadAccess,
+	IoWriteAccess,
+	IoModifyAccess
+} LOCK_OPERATION;
+
+#define NormalPagePriority 16
+#define MdlMappingNoExecute 0x40000000
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PVOID Irp);
+VOID IoFreeMdl(PMDL Mdl);
+VOID MmProbeAndLockPages(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation);
+VOID MmUnlockPages(PMDL MemoryDescriptorList);
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) ((Mdl)->StartVa)
+
+// structured exceptions are never raised here
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define __try if (1)
+#define __except(Filter) else
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <wchar.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR, CCHAR;
+typedef const char *PCSTR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef short SHORT;
+typedef unsigned short USHORT, *PUSHORT;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, LONG64, *PLONGLONG, *PLONG64;
+typedef uint64_t ULONGLONG, ULONG64, *PULONGLONG, *PULONG64;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef UCHAR BOOLEAN, *PBOOLEAN;
+typedef LONG NTSTATUS;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR, *PWCH;
+typedef const wchar_t *PCWSTR;
+typedef PVOID HANDLE, *PHANDLE;
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _UNICODE_STRING {
+	USHORT Length;
+	USHORT MaximumLength;
+	PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+VOID RtlInitUnicodeString(PUNICODE_STRING DestinationString, PCWSTR SourceString);
+VOID RtlCopyUnicodeString(PUNICODE_STRING DestinationString, const UNICODE_STRING* SourceString);
+
+#define TRUE 1
+#define FALSE 0
+
+#define MAXULONG 0xffffffffu
+#define MAXLONG 0x7fffffff
+#define MAXLONGLONG INT64_MAX
+#define MAXULONGLONG UINT64_MAX
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define FIELD_OFFSET(type, field) ((LONG)__builtin_offsetof(type, field))
+#define C_ASSERT(e) _Static_assert(e, #e)
+#define DECLSPEC_IMPORT
+#define IN
+#define OUT
+#define _In_
+#define _Out_
+
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000l)
+#define STATUS_WAIT_0 ((NTSTATUS)0x00000000l)
+#define STATUS_WAIT_1 ((NTSTATUS)0x00000001l)
+#define STATUS_WAIT_2 ((NTSTATUS)0x00000002l)
+#define STATUS_WAIT_3 ((NTSTATUS)0x00000003l)
+#define STATUS_ALERTED ((NTSTATUS)0x00000101l)
+#define STATUS_TIMEOUT ((NTSTATUS)0x00000102l)
+#define STATUS_PENDING ((NTSTATUS)0x00000103l)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005l)
+#define STATUS_NO_MORE_FILES ((NTSTATUS)0x80000006l)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001l)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000Dl)
+#define STATUS_NO_MEMORY ((NTSTATUS)0xC0000017l)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034l)
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035l)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009Al)
+#define STATUS_DISK_FULL ((NTSTATUS)0xC000007Fl)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBl)
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
@@ -0,0 +1,30 @@
+#pragma once
+
+// user-mode stand-in for the WDK ntstrsafe.h subset used by the driver
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "ntdef.h"
+
+static inline NTSTATUS
+RtlStringCbPrintfA(
+	char* pszDest,
+	size_t cbDest,
+	const char* pszFormat,
+	...
+) {
+	if (!cbDest)
+		return STATUS_INVALID_PARAMETER;
+
+	va_list Args;
+	va_start(Args, pszFormat);
+	int Length = vsnprintf(pszDest, cbDest, pszFormat, Args);
+	va_end(Args);
+
+	if (Length < 0) {
+		pszDest[0] = '\0';
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return ((size_t)Length >= cbDest) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#define ERROR_SUCCESS 0l
+#define ERROR_NOT_ENOUGH_MEMORY 8l
+#define ERROR_BAD_ARGUMENTS 160l
+#define ERROR_INSUFFICIENT_BUFFER 122l
+#define ERROR_CANNOT_MAKE 82l
+#define ERROR_TOO_MANY_TCBS 155l
+#define ERROR_NO_MORE_ITEMS 259l
+#define ERROR_NOT_SUPPORTED 50l
+#define ERROR_ALREADY_EXISTS 183l
+#define ERROR_OPERATION_ABORTED 995l
+#define ERROR_WRITE_FAULT 29l
@@ -0,0 +1,461 @@
+// benchmark suite of RingBuffer.c and KLogger.c: throughput and call latency percentiles
+// over every combination of producer count, message size and ring size, as CSV or JSON lines.
+//
+//   rb   RBWrite producers against one RBRead consumer thread
+//   log  KLoggerLog producers, end to end with the flushing thread and the log file,
+//        KLoggerLogV batches of -v messages per call if it is over 1
+//   id   the same message registered with the catalog and logged with KLoggerLogId
+//
+// Latencies are per call, measured with CLOCK_MONOTONIC (the clock read itself is included)
+// and kept in a log-linear histogram: 16 sub-buckets per power of two, about 6% precision.
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "RingBuffer.h"
+#include "KLogger.h"
+#include "Catalog.h"
+
+#define READ_BUF_SIZE (4u * 1024u * 1024u)
+#define MAX_MSG_SIZE 4096u
+#define MAX_SWEEP 32
+#define MAX_BATCH 256
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct Histogram {
+	ULONGLONG Count;
+	ULONGLONG Sum;
+	ULONGLONG Max;
+	ULONGLONG Buckets[HIST_BUCKETS];
+} HISTOGRAM;
+
+typedef enum BenchKind {
+	BENCH_RB,
+	BENCH_LOG,
+	BENCH_ID
+} BENCHKIND;
+
+static PCSTR BenchNames[] = { "rb", "log", "id" };
+
+typedef struct BenchCtx {
+	BENCHKIND Kind;
+	PRINGBUFFER pRingBuf;
+	SIZE_T MsgSize;
+	ULONG Batch;
+	ULONG Id; // of Msg in the catalog
+	CHAR Msg[MAX_MSG_SIZE + 1];
+	volatile LONG Stop;
+	ULONGLONG Read; // bytes taken by the rb consumer
+} BENCHCTX;
+
+typedef struct ProducerStat {
+	BENCHCTX* Ctx;
+	ULONGLONG Written;
+	ULONGLONG Dropped;
+	HISTOGRAM Latency;
+} PRODUCERSTAT;
+
+typedef struct Sweep {
+	ULONGLONG Values[MAX_SWEEP];
+	int Count;
+} SWEEP;
+
+static int IsJson = 0;
+
+static ULONGLONG
+NowNs(void) {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return (ULONGLONG)Ts.tv_sec * 1000000000ull + (ULONGLONG)Ts.tv_nsec;
+}
+
+static unsigned
+HistIndex(
+	ULONGLONG Value
+) {
+	if (Value < HIST_SUB_COUNT) {
+		return (unsigned)Value;
+	}
+
+	unsigned Msb = 63 - (unsigned)__builtin_clzll(Value);
+	unsigned Sub = (unsigned)(Value >> (Msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+	return (Msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + Sub;
+}
+
+// middle of the values that fall into the bucket
+static ULONGLONG
+HistValue(
+	unsigned Index
+) {
+	if (Index < HIST_SUB_COUNT) {
+		return Index;
+	}
+
+	unsigned Msb = Index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+	unsigned Sub = Index % HIST_SUB_COUNT;
+	ULONGLONG Low = (1ull << Msb) | ((ULONGLONG)Sub << (Msb - HIST_SUB_BITS));
+	return Low + (1ull << (Msb - HIST_SUB_BITS)) / 2;
+}
+
+static __inline VOID
+HistAdd(
+	HISTOGRAM* Hist,
+	ULONGLONG Value
+) {
+	Hist->Buckets[HistIndex(Value)]++;
+	Hist->Count++;
+	Hist->Sum += Value;
+	if (Value > Hist->Max) {
+		Hist->Max = Value;
+	}
+}
+
+static VOID
+HistMerge(
+	HISTOGRAM* To,
+	const HISTOGRAM* From
+) {
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		To->Buckets[i] += From->Buckets[i];
+	}
+	To->Count += From->Count;
+	To->Sum += From->Sum;
+	if (From->Max > To->Max) {
+		To->Max = From->Max;
+	}
+}
+
+static ULONGLONG
+HistPercentile(
+	const HISTOGRAM* Hist,
+	double Percentile
+) {
+	if (!Hist->Count) {
+		return 0;
+	}
+
+	ULONGLONG Rank = (ULONGLONG)(Percentile / 100.0 * (double)(Hist->Count - 1)) + 1;
+	ULONGLONG Seen = 0;
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		Seen += Hist->Buckets[i];
+		if (Seen >= Rank) {
+			ULONGLONG Value = HistValue(i);
+			return Value < Hist->Max ? Value : Hist->Max;
+		}
+	}
+
+	return Hist->Max;
+}
+
+static void*
+ProducerFunc(
+	void* Arg
+) {
+	PRODUCERSTAT* Stat = (PRODUCERSTAT*)Arg;
+	BENCHCTX* Ctx = Stat->Ctx;
+	BOOLEAN IsBatch = Ctx->Kind == BENCH_LOG && Ctx->Batch > 1;
+
+	KLOGGER_ENTRY Entries[MAX_BATCH];
+	for (ULONG i = 0; i < Ctx->Batch; ++i) {
+		Entries[i].Msg = Ctx->Msg;
+		Entries[i].Length = Ctx->MsgSize;
+	}
+
+	while (!Ctx->Stop) {
+		ULONGLONG Start = NowNs();
+		INT Err;
+		if (Ctx->Kind == BENCH_RB) {
+			Err = RBWrite(Ctx->pRingBuf, Ctx->Msg, Ctx->MsgSize);
+		} else if (Ctx->Kind == BENCH_ID) {
+			Err = KLoggerLogId(Ctx->Id);
+		} else if (IsBatch) {
+			Err = KLoggerLogV(Entries, Ctx->Batch);
+		} else {
+			Err = KLoggerLog(Ctx->Msg);
+		}
+		HistAdd(&(Stat->Latency), NowNs() - Start);
+
+		if (Err == ERROR_SUCCESS) {
+			Stat->Written += IsBatch ? Ctx->Batch : 1;
+		} else {
+			Stat->Dropped += IsBatch ? Ctx->Batch : 1;
+		}
+	}
+
+	return NULL;
+}
+
+static void*
+ConsumerFunc(
+	void* Arg
+) {
+	BENCHCTX* Ctx = (BENCHCTX*)Arg;
+	PCHAR Buf = malloc(READ_BUF_SIZE);
+
+	while (!Ctx->Stop) {
+		SIZE_T Size = READ_BUF_SIZE;
+		RBRead(Ctx->pRingBuf, Buf, &Size);
+		Ctx->Read += Size;
+		if (!Size) {
+			sched_yield();
+		}
+	}
+
+	free(Buf);
+	return NULL;
+}
+
+static ULONGLONG
+FileSize(
+	PCSTR Path
+) {
+	struct stat St;
+	return stat(Path, &St) == 0 ? (ULONGLONG)St.st_size : 0;
+}
+
+static int
+RunOne(
+	BENCHKIND Kind,
+	int Producers,
+	SIZE_T MsgSize,
+	SIZE_T RingSize,
+	ULONG Batch,
+	double Duration,
+	PCSTR LogPath
+) {
+	BENCHCTX* Ctx = calloc(1, sizeof(BENCHCTX));
+	Ctx->Kind = Kind;
+	Ctx->MsgSize = MsgSize;
+	Ctx->Batch = Batch;
+	memset(Ctx->Msg, 'x', MsgSize);
+
+	pthread_t Consumer;
+	if (Kind == BENCH_RB) {
+		if (RBInit(&Ctx->pRingBuf, RingSize) != ERROR_SUCCESS) {
+			fprintf(stderr, "RBInit failed\n");
+			free(Ctx);
+			return 1;
+		}
+		pthread_create(&Consumer, NULL, ConsumerFunc, Ctx);
+	} else {
+		char Value[32];
+		snprintf(Value, sizeof(Value), "%zu", RingSize);
+		setenv("KLOGGER_PER_CPU_BUF_SIZE", Value, 1);
+		unlink(LogPath);
+
+		UNICODE_STRING RegistryPath;
+		RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\klbench");
+		if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+			fprintf(stderr, "KLoggerInit failed\n");
+			free(Ctx);
+			return 1;
+		}
+
+		if (Kind == BENCH_ID && KLoggerRegister(Ctx->Msg, &Ctx->Id) != ERROR_SUCCESS) {
+			fprintf(stderr, "KLoggerRegister failed, formats are limited to %u bytes\n", CATALOG_FORMAT_MAX - 1);
+			KLoggerDeinit();
+			free(Ctx);
+			return 1;
+		}
+	}
+
+	PRODUCERSTAT* Stats = calloc(Producers, sizeof(PRODUCERSTAT));
+	pthread_t* Threads = calloc(Producers, sizeof(pthread_t));
+
+	ULONGLONG Start = NowNs();
+	for (int i = 0; i < Producers; ++i) {
+		Stats[i].Ctx = Ctx;
+		pthread_create(&Threads[i], NULL, ProducerFunc, &Stats[i]);
+	}
+
+	usleep((useconds_t)(Duration * 1e6));
+	Ctx->Stop = 1;
+
+	ULONGLONG Written = 0, Dropped = 0;
+	HISTOGRAM* Latency = calloc(1, sizeof(HISTOGRAM));
+	for (int i = 0; i < Producers; ++i) {
+		pthread_join(Threads[i], NULL);
+		Written += Stats[i].Written;
+		Dropped += Stats[i].Dropped;
+		HistMerge(Latency, &(Stats[i].Latency));
+	}
+	double Elapsed = (NowNs() - Start) * 1e-9;
+
+	ULONGLONG Drained;
+	if (Kind == BENCH_RB) {
+		pthread_join(Consumer, NULL);
+		RBDeinit(Ctx->pRingBuf);
+		Drained = Ctx->Read;
+	} else {
+		KLoggerDeinit();
+		Drained = FileSize(LogPath);
+	}
+
+	PCSTR Name = BenchNames[Kind];
+	double Mean = Latency->Count ? (double)Latency->Sum / Latency->Count : 0.0;
+	unsigned long long P50 = HistPercentile(Latency, 50.0);
+	unsigned long long P99 = HistPercentile(Latency, 99.0);
+	unsigned long long P999 = HistPercentile(Latency, 99.9);
+	unsigned long long Max = Latency->Max;
+	if (IsJson) {
+		printf("{\"bench\":\"%s\",\"producers\":%d,\"msg_size\":%zu,\"ring_size\":%zu,"
+			"\"written_per_sec\":%.0f,\"dropped_per_sec\":%.0f,\"drained_mb_per_sec\":%.1f,"
+			"\"mean_ns\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+			Name, Producers, MsgSize, RingSize,
+			Written / Elapsed, Dropped / Elapsed, Drained / Elapsed / (1024.0 * 1024.0),
+			Mean, P50, P99, P999, Max);
+	} else {
+		printf("%s,%d,%zu,%zu,%.0f,%.0f,%.1f,%.0f,%llu,%llu,%llu,%llu\n",
+			Name, Producers, MsgSize, RingSize,
+			Written / Elapsed, Dropped / Elapsed, Drained / Elapsed / (1024.0 * 1024.0),
+			Mean, P50, P99, P999, Max);
+	}
+	fflush(stdout);
+
+	free(Latency);
+	free(Threads);
+	free(Stats);
+	free(Ctx);
+	return 0;
+}
+
+// "1,2,4" or "1-8" (powers of two from 1 to 8), sizes may end with k or m
+static int
+ParseSweep(
+	PCSTR Arg,
+	SWEEP* Sweep
+) {
+	Sweep->Count = 0;
+	while (*Arg) {
+		char* End;
+		ULONGLONG Value = strtoull(Arg, &End, 0);
+		if (*End == 'k' || *End == 'K') {
+			Value <<= 10;
+			End++;
+		} else if (*End == 'm' || *End == 'M') {
+			Value <<= 20;
+			End++;
+		}
+
+		if (End == Arg || !Value || Sweep->Count == MAX_SWEEP) {
+			return -1;
+		}
+
+		if (*End == '-') {
+			SWEEP Last;
+			if (ParseSweep(End + 1, &Last) || Last.Count != 1) {
+				return -1;
+			}
+			for (; Value <= Last.Values[0] && Sweep->Count < MAX_SWEEP; Value *= 2) {
+				Sweep->Values[Sweep->Count++] = Value;
+			}
+			return 0;
+		}
+
+		Sweep->Values[Sweep->Count++] = Value;
+		if (*End == ',') {
+			End++;
+		} else if (*End) {
+			return -1;
+		}
+		Arg = End;
+	}
+
+	return Sweep->Count ? 0 : -1;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	PCSTR Benches = "rb,log,id";
+	SWEEP Producers, MsgSizes, RingSizes;
+	double Duration = 1.0;
+	ULONG Batch = 1;
+
+	ParseSweep("1-4", &Producers);
+	ParseSweep("32,256", &MsgSizes);
+	ParseSweep("1m,16m", &RingSizes);
+
+	int Opt;
+	while ((Opt = getopt(argc, argv, "b:p:m:r:t:v:j")) != -1) {
+		int Err = 0;
+		switch (Opt) {
+		case 'b': Benches = optarg; break;
+		case 'p': Err = ParseSweep(optarg, &Producers); break;
+		case 'm': Err = ParseSweep(optarg, &MsgSizes); break;
+		case 'r': Err = ParseSweep(optarg, &RingSizes); break;
+		case 't': Duration = atof(optarg); break;
+		case 'v': Batch = (ULONG)atoi(optarg); Err = Batch < 1 || Batch > MAX_BATCH; break;
+		case 'j': IsJson = 1; break;
+		default: Err = -1; break;
+		}
+
+		if (Err) {
+			fprintf(stderr,
+				"usage: %s [-b rb,log,id] [-p producers] [-m msg_sizes] [-r ring_sizes] [-t seconds] [-v batch] [-j]\n"
+				"  sweeps are lists (1,2,4) or power of two ranges (1-16), sizes take k and m suffixes\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < MsgSizes.Count; ++i) {
+		if (MsgSizes.Values[i] > MAX_MSG_SIZE) {
+			fprintf(stderr, "message sizes are limited to %u\n", MAX_MSG_SIZE);
+			return 1;
+		}
+	}
+
+	char Root[] = "/tmp/klbench.XXXXXX";
+	BOOLEAN IsFile = strstr(Benches, "log") || strstr(Benches, "id");
+	if (IsFile) {
+		if (!mkdtemp(Root)) {
+			perror("mkdtemp");
+			return 1;
+		}
+		setenv("KLOGGER_ROOT", Root, 1);
+	}
+
+	char LogPath[sizeof(Root) + 16];
+	snprintf(LogPath, sizeof(LogPath), "%s/klogger.log", Root);
+
+	if (!IsJson) {
+		printf("bench,producers,msg_size,ring_size,written_per_sec,dropped_per_sec,drained_mb_per_sec,"
+			"mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+	}
+
+	for (int b = 0; b < 3; ++b) {
+		BENCHKIND Kind = (BENCHKIND)b;
+		if (!strstr(Benches, BenchNames[Kind])) {
+			continue;
+		}
+
+		for (int r = 0; r < RingSizes.Count; ++r) {
+			for (int m = 0; m < MsgSizes.Count; ++m) {
+				for (int p = 0; p < Producers.Count; ++p) {
+					if (RunOne(Kind, (int)Producers.Values[p], (SIZE_T)MsgSizes.Values[m],
+						(SIZE_T)RingSizes.Values[r], Batch, Duration, LogPath)) {
+						return 1;
+					}
+				}
+			}
+		}
+	}
+
+	if (IsFile) {
+		unlink(LogPath);
+		rmdir(Root);
+	}
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+// chunk compression (Compress.c) against the decoder the host tools use. Random, text, run and
+// small-alphabet buffers, from empty up to a whole flush buffer, have to come back from
+// LZCompress and LZDecompress unchanged, within LZ_COMPRESS_BOUND and not into less room than
+// they need. Then a log written with COMPRESS 1, text and random phases with bodies large enough
+// to go straight from the ring, has to give every message back byte for byte through
+// tools/LogReader.c, from frames and from the chunks stored as is because they did not shrink.
+// The raw records of every frame and every stored chunk are round-tripped as blocks too
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "Compress.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define MAX_BLOCK (1024 * 1024) // FLUSH_BUF_SIZE of KLogger.c
+#define DIRECT_MIN 4096 // FLUSH_DIRECT_MIN of KLogger.c
+#define PHASES 8
+#define PHASE_BYTES (512 * 1024)
+
+typedef struct Message {
+	size_t Offset; // in the message text buffer
+	size_t Length;
+} MESSAGE;
+
+static void* HashTable;
+static unsigned char* Packed; // room for the largest buffer checked, compressed
+static unsigned char* Unpacked; // and decompressed
+static unsigned long long Blocks = 0, Expanded = 0;
+
+// compresses and decompresses Buf, Name says where it came from
+static void
+RoundTrip(
+	const void* Buf,
+	size_t Length,
+	const char* Name
+) {
+	Blocks++;
+	size_t Size = LZCompress(Buf, Length, Packed, HashTable);
+	if (Size > LZ_COMPRESS_BOUND(Length)) {
+		CheckError("%s, %zu bytes: compressed to %zu, over the bound %zu", Name, Length, Size, (size_t)LZ_COMPRESS_BOUND(Length));
+		return;
+	}
+	if (Size >= Length) {
+		Expanded++;
+	}
+
+	size_t Back = LZDecompress(Packed, Size, Unpacked, Length);
+	if (Back != Length || memcmp(Buf, Unpacked, Length)) {
+		CheckError("%s, %zu bytes: does not decompress to itself", Name, Length);
+		return;
+	}
+
+	if (Length && LZDecompress(Packed, Size, Unpacked, Length - 1) != (size_t)-1) {
+		CheckError("%s, %zu bytes: decompressed into %zu bytes of room", Name, Length, Length - 1);
+	}
+}
+
+static void
+FillRandom(
+	unsigned char* Buf,
+	size_t Length,
+	unsigned* pSeed
+) {
+	for (size_t i = 0; i < Length; ++i) {
+		Buf[i] = (unsigned char)(rand_r(pSeed) >> 7);
+	}
+}
+
+// log-like lines with a counter and some varying words
+static void
+FillText(
+	unsigned char* Buf,
+	size_t Length,
+	unsigned* pSeed
+) {
+	static const char* Words[] = { "irp", "completed", "status", "device", "queue", "read", "write", "pending" };
+	size_t i = 0;
+	while (i < Length) {
+		char Line[96];
+		int n = snprintf(Line, sizeof(Line), "line %u: %s %s 0x%08x\n", (unsigned)i,
+			Words[rand_r(pSeed) % 8], Words[rand_r(pSeed) % 8], (unsigned)rand_r(pSeed) & 0xffff);
+		size_t Part = (size_t)n < Length - i ? (size_t)n : Length - i;
+		memcpy(Buf + i, Line, Part);
+		i += Part;
+	}
+}
+
+static void
+CheckBlocks(
+	unsigned char* Buf
+) {
+	static const size_t Sizes[] = { 4095, 4096, 4097, 65535, 65536, 65537, 300000, MAX_BLOCK };
+	unsigned Seed = 1;
+
+	for (int Kind = 0; Kind < 4; ++Kind) {
+		const char* Name = "random";
+		if (Kind == 0) {
+			FillRandom(Buf, MAX_BLOCK, &Seed);
+		} else if (Kind == 1) {
+			FillText(Buf, MAX_BLOCK, &Seed);
+			Name = "text";
+		} else if (Kind == 2) {
+			memset(Buf, 'a', MAX_BLOCK);
+			Name = "run";
+		} else {
+			for (size_t i = 0; i < MAX_BLOCK; ++i) {
+				Buf[i] = (unsigned char)"abcd"[rand_r(&Seed) % 4];
+			}
+			Name = "alphabet";
+		}
+
+		for (size_t Length = 0; Length <= 64; ++Length) {
+			RoundTrip(Buf, Length, Name);
+		}
+		for (size_t i = 0; i < sizeof(Sizes) / sizeof(Sizes[0]); ++i) {
+			RoundTrip(Buf, Sizes[i], Name);
+		}
+
+		// random input can't shrink, the flushing thread stores such chunks as they are
+		if (Kind == 0 && LZCompress(Buf, MAX_BLOCK, Packed, HashTable) < MAX_BLOCK) {
+			CheckError("random, %d bytes: compressed", MAX_BLOCK);
+		}
+	}
+}
+
+// the message sequence of the log check: text and random phases, every 64th message is a body
+// written straight from the ring
+static size_t
+MakeMessages(
+	unsigned char* Text,
+	size_t Capacity,
+	MESSAGE* Messages,
+	size_t MaxMessages
+) {
+	unsigned Seed = 2;
+	size_t Count = 0, Used = 0;
+	for (int Phase = 0; Phase < PHASES; ++Phase) {
+		size_t PhaseEnd = Used + PHASE_BYTES;
+		while (Used < PhaseEnd && Count < MaxMessages) {
+			size_t Length = 1 + rand_r(&Seed) % 300;
+			if (!(Count % 64)) {
+				Length = DIRECT_MIN + rand_r(&Seed) % (3 * DIRECT_MIN);
+			}
+			if (Used + Length > Capacity) {
+				return Count;
+			}
+
+			if (Phase % 2) {
+				FillRandom(Text + Used, Length, &Seed);
+			} else {
+				FillText(Text + Used, Length, &Seed);
+			}
+			Messages[Count].Offset = Used;
+			Messages[Count].Length = Length;
+			Count++;
+			Used += Length;
+		}
+	}
+
+	return Count;
+}
+
+static void
+CheckLog(
+	unsigned char* Text,
+	size_t Capacity
+) {
+	size_t MaxMessages = PHASES * PHASE_BYTES;
+	MESSAGE* Messages = malloc(MaxMessages * sizeof(MESSAGE));
+	size_t Count = MakeMessages(Text, Capacity, Messages, MaxMessages);
+
+	char Root[] = "/tmp/lzcheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		CheckErrors++;
+		free(Messages);
+		return;
+	}
+
+	char LogPath[sizeof(Root) + 16];
+	snprintf(LogPath, sizeof(LogPath), "%s/klogger.log", Root);
+
+	// a small ring is drained in many chunks, writers wait for it instead of dropping
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_COMPRESS", "1", 1);
+	setenv("KLOGGER_BUF_SIZE", "262144", 1);
+	setenv("KLOGGER_OVERFLOW_POLICY", "2", 1);
+	setenv("KLOGGER_BLOCK_TIMEOUT_MS", "10000", 1);
+
+	UNICODE_STRING RegistryPath;
+	RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\lzcheck");
+	if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+		CheckError("KLoggerInit failed");
+		rmdir(Root);
+		free(Messages);
+		return;
+	}
+
+	for (size_t i = 0; i < Count; ++i) {
+		if (KLoggerLogN((PCSTR)Text + Messages[i].Offset, Messages[i].Length) != ERROR_SUCCESS) {
+			CheckError("message %zu: not logged", i);
+		}
+	}
+	KLoggerDeinit();
+
+	size_t Size = 0;
+	char* Log = CheckReadFile(LogPath, &Size);
+	unlink(LogPath);
+	rmdir(Root);
+	if (!Log) {
+		CheckErrors++;
+		free(Messages);
+		return;
+	}
+
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Log, Size);
+
+	unsigned long long Frames = 0, Stored = 0, FramedRecords = 0, StoredRecords = 0;
+	const unsigned char* Frame = NULL; // the frame being read, by its end in the file
+	size_t StoredStart = 0; // of the stored chunk being read, SIZE_MAX - none
+	int64_t Sync = INT64_MIN;
+	size_t Next = 0;
+	int Ret;
+	for (;;) {
+		size_t Offset = LogReaderOffset(&Reader);
+		Ret = LogReaderNext(&Reader, &Record);
+
+		// a stored chunk ends where the next chunk starts
+		BOOLEAN IsNewChunk = Ret != LOG_READ_RECORD || Reader.SyncTimestamp != Sync ||
+			(Reader.InFrame && Reader.OuterPos != Frame);
+		if (IsNewChunk && StoredStart != SIZE_MAX && Frame == NULL && Sync != INT64_MIN) {
+			RoundTrip(Log + StoredStart, Offset - StoredStart, "stored chunk");
+			Stored++;
+		}
+		if (Ret != LOG_READ_RECORD) {
+			break;
+		}
+
+		if (IsNewChunk) {
+			Sync = Reader.SyncTimestamp;
+			Frame = NULL;
+			StoredStart = SIZE_MAX;
+			if (Reader.InFrame) {
+				Frame = Reader.OuterPos;
+				RoundTrip(Reader.Frame, (size_t)(Reader.End - Reader.Frame), "frame");
+				Frames++;
+			} else {
+				StoredStart = Offset;
+			}
+		}
+
+		if (Reader.InFrame) {
+			FramedRecords++;
+		} else {
+			StoredRecords++;
+		}
+
+		if (Record.Type != KLOGGER_REC_MESSAGE) {
+			CheckError("record %zu: type %d", Next, Record.Type);
+			continue;
+		}
+		if (Next >= Count) {
+			CheckError("record %zu: more records than the %zu messages logged", Next, Count);
+			continue;
+		}
+
+		const MESSAGE* Expect = &Messages[Next];
+		if (Record.Length != Expect->Length) {
+			CheckError("record %zu: %zu bytes, the message logged has %zu", Next, Record.Length, Expect->Length);
+		} else if (memcmp(Record.Data, Text + Expect->Offset, Expect->Length)) {
+			CheckError("record %zu: differs from the message logged", Next);
+		}
+		Next++;
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("log is corrupted at offset %zu", LogReaderOffset(&Reader));
+	}
+	if (Next != Count) {
+		CheckError("%zu of %zu messages decoded", Next, Count);
+	}
+	if (!Frames || !Stored) {
+		CheckError("%llu compressed and %llu stored chunks, both kinds are needed", Frames, Stored);
+	}
+
+	printf("log: %zu messages, %zu bytes, %llu compressed chunks with %llu records, %llu stored chunks with %llu records\n",
+		Count, Size, Frames, FramedRecords, Stored, StoredRecords);
+
+	LogReaderFree(&Reader);
+	free(Log);
+	free(Messages);
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	UNREFERENCED_PARAMETER(argc);
+	UNREFERENCED_PARAMETER(argv);
+
+	size_t Capacity = PHASES * PHASE_BYTES + 4 * DIRECT_MIN;
+	unsigned char* Buf = malloc(Capacity > MAX_BLOCK ? Capacity : MAX_BLOCK);
+	HashTable = malloc(LZ_HASH_TABLE_SIZE);
+	Packed = malloc(LZ_COMPRESS_BOUND(Capacity));
+	Unpacked = malloc(Capacity);
+	if (!Buf || !HashTable || !Packed || !Unpacked) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	CheckBlocks(Buf);
+	CheckLog(Buf, Capacity);
+
+	printf("%llu blocks, %llu did not shrink, %llu errors\n", Blocks, Expanded, CheckErrors);
+
+	free(Unpacked);
+	free(Packed);
+	free(HashTable);
+	free(Buf);
+
+	return CheckErrors ? 1 : 0;
+}
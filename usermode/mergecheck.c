@@ -0,0 +1,381 @@
+// KLoggerLogV batches and the merge of per-processor rings, decoded back from the log file with
+// tools/LogReader.c. Every producer is pinned to a stand-in processor of its own
+// (KLOGGER_SHIM_CPUS), so each ring has one writer, and rings are small enough that batches keep
+// wrapping and some are dropped. A batch has to be in the log whole, in order and on its
+// processor exactly when KLoggerLogV accepted it, and the LOSS records of a processor have to add
+// up to the messages it had dropped. Within a chunk records are in timestamp order, across chunks
+// a record committed late may follow newer ones and is only counted. No pool or node memory may
+// be left after KLoggerDeinit. With -z the rings are resized over and over while the producers
+// run, each resize asked for once the last one is done: the same has to hold, every retired ring
+// freed, and every resize has to happen, which it only does once the retired rings are freed
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define MAX_PRODUCERS 16
+#define MAX_BATCH 8
+#define MAX_PAD 200
+#define MSG_SIZE (64 + MAX_PAD)
+
+typedef struct Producer {
+	int Index;
+	int Batches;
+	signed char* Sent; // per batch: message count if accepted, minus it if dropped
+	unsigned long long Dropped; // messages
+} PRODUCER;
+
+typedef struct Expect {
+	int Batch; // open one, -1 - none
+	int Next; // message expected in it
+	int Count;
+	int Last; // batch seen last
+	BOOLEAN IsEnded;
+	char* Seen; // per batch
+	unsigned long long Lost; // reported by LOSS records
+} EXPECT;
+
+typedef struct Resizer {
+	SIZE_T Sizes[3]; // taken in turn
+	int volatile IsDone; // the producers are
+	ULONG Asked; // resizes
+} RESIZER;
+
+static void*
+ProducerFunc(
+	void* Arg
+) {
+	PRODUCER* Self = (PRODUCER*)Arg;
+	unsigned Seed = (unsigned)Self->Index * 7919u + 1u;
+
+	GROUP_AFFINITY Affinity, OldAffinity;
+	memset(&Affinity, 0, sizeof(Affinity));
+	Affinity.Mask = (KAFFINITY)1 << Self->Index;
+	KeSetSystemGroupAffinityThread(&Affinity, &OldAffinity);
+
+	char Msgs[MAX_BATCH][MSG_SIZE];
+	KLOGGER_ENTRY Entries[MAX_BATCH];
+	for (int b = 0; b < Self->Batches; ++b) {
+		int Count = 1 + (int)(rand_r(&Seed) % MAX_BATCH);
+		for (int m = 0; m < Count; ++m) {
+			int Length = snprintf(Msgs[m], MSG_SIZE, "p%d b%d m%d/%d ", Self->Index, b, m, Count);
+			int Pad = (int)(rand_r(&Seed) % MAX_PAD);
+			memset(Msgs[m] + Length, 'x', (size_t)Pad);
+			Msgs[m][Length + Pad] = '\n';
+			Entries[m].Msg = Msgs[m];
+			Entries[m].Length = (SIZE_T)(Length + Pad + 1);
+		}
+
+		if (KLoggerLogV(Entries, (ULONG)Count) == ERROR_SUCCESS) {
+			Self->Sent[b] = (signed char)Count;
+		} else {
+			Self->Sent[b] = (signed char)-Count;
+			Self->Dropped += (unsigned long long)Count;
+		}
+
+		if (!(rand_r(&Seed) % 64)) {
+			sched_yield();
+		}
+	}
+
+	// tries that find the ring full are drops too, reported with the others by the next
+	// message or by KLoggerDeinit
+	char End[32];
+	snprintf(End, sizeof(End), "p%d end\n", Self->Index);
+	while (KLoggerLog(End) != ERROR_SUCCESS) {
+		Self->Dropped++;
+		usleep(1000);
+	}
+
+	KeRevertToUserGroupAffinityThread(&OldAffinity);
+	return NULL;
+}
+
+// a new size once the rings of the last one are in use, so that every request makes a resize
+static void*
+ResizerFunc(
+	void* Arg
+) {
+	RESIZER* Self = (RESIZER*)Arg;
+	while (!Self->IsDone) {
+		KLOGGER_STATS Stats;
+		KLoggerGetStats(&Stats);
+		if (Stats.RingResizes == Self->Asked) {
+			if (KLoggerResize(Self->Sizes[Self->Asked % 3]) != ERROR_SUCCESS) {
+				CheckError("KLoggerResize failed");
+				break;
+			}
+			Self->Asked++;
+		}
+		usleep(2000);
+	}
+
+	return NULL;
+}
+
+static void
+CheckMessage(
+	const LOGRECORD* Record,
+	EXPECT* Expects,
+	PRODUCER* Producers,
+	int ProducerCount
+) {
+	int p, b, m, Count;
+	char Tail;
+	if (sscanf(Record->Data, "p%d end%c", &p, &Tail) == 2 && p >= 0 && p < ProducerCount) {
+		if (Expects[p].Batch >= 0) {
+			CheckError("p%d: batch %d cut at message %d by the end", p, Expects[p].Batch, Expects[p].Next);
+		}
+		Expects[p].IsEnded = TRUE;
+		return;
+	}
+
+	if (sscanf(Record->Data, "p%d b%d m%d/%d", &p, &b, &m, &Count) != 4 ||
+		p < 0 || p >= ProducerCount || b < 0 || b >= Producers[p].Batches) {
+		CheckError("unexpected record: %.*s", (int)(Record->Length > 64 ? 64 : Record->Length), Record->Data);
+		return;
+	}
+
+	EXPECT* Expect = &Expects[p];
+	if ((int)Record->Cpu != p) {
+		CheckError("p%d b%d m%d: on processor %u", p, b, m, Record->Cpu);
+	}
+
+	if (Expect->Batch >= 0 && (b != Expect->Batch || m != Expect->Next)) {
+		CheckError("p%d: batch %d cut at message %d by b%d m%d", p, Expect->Batch, Expect->Next, b, m);
+		Expect->Batch = -1;
+	}
+
+	if (Expect->Batch < 0) {
+		if (m != 0) {
+			CheckError("p%d b%d: starts at message %d", p, b, m);
+			return;
+		}
+		if (b <= Expect->Last) {
+			CheckError("p%d b%d: after b%d", p, b, Expect->Last);
+		}
+		if (Producers[p].Sent[b] != Count) {
+			CheckError("p%d b%d: in the log, KLoggerLogV returned %s for it", p, b, Producers[p].Sent[b] > 0 ? "success" : "an error");
+		}
+
+		Expect->Batch = b;
+		Expect->Count = Count;
+		Expect->Next = 0;
+		Expect->Last = b;
+		Expect->Seen[b] = 1;
+	}
+
+	if (++Expect->Next == Expect->Count) {
+		Expect->Batch = -1;
+	}
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	int ProducerCount = 4;
+	int Batches = 20000;
+	const char* RingSize = "64k";
+	BOOLEAN IsResizing = FALSE;
+
+	int Opt;
+	while ((Opt = getopt(argc, argv, "p:n:r:z")) != -1) {
+		switch (Opt) {
+		case 'p': ProducerCount = atoi(optarg); break;
+		case 'n': Batches = atoi(optarg); break;
+		case 'r': RingSize = optarg; break;
+		case 'z': IsResizing = TRUE; break;
+		default: ProducerCount = 0; break;
+		}
+	}
+
+	if (ProducerCount < 1 || ProducerCount > MAX_PRODUCERS || Batches < 1) {
+		fprintf(stderr, "usage: %s [-p producers, up to %d] [-n batches per producer] [-r ring_size] [-z]\n", argv[0], MAX_PRODUCERS);
+		return 2;
+	}
+
+	char Root[] = "/tmp/mergecheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	char LogPath[sizeof(Root) + 16];
+	snprintf(LogPath, sizeof(LogPath), "%s/klogger.log", Root);
+
+	char Cpus[16];
+	snprintf(Cpus, sizeof(Cpus), "%d", ProducerCount);
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_SHIM_CPUS", Cpus, 1);
+
+	// the registry stand-in takes numbers only
+	unsigned long long Ring = strtoull(RingSize, NULL, 0);
+	if (strchr(RingSize, 'k')) Ring <<= 10;
+	if (strchr(RingSize, 'm')) Ring <<= 20;
+	char RingValue[32];
+	snprintf(RingValue, sizeof(RingValue), "%llu", Ring);
+	setenv("KLOGGER_PER_CPU_BUF_SIZE", RingValue, 1);
+
+	UNICODE_STRING RegistryPath;
+	RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\mergecheck");
+	if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+		fprintf(stderr, "KLoggerInit failed\n");
+		rmdir(Root);
+		return 1;
+	}
+
+	PRODUCER Producers[MAX_PRODUCERS];
+	pthread_t Threads[MAX_PRODUCERS];
+	for (int p = 0; p < ProducerCount; ++p) {
+		Producers[p].Index = p;
+		Producers[p].Batches = Batches;
+		Producers[p].Sent = calloc((size_t)Batches, 1);
+		Producers[p].Dropped = 0;
+		pthread_create(&Threads[p], NULL, ProducerFunc, &Producers[p]);
+	}
+
+	// half, twice and back to the size the rings start with
+	RESIZER Resizer;
+	memset(&Resizer, 0, sizeof(Resizer));
+	Resizer.Sizes[0] = (SIZE_T)Ring / 2;
+	Resizer.Sizes[1] = (SIZE_T)Ring * 2;
+	Resizer.Sizes[2] = (SIZE_T)Ring;
+	pthread_t ResizerThread;
+	if (IsResizing) {
+		pthread_create(&ResizerThread, NULL, ResizerFunc, &Resizer);
+	}
+
+	for (int p = 0; p < ProducerCount; ++p) {
+		pthread_join(Threads[p], NULL);
+	}
+
+	KLOGGER_STATS Stats;
+	memset(&Stats, 0, sizeof(Stats));
+	if (IsResizing) {
+		Resizer.IsDone = 1;
+		pthread_join(ResizerThread, NULL);
+
+		// the last one is asked for, it may not be done yet
+		for (int i = 0; i < 1000; ++i) {
+			KLoggerGetStats(&Stats);
+			if (Stats.RingResizes == Resizer.Asked) {
+				break;
+			}
+			usleep(1000);
+		}
+		if (Stats.RingResizes != Resizer.Asked || Resizer.Asked < 3) {
+			CheckError("%u resizes done, %u asked for", Stats.RingResizes, Resizer.Asked);
+		}
+	}
+	KLoggerDeinit();
+
+	if (ShimAllocations()) {
+		CheckError("%d allocations left after KLoggerDeinit", (int)ShimAllocations());
+	}
+
+	size_t Size = 0;
+	char* Log = CheckReadFile(LogPath, &Size);
+	unlink(LogPath);
+	rmdir(Root);
+	if (!Log) {
+		return 1;
+	}
+
+	EXPECT Expects[MAX_PRODUCERS];
+	for (int p = 0; p < ProducerCount; ++p) {
+		memset(&Expects[p], 0, sizeof(EXPECT));
+		Expects[p].Batch = -1;
+		Expects[p].Last = -1;
+		Expects[p].Seen = calloc((size_t)Batches, 1);
+	}
+
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Log, Size);
+
+	unsigned long long Records = 0, Chunks = 0, LateRecords = 0;
+	int64_t ChunkSync = INT64_MIN, ChunkLast = INT64_MIN, Newest = INT64_MIN;
+	int Ret;
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		Records++;
+
+		// every chunk starts with a SYNC of its own time base
+		if (Reader.SyncTimestamp != ChunkSync) {
+			ChunkSync = Reader.SyncTimestamp;
+			ChunkLast = INT64_MIN;
+			Chunks++;
+		}
+
+		if (Record.Timestamp < ChunkLast) {
+			CheckError("record %llu: timestamp %lld before %lld within its chunk", Records, (long long)Record.Timestamp, (long long)ChunkLast);
+		}
+		ChunkLast = Record.Timestamp;
+
+		if (Record.Timestamp < Newest) {
+			LateRecords++;
+		} else {
+			Newest = Record.Timestamp;
+		}
+
+		if (Record.Type == KLOGGER_REC_LOSS) {
+			unsigned long long Messages;
+			if (sscanf(Record.Data, "*** %llu messages", &Messages) == 1 && Record.Cpu < (unsigned)ProducerCount) {
+				Expects[Record.Cpu].Lost += Messages;
+			} else {
+				CheckError("unexpected LOSS record on processor %u", Record.Cpu);
+			}
+			continue;
+		}
+
+		CheckMessage(&Record, Expects, Producers, ProducerCount);
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("log is corrupted at offset %zu", LogReaderOffset(&Reader));
+	}
+
+	unsigned long long Accepted = 0, Dropped = 0;
+	for (int p = 0; p < ProducerCount; ++p) {
+		EXPECT* Expect = &Expects[p];
+		if (!Expect->IsEnded) {
+			CheckError("p%d: no end record", p);
+		}
+
+		for (int b = 0; b < Batches; ++b) {
+			if (Producers[p].Sent[b] > 0) {
+				Accepted++;
+				if (!Expect->Seen[b]) {
+					CheckError("p%d b%d: accepted, not in the log", p, b);
+				}
+			} else {
+				Dropped++;
+			}
+		}
+
+		if (Expect->Lost != Producers[p].Dropped) {
+			CheckError("p%d: LOSS records report %llu messages, %llu were dropped", p, Expect->Lost, Producers[p].Dropped);
+		}
+
+		free(Expect->Seen);
+		free(Producers[p].Sent);
+	}
+
+	printf("%d producers, %llu records in %llu chunks, %llu batches logged, %llu dropped, "
+		"%llu records committed late, %u resizes, %llu errors\n",
+		ProducerCount, Records, Chunks, Accepted, Dropped, LateRecords, Stats.RingResizes, CheckErrors);
+
+	LogReaderFree(&Reader);
+	free(Log);
+
+	return CheckErrors ? 1 : 0;
+}
@@ -0,0 +1,1651 @@
+#define _GNU_SOURCE
+
+#include <ntddk.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+__thread KIRQL ShimCurrentIrql = PASSIVE_LEVEL;
+static __thread LONG ShimThreadCpu = -1; // set by KeSetSystemGroupAffinityThread
+
+enum {
+	SHIM_HANDLE_FILE = 1,
+	SHIM_HANDLE_KEY,
+	SHIM_HANDLE_THREAD,
+	SHIM_HANDLE_EVENT,
+	SHIM_HANDLE_SECTION
+};
+
+typedef struct ShimHandle {
+	ULONG Kind;
+} SHIMHANDLE, *PSHIMHANDLE;
+
+typedef struct ShimFile {
+	SHIMHANDLE Handle;
+	int Fd;
+	BOOLEAN IsAsync;
+	DIR* Dir; // FILE_DIRECTORY_FILE, Fd is not used then
+	char Pattern[256]; // of the listing, given by its first ZwQueryDirectoryFile
+} SHIMFILE, *PSHIMFILE;
+
+// the handle is also the object ObReferenceObjectByHandle returns, told from a thread by its
+// first word: a handle kind there, a dispatcher type (an event type) in a thread
+typedef struct ShimSection {
+	SHIMHANDLE Handle;
+	int Fd;
+	SIZE_T Size;
+	LONG volatile RefCount;
+	char Path[4096];
+} SHIMSECTION, *PSHIMSECTION;
+
+typedef struct ShimEvent {
+	SHIMHANDLE Handle;
+	KEVENT Event;
+} SHIMEVENT, *PSHIMEVENT;
+
+// asynchronous write waiting for an io thread
+typedef struct ShimIo {
+	struct ShimIo* Next;
+	PSHIMFILE File;
+	PVOID Buffer;
+	ULONG Length;
+	LONGLONG Offset;
+	PIO_STATUS_BLOCK IoStatusBlock;
+	PSHIMEVENT Event;
+	BOOLEAN IsFailed; // KLOGGER_SHIM_FAIL_WRITE
+} SHIMIO, *PSHIMIO;
+
+typedef struct _KTHREAD {
+	DISPATCHER_HEADER Header; // must be first, the thread is waited on as a dispatcher object
+	SHIMHANDLE Handle;
+	pthread_t Thread;
+	PKSTART_ROUTINE StartRoutine;
+	PVOID StartContext;
+	LONG volatile RefCount;
+} KTHREAD;
+
+static SHIMHANDLE ShimKeyHandle = { SHIM_HANDLE_KEY };
+
+// every dispatcher object is guarded by one lock, waiters are woken by one condition
+static pthread_mutex_t ShimDispatcherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ShimDispatcherCond;
+static pthread_once_t ShimDispatcherOnce = PTHREAD_ONCE_INIT;
+
+static __thread PKTHREAD ShimCurrentThread;
+
+static void
+ShimDispatcherInit(void) {
+	pthread_condattr_t Attr;
+	pthread_condattr_init(&Attr);
+	pthread_condattr_setclock(&Attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ShimDispatcherCond, &Attr);
+	pthread_condattr_destroy(&Attr);
+}
+
+static void
+ShimLockDispatcher(void) {
+	pthread_once(&ShimDispatcherOnce, ShimDispatcherInit);
+	pthread_mutex_lock(&ShimDispatcherLock);
+}
+
+static void
+ShimUnlockDispatcher(void) {
+	pthread_mutex_unlock(&ShimDispatcherLock);
+}
+
+static ULONGLONG
+ShimNowNs(clockid_t Clock) {
+	struct timespec Ts;
+	clock_gettime(Clock, &Ts);
+	return (ULONGLONG)Ts.tv_sec * 1000000000ull + (ULONGLONG)Ts.tv_nsec;
+}
+
+ULONG
+DbgPrint(
+	PCSTR Format,
+	...
+) {
+	static int IsEnabled = -1;
+	if (IsEnabled < 0) {
+		IsEnabled = getenv("KLOGGER_SHIM_DEBUG") != NULL;
+	}
+
+	if (!IsEnabled) {
+		return 0;
+	}
+
+	va_list Args;
+	va_start(Args, Format);
+	vfprintf(stderr, Format, Args);
+	va_end(Args);
+
+	return 0;
+}
+
+// pool
+
+static LONG volatile ShimAllocationCount;
+
+LONG
+ShimAllocations(
+	VOID
+) {
+	return __sync_add_and_fetch(&ShimAllocationCount, 0);
+}
+
+PVOID
+ExAllocatePool(
+	POOL_TYPE PoolType,
+	SIZE_T NumberOfBytes
+) {
+	UNREFERENCED_PARAMETER(PoolType);
+
+	PVOID P;
+	if (posix_memalign(&P, 64, NumberOfBytes ? NumberOfBytes : 1)) {
+		return NULL;
+	}
+
+	__sync_add_and_fetch(&ShimAllocationCount, 1);
+	return P;
+}
+
+VOID
+ExFreePool(
+	PVOID P
+) {
+	if (P) {
+		__sync_sub_and_fetch(&ShimAllocationCount, 1);
+	}
+	free(P);
+}
+
+SIZE_T
+ShimCompareMemory(
+	const VOID* A,
+	const VOID* B,
+	SIZE_T Length
+) {
+	SIZE_T i = 0;
+	while (i < Length && ((const UCHAR*)A)[i] == ((const UCHAR*)B)[i]) {
+		i++;
+	}
+
+	return i;
+}
+
+VOID
+RtlInitUnicodeString(
+	PUNICODE_STRING DestinationString,
+	PCWSTR SourceString
+) {
+	SIZE_T Length = SourceString ? wcslen(SourceString) * sizeof(WCHAR) : 0;
+	DestinationString->Length = (USHORT)Length;
+	DestinationString->MaximumLength = (USHORT)(Length + sizeof(WCHAR));
+	DestinationString->Buffer = (PWSTR)SourceString;
+}
+
+VOID
+RtlCopyUnicodeString(
+	PUNICODE_STRING DestinationString,
+	const UNICODE_STRING* SourceString
+) {
+	USHORT Length = SourceString ? SourceString->Length : 0;
+	if (Length > DestinationString->MaximumLength) {
+		Length = DestinationString->MaximumLength;
+	}
+
+	if (Length) {
+		memcpy(DestinationString->Buffer, SourceString->Buffer, Length);
+	}
+	DestinationString->Length = Length;
+}
+
+// node memory, sizes are kept for munmap
+
+typedef struct ShimMapping {
+	struct ShimMapping* Next;
+	PVOID Base;
+	SIZE_T Size;
+} SHIMMAPPING, *PSHIMMAPPING;
+
+static PSHIMMAPPING ShimMappings;
+static pthread_mutex_t ShimMappingLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SHIM_MPOL_PREFERRED 1
+
+static void ShimAddMapping(PSHIMMAPPING Mapping, PVOID Base, SIZE_T Size);
+static BOOLEAN ShimUnmap(PVOID BaseAddress);
+
+PVOID
+MmAllocateContiguousNodeMemory(
+	SIZE_T NumberOfBytes,
+	PHYSICAL_ADDRESS LowestAcceptableAddress,
+	PHYSICAL_ADDRESS HighestAcceptableAddress,
+	PHYSICAL_ADDRESS BoundaryAddressMultiple,
+	ULONG Protect,
+	ULONG PreferredNode
+) {
+	UNREFERENCED_PARAMETER(LowestAcceptableAddress);
+	UNREFERENCED_PARAMETER(HighestAcceptableAddress);
+	UNREFERENCED_PARAMETER(BoundaryAddressMultiple);
+	UNREFERENCED_PARAMETER(Protect);
+
+	PSHIMMAPPING Mapping = (PSHIMMAPPING)malloc(sizeof(SHIMMAPPING));
+	if (!Mapping) {
+		return NULL;
+	}
+
+	PVOID Base = mmap(NULL, NumberOfBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Base == MAP_FAILED) {
+		free(Mapping);
+		return NULL;
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(Base, NumberOfBytes, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+	if (PreferredNode != MM_ANY_NODE_OK && PreferredNode < 64) {
+		unsigned long NodeMask = 1ul << PreferredNode;
+		if (syscall(SYS_mbind, Base, NumberOfBytes, SHIM_MPOL_PREFERRED, &NodeMask, 64ul, 0u) != 0) {
+			DbgPrint("[shim] mbind to node %u failed: %d\n", PreferredNode, errno);
+		}
+	}
+#endif
+
+	ShimAddMapping(Mapping, Base, NumberOfBytes);
+	__sync_add_and_fetch(&ShimAllocationCount, 1);
+	return Base;
+}
+
+VOID
+MmFreeContiguousMemory(
+	PVOID BaseAddress
+) {
+	if (ShimUnmap(BaseAddress)) {
+		__sync_sub_and_fetch(&ShimAllocationCount, 1);
+	}
+}
+
+static void
+ShimAddMapping(
+	PSHIMMAPPING Mapping,
+	PVOID Base,
+	SIZE_T Size
+) {
+	Mapping->Base = Base;
+	Mapping->Size = Size;
+	pthread_mutex_lock(&ShimMappingLock);
+	Mapping->Next = ShimMappings;
+	ShimMappings = Mapping;
+	pthread_mutex_unlock(&ShimMappingLock);
+}
+
+static BOOLEAN
+ShimUnmap(
+	PVOID BaseAddress
+) {
+	pthread_mutex_lock(&ShimMappingLock);
+	PSHIMMAPPING* pLink = &ShimMappings;
+	while (*pLink && (*pLink)->Base != BaseAddress) {
+		pLink = &((*pLink)->Next);
+	}
+
+	PSHIMMAPPING Mapping = *pLink;
+	if (Mapping) {
+		*pLink = Mapping->Next;
+	}
+	pthread_mutex_unlock(&ShimMappingLock);
+
+	if (Mapping) {
+		munmap(Mapping->Base, Mapping->Size);
+		free(Mapping);
+	}
+
+	return Mapping != NULL;
+}
+
+// spin locks
+
+VOID
+KeInitializeSpinLock(
+	PKSPIN_LOCK SpinLock
+) {
+	*SpinLock = 0;
+}
+
+VOID
+KeAcquireSpinLockAtDpcLevel(
+	PKSPIN_LOCK SpinLock
+) {
+	while (__sync_lock_test_and_set(SpinLock, 1)) {
+		while (*(volatile KSPIN_LOCK*)SpinLock) {
+			YieldProcessor();
+		}
+	}
+}
+
+VOID
+KeReleaseSpinLockFromDpcLevel(
+	PKSPIN_LOCK SpinLock
+) {
+	__sync_lock_release(SpinLock);
+}
+
+VOID
+ShimAcquireSpinLock(
+	PKSPIN_LOCK SpinLock,
+	PKIRQL OldIrql
+) {
+	KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+	KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+VOID
+KeReleaseSpinLock(
+	PKSPIN_LOCK SpinLock,
+	KIRQL NewIrql
+) {
+	KeReleaseSpinLockFromDpcLevel(SpinLock);
+	KeLowerIrql(NewIrql);
+}
+
+// processors and clocks
+
+ULONG
+KeQueryActiveProcessorCountEx(
+	USHORT GroupNumber
+) {
+	UNREFERENCED_PARAMETER(GroupNumber);
+
+	// asked for on every log call, the environment is read once
+	static ULONG volatile Count;
+	if (!Count) {
+		const char* Cpus = getenv("KLOGGER_SHIM_CPUS");
+		ULONG Stand = Cpus ? (ULONG)strtoul(Cpus, NULL, 0) : 0;
+		Count = Stand ? ((Stand < 64) ? Stand : 64) : (ULONG)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	return Count;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+	PPROCESSOR_NUMBER ProcNumber
+) {
+	int Cpu = ShimThreadCpu;
+	if (Cpu < 0) {
+		Cpu = sched_getcpu();
+		Cpu = (Cpu < 0) ? 0 : Cpu % (int)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	}
+
+	if (ProcNumber) {
+		ProcNumber->Group = 0;
+		ProcNumber->Number = (UCHAR)Cpu;
+		ProcNumber->Reserved = 0;
+	}
+
+	return (ULONG)Cpu;
+}
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(
+	ULONG ProcIndex,
+	PPROCESSOR_NUMBER ProcNumber
+) {
+	if (ProcIndex >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS))
+		return STATUS_INVALID_PARAMETER;
+
+	ProcNumber->Group = 0;
+	ProcNumber->Number = (UCHAR)ProcIndex;
+	ProcNumber->Reserved = 0;
+	return STATUS_SUCCESS;
+}
+
+// processors of the node as a mask, from its cpulist ("0-3,8-11"), FALSE if there is none
+static BOOLEAN
+ShimNodeMask(
+	USHORT NodeNumber,
+	KAFFINITY* pMask
+) {
+	if (getenv("KLOGGER_SHIM_CPUS")) {
+		return FALSE;
+	}
+
+	CHAR Path[64];
+	snprintf(Path, sizeof(Path), "/sys/devices/system/node/node%u/cpulist", NodeNumber);
+	FILE* File = fopen(Path, "r");
+	if (!File) {
+		return FALSE;
+	}
+
+	CHAR List[256];
+	*pMask = 0;
+	if (fgets(List, sizeof(List), File)) {
+		PCHAR p = List;
+		while (*p >= '0' && *p <= '9') {
+			ULONG First = (ULONG)strtoul(p, &p, 10);
+			ULONG Last = First;
+			if (*p == '-') {
+				Last = (ULONG)strtoul(p + 1, &p, 10);
+			}
+
+			for (ULONG Cpu = First; Cpu <= Last && Cpu < 64; ++Cpu) {
+				*pMask |= (KAFFINITY)1 << Cpu;
+			}
+
+			if (*p == ',') {
+				p++;
+			}
+		}
+	}
+
+	fclose(File);
+	return TRUE;
+}
+
+USHORT
+KeQueryHighestNodeNumber(VOID) {
+	USHORT Highest = 0;
+	KAFFINITY Mask;
+	for (USHORT Node = 1; Node < 64; ++Node) {
+		if (ShimNodeMask(Node, &Mask)) {
+			Highest = Node;
+		}
+	}
+
+	return Highest;
+}
+
+VOID
+KeQueryNodeActiveAffinity(
+	USHORT NodeNumber,
+	PGROUP_AFFINITY Affinity,
+	PUSHORT Count
+) {
+	memset(Affinity, 0, sizeof(GROUP_AFFINITY));
+	if (!ShimNodeMask(NodeNumber, &(Affinity->Mask)) && NodeNumber == 0) {
+		ULONG Processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+		Affinity->Mask = (Processors >= 64) ? ~(KAFFINITY)0 : ((KAFFINITY)1 << Processors) - 1;
+	}
+
+	if (Count) {
+		*Count = (USHORT)__builtin_popcountll(Affinity->Mask);
+	}
+}
+
+// every thread that ever raised to DISPATCH_LEVEL, its Sequence is odd while it is there
+typedef struct ShimDispatchThread {
+	struct ShimDispatchThread* Next;
+	LONGLONG volatile Sequence;
+} SHIMDISPATCHTHREAD, *PSHIMDISPATCHTHREAD;
+
+static PSHIMDISPATCHTHREAD volatile ShimDispatchThreads;
+static __thread PSHIMDISPATCHTHREAD ShimDispatchSelf;
+
+VOID
+ShimEnterDispatch(VOID) {
+	PSHIMDISPATCHTHREAD Self = ShimDispatchSelf;
+	if (!Self) {
+		// never freed, threads come and go rarely
+		Self = (PSHIMDISPATCHTHREAD)calloc(1, sizeof(SHIMDISPATCHTHREAD));
+		if (!Self)
+			abort();
+
+		PSHIMDISPATCHTHREAD Head;
+		do {
+			Head = ShimDispatchThreads;
+			Self->Next = Head;
+		} while (!__sync_bool_compare_and_swap(&ShimDispatchThreads, Head, Self));
+		ShimDispatchSelf = Self;
+	}
+
+	// ordered before whatever the section reads
+	__atomic_add_fetch(&(Self->Sequence), 1, __ATOMIC_SEQ_CST);
+}
+
+VOID
+ShimLeaveDispatch(VOID) {
+	__atomic_add_fetch(&(ShimDispatchSelf->Sequence), 1, __ATOMIC_RELEASE);
+}
+
+VOID
+KeSetSystemGroupAffinityThread(
+	PGROUP_AFFINITY Affinity,
+	PGROUP_AFFINITY PreviousAffinity
+) {
+	if (PreviousAffinity) {
+		memset(PreviousAffinity, 0, sizeof(GROUP_AFFINITY));
+		if (ShimThreadCpu >= 0) {
+			PreviousAffinity->Mask = (KAFFINITY)1 << ShimThreadCpu;
+		}
+	}
+
+	if (Affinity->Mask) {
+		ShimThreadCpu = __builtin_ctzll(Affinity->Mask);
+	}
+
+	// on the target processor nothing else runs at DISPATCH_LEVEL: waits for
+	// the sections that are in progress now, on any thread
+	__sync_synchronize();
+	for (PSHIMDISPATCHTHREAD Thread = ShimDispatchThreads; Thread; Thread = Thread->Next) {
+		LONGLONG Sequence = __atomic_load_n(&(Thread->Sequence), __ATOMIC_ACQUIRE);
+		if (!(Sequence & 1) || Thread == ShimDispatchSelf)
+			continue;
+
+		while (__atomic_load_n(&(Thread->Sequence), __ATOMIC_ACQUIRE) == Sequence) {
+			sched_yield();
+		}
+	}
+}
+
+VOID
+KeRevertToUserGroupAffinityThread(
+	PGROUP_AFFINITY PreviousAffinity
+) {
+	ShimThreadCpu = PreviousAffinity->Mask ? __builtin_ctzll(PreviousAffinity->Mask) : -1;
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+	PLARGE_INTEGER PerformanceFrequency
+) {
+	LARGE_INTEGER Counter;
+	if (PerformanceFrequency) {
+		PerformanceFrequency->QuadPart = 1000000000ll;
+	}
+
+	Counter.QuadPart = (LONGLONG)ShimNowNs(CLOCK_MONOTONIC);
+	return Counter;
+}
+
+VOID
+KeQuerySystemTimePrecise(
+	PLARGE_INTEGER CurrentTime
+) {
+	// 100ns intervals since 1601
+	CurrentTime->QuadPart = (LONGLONG)(ShimNowNs(CLOCK_REALTIME) / 100) + 116444736000000000ll;
+}
+
+// events and waits
+
+VOID
+KeInitializeEvent(
+	PRKEVENT Event,
+	EVENT_TYPE Type,
+	BOOLEAN State
+) {
+	Event->Header.Type = Type;
+	Event->Header.SignalState = State;
+}
+
+LONG
+KeSetEvent(
+	PRKEVENT Event,
+	LONG Increment,
+	BOOLEAN Wait
+) {
+	UNREFERENCED_PARAMETER(Increment);
+	UNREFERENCED_PARAMETER(Wait);
+
+	ShimLockDispatcher();
+	LONG Old = Event->Header.SignalState;
+	Event->Header.SignalState = 1;
+	pthread_cond_broadcast(&ShimDispatcherCond);
+	ShimUnlockDispatcher();
+
+	return Old;
+}
+
+LONG
+KeResetEvent(
+	PRKEVENT Event
+) {
+	ShimLockDispatcher();
+	LONG Old = Event->Header.SignalState;
+	Event->Header.SignalState = 0;
+	ShimUnlockDispatcher();
+
+	return Old;
+}
+
+VOID
+KeClearEvent(
+	PRKEVENT Event
+) {
+	KeResetEvent(Event);
+}
+
+LONG
+KeReadStateEvent(
+	PRKEVENT Event
+) {
+	return Event->Header.SignalState;
+}
+
+NTSTATUS
+KeWaitForMultipleObjects(
+	ULONG Count,
+	PVOID Object[],
+	WAIT_TYPE WaitType,
+	KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout,
+	PKWAIT_BLOCK WaitBlockArray
+) {
+	UNREFERENCED_PARAMETER(WaitReason);
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+	UNREFERENCED_PARAMETER(WaitBlockArray);
+
+	struct timespec Deadline;
+	if (Timeout) {
+		// relative timeouts only (negative, in 100ns units)
+		LONGLONG Interval = Timeout->QuadPart < 0 ? -Timeout->QuadPart : Timeout->QuadPart;
+		ULONGLONG Ns = ShimNowNs(CLOCK_MONOTONIC) + (ULONGLONG)Interval * 100;
+		Deadline.tv_sec = (time_t)(Ns / 1000000000ull);
+		Deadline.tv_nsec = (long)(Ns % 1000000000ull);
+	}
+
+	NTSTATUS Status = STATUS_TIMEOUT;
+	ShimLockDispatcher();
+	while (TRUE) {
+		ULONG Signaled = 0;
+		for (ULONG i = 0; i < Count; ++i) {
+			DISPATCHER_HEADER* Header = (DISPATCHER_HEADER*)Object[i];
+			if (Header->SignalState) {
+				Signaled++;
+				if (WaitType == WaitAny) {
+					if (Header->Type == SynchronizationEvent) {
+						Header->SignalState = 0;
+					}
+					Status = STATUS_WAIT_0 + (NTSTATUS)i;
+					goto out;
+				}
+			}
+		}
+
+		if (WaitType == WaitAll && Signaled == Count) {
+			for (ULONG i = 0; i < Count; ++i) {
+				DISPATCHER_HEADER* Header = (DISPATCHER_HEADER*)Object[i];
+				if (Header->Type == SynchronizationEvent) {
+					Header->SignalState = 0;
+				}
+			}
+			Status = STATUS_WAIT_0;
+			goto out;
+		}
+
+		if (Timeout) {
+			if (pthread_cond_timedwait(&ShimDispatcherCond, &ShimDispatcherLock, &Deadline) == ETIMEDOUT) {
+				Status = STATUS_TIMEOUT;
+				goto out;
+			}
+		} else {
+			pthread_cond_wait(&ShimDispatcherCond, &ShimDispatcherLock);
+		}
+	}
+
+out:
+	ShimUnlockDispatcher();
+	return Status;
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+	PVOID Object,
+	KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout
+) {
+	return KeWaitForMultipleObjects(1, &Object, WaitAny, WaitReason, WaitMode, Alertable, Timeout, NULL);
+}
+
+NTSTATUS
+KeDelayExecutionThread(
+	KPROCESSOR_MODE WaitMode,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Interval
+) {
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+
+	LONGLONG Ticks = Interval->QuadPart < 0 ? -Interval->QuadPart : Interval->QuadPart;
+	struct timespec Ts;
+	Ts.tv_sec = (time_t)(Ticks / 10000000ll);
+	Ts.tv_nsec = (long)(Ticks % 10000000ll) * 100;
+	nanosleep(&Ts, NULL);
+
+	return STATUS_SUCCESS;
+}
+
+// dpc
+
+VOID
+KeInitializeDpc(
+	PRKDPC Dpc,
+	PKDEFERRED_ROUTINE DeferredRoutine,
+	PVOID DeferredContext
+) {
+	Dpc->DeferredRoutine = DeferredRoutine;
+	Dpc->DeferredContext = DeferredContext;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+	PRKDPC Dpc,
+	PVOID SystemArgument1,
+	PVOID SystemArgument2
+) {
+	KIRQL OldIrql;
+	KeRaiseIrql(DISPATCH_LEVEL > KeGetCurrentIrql() ? DISPATCH_LEVEL : KeGetCurrentIrql(), &OldIrql);
+	Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext, SystemArgument1, SystemArgument2);
+	KeLowerIrql(OldIrql);
+
+	return TRUE;
+}
+
+VOID
+KeFlushQueuedDpcs(VOID) {
+}
+
+// threads
+
+static void
+ShimReleaseThread(
+	PKTHREAD Thread
+) {
+	if (InterlockedDecrement(&(Thread->RefCount)) == 0) {
+		pthread_join(Thread->Thread, NULL);
+		free(Thread);
+	}
+}
+
+static void
+ShimThreadExit(void) {
+	PKTHREAD Thread = ShimCurrentThread;
+
+	ShimLockDispatcher();
+	Thread->Header.SignalState = 1;
+	pthread_cond_broadcast(&ShimDispatcherCond);
+	ShimUnlockDispatcher();
+}
+
+static void*
+ShimThreadStart(
+	void* Arg
+) {
+	PKTHREAD Thread = (PKTHREAD)Arg;
+	ShimCurrentThread = Thread;
+
+	Thread->StartRoutine(Thread->StartContext);
+	ShimThreadExit();
+
+	return NULL;
+}
+
+NTSTATUS
+PsCreateSystemThread(
+	PHANDLE ThreadHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	HANDLE ProcessHandle,
+	PVOID ClientId,
+	PKSTART_ROUTINE StartRoutine,
+	PVOID StartContext
+) {
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+	UNREFERENCED_PARAMETER(ProcessHandle);
+	UNREFERENCED_PARAMETER(ClientId);
+
+	PKTHREAD Thread = calloc(1, sizeof(KTHREAD));
+	if (!Thread) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Thread->Header.Type = NotificationEvent;
+	Thread->Handle.Kind = SHIM_HANDLE_THREAD;
+	Thread->StartRoutine = StartRoutine;
+	Thread->StartContext = StartContext;
+	Thread->RefCount = 1;
+
+	if (pthread_create(&(Thread->Thread), NULL, ShimThreadStart, Thread)) {
+		free(Thread);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	*ThreadHandle = &(Thread->Handle);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PsTerminateSystemThread(
+	NTSTATUS ExitStatus
+) {
+	UNREFERENCED_PARAMETER(ExitStatus);
+
+	ShimThreadExit();
+	pthread_exit(NULL);
+}
+
+NTSTATUS
+ObReferenceObjectByHandle(
+	HANDLE Handle,
+	ULONG DesiredAccess,
+	PVOID ObjectType,
+	KPROCESSOR_MODE AccessMode,
+	PVOID* Object,
+	PVOID HandleInformation
+) {
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectType);
+	UNREFERENCED_PARAMETER(AccessMode);
+	UNREFERENCED_PARAMETER(HandleInformation);
+
+	PSHIMHANDLE ShimHandle = (PSHIMHANDLE)Handle;
+	if (ShimHandle->Kind == SHIM_HANDLE_SECTION) {
+		PSHIMSECTION Section = (PSHIMSECTION)ShimHandle;
+		InterlockedIncrement(&(Section->RefCount));
+		*Object = Section;
+		return STATUS_SUCCESS;
+	}
+
+	if (ShimHandle->Kind != SHIM_HANDLE_THREAD) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	PKTHREAD Thread = (PKTHREAD)((PCHAR)ShimHandle - offsetof(KTHREAD, Handle));
+	InterlockedIncrement(&(Thread->RefCount));
+	*Object = Thread;
+
+	return STATUS_SUCCESS;
+}
+
+static void ShimReleaseSection(PSHIMSECTION Section);
+
+VOID
+ObDereferenceObject(
+	PVOID Object
+) {
+	if (((PSHIMHANDLE)Object)->Kind == SHIM_HANDLE_SECTION) {
+		ShimReleaseSection((PSHIMSECTION)Object);
+		return;
+	}
+
+	ShimReleaseThread((PKTHREAD)Object);
+}
+
+// files
+
+static void
+ShimFilePath(
+	PUNICODE_STRING Name,
+	char* Path,
+	SIZE_T PathSize
+) {
+	const char* Root = getenv("KLOGGER_ROOT");
+	SIZE_T Chars = Name->Length / sizeof(WCHAR);
+	SIZE_T Start = 0;
+
+	// drop "\??\X:\" - everything up to the first backslash after a drive colon
+	for (SIZE_T i = 0; i + 1 < Chars; ++i) {
+		if (Name->Buffer[i] == L':' && Name->Buffer[i + 1] == L'\\') {
+			Start = i + 2;
+			break;
+		}
+	}
+
+	int Length = snprintf(Path, PathSize, "%s/", Root ? Root : ".");
+	for (SIZE_T i = Start; i < Chars && (SIZE_T)Length + 1 < PathSize; ++i) {
+		WCHAR C = Name->Buffer[i];
+		Path[Length++] = (C == L'\\') ? '/' : (char)C;
+	}
+	Path[Length] = '\0';
+}
+
+NTSTATUS
+ZwCreateFile(
+	PHANDLE FileHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PLARGE_INTEGER AllocationSize,
+	ULONG FileAttributes,
+	ULONG ShareAccess,
+	ULONG CreateDisposition,
+	ULONG CreateOptions,
+	PVOID EaBuffer,
+	ULONG EaLength
+) {
+	UNREFERENCED_PARAMETER(FileAttributes);
+	UNREFERENCED_PARAMETER(ShareAccess);
+	UNREFERENCED_PARAMETER(EaBuffer);
+	UNREFERENCED_PARAMETER(EaLength);
+
+	char Path[4096];
+	ShimFilePath(ObjectAttributes->ObjectName, Path, sizeof(Path));
+
+	if (CreateOptions & FILE_DIRECTORY_FILE) {
+		DIR* Dir = opendir(Path);
+		if (!Dir) {
+			IoStatusBlock->Status = STATUS_OBJECT_NAME_NOT_FOUND;
+			return STATUS_OBJECT_NAME_NOT_FOUND;
+		}
+
+		PSHIMFILE File = calloc(1, sizeof(SHIMFILE));
+		File->Handle.Kind = SHIM_HANDLE_FILE;
+		File->Fd = -1;
+		File->Dir = Dir;
+		strcpy(File->Pattern, "*");
+
+		*FileHandle = &(File->Handle);
+		IoStatusBlock->Status = STATUS_SUCCESS;
+		IoStatusBlock->Information = 0;
+
+		return STATUS_SUCCESS;
+	}
+
+	int Flags = O_WRONLY | O_CLOEXEC;
+	if (DesiredAccess & FILE_APPEND_DATA && !(DesiredAccess & FILE_WRITE_DATA)) {
+		Flags |= O_APPEND;
+	}
+
+	switch (CreateDisposition) {
+	case FILE_OPEN: break;
+	case FILE_CREATE: Flags |= O_CREAT | O_EXCL; break;
+	case FILE_OPEN_IF: Flags |= O_CREAT; break;
+	case FILE_OVERWRITE: Flags |= O_TRUNC; break;
+	default: Flags |= O_CREAT | O_TRUNC; break;
+	}
+
+	int Fd = open(Path, Flags, 0644);
+	if (Fd < 0) {
+		IoStatusBlock->Status = STATUS_UNSUCCESSFUL;
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	if (AllocationSize && AllocationSize->QuadPart > 0) {
+		// allocation only, like on NTFS the end of file stays where it is
+		fallocate(Fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)AllocationSize->QuadPart);
+	}
+
+	PSHIMFILE File = calloc(1, sizeof(SHIMFILE));
+	File->Handle.Kind = SHIM_HANDLE_FILE;
+	File->Fd = Fd;
+	File->IsAsync = !(CreateOptions & (FILE_SYNCHRONOUS_IO_ALERT | FILE_SYNCHRONOUS_IO_NONALERT));
+
+	*FileHandle = &(File->Handle);
+	IoStatusBlock->Status = STATUS_SUCCESS;
+	IoStatusBlock->Information = 0;
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+ShimWrite(
+	PSHIMFILE File,
+	PVOID Buffer,
+	ULONG Length,
+	LONGLONG Offset,
+	PIO_STATUS_BLOCK IoStatusBlock
+) {
+	SIZE_T Done = 0;
+	while (Done < Length) {
+		ssize_t Written;
+		if (Offset >= 0) {
+			Written = pwrite(File->Fd, (PCHAR)Buffer + Done, Length - Done, (off_t)(Offset + Done));
+		} else {
+			Written = write(File->Fd, (PCHAR)Buffer + Done, Length - Done);
+		}
+
+		if (Written <= 0) {
+			IoStatusBlock->Status = STATUS_DISK_FULL;
+			IoStatusBlock->Information = Done;
+			return STATUS_DISK_FULL;
+		}
+		Done += (SIZE_T)Written;
+	}
+
+	IoStatusBlock->Status = STATUS_SUCCESS;
+	IoStatusBlock->Information = Done;
+
+	return STATUS_SUCCESS;
+}
+
+static pthread_mutex_t ShimIoLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ShimIoCond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ShimIoOnce = PTHREAD_ONCE_INIT;
+static PSHIMIO ShimIoHead;
+static PSHIMIO ShimIoTail;
+static ULONG ShimIoDelayUs;
+static ULONG ShimIoFailEvery;
+static ULONG volatile ShimIoCount;
+
+static void*
+ShimIoThread(
+	void* Arg
+) {
+	UNREFERENCED_PARAMETER(Arg);
+
+	while (TRUE) {
+		pthread_mutex_lock(&ShimIoLock);
+		while (!ShimIoHead) {
+			pthread_cond_wait(&ShimIoCond, &ShimIoLock);
+		}
+
+		PSHIMIO Io = ShimIoHead;
+		ShimIoHead = Io->Next;
+		if (!ShimIoHead) {
+			ShimIoTail = NULL;
+		}
+		pthread_mutex_unlock(&ShimIoLock);
+
+		if (ShimIoDelayUs) {
+			usleep(ShimIoDelayUs);
+		}
+
+		if (Io->IsFailed) {
+			Io->IoStatusBlock->Information = 0;
+			Io->IoStatusBlock->Status = STATUS_DISK_FULL;
+		} else {
+			ShimWrite(Io->File, Io->Buffer, Io->Length, Io->Offset, Io->IoStatusBlock);
+		}
+		if (Io->Event) {
+			KeSetEvent(&(Io->Event->Event), 0, FALSE);
+		}
+
+		free(Io);
+	}
+
+	return NULL;
+}
+
+static void
+ShimIoInit(void) {
+	const char* Threads = getenv("KLOGGER_SHIM_IO_THREADS");
+	const char* Delay = getenv("KLOGGER_SHIM_WRITE_DELAY_US");
+	const char* Fail = getenv("KLOGGER_SHIM_FAIL_WRITE");
+	ULONG Count = Threads ? (ULONG)strtoul(Threads, NULL, 0) : 2;
+	ShimIoDelayUs = Delay ? (ULONG)strtoul(Delay, NULL, 0) : 0;
+	ShimIoFailEvery = Fail ? (ULONG)strtoul(Fail, NULL, 0) : 0;
+
+	for (ULONG i = 0; i < (Count ? Count : 1); ++i) {
+		pthread_t Thread;
+		pthread_create(&Thread, NULL, ShimIoThread, NULL);
+		pthread_detach(Thread);
+	}
+}
+
+NTSTATUS
+ZwWriteFile(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID Buffer,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset,
+	PULONG Key
+) {
+	UNREFERENCED_PARAMETER(ApcRoutine);
+	UNREFERENCED_PARAMETER(ApcContext);
+	UNREFERENCED_PARAMETER(Key);
+
+	PSHIMFILE File = (PSHIMFILE)FileHandle;
+	PSHIMEVENT ShimEvent = (PSHIMEVENT)Event;
+	LONGLONG Offset = (ByteOffset && ByteOffset->QuadPart >= 0) ? ByteOffset->QuadPart : -1;
+
+	if (ShimEvent) {
+		KeClearEvent(&(ShimEvent->Event));
+	}
+
+	if (!File->IsAsync) {
+		NTSTATUS Status = ShimWrite(File, Buffer, Length, Offset, IoStatusBlock);
+		if (ShimEvent) {
+			KeSetEvent(&(ShimEvent->Event), 0, FALSE);
+		}
+
+		return Status;
+	}
+
+	PSHIMIO Io = calloc(1, sizeof(SHIMIO));
+	if (!Io) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Io->File = File;
+	Io->Buffer = Buffer;
+	Io->Length = Length;
+	Io->Offset = Offset;
+	Io->IoStatusBlock = IoStatusBlock;
+	Io->Event = ShimEvent;
+	IoStatusBlock->Status = STATUS_PENDING;
+
+	pthread_once(&ShimIoOnce, ShimIoInit);
+	Io->IsFailed = ShimIoFailEvery && !(__sync_add_and_fetch(&ShimIoCount, 1) % ShimIoFailEvery);
+	pthread_mutex_lock(&ShimIoLock);
+	if (ShimIoTail) {
+		ShimIoTail->Next = Io;
+	} else {
+		ShimIoHead = Io;
+	}
+	ShimIoTail = Io;
+	pthread_cond_signal(&ShimIoCond);
+	pthread_mutex_unlock(&ShimIoLock);
+
+	return STATUS_PENDING;
+}
+
+NTSTATUS
+ZwSetInformationFile(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass
+) {
+	PSHIMFILE File = (PSHIMFILE)FileHandle;
+
+	if (FileInformationClass != FileEndOfFileInformation || Length < sizeof(FILE_END_OF_FILE_INFORMATION)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	PFILE_END_OF_FILE_INFORMATION Info = (PFILE_END_OF_FILE_INFORMATION)FileInformation;
+	if (ftruncate(File->Fd, (off_t)Info->EndOfFile.QuadPart)) {
+		IoStatusBlock->Status = STATUS_UNSUCCESSFUL;
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	IoStatusBlock->Status = STATUS_SUCCESS;
+	IoStatusBlock->Information = 0;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwQueryInformationFile(
+	HANDLE FileHandle,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass
+) {
+	PSHIMFILE File = (PSHIMFILE)FileHandle;
+	struct stat St;
+
+	if (FileInformationClass != FileStandardInformation || Length < sizeof(FILE_STANDARD_INFORMATION)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (fstat(File->Fd, &St)) {
+		IoStatusBlock->Status = STATUS_UNSUCCESSFUL;
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	PFILE_STANDARD_INFORMATION Info = (PFILE_STANDARD_INFORMATION)FileInformation;
+	memset(Info, 0, sizeof(*Info));
+	Info->AllocationSize.QuadPart = (LONGLONG)St.st_blocks * 512;
+	Info->EndOfFile.QuadPart = (LONGLONG)St.st_size;
+	Info->NumberOfLinks = (ULONG)St.st_nlink;
+
+	IoStatusBlock->Status = STATUS_SUCCESS;
+	IoStatusBlock->Information = sizeof(*Info);
+
+	return STATUS_SUCCESS;
+}
+
+// synchronous, entries are returned as long as they fit
+NTSTATUS
+ZwQueryDirectoryFile(
+	HANDLE FileHandle,
+	HANDLE Event,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation,
+	ULONG Length,
+	FILE_INFORMATION_CLASS FileInformationClass,
+	BOOLEAN ReturnSingleEntry,
+	PUNICODE_STRING FileName,
+	BOOLEAN RestartScan
+) {
+	UNREFERENCED_PARAMETER(Event);
+	UNREFERENCED_PARAMETER(ApcRoutine);
+	UNREFERENCED_PARAMETER(ApcContext);
+
+	PSHIMFILE File = (PSHIMFILE)FileHandle;
+	if (!File->Dir || FileInformationClass != FileNamesInformation) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (FileName) {
+		SIZE_T Chars = FileName->Length / sizeof(WCHAR);
+		SIZE_T i = 0;
+		for (; i < Chars && i + 1 < sizeof(File->Pattern); ++i) {
+			File->Pattern[i] = (char)FileName->Buffer[i];
+		}
+		File->Pattern[i] = '\0';
+	}
+
+	if (RestartScan) {
+		rewinddir(File->Dir);
+	}
+
+	PUCHAR Out = (PUCHAR)FileInformation;
+	PFILE_NAMES_INFORMATION Last = NULL;
+	ULONG Used = 0;
+
+	while (TRUE) {
+		long Position = telldir(File->Dir);
+		struct dirent* Entry = readdir(File->Dir);
+		if (!Entry) {
+			break;
+		}
+
+		if (fnmatch(File->Pattern, Entry->d_name, FNM_CASEFOLD)) {
+			continue;
+		}
+
+		SIZE_T NameLength = strlen(Entry->d_name);
+		ULONG Size = (ULONG)(offsetof(FILE_NAMES_INFORMATION, FileName) + NameLength * sizeof(WCHAR));
+		Size = (Size + 7) & ~7u;
+		if (Used + Size > Length) {
+			seekdir(File->Dir, Position);
+			if (!Last) {
+				IoStatusBlock->Status = STATUS_BUFFER_OVERFLOW;
+				return STATUS_BUFFER_OVERFLOW;
+			}
+			break;
+		}
+
+		PFILE_NAMES_INFORMATION Info = (PFILE_NAMES_INFORMATION)(Out + Used);
+		Info->NextEntryOffset = 0;
+		Info->FileIndex = 0;
+		Info->FileNameLength = (ULONG)(NameLength * sizeof(WCHAR));
+		for (SIZE_T i = 0; i < NameLength; ++i) {
+			Info->FileName[i] = (WCHAR)(UCHAR)Entry->d_name[i];
+		}
+
+		if (Last) {
+			Last->NextEntryOffset = (ULONG)((PUCHAR)Info - (PUCHAR)Last);
+		}
+		Last = Info;
+		Used += Size;
+
+		if (ReturnSingleEntry) {
+			break;
+		}
+	}
+
+	if (!Last) {
+		IoStatusBlock->Status = STATUS_NO_MORE_FILES;
+		return STATUS_NO_MORE_FILES;
+	}
+
+	IoStatusBlock->Status = STATUS_SUCCESS;
+	IoStatusBlock->Information = Used;
+
+	return STATUS_SUCCESS;
+}
+
+// event handles
+
+NTSTATUS
+ZwCreateEvent(
+	PHANDLE EventHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	EVENT_TYPE EventType,
+	BOOLEAN InitialState
+) {
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+
+	PSHIMEVENT Event = calloc(1, sizeof(SHIMEVENT));
+	if (!Event) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Event->Handle.Kind = SHIM_HANDLE_EVENT;
+	KeInitializeEvent(&(Event->Event), EventType, InitialState);
+
+	*EventHandle = &(Event->Handle);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwWaitForSingleObject(
+	HANDLE Handle,
+	BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout
+) {
+	PSHIMHANDLE ShimHandle = (PSHIMHANDLE)Handle;
+	if (ShimHandle->Kind != SHIM_HANDLE_EVENT) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	return KeWaitForSingleObject(&(((PSHIMEVENT)ShimHandle)->Event), Executive, KernelMode, Alertable, Timeout);
+}
+
+NTSTATUS
+ZwDeleteFile(
+	POBJECT_ATTRIBUTES ObjectAttributes
+) {
+	char Path[4096];
+	ShimFilePath(ObjectAttributes->ObjectName, Path, sizeof(Path));
+
+	return unlink(Path) ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwClose(
+	HANDLE Handle
+) {
+	PSHIMHANDLE ShimHandle = (PSHIMHANDLE)Handle;
+
+	switch (ShimHandle->Kind) {
+	case SHIM_HANDLE_FILE:
+		if (((PSHIMFILE)ShimHandle)->Dir) {
+			closedir(((PSHIMFILE)ShimHandle)->Dir);
+		} else {
+			close(((PSHIMFILE)ShimHandle)->Fd);
+		}
+		free(ShimHandle);
+		break;
+
+	case SHIM_HANDLE_EVENT:
+		free(ShimHandle);
+		break;
+
+	case SHIM_HANDLE_THREAD:
+		ShimReleaseThread((PKTHREAD)((PCHAR)ShimHandle - offsetof(KTHREAD, Handle)));
+		break;
+
+	case SHIM_HANDLE_SECTION:
+		// the name goes with the last handle, there is only one
+		unlink(((PSHIMSECTION)ShimHandle)->Path);
+		ShimReleaseSection((PSHIMSECTION)ShimHandle);
+		break;
+
+	default:
+		break;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+// sections
+
+static void
+ShimReleaseSection(
+	PSHIMSECTION Section
+) {
+	if (InterlockedDecrement(&(Section->RefCount)) == 0) {
+		close(Section->Fd);
+		free(Section);
+	}
+}
+
+// "$KLOGGER_SHM_DIR/<name after the last backslash>"
+static void
+ShimSectionPath(
+	PUNICODE_STRING Name,
+	char* Path,
+	SIZE_T PathSize
+) {
+	const char* Dir = getenv("KLOGGER_SHM_DIR");
+	SIZE_T Chars = Name->Length / sizeof(WCHAR);
+	SIZE_T Start = 0;
+	for (SIZE_T i = 0; i < Chars; ++i) {
+		if (Name->Buffer[i] == L'\\') {
+			Start = i + 1;
+		}
+	}
+
+	int Length = snprintf(Path, PathSize, "%s/", Dir ? Dir : "/dev/shm");
+	for (SIZE_T i = Start; i < Chars && (SIZE_T)Length + 1 < PathSize; ++i) {
+		Path[Length++] = (char)Name->Buffer[i];
+	}
+	Path[Length] = '\0';
+}
+
+// always created anew, a name that is taken is a collision as with a live object
+NTSTATUS
+ZwCreateSection(
+	PHANDLE SectionHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PLARGE_INTEGER MaximumSize,
+	ULONG SectionPageProtection,
+	ULONG AllocationAttributes,
+	HANDLE FileHandle
+) {
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(SectionPageProtection);
+	UNREFERENCED_PARAMETER(AllocationAttributes);
+
+	if (!ObjectAttributes || !ObjectAttributes->ObjectName || FileHandle || !MaximumSize) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	PSHIMSECTION Section = calloc(1, sizeof(SHIMSECTION));
+	if (!Section) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ShimSectionPath(ObjectAttributes->ObjectName, Section->Path, sizeof(Section->Path));
+	Section->Fd = open(Section->Path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (Section->Fd < 0) {
+		NTSTATUS Status = (errno == EEXIST) ? STATUS_OBJECT_NAME_COLLISION : STATUS_UNSUCCESSFUL;
+		free(Section);
+		return Status;
+	}
+
+	Section->Size = (SIZE_T)MaximumSize->QuadPart;
+	if (ftruncate(Section->Fd, (off_t)Section->Size)) {
+		unlink(Section->Path);
+		close(Section->Fd);
+		free(Section);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Section->Handle.Kind = SHIM_HANDLE_SECTION;
+	Section->RefCount = 1;
+	*SectionHandle = &(Section->Handle);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmMapViewInSystemSpace(
+	PVOID Object,
+	PVOID* MappedBase,
+	PSIZE_T ViewSize
+) {
+	PSHIMSECTION Section = (PSHIMSECTION)Object;
+	SIZE_T Size = *ViewSize ? *ViewSize : Section->Size;
+
+	PSHIMMAPPING Mapping = (PSHIMMAPPING)malloc(sizeof(SHIMMAPPING));
+	if (!Mapping) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	PVOID Base = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Section->Fd, 0);
+	if (Base == MAP_FAILED) {
+		free(Mapping);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ShimAddMapping(Mapping, Base, Size);
+	*MappedBase = Base;
+	*ViewSize = Size;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MmUnmapViewInSystemSpace(
+	PVOID MappedBase
+) {
+	return ShimUnmap(MappedBase) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+PMDL
+IoAllocateMdl(
+	PVOID VirtualAddress,
+	ULONG Length,
+	BOOLEAN SecondaryBuffer,
+	BOOLEAN ChargeQuota,
+	PVOID Irp
+) {
+	UNREFERENCED_PARAMETER(SecondaryBuffer);
+	UNREFERENCED_PARAMETER(ChargeQuota);
+	UNREFERENCED_PARAMETER(Irp);
+
+	PMDL Mdl = (PMDL)malloc(sizeof(MDL));
+	if (Mdl) {
+		Mdl->StartVa = VirtualAddress;
+		Mdl->ByteCount = Length;
+	}
+
+	return Mdl;
+}
+
+VOID
+IoFreeMdl(
+	PMDL Mdl
+) {
+	free(Mdl);
+}
+
+VOID
+MmProbeAndLockPages(
+	PMDL MemoryDescriptorList,
+	KPROCESSOR_MODE AccessMode,
+	LOCK_OPERATION Operation
+) {
+	UNREFERENCED_PARAMETER(AccessMode);
+	UNREFERENCED_PARAMETER(Operation);
+
+	// RLIMIT_MEMLOCK may not allow it, the pages are only resident then
+	mlock(MemoryDescriptorList->StartVa, MemoryDescriptorList->ByteCount);
+}
+
+VOID
+MmUnlockPages(
+	PMDL MemoryDescriptorList
+) {
+	munlock(MemoryDescriptorList->StartVa, MemoryDescriptorList->ByteCount);
+}
+
+// registry
+
+// "KLOGGER_<value name>"
+static void
+ShimValueName(
+	PUNICODE_STRING ValueName,
+	char* Name,
+	SIZE_T NameSize
+) {
+	SIZE_T Length = (SIZE_T)snprintf(Name, NameSize, "KLOGGER_");
+	SIZE_T Chars = ValueName->Length / sizeof(WCHAR);
+	for (SIZE_T i = 0; i < Chars && Length + 1 < NameSize; ++i) {
+		Name[Length++] = (char)ValueName->Buffer[i];
+	}
+	Name[Length] = '\0';
+}
+
+NTSTATUS
+ZwCreateKey(
+	PHANDLE KeyHandle,
+	ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	ULONG TitleIndex,
+	PUNICODE_STRING Class,
+	ULONG CreateOptions,
+	PULONG Disposition
+) {
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+	UNREFERENCED_PARAMETER(TitleIndex);
+	UNREFERENCED_PARAMETER(Class);
+	UNREFERENCED_PARAMETER(CreateOptions);
+	UNREFERENCED_PARAMETER(Disposition);
+
+	*KeyHandle = &ShimKeyHandle;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwQueryValueKey(
+	HANDLE KeyHandle,
+	PUNICODE_STRING ValueName,
+	KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+	PVOID KeyValueInformation,
+	ULONG Length,
+	PULONG ResultLength
+) {
+	UNREFERENCED_PARAMETER(KeyHandle);
+	UNREFERENCED_PARAMETER(KeyValueInformationClass);
+
+	char Name[256];
+	ShimValueName(ValueName, Name, sizeof(Name));
+
+	const char* Value = getenv(Name);
+	if (!Value) {
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	ULONG Needed = (ULONG)(offsetof(KEY_VALUE_PARTIAL_INFORMATION, Data) + sizeof(ULONG));
+	*ResultLength = Needed;
+	if (Length < Needed) {
+		return STATUS_BUFFER_OVERFLOW;
+	}
+
+	PKEY_VALUE_PARTIAL_INFORMATION Info = (PKEY_VALUE_PARTIAL_INFORMATION)KeyValueInformation;
+	ULONG Dword = (ULONG)strtoul(Value, NULL, 0);
+	Info->TitleIndex = 0;
+	Info->Type = REG_DWORD;
+	Info->DataLength = sizeof(ULONG);
+	memcpy(Info->Data, &Dword, sizeof(Dword));
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ZwSetValueKey(
+	HANDLE KeyHandle,
+	PUNICODE_STRING ValueName,
+	ULONG TitleIndex,
+	ULONG Type,
+	PVOID Data,
+	ULONG DataSize
+) {
+	UNREFERENCED_PARAMETER(KeyHandle);
+	UNREFERENCED_PARAMETER(TitleIndex);
+
+	if (Type != REG_DWORD || DataSize != sizeof(ULONG)) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	char Name[256];
+	char Value[16];
+	ShimValueName(ValueName, Name, sizeof(Name));
+	snprintf(Value, sizeof(Value), "%u", *(PULONG)Data);
+	setenv(Name, Value, 1);
+
+	return STATUS_SUCCESS;
+}
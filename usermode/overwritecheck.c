@@ -0,0 +1,176 @@
+// flight-recorder mode, OVERFLOW_POLICY 1. Numbered messages are logged into a small ring in
+// bursts of a few times its size, the flushing thread left idle in between, so writers keep
+// discarding the oldest records. The log has to decode without a corrupted record, the messages
+// have to be in order and each one whole, the last one accepted has to be there, and the messages
+// and bytes missing have to be those KLoggerGetStats counts as overwritten plus those the LOSS
+// records report, for drops while a flush held the oldest records
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define MESSAGES 200000
+#define MAX_PAD 200
+#define MSG_SIZE (32 + MAX_PAD)
+#define BURST 2000 // messages, a few times the ring
+
+// text of message Seq
+static size_t
+MakeMessage(
+	char* Msg,
+	unsigned Seq
+) {
+	int Length = snprintf(Msg, MSG_SIZE, "o %u ", Seq);
+	size_t Pad = Seq % MAX_PAD;
+	memset(Msg + Length, 'o', Pad);
+	Msg[Length + Pad] = '\n';
+	return (size_t)Length + Pad + 1;
+}
+
+static void
+CheckLog(
+	const char* Log,
+	size_t Size,
+	const size_t* Lengths,
+	unsigned Last,
+	const KLOGGER_STATS* Stats
+) {
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Log, Size);
+
+	// messages up to Next are in the log or missing
+	unsigned long long LostMessages = 0, LostBytes = 0, Missing = 0, MissingBytes = 0, Gaps = 0;
+	unsigned Next = 0;
+	char Msg[MSG_SIZE];
+	int Ret;
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		if (Record.Type == KLOGGER_REC_LOSS) {
+			unsigned long long Messages = 0, Bytes = 0;
+			sscanf(Record.Data, "*** %llu messages / %llu bytes lost ***", &Messages, &Bytes);
+			LostMessages += Messages;
+			LostBytes += Bytes;
+			continue;
+		}
+
+		unsigned Seq;
+		if (Record.Type != KLOGGER_REC_MESSAGE || sscanf(Record.Data, "o %u ", &Seq) != 1 || Seq >= MESSAGES) {
+			CheckError("unexpected record: %.*s", (int)(Record.Length > 32 ? 32 : Record.Length), Record.Data);
+			continue;
+		}
+		if (Seq < Next) {
+			CheckError("message %u after message %u", Seq, Next - 1);
+			continue;
+		}
+
+		Gaps += Seq > Next;
+		for (; Next < Seq; ++Next) {
+			Missing++;
+			MissingBytes += Lengths[Next];
+		}
+
+		size_t Length = MakeMessage(Msg, Seq);
+		if (Record.Length != Length || memcmp(Record.Data, Msg, Length)) {
+			CheckError("message %u: differs from the message logged", Seq);
+		}
+		Next = Seq + 1;
+	}
+	if (Next <= Last) {
+		CheckError("the log ends before message %u, the last one logged", Last);
+	}
+	for (; Next < MESSAGES; ++Next) {
+		Missing++;
+		MissingBytes += Lengths[Next];
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("log is corrupted at offset %zu", LogReaderOffset(&Reader));
+	}
+	if (Stats->MessagesOverwritten + LostMessages != Missing || Stats->BytesOverwritten + LostBytes != MissingBytes) {
+		CheckError("%llu messages / %llu bytes overwritten and %llu / %llu reported lost, %llu / %llu are missing",
+			(unsigned long long)Stats->MessagesOverwritten, (unsigned long long)Stats->BytesOverwritten, LostMessages, LostBytes, Missing, MissingBytes);
+	}
+	if (!Stats->MessagesOverwritten) {
+		CheckError("nothing was overwritten");
+	}
+
+	printf("%d messages, %llu missing in %llu gaps, %llu overwritten, %llu reported lost, %zu byte log\n",
+		MESSAGES, Missing, Gaps, (unsigned long long)Stats->MessagesOverwritten, LostMessages, Size);
+
+	LogReaderFree(&Reader);
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	UNREFERENCED_PARAMETER(argc);
+	UNREFERENCED_PARAMETER(argv);
+
+	char Root[] = "/tmp/overwritecheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	char LogPath[sizeof(Root) + 16];
+	snprintf(LogPath, sizeof(LogPath), "%s/klogger.log", Root);
+
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_BUF_SIZE", "65536", 1);
+	setenv("KLOGGER_OVERFLOW_POLICY", "1", 1);
+
+	UNICODE_STRING RegistryPath;
+	RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\overwritecheck");
+	if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+		fprintf(stderr, "KLoggerInit failed\n");
+		rmdir(Root);
+		return 1;
+	}
+
+	size_t* Lengths = malloc(MESSAGES * sizeof(size_t));
+	char Msg[MSG_SIZE];
+	unsigned Last = 0; // accepted
+	for (unsigned i = 0; i < MESSAGES; ++i) {
+		Lengths[i] = MakeMessage(Msg, i);
+		if (KLoggerLogN(Msg, Lengths[i]) == ERROR_SUCCESS) {
+			Last = i;
+		}
+
+		// a burst finds the flushing thread idle and laps it
+		if (!((i + 1) % BURST)) {
+			usleep(3000);
+		}
+	}
+
+	// what the writer lost while a flush held the oldest records is in the LOSS records,
+	// the overwritten messages are counted only
+	KLOGGER_STATS Stats;
+	KLoggerGetStats(&Stats);
+	KLoggerDeinit();
+
+	size_t Size = 0;
+	char* Log = CheckReadFile(LogPath, &Size);
+	unlink(LogPath);
+	rmdir(Root);
+	if (!Log) {
+		free(Lengths);
+		return 1;
+	}
+
+	CheckLog(Log, Size, Lengths, Last, &Stats);
+	printf("%llu errors\n", CheckErrors);
+
+	free(Log);
+	free(Lengths);
+
+	return CheckErrors ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+// producer scaling of RingBuffer.c: 1..N writer threads against the single reader.
+// -n puts the ring on a NUMA node, -c keeps the threads on the processors of one,
+// local and remote placement are compared by running both ways. -a and -o add required
+// and optional readers of the same records besides the one that frees them
+
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "RingBuffer.h"
+
+#define READ_BUF_SIZE (4u * 1024u * 1024u)
+
+typedef struct BenchCtx {
+	PRINGBUFFER pRingBuf;
+	SIZE_T MsgSize;
+	volatile LONG Stop;
+	BOOLEAN IsPinned;
+	cpu_set_t CpuSet; // of the node the threads run on
+} BENCHCTX;
+
+typedef struct ReaderStat {
+	BENCHCTX* Ctx;
+	BOOLEAN IsRequired;
+	ULONG Reader;
+	ULONGLONG Read; // bytes
+	ULONGLONG Lagged;
+} READERSTAT;
+
+typedef struct ProducerStat {
+	BENCHCTX* Ctx;
+	ULONGLONG Written;
+	ULONGLONG Dropped;
+} PRODUCERSTAT;
+
+static double
+NowSec(void) {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+static void
+PinThread(
+	BENCHCTX* Ctx
+) {
+	if (Ctx->IsPinned) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &Ctx->CpuSet);
+	}
+}
+
+static void*
+ProducerFunc(
+	void* Arg
+) {
+	PRODUCERSTAT* Stat = (PRODUCERSTAT*)Arg;
+	CHAR Msg[4096];
+	memset(Msg, 'x', sizeof(Msg));
+	PinThread(Stat->Ctx);
+
+	while (!Stat->Ctx->Stop) {
+		if (RBWrite(Stat->Ctx->pRingBuf, Msg, Stat->Ctx->MsgSize) == ERROR_SUCCESS) {
+			Stat->Written++;
+		} else {
+			Stat->Dropped++;
+		}
+	}
+
+	return NULL;
+}
+
+static void*
+ConsumerFunc(
+	void* Arg
+) {
+	BENCHCTX* Ctx = (BENCHCTX*)Arg;
+	PCHAR Buf = malloc(READ_BUF_SIZE);
+	PinThread(Ctx);
+
+	while (!Ctx->Stop) {
+		SIZE_T Size = READ_BUF_SIZE;
+		RBRead(Ctx->pRingBuf, Buf, &Size);
+		if (!Size) {
+			sched_yield();
+		}
+	}
+
+	free(Buf);
+	return NULL;
+}
+
+static void*
+ReaderFunc(
+	void* Arg
+) {
+	READERSTAT* Stat = (READERSTAT*)Arg;
+	PRINGBUFFER pRingBuf = Stat->Ctx->pRingBuf;
+	PinThread(Stat->Ctx);
+
+	while (!Stat->Ctx->Stop) {
+		LONGLONG Pos = RBReaderBegin(pRingBuf, Stat->Reader);
+		ULONGLONG Read = 0;
+		PVOID Data;
+		SIZE_T Size;
+		while (RBReaderNext(pRingBuf, Stat->Reader, &Pos, &Data, &Size) == ERROR_SUCCESS) {
+			Read += Size;
+		}
+
+		if (RBReaderEnd(pRingBuf, Stat->Reader, Pos) == ERROR_SUCCESS) {
+			Stat->Read += Read;
+		}
+
+		if (!Read) {
+			sched_yield();
+		}
+	}
+
+	Stat->Lagged = RBReaderLagged(pRingBuf, Stat->Reader);
+	RBRemoveReader(pRingBuf, Stat->Reader);
+	return NULL;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	int MaxProducers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	SIZE_T MsgSize = 32;
+	SIZE_T RingSize = 64u * 1024u * 1024u;
+	double Duration = 1.0;
+	ULONG MemNode = MM_ANY_NODE_OK;
+	int CpuNode = -1;
+	int Required = 0;
+	int Optional = 0;
+
+	int Opt;
+	while ((Opt = getopt(argc, argv, "p:m:r:t:n:c:a:o:")) != -1) {
+		switch (Opt) {
+		case 'p': MaxProducers = atoi(optarg); break;
+		case 'm': MsgSize = strtoull(optarg, NULL, 0); break;
+		case 'r': RingSize = strtoull(optarg, NULL, 0); break;
+		case 't': Duration = atof(optarg); break;
+		case 'n': MemNode = (ULONG)atoi(optarg); break;
+		case 'c': CpuNode = atoi(optarg); break;
+		case 'a': Required = atoi(optarg); break;
+		case 'o': Optional = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-p max_producers] [-m msg_size] [-r ring_size] [-t seconds] [-n mem_node] [-c cpu_node] [-a required_readers] [-o optional_readers]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (MsgSize > 4096) {
+		MsgSize = 4096;
+	}
+
+	cpu_set_t CpuSet;
+	CPU_ZERO(&CpuSet);
+	if (CpuNode >= 0) {
+		GROUP_AFFINITY Affinity;
+		USHORT Count;
+		KeQueryNodeActiveAffinity((USHORT)CpuNode, &Affinity, &Count);
+		if (!Count) {
+			fprintf(stderr, "node %d has no processors\n", CpuNode);
+			return 1;
+		}
+
+		for (int Cpu = 0; Cpu < 64; ++Cpu) {
+			if (Affinity.Mask & ((KAFFINITY)1 << Cpu)) {
+				CPU_SET(Cpu, &CpuSet);
+			}
+		}
+	}
+
+	printf("producers,msg_size,ring_size,mem_node,cpu_node,written_per_sec,dropped_per_sec,written_mb_per_sec,required_readers,optional_readers,slowest_read_mb_per_sec,lagged_mb_per_sec\n");
+
+	for (int Producers = 1; Producers <= MaxProducers; ++Producers) {
+		BENCHCTX Ctx = { 0 };
+		Ctx.MsgSize = MsgSize;
+		Ctx.IsPinned = CpuNode >= 0;
+		Ctx.CpuSet = CpuSet;
+		if (RBInitOnNode(&Ctx.pRingBuf, RingSize, MemNode) != ERROR_SUCCESS) {
+			fprintf(stderr, "RBInitOnNode failed\n");
+			return 1;
+		}
+
+		PRODUCERSTAT* Stats = calloc(Producers, sizeof(PRODUCERSTAT));
+		pthread_t* Threads = calloc(Producers, sizeof(pthread_t));
+		pthread_t Consumer;
+		int Readers = Required + Optional;
+		READERSTAT* ReaderStats = calloc(Readers + 1, sizeof(READERSTAT));
+		pthread_t* ReaderThreads = calloc(Readers + 1, sizeof(pthread_t));
+
+		for (int i = 0; i < Readers; ++i) {
+			ReaderStats[i].Ctx = &Ctx;
+			ReaderStats[i].IsRequired = i < Required;
+			if (RBAddReader(Ctx.pRingBuf, ReaderStats[i].IsRequired, &ReaderStats[i].Reader) != ERROR_SUCCESS) {
+				fprintf(stderr, "RBAddReader failed\n");
+				return 1;
+			}
+		}
+
+		for (int i = 0; i < Readers; ++i) {
+			pthread_create(&ReaderThreads[i], NULL, ReaderFunc, &ReaderStats[i]);
+		}
+
+		pthread_create(&Consumer, NULL, ConsumerFunc, &Ctx);
+		double Start = NowSec();
+		for (int i = 0; i < Producers; ++i) {
+			Stats[i].Ctx = &Ctx;
+			pthread_create(&Threads[i], NULL, ProducerFunc, &Stats[i]);
+		}
+
+		usleep((useconds_t)(Duration * 1e6));
+		Ctx.Stop = 1;
+
+		ULONGLONG Written = 0, Dropped = 0;
+		for (int i = 0; i < Producers; ++i) {
+			pthread_join(Threads[i], NULL);
+			Written += Stats[i].Written;
+			Dropped += Stats[i].Dropped;
+		}
+		double Elapsed = NowSec() - Start;
+		pthread_join(Consumer, NULL);
+
+		ULONGLONG Slowest = 0, Lagged = 0;
+		for (int i = 0; i < Readers; ++i) {
+			pthread_join(ReaderThreads[i], NULL);
+			if (!i || ReaderStats[i].Read < Slowest) {
+				Slowest = ReaderStats[i].Read;
+			}
+			Lagged += ReaderStats[i].Lagged;
+		}
+
+		printf("%d,%zu,%zu,%d,%d,%.0f,%.0f,%.1f,%d,%d,%.1f,%.1f\n",
+			Producers,
+			MsgSize,
+			RingSize,
+			(MemNode == MM_ANY_NODE_OK) ? -1 : (int)MemNode,
+			CpuNode,
+			Written / Elapsed,
+			Dropped / Elapsed,
+			Written * MsgSize / Elapsed / (1024.0 * 1024.0),
+			Required,
+			Optional,
+			Slowest / Elapsed / (1024.0 * 1024.0),
+			Lagged / Elapsed / (1024.0 * 1024.0));
+
+		free(ReaderThreads);
+		free(ReaderStats);
+		free(Threads);
+		free(Stats);
+		RBDeinit(Ctx.pRingBuf);
+	}
+
+	return 0;
+}
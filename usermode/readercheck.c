@@ -0,0 +1,275 @@
+// readers added with RBAddReader next to the primary one. A writer fills a small ring with
+// numbered records and waits for space when it is full, so nothing is dropped. The primary and
+// a required reader have to see every record exactly once and in order, the required one slow
+// enough to hold the writer back. An optional reader that keeps falling behind may only keep
+// batches RBReaderEnd accepts: their records have to be intact and in order, none of them given
+// back and written over under it. What it kept plus RBReaderLagged has to be all that was written
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "RingBuffer.h"
+#include "check.h"
+
+#define RING_SIZE (64 * 1024)
+#define RECORDS 200000u
+#define MAX_PAD 120
+#define BATCH 64 // records an optional reader takes at most before RBReaderEnd
+
+typedef struct Ctx {
+	PRINGBUFFER pRingBuf;
+	int volatile IsDone; // the writer is
+	LONGLONG Written; // ring bytes, once IsDone
+} CTX;
+
+typedef struct ReaderStat {
+	CTX* Ctx;
+	ULONG Reader;
+	BOOLEAN IsRequired;
+	unsigned long long Kept; // records, optional reader
+	unsigned long long KeptBytes; // ring bytes, optional reader
+	unsigned long long Aborted; // batches, optional reader
+	unsigned long long Lagged;
+} READERSTAT;
+
+static size_t
+RecordSize(
+	unsigned Seq
+) {
+	return sizeof(unsigned) + Seq % MAX_PAD;
+}
+
+static void
+FillRecord(
+	unsigned char* Data,
+	unsigned Seq
+) {
+	memcpy(Data, &Seq, sizeof(Seq));
+	for (size_t i = sizeof(Seq); i < RecordSize(Seq); ++i) {
+		Data[i] = (unsigned char)(Seq * 31 + i);
+	}
+}
+
+// the record's number, -1 if it is not one the writer wrote
+static long long
+RecordSeq(
+	const unsigned char* Data,
+	size_t Size
+) {
+	unsigned Seq;
+	if (Size < sizeof(Seq)) {
+		return -1;
+	}
+
+	memcpy(&Seq, Data, sizeof(Seq));
+	if (Seq >= RECORDS || Size != RecordSize(Seq)) {
+		return -1;
+	}
+	for (size_t i = sizeof(Seq); i < Size; ++i) {
+		if (Data[i] != (unsigned char)(Seq * 31 + i)) {
+			return -1;
+		}
+	}
+
+	return Seq;
+}
+
+static void*
+WriterFunc(
+	void* Arg
+) {
+	CTX* Ctx = (CTX*)Arg;
+	for (unsigned Seq = 0; Seq < RECORDS; ++Seq) {
+		PVOID pData;
+		while (RBReserve(Ctx->pRingBuf, RecordSize(Seq), &pData) != ERROR_SUCCESS) {
+			sched_yield();
+		}
+
+		FillRecord(pData, Seq);
+		RBCommit(pData, RecordSize(Seq));
+	}
+
+	Ctx->Written = RBReserved(Ctx->pRingBuf);
+	__sync_synchronize();
+	Ctx->IsDone = 1;
+	return NULL;
+}
+
+// the primary reader, or a required one with Stat
+static void
+ReadAll(
+	CTX* Ctx,
+	READERSTAT* Stat,
+	const char* Name
+) {
+	unsigned Next = 0;
+	while (Next < RECORDS) {
+		BOOLEAN IsDone = Ctx->IsDone;
+		LONGLONG Pos = Stat ? RBReaderBegin(Ctx->pRingBuf, Stat->Reader) : RBReadBegin(Ctx->pRingBuf);
+		PVOID pData;
+		SIZE_T Size;
+		unsigned Count = 0;
+		while ((Stat ? RBReaderNext(Ctx->pRingBuf, Stat->Reader, &Pos, &pData, &Size) :
+			RBReadNext(Ctx->pRingBuf, &Pos, &pData, &Size)) == ERROR_SUCCESS) {
+			long long Seq = RecordSeq(pData, Size);
+			if (Seq != (long long)Next) {
+				CheckError("%s reader: record %lld where %u was expected", Name, Seq, Next);
+			}
+			Next = (Seq < 0) ? Next + 1 : (unsigned)Seq + 1;
+			Count++;
+		}
+
+		if (Stat) {
+			RBReaderEnd(Ctx->pRingBuf, Stat->Reader, Pos);
+		} else {
+			RBReadEnd(Ctx->pRingBuf, Pos);
+		}
+
+		// all is written and read, records the ring gave back under the reader are missing
+		if (!Count && IsDone && Pos >= Ctx->Written) {
+			break;
+		}
+
+		// the required reader holds the writer back now and then
+		if (!Count || (Stat && !(Next % 8))) {
+			sched_yield();
+		}
+	}
+
+	if (Next != RECORDS) {
+		CheckError("%s reader: read up to record %u of %u", Name, Next, RECORDS);
+	}
+}
+
+static void*
+RequiredFunc(
+	void* Arg
+) {
+	READERSTAT* Stat = (READERSTAT*)Arg;
+	ReadAll(Stat->Ctx, Stat, "required");
+	return NULL;
+}
+
+static void*
+OptionalFunc(
+	void* Arg
+) {
+	READERSTAT* Stat = (READERSTAT*)Arg;
+	PRINGBUFFER pRingBuf = Stat->Ctx->pRingBuf;
+	PVOID Data[BATCH];
+	SIZE_T Sizes[BATCH];
+	long long Batch[BATCH];
+	long long Last = -1;
+	unsigned Passes = 0;
+
+	while (TRUE) {
+		BOOLEAN IsDone = Stat->Ctx->IsDone;
+		LONGLONG Begin = RBReaderBegin(pRingBuf, Stat->Reader);
+		LONGLONG Pos = Begin;
+		PVOID pData;
+		SIZE_T Size;
+		int Count = 0;
+		while (Count < BATCH && RBReaderNext(pRingBuf, Stat->Reader, &Pos, &pData, &Size) == ERROR_SUCCESS) {
+			Data[Count] = pData;
+			Sizes[Count++] = Size;
+		}
+
+		// falls behind: the writer laps it while it holds a batch. Records are read in place
+		// up to RBReaderEnd, which tells if they were still there
+		if (!(++Passes % 4)) {
+			usleep(300);
+		}
+		for (int i = 0; i < Count; ++i) {
+			Batch[i] = RecordSeq(Data[i], Sizes[i]);
+		}
+
+		if (RBReaderEnd(pRingBuf, Stat->Reader, Pos) != ERROR_SUCCESS) {
+			Stat->Aborted++;
+			continue;
+		}
+
+		for (int i = 0; i < Count; ++i) {
+			if (Batch[i] < 0) {
+				CheckError("optional reader: a record it kept was written over");
+			} else if (Batch[i] <= Last) {
+				CheckError("optional reader: record %lld after record %lld", Batch[i], Last);
+			} else {
+				Last = Batch[i];
+			}
+		}
+		Stat->Kept += (unsigned long long)Count;
+		Stat->KeptBytes += (unsigned long long)(Pos - Begin);
+
+		if (IsDone && Pos >= Stat->Ctx->Written) {
+			break;
+		}
+		if (!Count) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	UNREFERENCED_PARAMETER(argc);
+	UNREFERENCED_PARAMETER(argv);
+
+	CTX Ctx;
+	memset(&Ctx, 0, sizeof(Ctx));
+	if (RBInit(&(Ctx.pRingBuf), RING_SIZE) != ERROR_SUCCESS) {
+		fprintf(stderr, "RBInit failed\n");
+		return 1;
+	}
+
+	READERSTAT Required, Optional;
+	memset(&Required, 0, sizeof(Required));
+	memset(&Optional, 0, sizeof(Optional));
+	Required.Ctx = &Ctx;
+	Required.IsRequired = TRUE;
+	Optional.Ctx = &Ctx;
+	if (RBAddReader(Ctx.pRingBuf, TRUE, &(Required.Reader)) != ERROR_SUCCESS ||
+		RBAddReader(Ctx.pRingBuf, FALSE, &(Optional.Reader)) != ERROR_SUCCESS) {
+		fprintf(stderr, "RBAddReader failed\n");
+		RBDeinit(Ctx.pRingBuf);
+		return 1;
+	}
+
+	pthread_t Writer, RequiredThread, OptionalThread;
+	pthread_create(&RequiredThread, NULL, RequiredFunc, &Required);
+	pthread_create(&OptionalThread, NULL, OptionalFunc, &Optional);
+	pthread_create(&Writer, NULL, WriterFunc, &Ctx);
+
+	ReadAll(&Ctx, NULL, "primary");
+
+	pthread_join(Writer, NULL);
+	pthread_join(RequiredThread, NULL);
+	pthread_join(OptionalThread, NULL);
+
+	Optional.Lagged = RBReaderLagged(Ctx.pRingBuf, Optional.Reader);
+	if (Optional.KeptBytes + Optional.Lagged != (unsigned long long)Ctx.Written) {
+		CheckError("optional reader: %llu bytes kept and %llu lagged, %lld were written",
+			Optional.KeptBytes, Optional.Lagged, (long long)Ctx.Written);
+	}
+	if (!Optional.Lagged || !Optional.Kept) {
+		CheckError("optional reader: %llu records kept, %llu bytes lagged, it has to do both",
+			Optional.Kept, Optional.Lagged);
+	}
+
+	printf("%u records, %lld bytes written to a %d byte ring, optional reader kept %llu, dropped %llu batches, lagged %llu bytes, %llu errors\n",
+		RECORDS, (long long)Ctx.Written, RING_SIZE, Optional.Kept, Optional.Aborted, Optional.Lagged, CheckErrors);
+
+	RBRemoveReader(Ctx.pRingBuf, Optional.Reader);
+	RBRemoveReader(Ctx.pRingBuf, Required.Reader);
+	RBDeinit(Ctx.pRingBuf);
+
+	return CheckErrors ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+// tools/klrecover on a ring dumped the way a memory image holds it. The ring is filled past its
+// capacity a few times, records before tail consumed as the flushing thread would, and one
+// record is reserved at head and never committed. Its header and records, read at the fixed
+// offsets of KLoggerFormat.h, are dumped between random bytes. klrecover has to find the ring,
+// give back every committed record between tail and head in order, and skip the one at head
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "RingBuffer.h"
+#include "KLoggerFormat.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define RING_SIZE (64 * 1024)
+#define WRAPS 3 // times the capacity written
+#define MSG_SIZE 160
+#define IMAGE_PREFIX (4096 + 3 * 64) // ring headers are cache line aligned in an image
+#define IMAGE_SUFFIX 333
+#define TIME_BASE 133000000000000000ll // 100ns since 1601
+#define FREQUENCY 10000000ll
+#define UNCOMMITTED_TEXT "uncommitted at head\n"
+
+// text of record Seq
+static size_t
+MakeMessage(
+	char* Msg,
+	unsigned Seq
+) {
+	int Length = snprintf(Msg, MSG_SIZE, "record %u ", Seq);
+	size_t Pad = Seq % 97;
+	memset(Msg + Length, 'r', Pad);
+	Msg[Length + Pad] = '\n';
+	return (size_t)Length + Pad + 1;
+}
+
+// a KLOGGER_RECORD and its message, as KLogger.c puts them into rings. Committed only if
+// IsCommitted, ERROR_INSUFFICIENT_BUFFER if the ring is full
+static INT
+PutRecord(
+	PRINGBUFFER pRingBuf,
+	const char* Msg,
+	size_t Length,
+	long long Timestamp,
+	BOOLEAN IsCommitted
+) {
+	PKLOGGER_RECORD Record;
+	SIZE_T Size = sizeof(KLOGGER_RECORD) + Length;
+	INT Err = RBReserve(pRingBuf, Size, (PVOID*)&Record);
+	if (Err != ERROR_SUCCESS) {
+		return Err;
+	}
+
+	memset(Record, 0, sizeof(KLOGGER_RECORD));
+	Record->Timestamp = Timestamp;
+	Record->Length = (unsigned)Length;
+	Record->Type = KLOGGER_REC_MESSAGE;
+	memcpy(Record + 1, Msg, Length);
+	if (IsCommitted) {
+		RBCommit(Record, Size);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+// reads and releases records from tail, about a third of the ring. Returns how many
+static unsigned
+Consume(
+	PRINGBUFFER pRingBuf
+) {
+	unsigned Count = 0;
+	LONGLONG Begin = RBReadBegin(pRingBuf);
+	LONGLONG Pos = Begin;
+	PVOID pData;
+	SIZE_T Size;
+	while (Pos - Begin < RING_SIZE / 3 && RBReadNext(pRingBuf, &Pos, &pData, &Size) == ERROR_SUCCESS) {
+		Count++;
+	}
+	RBReadEnd(pRingBuf, Pos);
+
+	return Count;
+}
+
+static long long
+ReadI64(
+	const unsigned char* p
+) {
+	long long v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned
+ReadU32(
+	const unsigned char* p
+) {
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// random bytes, then the ring header and records, then random bytes again
+static int
+WriteImage(
+	const char* Path,
+	const unsigned char* Ring,
+	size_t HeaderSize,
+	size_t Capacity
+) {
+	FILE* File = fopen(Path, "wb");
+	if (!File) {
+		perror(Path);
+		return -1;
+	}
+
+	unsigned Seed = 3;
+	for (int i = 0; i < IMAGE_PREFIX; ++i) {
+		fputc(rand_r(&Seed) & 0xff, File);
+	}
+	fwrite(Ring, 1, HeaderSize, File);
+	fwrite(Ring + HeaderSize, 1, Capacity, File);
+	for (int i = 0; i < IMAGE_SUFFIX; ++i) {
+		fputc(rand_r(&Seed) & 0xff, File);
+	}
+
+	if (fclose(File)) {
+		perror(Path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// runs klrecover on the image, -1 if it failed. *pUncommitted is from its ring line
+static int
+RunRecover(
+	const char* Tool,
+	const char* ImagePath,
+	const char* OutPath,
+	size_t* pRings,
+	size_t* pUncommitted
+) {
+	char Command[512];
+	snprintf(Command, sizeof(Command), "%s %s -o %s -j 2 2>&1", Tool, ImagePath, OutPath);
+	FILE* Pipe = popen(Command, "r");
+	if (!Pipe) {
+		perror(Tool);
+		return -1;
+	}
+
+	char Line[256];
+	while (fgets(Line, sizeof(Line), Pipe)) {
+		size_t Records, Uncommitted;
+		const char* p = strstr(Line, " records, ");
+		if (!strncmp(Line, "ring at ", 8) && p && sscanf(p, " records, %zu uncommitted", &Uncommitted) == 1) {
+			(*pRings)++;
+			*pUncommitted = Uncommitted;
+		} else if (sscanf(Line, "%*u rings, %zu records written", &Records) != 1) {
+			fputs(Line, stderr);
+		}
+	}
+
+	return pclose(Pipe) == 0 ? 0 : -1;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	const char* Tool = "../tools/klrecover";
+	if (argc == 3 && !strcmp(argv[1], "-k")) {
+		Tool = argv[2];
+	} else if (argc != 1) {
+		fprintf(stderr, "usage: %s [-k klrecover]\n", argv[0]);
+		return 2;
+	}
+
+	PRINGBUFFER pRingBuf;
+	if (RBInit(&pRingBuf, RING_SIZE) != ERROR_SUCCESS) {
+		fprintf(stderr, "RBInit failed\n");
+		return 1;
+	}
+	RBSetTimeBase(pRingBuf, 0, TIME_BASE, FREQUENCY);
+
+	// records [Kept, Written) stay in the ring
+	unsigned Written = 0, Kept = 0;
+	unsigned long long Bytes = 0;
+	char Msg[MSG_SIZE];
+	while (Bytes < WRAPS * (unsigned long long)RING_SIZE) {
+		size_t Length = MakeMessage(Msg, Written);
+		if (PutRecord(pRingBuf, Msg, Length, 1000 + 10 * (long long)Written, TRUE) != ERROR_SUCCESS) {
+			Kept += Consume(pRingBuf);
+			continue;
+		}
+		Written++;
+		Bytes += sizeof(KLOGGER_RECORD) + Length;
+	}
+
+	// a writer that reserved its record and did not get to commit it
+	while (PutRecord(pRingBuf, UNCOMMITTED_TEXT, sizeof(UNCOMMITTED_TEXT) - 1, 1000 + 10 * (long long)Written, FALSE) != ERROR_SUCCESS) {
+		Kept += Consume(pRingBuf);
+	}
+
+	const unsigned char* Ring = (const unsigned char*)pRingBuf;
+	size_t HeaderSize = ReadU32(Ring + KLOGGER_RING_HEADER_SIZE_OFFSET);
+	size_t Capacity = (size_t)ReadI64(Ring + KLOGGER_RING_CAPACITY_OFFSET);
+	long long Head = ReadI64(Ring + KLOGGER_RING_HEAD_OFFSET);
+	if (memcmp(Ring, KLOGGER_RING_MAGIC, KLOGGER_RING_MAGIC_SIZE) || Capacity != RING_SIZE) {
+		CheckError("ring header: no magic or capacity %zu, not %d", Capacity, RING_SIZE);
+	}
+	if (Head <= (long long)Capacity) {
+		CheckError("ring did not wrap, head %lld", Head);
+	}
+
+	char Root[] = "/tmp/recovercheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		RBDeinit(pRingBuf);
+		return 1;
+	}
+
+	char ImagePath[sizeof(Root) + 16];
+	char OutPath[sizeof(Root) + 16];
+	snprintf(ImagePath, sizeof(ImagePath), "%s/image.bin", Root);
+	snprintf(OutPath, sizeof(OutPath), "%s/recovered.log", Root);
+
+	size_t Rings = 0, Uncommitted = 0, Size = 0;
+	char* Log = NULL;
+	if (WriteImage(ImagePath, Ring, HeaderSize, Capacity) == 0) {
+		if (RunRecover(Tool, ImagePath, OutPath, &Rings, &Uncommitted) != 0) {
+			CheckError("%s failed", Tool);
+		} else {
+			Log = CheckReadFile(OutPath, &Size);
+		}
+	}
+	RBDeinit(pRingBuf);
+	unlink(ImagePath);
+	unlink(OutPath);
+	rmdir(Root);
+	if (!Log) {
+		fprintf(stderr, "nothing recovered\n");
+		return 1;
+	}
+
+	if (Rings != 1) {
+		CheckError("%zu rings found in the image, 1 was dumped", Rings);
+	}
+	if (Uncommitted != 1) {
+		CheckError("%zu uncommitted records, 1 was reserved at head", Uncommitted);
+	}
+
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Log, Size);
+
+	unsigned Next = Kept;
+	int Ret;
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		if (Record.Type != KLOGGER_REC_MESSAGE) {
+			CheckError("record of type %d", Record.Type);
+			continue;
+		}
+		if (Record.Length == sizeof(UNCOMMITTED_TEXT) - 1 && !memcmp(Record.Data, UNCOMMITTED_TEXT, Record.Length)) {
+			CheckError("the uncommitted record was recovered");
+			continue;
+		}
+		if (Next >= Written) {
+			CheckError("more records than the %u left in the ring", Written - Kept);
+			continue;
+		}
+
+		size_t Length = MakeMessage(Msg, Next);
+		if (Record.Length != Length || memcmp(Record.Data, Msg, Length)) {
+			CheckError("record %u: %.*s", Next, (int)(Record.Length > 32 ? 32 : Record.Length), Record.Data);
+		}
+		if (Record.Timestamp != 1000 + 10 * (long long)Next) {
+			CheckError("record %u: timestamp %lld", Next, (long long)Record.Timestamp);
+		}
+		Next++;
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("recovered log is corrupted at offset %zu", LogReaderOffset(&Reader));
+	}
+	if (Next != Written) {
+		CheckError("%u of the %u records left in the ring recovered", Next - Kept, Written - Kept);
+	}
+
+	printf("%u records written, head at %lld of a %zu byte ring, %u recovered, %zu uncommitted skipped, %llu errors\n",
+		Written, Head, Capacity, Next - Kept, Uncommitted, CheckErrors);
+
+	LogReaderFree(&Reader);
+	free(Log);
+
+	return CheckErrors ? 1 : 0;
+}
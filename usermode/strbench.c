@@ -0,0 +1,171 @@
+// message ingestion cost for 16 B to 4 KB messages: finding the length and copying the message
+// into a ring-sized buffer, as KLoggerLog does it, in ns per message.
+//
+//   bytewise  the byte by byte scan KLoggerLog used to have, then a copy
+//   strscan   StrScanLength (SSE2) then a copy - the second pass reads what the scan left in L1
+//   avx2      the same scan with 32 byte AVX2 loads, user mode only, for reference
+//   counted   copy only, KLoggerLogN callers that know the length
+
+#include <ntddk.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "StrScan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRBENCH_AVX2
+#endif
+
+#define MAX_SIZE 4096u
+#define MSG_COUNT 64 // messages of one size at different alignments
+#define RING_SIZE (1u << 20)
+
+typedef SIZE_T (*SCANFUNC)(PCSTR Str);
+
+static double
+NowSec(void) {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec + Ts.tv_nsec * 1e-9;
+}
+
+// kept a loop: the compiler must not turn it into a strlen call
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+static SIZE_T
+ScanBytewise(
+	PCSTR Str
+) {
+	SIZE_T Length = 0;
+	while (*(Str + Length) != '\0') {
+		Length++;
+	}
+
+	return Length;
+}
+
+#ifdef STRBENCH_AVX2
+__attribute__((noinline, target("avx2")))
+static SIZE_T
+ScanAvx2(
+	PCSTR Str
+) {
+	ULONG Skip = (ULONG)((ULONG_PTR)Str & 31);
+	const __m256i* p = (const __m256i*)(Str - Skip);
+	__m256i Zero = _mm256_setzero_si256();
+
+	ULONG Mask = (ULONG)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(p), Zero)) >> Skip;
+	if (Mask) {
+		return (SIZE_T)__builtin_ctz(Mask);
+	}
+
+	do {
+		++p;
+		Mask = (ULONG)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(p), Zero));
+	} while (!Mask);
+
+	return (SIZE_T)((PCSTR)p - Str) + (SIZE_T)__builtin_ctz(Mask);
+}
+#endif
+
+static double
+Measure(
+	SCANFUNC Scan,
+	PCSTR* Msgs,
+	SIZE_T Size,
+	PCHAR Ring,
+	double Duration
+) {
+	ULONGLONG Count = 0;
+	SIZE_T Offset = 0;
+	SIZE_T Check = 0;
+	double Start = NowSec();
+	double Elapsed;
+
+	do {
+		for (int Round = 0; Round < 256; ++Round) {
+			for (int i = 0; i < MSG_COUNT; ++i) {
+				SIZE_T Length = Scan ? Scan(Msgs[i]) : Size;
+				if (Offset + Length > RING_SIZE) {
+					Offset = 0;
+				}
+				memcpy(Ring + Offset, Msgs[i], Length);
+				Offset += (Length + 7) & ~(SIZE_T)7;
+				Check += Length;
+			}
+			Count += MSG_COUNT;
+		}
+		Elapsed = NowSec() - Start;
+	} while (Elapsed < Duration);
+
+	if (Check != Count * Size) {
+		fprintf(stderr, "wrong length\n");
+		exit(1);
+	}
+
+	return Elapsed * 1e9 / Count;
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	double Duration = 0.2;
+
+	int Opt;
+	while ((Opt = getopt(argc, argv, "t:")) != -1) {
+		switch (Opt) {
+		case 't': Duration = atof(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds_per_step]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	PCHAR Ring = malloc(RING_SIZE);
+	PCHAR Pool = malloc(MSG_COUNT * (MAX_SIZE + 64));
+	PCSTR Msgs[MSG_COUNT];
+	memset(Ring, 0, RING_SIZE);
+
+	BOOLEAN HasAvx2 = FALSE;
+#ifdef STRBENCH_AVX2
+	HasAvx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+	printf("msg_size,bytewise_ns,strscan_ns,avx2_ns,counted_ns\n");
+
+	for (SIZE_T Size = 16; Size <= MAX_SIZE; Size *= 2) {
+		for (int i = 0; i < MSG_COUNT; ++i) {
+			PCHAR Msg = Pool + i * (MAX_SIZE + 64) + i % 32;
+			memset(Msg, 'x', Size);
+			Msg[Size] = '\0';
+			Msgs[i] = Msg;
+
+			if (StrScanLength(Msg) != Size) {
+				fprintf(stderr, "StrScanLength is wrong for %zu at offset %d\n", Size, i % 32);
+				return 1;
+			}
+		}
+
+		double Avx2 = 0.0;
+#ifdef STRBENCH_AVX2
+		if (HasAvx2) {
+			Avx2 = Measure(ScanAvx2, Msgs, Size, Ring, Duration);
+		}
+#endif
+
+		printf("%zu,%.1f,%.1f,%.1f,%.1f\n",
+			Size,
+			Measure(ScanBytewise, Msgs, Size, Ring, Duration),
+			Measure(StrScanLength, Msgs, Size, Ring, Duration),
+			Avx2,
+			Measure(NULL, Msgs, Size, Ring, Duration));
+		fflush(stdout);
+	}
+
+	free(Pool);
+	free(Ring);
+	return 0;
+}
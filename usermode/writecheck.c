@@ -0,0 +1,258 @@
+// writes that fail after they were started. The shim fails every KLOGGER_SHIM_FAIL_WRITE-th
+// asynchronous write (ntddk.h) while it delays the others, so chunks written after a failed one
+// are still in flight and get to the file. Numbered messages, some of them bodies written
+// straight from the ring, are logged with writers waiting for ring space. The log has to decode
+// without a corrupted record, the messages have to be in order, and what is missing has to be
+// reported by LOSS records, messages and bytes. Every index entry has to be a decode start with
+// the sequence number of the record there
+
+#include <ntddk.h>
+#include <winerror.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KLogger.h"
+#include "KLoggerFormat.h"
+#include "../tools/LogReader.h"
+#include "check.h"
+
+#define MESSAGES 60000
+#define DIRECT_MIN 4096 // FLUSH_DIRECT_MIN of KLogger.c
+#define MSG_SIZE (3 * DIRECT_MIN)
+#define LOSS_NONE -1 // key of a message record
+
+// text of message Seq, every 40th one is a body large enough to go straight from the ring
+static size_t
+MakeMessage(
+	char* Msg,
+	unsigned Seq
+) {
+	int Length = snprintf(Msg, MSG_SIZE, "w %u ", Seq);
+	size_t Pad = (Seq % 40) ? Seq % 173 : DIRECT_MIN + Seq % (2 * DIRECT_MIN - 64);
+	memset(Msg + Length, 'w', Pad);
+	Msg[Length + Pad] = '\n';
+	return (size_t)Length + Pad + 1;
+}
+
+// records from the start of the file, by sequence number: the message number or
+// -2 - the count of a LOSS record
+typedef struct Decoded {
+	long long* Keys;
+	size_t Count;
+	size_t Capacity;
+} DECODED;
+
+static long long
+RecordKey(
+	const LOGRECORD* Record
+) {
+	unsigned long long Messages = 0, Bytes = 0;
+	if (Record->Type == KLOGGER_REC_LOSS) {
+		sscanf(Record->Data, "*** %llu messages / %llu bytes lost ***", &Messages, &Bytes);
+		return -2 - (long long)Messages;
+	}
+
+	unsigned Seq;
+	if (Record->Type != KLOGGER_REC_MESSAGE || sscanf(Record->Data, "w %u ", &Seq) != 1) {
+		return LOSS_NONE;
+	}
+
+	return (long long)Seq;
+}
+
+static void
+CheckLog(
+	const char* Log,
+	size_t Size,
+	const size_t* Lengths,
+	DECODED* Decoded
+) {
+	LOGREADER Reader;
+	LOGRECORD Record;
+	LogReaderInit(&Reader, Log, Size);
+
+	unsigned long long LostMessages = 0, LostBytes = 0, Missing = 0, MissingBytes = 0, Losses = 0;
+	unsigned Next = 0;
+	char Msg[MSG_SIZE];
+	int Ret;
+	while ((Ret = LogReaderNext(&Reader, &Record)) == LOG_READ_RECORD) {
+		if (Decoded->Count == Decoded->Capacity) {
+			Decoded->Capacity = Decoded->Capacity ? 2 * Decoded->Capacity : 4096;
+			Decoded->Keys = realloc(Decoded->Keys, Decoded->Capacity * sizeof(long long));
+		}
+		long long Key = RecordKey(&Record);
+		Decoded->Keys[Decoded->Count++] = Key;
+
+		if (Record.Type == KLOGGER_REC_LOSS) {
+			unsigned long long Messages = 0, Bytes = 0;
+			sscanf(Record.Data, "*** %llu messages / %llu bytes lost ***", &Messages, &Bytes);
+			LostMessages += Messages;
+			LostBytes += Bytes;
+			Losses++;
+			continue;
+		}
+		if (Key == LOSS_NONE || Key >= MESSAGES) {
+			CheckError("record %zu: %.*s", Decoded->Count - 1, (int)(Record.Length > 32 ? 32 : Record.Length), Record.Data);
+			continue;
+		}
+
+		unsigned Seq = (unsigned)Key;
+		if (Seq < Next) {
+			CheckError("message %u after message %u", Seq, Next - 1);
+			continue;
+		}
+		for (; Next < Seq; ++Next) {
+			Missing++;
+			MissingBytes += Lengths[Next];
+		}
+
+		size_t Length = MakeMessage(Msg, Seq);
+		if (Record.Length != Length || memcmp(Record.Data, Msg, Length)) {
+			CheckError("message %u: differs from the message logged", Seq);
+		}
+		Next = Seq + 1;
+	}
+	for (; Next < MESSAGES; ++Next) {
+		Missing++;
+		MissingBytes += Lengths[Next];
+	}
+
+	if (Ret == LOG_READ_ERROR) {
+		CheckError("log is corrupted at offset %zu", LogReaderOffset(&Reader));
+	}
+	if (LostMessages != Missing || LostBytes != MissingBytes) {
+		CheckError("LOSS records report %llu messages / %llu bytes, %llu / %llu are missing",
+			LostMessages, LostBytes, Missing, MissingBytes);
+	}
+	if (!Losses) {
+		CheckError("no write failed, nothing was lost");
+	}
+
+	printf("%d messages, %llu missing, reported by %llu LOSS records, %zu byte log\n",
+		MESSAGES, Missing, Losses, Size);
+
+	LogReaderFree(&Reader);
+}
+
+// decoding from each entry has to start with the record of its sequence number
+static void
+CheckIndex(
+	const char* Log,
+	size_t Size,
+	const char* Index,
+	size_t IndexSize,
+	const DECODED* Decoded
+) {
+	if (IndexSize < KLOGGER_INDEX_HEADER_SIZE || memcmp(Index, KLOGGER_INDEX_MAGIC, 4)) {
+		CheckError("index has no header");
+		return;
+	}
+	if ((IndexSize - KLOGGER_INDEX_HEADER_SIZE) % sizeof(KLOGGER_INDEX_ENTRY)) {
+		CheckError("index of %zu bytes ends inside an entry", IndexSize);
+	}
+
+	size_t Entries = 0;
+	unsigned long long PrevOffset = 0;
+	for (size_t Pos = KLOGGER_INDEX_HEADER_SIZE; Pos + sizeof(KLOGGER_INDEX_ENTRY) <= IndexSize; Pos += sizeof(KLOGGER_INDEX_ENTRY)) {
+		KLOGGER_INDEX_ENTRY Entry;
+		memcpy(&Entry, Index + Pos, sizeof(Entry));
+		Entries++;
+
+		if (Entry.Offset >= Size || Entry.Offset <= PrevOffset || Entry.Sequence >= Decoded->Count) {
+			CheckError("index entry %zu: offset %llu, sequence %llu, past the log or out of order",
+				Entries - 1, Entry.Offset, Entry.Sequence);
+			continue;
+		}
+		PrevOffset = Entry.Offset;
+
+		LOGREADER Reader;
+		LOGRECORD Record;
+		LogReaderInit(&Reader, Log + Entry.Offset, Size - Entry.Offset);
+		if (LogReaderNext(&Reader, &Record) != LOG_READ_RECORD) {
+			CheckError("index entry %zu: no record at offset %llu", Entries - 1, Entry.Offset);
+		} else if (RecordKey(&Record) != Decoded->Keys[Entry.Sequence]) {
+			CheckError("index entry %zu: the record at offset %llu is not record %llu",
+				Entries - 1, Entry.Offset, Entry.Sequence);
+		}
+		LogReaderFree(&Reader);
+	}
+
+	if (!Entries) {
+		CheckError("index has no entries");
+	}
+	printf("%zu index entries\n", Entries);
+}
+
+int
+main(
+	int argc,
+	char** argv
+) {
+	UNREFERENCED_PARAMETER(argc);
+	UNREFERENCED_PARAMETER(argv);
+
+	char Root[] = "/tmp/writecheck.XXXXXX";
+	if (!mkdtemp(Root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	char LogPath[sizeof(Root) + 16];
+	char IndexPath[sizeof(Root) + 16];
+	snprintf(LogPath, sizeof(LogPath), "%s/klogger.log", Root);
+	snprintf(IndexPath, sizeof(IndexPath), "%s/klogger.log.idx", Root);
+
+	// a small ring is drained in many chunks, writers wait for it instead of dropping
+	setenv("KLOGGER_ROOT", Root, 1);
+	setenv("KLOGGER_BUF_SIZE", "262144", 1);
+	setenv("KLOGGER_OVERFLOW_POLICY", "2", 1);
+	setenv("KLOGGER_BLOCK_TIMEOUT_MS", "10000", 1);
+	setenv("KLOGGER_INDEX_KB", "64", 1);
+	setenv("KLOGGER_SHIM_FAIL_WRITE", "7", 1);
+	setenv("KLOGGER_SHIM_WRITE_DELAY_US", "300", 1);
+
+	UNICODE_STRING RegistryPath;
+	RtlInitUnicodeString(&RegistryPath, L"\\Registry\\Machine\\writecheck");
+	if (KLoggerInit(&RegistryPath) != ERROR_SUCCESS) {
+		fprintf(stderr, "KLoggerInit failed\n");
+		rmdir(Root);
+		return 1;
+	}
+
+	size_t* Lengths = malloc(MESSAGES * sizeof(size_t));
+	char* Msg = malloc(MSG_SIZE);
+	for (unsigned i = 0; i < MESSAGES; ++i) {
+		Lengths[i] = MakeMessage(Msg, i);
+		if (KLoggerLogN(Msg, Lengths[i]) != ERROR_SUCCESS) {
+			CheckError("message %u: not logged", i);
+		}
+	}
+	KLoggerDeinit();
+
+	size_t Size = 0, IndexSize = 0;
+	char* Log = CheckReadFile(LogPath, &Size);
+	char* Index = CheckReadFile(IndexPath, &IndexSize);
+	unlink(LogPath);
+	unlink(IndexPath);
+	rmdir(Root);
+	if (!Log || !Index) {
+		fprintf(stderr, "no log or no index\n");
+		return 1;
+	}
+
+	DECODED Decoded;
+	memset(&Decoded, 0, sizeof(Decoded));
+	CheckLog(Log, Size, Lengths, &Decoded);
+	CheckIndex(Log, Size, Index, IndexSize, &Decoded);
+
+	printf("%llu errors\n", CheckErrors);
+
+	free(Decoded.Keys);
+	free(Index);
+	free(Log);
+	free(Msg);
+	free(Lengths);
+
+	return CheckErrors ? 1 : 0;
+}